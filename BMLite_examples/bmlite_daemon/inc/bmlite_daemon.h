@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BMLITE_DAEMON_H
+#define BMLITE_DAEMON_H
+
+/**
+ * @file    bmlite_daemon.h
+ * @brief   BM-Lite daemon internals.
+ */
+
+#include <pthread.h>
+
+#include "hcp_tiny.h"
+#include "bmlite_if.h"
+#include "bmlite_service.h"
+#include "bmlite_telemetry.h"
+#include "bmlite_daemon_proto.h"
+
+#define DAEMON_MAX_SENSORS 8
+
+typedef struct daemon daemon_t;
+typedef struct daemon_op daemon_op_t;
+typedef struct daemon_client daemon_client_t;
+
+typedef struct {
+    uint8_t index;
+    HCP_comm_t chain;
+    uint8_t txrx_buffer[MTU];
+    /** BM-Lite properties, probed once on open */
+    bmlite_caps_t caps;
+    /** Executes BM-Lite commands of this sensor */
+    bmlite_service_t svc;
+    /** Pending identification, shared by all IDENTIFY requests. Main thread only */
+    daemon_op_t *identify;
+    /** Protects bg_running and chain.cancel against spurious cancellation */
+    pthread_mutex_t lock;
+    /** Background identification is executed and can be cancelled */
+    bool bg_running;
+    /** Resource samples taken between requests */
+    bmlite_telemetry_t telemetry;
+} daemon_sensor_t;
+
+struct daemon_client {
+    daemon_client_t *next;
+    int fd;
+    bool subscribed;
+    /** Number of operations waiting for reply */
+    int refs;
+};
+
+typedef struct {
+    daemon_client_t *client;
+    uint16_t seq;
+} daemon_waiter_t;
+
+struct daemon_op {
+    /** Must be first, completion callback gets the request only */
+    bmlite_request_t req;
+    daemon_t *daemon;
+    daemon_sensor_t *sensor;
+    /** Completed operations list */
+    daemon_op_t *next;
+    uint16_t cmd;
+    uint16_t arg;
+    /** Started by watch mode, cancelled by any other request */
+    bool background;
+    daemon_waiter_t *waiters;
+    int nr_waiters;
+    int max_waiters;
+    /* Results */
+    bool match;
+    uint16_t template_id;
+    uint16_t data_len;
+    uint8_t data[BMLITED_MAX_PKT - sizeof(bmlited_hdr_t) - sizeof(bmlited_result_t)];
+};
+
+struct daemon {
+    const char *socket_path;
+    /** Default capture timeout, ms */
+    uint16_t timeout;
+    /** Identify continuously while there are subscribers */
+    bool watch;
+    /** Telemetry sampling period, ms. 0 - disabled */
+    uint32_t telemetry_period;
+    /** Real-time mode of I/O threads, NULL - normal scheduling */
+    const hal_rt_config_t *rt;
+
+    daemon_sensor_t sensors[DAEMON_MAX_SENSORS];
+    int nr_sensors;
+
+    int listen_fd;
+    int epoll_fd;
+    /** Signalled by I/O threads when an operation is completed */
+    int event_fd;
+    int signal_fd;
+
+    daemon_client_t *clients;
+    /** Disconnected clients waiting to be freed */
+    daemon_client_t *closed;
+    int subscribers;
+
+    pthread_mutex_t done_lock;
+    daemon_op_t *done;
+};
+
+/**
+ * @brief Start sensor services and listen on d->socket_path
+ *
+ *   Sensors d->sensors[0..d->nr_sensors-1] must be opened.
+ *
+ * @param[in] d - daemon
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t daemon_start(daemon_t *d);
+
+/**
+ * @brief Serve clients until SIGINT or SIGTERM
+ *
+ * @param[in] d - daemon
+ */
+void daemon_run(daemon_t *d);
+
+/**
+ * @brief Stop sensor services, disconnect clients and remove socket
+ *
+ * @param[in] d - daemon
+ */
+void daemon_stop(daemon_t *d);
+
+#endif /* BMLITE_DAEMON_H */
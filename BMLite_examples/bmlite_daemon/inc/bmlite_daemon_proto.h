@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BMLITE_DAEMON_PROTO_H
+#define BMLITE_DAEMON_PROTO_H
+
+/**
+ * @file    bmlite_daemon_proto.h
+ * @brief   Client protocol of BM-Lite daemon.
+ *
+ *   Clients talk to the daemon over a SOCK_SEQPACKET Unix domain socket.
+ *   Every packet is a bmlited_hdr_t followed by hdr.len bytes of payload.
+ *   All fields are little-endian.
+ *
+ *   Every request is answered by a packet with the same cmd and seq and
+ *   BMLITED_REPLY flag set. Reply payload starts with bmlited_result_t.
+ *   Subscribed clients also receive BMLITED_EVT_* packets with seq = 0.
+ */
+
+#include <stdint.h>
+
+#define BMLITED_SOCKET_PATH "/run/bmlited.sock"
+
+/** Maximal packet size, header included */
+#define BMLITED_MAX_PKT 4096
+
+/** Set in cmd field of replies */
+#define BMLITED_REPLY 0x8000
+
+typedef enum {
+    /** Payload: uint16_t timeout (ms, 0 - daemon default).
+        Reply: bmlited_match_t. Concurrent requests share one capture */
+    BMLITED_CMD_IDENTIFY = 1,
+    /** Payload: uint16_t template id. Enroll finger and save template with the id */
+    BMLITED_CMD_ENROLL,
+    /** Payload: uint16_t template id */
+    BMLITED_CMD_TEMPLATE_REMOVE,
+    BMLITED_CMD_TEMPLATE_REMOVE_ALL,
+    /** Reply: array of uint16_t template ids */
+    BMLITED_CMD_TEMPLATE_LIST,
+    /** Reply: version string */
+    BMLITED_CMD_VERSION,
+    /** Reply: uint8_t number of sensors */
+    BMLITED_CMD_SENSORS,
+    /** Start receiving BMLITED_EVT_MATCH events from all sensors */
+    BMLITED_CMD_SUBSCRIBE,
+    BMLITED_CMD_UNSUBSCRIBE,
+    /** Reply: bmlited_telemetry_t. Answered from the last sample, no sensor I/O */
+    BMLITED_CMD_TELEMETRY,
+} bmlited_cmd_t;
+
+typedef enum {
+    /** Payload: bmlited_match_t. Sent for every finished identification */
+    BMLITED_EVT_MATCH = 0x4001,
+} bmlited_evt_t;
+
+typedef struct __attribute__((packed)) {
+    uint16_t cmd;
+    uint16_t seq;
+    uint16_t len;
+    /** Sensor index, see BMLITED_CMD_SENSORS */
+    uint8_t sensor;
+    uint8_t reserved;
+} bmlited_hdr_t;
+
+typedef struct __attribute__((packed)) {
+    /** ::fpc_bep_result_t of the operation */
+    int16_t result;
+    /** ::fpc_bep_result_t reported by BM-Lite for the last command */
+    int16_t bep_result;
+} bmlited_result_t;
+
+typedef struct __attribute__((packed)) {
+    bmlited_result_t res;
+    uint8_t match;
+    uint16_t template_id;
+} bmlited_match_t;
+
+typedef struct __attribute__((packed)) {
+    /** Samples taken and samples BM-Lite failed to answer */
+    uint32_t samples;
+    uint32_t failed;
+    /** Time since the last successful sample, ms. 0xffffffff - none yet */
+    uint32_t age_ms;
+    /** Stack and heap high-water marks and sizes of the last sample, bytes */
+    uint32_t stack_used;
+    uint32_t stack_size;
+    uint32_t heap_used;
+    uint32_t heap_size;
+    /** Highest high-water marks since the daemon start, bytes */
+    uint32_t stack_peak;
+    uint32_t heap_peak;
+    /** Storage log size, bytes */
+    uint32_t log_size;
+    /** Link frames and link errors (CRC, missing ACK) since the daemon start */
+    uint32_t link_frames;
+    uint32_t link_errors;
+} bmlited_telemetry_t;
+
+#endif /* BMLITE_DAEMON_PROTO_H */
@@ -0,0 +1,749 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    daemon.c
+ * @brief   BM-Lite daemon. Serves clients on Unix socket.
+ *
+ *   Sockets are served by the main thread only. BM-Lite commands are
+ *   executed on I/O thread of the sensor service, completed operations are
+ *   passed back to the main thread through d->done list and d->event_fd.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+
+#include "bmlite_if.h"
+#include "bmlite_daemon.h"
+
+#define MAX_EVENTS 16
+
+/* epoll data of non-client descriptors */
+#define EV_LISTEN ((void *)1)
+#define EV_DONE   ((void *)2)
+#define EV_SIGNAL ((void *)3)
+
+static void op_submit(daemon_op_t *op);
+
+/*
+ * Operations. Jobs are executed on I/O thread of the sensor
+ */
+
+static fpc_bep_result_t op_job(HCP_comm_t *chain, void *ctx)
+{
+    daemon_op_t *op = (daemon_op_t *)ctx;
+    daemon_sensor_t *s = op->sensor;
+    fpc_bep_result_t res = FPC_BEP_RESULT_OK;
+
+    switch (op->cmd) {
+        case BMLITED_CMD_IDENTIFY:
+            if (op->background) {
+                pthread_mutex_lock(&s->lock);
+                s->bg_running = true;
+                pthread_mutex_unlock(&s->lock);
+                // Don't report the same finger again and again
+                res = sensor_wait_finger_not_present(chain, 0);
+            }
+            if (res == FPC_BEP_RESULT_OK) {
+                res = bep_identify_finger(chain, op->arg, &op->template_id, &op->match);
+            }
+            if (op->background) {
+                pthread_mutex_lock(&s->lock);
+                s->bg_running = false;
+                chain->cancel = 0;
+                pthread_mutex_unlock(&s->lock);
+            }
+            break;
+        case BMLITED_CMD_ENROLL:
+            // Save in the same job, other requests would overwrite RAM template
+            res = bep_enroll_finger(chain);
+            if (res == FPC_BEP_RESULT_OK) {
+                res = bep_template_save(chain, op->arg);
+                bep_template_remove_ram(chain);
+            }
+            break;
+        case BMLITED_CMD_TEMPLATE_REMOVE:
+            res = bep_template_remove(chain, op->arg);
+            break;
+        case BMLITED_CMD_TEMPLATE_REMOVE_ALL:
+            res = bep_template_remove_all(chain);
+            break;
+        case BMLITED_CMD_TEMPLATE_LIST:
+            res = bep_template_get_ids(chain);
+            if (res == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_OK) {
+                op->data_len = HCP_MIN(chain->arg.size, sizeof(op->data));
+                memcpy(op->data, chain->arg.data, op->data_len);
+            }
+            break;
+        case BMLITED_CMD_VERSION:
+            res = bep_version(chain, (char *)op->data, sizeof(op->data) - 1);
+            if (res == FPC_BEP_RESULT_OK) {
+                op->data_len = strlen((char *)op->data);
+            }
+            break;
+        default:
+            res = FPC_BEP_RESULT_NOT_SUPPORTED;
+    }
+
+    return res;
+}
+
+static void op_done(bmlite_request_t *req)
+{
+    daemon_op_t *op = (daemon_op_t *)req;
+    daemon_t *d = op->daemon;
+    uint64_t event = 1;
+
+    pthread_mutex_lock(&d->done_lock);
+    op->next = d->done;
+    d->done = op;
+    pthread_mutex_unlock(&d->done_lock);
+
+    write(d->event_fd, &event, sizeof(event));
+}
+
+static daemon_op_t *op_create(daemon_t *d, daemon_sensor_t *s, uint16_t cmd, uint16_t arg)
+{
+    daemon_op_t *op = calloc(1, sizeof(daemon_op_t));
+
+    if (op == NULL) {
+        return NULL;
+    }
+    op->daemon = d;
+    op->sensor = s;
+    op->cmd = cmd;
+    op->arg = arg;
+    bmlite_request_init(&op->req, op_job, op, op_done);
+
+    return op;
+}
+
+static void op_free(daemon_op_t *op)
+{
+    bmlite_request_destroy(&op->req);
+    free(op->waiters);
+    free(op);
+}
+
+/* Real-time mode must be set by the thread doing the transfers */
+static fpc_bep_result_t rt_job(HCP_comm_t *chain, void *ctx)
+{
+    return hal_rt_set((const hal_rt_config_t *)ctx, chain);
+}
+
+static bool op_add_waiter(daemon_op_t *op, daemon_client_t *c, uint16_t seq)
+{
+    if (op->nr_waiters == op->max_waiters) {
+        int max = op->max_waiters ? op->max_waiters * 2 : 4;
+        daemon_waiter_t *w = realloc(op->waiters, max * sizeof(daemon_waiter_t));
+        if (w == NULL) {
+            return false;
+        }
+        op->waiters = w;
+        op->max_waiters = max;
+    }
+    op->waiters[op->nr_waiters].client = c;
+    op->waiters[op->nr_waiters].seq = seq;
+    op->nr_waiters++;
+    c->refs++;
+
+    return true;
+}
+
+/*
+ * Clients
+ */
+
+static void client_close(daemon_t *d, daemon_client_t *c)
+{
+    daemon_client_t **p;
+
+    if (c->fd < 0) {
+        return;
+    }
+
+    for (p = &d->clients; *p; p = &(*p)->next) {
+        if (*p == c) {
+            *p = c->next;
+            break;
+        }
+    }
+    if (c->subscribed) {
+        d->subscribers--;
+    }
+    epoll_ctl(d->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+
+    // Pending operations and events of current epoll batch can still refer
+    // to the client, it is freed by clients_reap()
+    c->next = d->closed;
+    d->closed = c;
+}
+
+static void client_put(daemon_t *d, daemon_client_t *c)
+{
+    c->refs--;
+}
+
+static void clients_reap(daemon_t *d)
+{
+    daemon_client_t **p = &d->closed;
+
+    while (*p) {
+        daemon_client_t *c = *p;
+        if (c->refs == 0) {
+            *p = c->next;
+            free(c);
+        } else {
+            p = &c->next;
+        }
+    }
+}
+
+static void client_send(daemon_t *d, daemon_client_t *c, uint16_t cmd, uint16_t seq,
+        uint8_t sensor, const void *payload, uint16_t len)
+{
+    uint8_t pkt[BMLITED_MAX_PKT];
+    bmlited_hdr_t *hdr = (bmlited_hdr_t *)pkt;
+
+    if (c->fd < 0) {
+        return;
+    }
+
+    hdr->cmd = cmd;
+    hdr->seq = seq;
+    hdr->len = len;
+    hdr->sensor = sensor;
+    hdr->reserved = 0;
+    memcpy(pkt + sizeof(bmlited_hdr_t), payload, len);
+
+    // A client which doesn't read its socket must not block other clients
+    if (send(c->fd, pkt, sizeof(bmlited_hdr_t) + len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+        client_close(d, c);
+    }
+}
+
+static void client_reply(daemon_t *d, daemon_client_t *c, const bmlited_hdr_t *req,
+        fpc_bep_result_t result, fpc_bep_result_t bep_result, const void *data, uint16_t len)
+{
+    uint8_t payload[BMLITED_MAX_PKT - sizeof(bmlited_hdr_t)];
+    bmlited_result_t *res = (bmlited_result_t *)payload;
+
+    res->result = result;
+    res->bep_result = bep_result;
+    len = HCP_MIN(len, sizeof(payload) - sizeof(bmlited_result_t));
+    if (len) {
+        memcpy(payload + sizeof(bmlited_result_t), data, len);
+    }
+    client_send(d, c, req->cmd | BMLITED_REPLY, req->seq, req->sensor, payload,
+            sizeof(bmlited_result_t) + len);
+}
+
+/*
+ * Operation completion. Main thread
+ */
+
+static void watch_arm(daemon_t *d, daemon_sensor_t *s)
+{
+    daemon_op_t *op;
+
+    if (!d->watch || d->subscribers == 0 || s->identify) {
+        return;
+    }
+
+    op = op_create(d, s, BMLITED_CMD_IDENTIFY, d->timeout);
+    if (op == NULL) {
+        return;
+    }
+    op->background = true;
+    s->identify = op;
+    if (bmlite_service_submit(&s->svc, &op->req, BMLITE_PRIO_NORMAL) != FPC_BEP_RESULT_OK) {
+        s->identify = NULL;
+        op_free(op);
+    }
+}
+
+static void op_complete(daemon_t *d, daemon_op_t *op)
+{
+    daemon_sensor_t *s = op->sensor;
+    bmlited_hdr_t hdr;
+    bmlited_match_t match;
+    bool stopping = bmlite_service_closed(&s->svc);
+
+    if (op->cmd == BMLITED_CMD_IDENTIFY) {
+        // Background capture was cancelled, but clients joined it meanwhile
+        if (op->req.result == FPC_BEP_RESULT_CANCELLED && op->nr_waiters && !stopping) {
+            op->background = false;
+            op_submit(op);
+            return;
+        }
+        s->identify = NULL;
+
+        match.res.result = op->req.result;
+        match.res.bep_result = op->req.bep_result;
+        match.match = op->match;
+        match.template_id = op->match ? op->template_id : 0;
+
+        for (int i = 0; i < op->nr_waiters; i++) {
+            client_send(d, op->waiters[i].client, op->cmd | BMLITED_REPLY,
+                    op->waiters[i].seq, s->index, &match, sizeof(match));
+        }
+
+        if (op->req.result == FPC_BEP_RESULT_OK) {
+            daemon_client_t *c = d->clients;
+            while (c) {
+                daemon_client_t *next = c->next;
+                if (c->subscribed) {
+                    client_send(d, c, BMLITED_EVT_MATCH, 0, s->index, &match, sizeof(match));
+                }
+                c = next;
+            }
+        }
+    } else if (op->nr_waiters) {
+        hdr.cmd = op->cmd;
+        hdr.seq = op->waiters[0].seq;
+        hdr.sensor = s->index;
+        client_reply(d, op->waiters[0].client, &hdr, op->req.result, op->req.bep_result,
+                op->data, op->data_len);
+    }
+
+    for (int i = 0; i < op->nr_waiters; i++) {
+        client_put(d, op->waiters[i].client);
+    }
+    op_free(op);
+
+    if (!stopping) {
+        watch_arm(d, s);
+    }
+}
+
+static void op_submit(daemon_op_t *op)
+{
+    daemon_sensor_t *s = op->sensor;
+    fpc_bep_result_t res;
+
+    res = bmlite_service_submit(&s->svc, &op->req, BMLITE_PRIO_HIGH);
+    if (res != FPC_BEP_RESULT_OK) {
+        op->req.result = res;
+        op_complete(op->daemon, op);
+        return;
+    }
+
+    // Client requests take over the sensor from watch mode
+    pthread_mutex_lock(&s->lock);
+    if (s->bg_running && s->identify && s->identify->nr_waiters == 0) {
+        bmlite_cancel(&s->chain);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void process_done(daemon_t *d)
+{
+    daemon_op_t *list, *op;
+    uint64_t events;
+
+    read(d->event_fd, &events, sizeof(events));
+
+    pthread_mutex_lock(&d->done_lock);
+    list = d->done;
+    d->done = NULL;
+    pthread_mutex_unlock(&d->done_lock);
+
+    // The list is LIFO, restore completion order
+    op = NULL;
+    while (list) {
+        daemon_op_t *next = list->next;
+        list->next = op;
+        op = list;
+        list = next;
+    }
+
+    while (op) {
+        daemon_op_t *next = op->next;
+        op_complete(d, op);
+        op = next;
+    }
+}
+
+/*
+ * Requests. Main thread
+ */
+
+static void telemetry_reply(daemon_t *d, daemon_client_t *c, const bmlited_hdr_t *hdr,
+        daemon_sensor_t *s)
+{
+    bmlite_telemetry_metrics_t m;
+    bmlited_telemetry_t t;
+    struct timespec ts;
+    uint64_t now;
+
+    if (d->telemetry_period == 0) {
+        client_reply(d, c, hdr, FPC_BEP_RESULT_NOT_SUPPORTED, FPC_BEP_RESULT_OK, NULL, 0);
+        return;
+    }
+
+    bmlite_telemetry_get(&s->telemetry, &m);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    t.samples = m.samples;
+    t.failed = m.failed;
+    t.age_ms = m.last.time_ms ? HCP_MIN(now - m.last.time_ms, UINT32_MAX) : UINT32_MAX;
+    t.stack_used = m.last.diag.stack_used;
+    t.stack_size = m.last.diag.stack_size;
+    t.heap_used = m.last.diag.heap_used;
+    t.heap_size = m.last.diag.heap_size;
+    t.stack_peak = m.peak.stack_used;
+    t.heap_peak = m.peak.heap_used;
+    t.log_size = m.last.log_size;
+    t.link_frames = m.last.link.frames;
+    t.link_errors = m.last.link.errors;
+    client_reply(d, c, hdr, FPC_BEP_RESULT_OK, FPC_BEP_RESULT_OK, &t, sizeof(t));
+}
+
+static void process_request(daemon_t *d, daemon_client_t *c, const uint8_t *pkt, ssize_t size)
+{
+    const bmlited_hdr_t *hdr = (const bmlited_hdr_t *)pkt;
+    const uint8_t *payload = pkt + sizeof(bmlited_hdr_t);
+    daemon_sensor_t *s;
+    daemon_op_t *op;
+    uint16_t arg = 0;
+
+    if (size < (ssize_t)sizeof(bmlited_hdr_t) ||
+        (ssize_t)hdr->len != size - (ssize_t)sizeof(bmlited_hdr_t)) {
+        client_close(d, c);
+        return;
+    }
+    if (hdr->len >= sizeof(uint16_t)) {
+        memcpy(&arg, payload, sizeof(arg));
+    }
+
+    switch (hdr->cmd) {
+        case BMLITED_CMD_SENSORS: {
+            uint8_t n = d->nr_sensors;
+            client_reply(d, c, hdr, FPC_BEP_RESULT_OK, FPC_BEP_RESULT_OK, &n, sizeof(n));
+            return;
+        }
+        case BMLITED_CMD_SUBSCRIBE:
+        case BMLITED_CMD_UNSUBSCRIBE: {
+            bool subscribe = hdr->cmd == BMLITED_CMD_SUBSCRIBE;
+            if (c->subscribed != subscribe) {
+                c->subscribed = subscribe;
+                d->subscribers += subscribe ? 1 : -1;
+            }
+            client_reply(d, c, hdr, FPC_BEP_RESULT_OK, FPC_BEP_RESULT_OK, NULL, 0);
+            for (int i = 0; i < d->nr_sensors; i++) {
+                watch_arm(d, &d->sensors[i]);
+            }
+            return;
+        }
+        case BMLITED_CMD_IDENTIFY:
+        case BMLITED_CMD_ENROLL:
+        case BMLITED_CMD_TELEMETRY:
+        case BMLITED_CMD_TEMPLATE_REMOVE:
+        case BMLITED_CMD_TEMPLATE_REMOVE_ALL:
+        case BMLITED_CMD_TEMPLATE_LIST:
+        case BMLITED_CMD_VERSION:
+            break;
+        default:
+            client_reply(d, c, hdr, FPC_BEP_RESULT_NOT_SUPPORTED, FPC_BEP_RESULT_OK, NULL, 0);
+            return;
+    }
+
+    if (hdr->sensor >= d->nr_sensors) {
+        client_reply(d, c, hdr, FPC_BEP_RESULT_INVALID_ARGUMENT, FPC_BEP_RESULT_OK, NULL, 0);
+        return;
+    }
+    s = &d->sensors[hdr->sensor];
+
+    if (hdr->cmd == BMLITED_CMD_TELEMETRY) {
+        telemetry_reply(d, c, hdr, s);
+        return;
+    }
+
+    // Coalesce with pending identification
+    if (hdr->cmd == BMLITED_CMD_IDENTIFY && s->identify) {
+        if (!op_add_waiter(s->identify, c, hdr->seq)) {
+            client_reply(d, c, hdr, FPC_BEP_RESULT_NO_MEMORY, FPC_BEP_RESULT_OK, NULL, 0);
+        }
+        return;
+    }
+
+    if (hdr->cmd == BMLITED_CMD_IDENTIFY && arg == 0) {
+        arg = d->timeout;
+    }
+    op = op_create(d, s, hdr->cmd, arg);
+    if (op == NULL || !op_add_waiter(op, c, hdr->seq)) {
+        if (op) {
+            op_free(op);
+        }
+        client_reply(d, c, hdr, FPC_BEP_RESULT_NO_MEMORY, FPC_BEP_RESULT_OK, NULL, 0);
+        return;
+    }
+    if (hdr->cmd == BMLITED_CMD_IDENTIFY) {
+        s->identify = op;
+    }
+    op_submit(op);
+}
+
+static void client_accept(daemon_t *d)
+{
+    struct epoll_event ev;
+    daemon_client_t *c;
+    int fd;
+
+    fd = accept4(d->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+
+    c = calloc(1, sizeof(daemon_client_t));
+    if (c == NULL) {
+        close(fd);
+        return;
+    }
+    c->fd = fd;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(d->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        close(fd);
+        free(c);
+        return;
+    }
+    c->next = d->clients;
+    d->clients = c;
+}
+
+static void client_read(daemon_t *d, daemon_client_t *c, uint32_t events)
+{
+    uint8_t pkt[BMLITED_MAX_PKT];
+    ssize_t size;
+
+    c->refs++;
+    while (c->fd >= 0) {
+        size = recv(c->fd, pkt, sizeof(pkt), MSG_DONTWAIT | MSG_TRUNC);
+        if (size < 0 && (errno == EAGAIN || errno == EINTR)) {
+            break;
+        }
+        if (size <= 0 || size > (ssize_t)sizeof(pkt)) {
+            client_close(d, c);
+            break;
+        }
+        process_request(d, c, pkt, size);
+    }
+
+    if (c->fd >= 0 && (events & (EPOLLHUP | EPOLLERR))) {
+        client_close(d, c);
+    }
+    client_put(d, c);
+}
+
+/*
+ * Daemon
+ */
+
+static int epoll_add(daemon_t *d, int fd, void *ptr)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = ptr;
+    return epoll_ctl(d->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int listen_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+fpc_bep_result_t daemon_start(daemon_t *d)
+{
+    sigset_t mask;
+    int started = 0;
+
+    d->clients = NULL;
+    d->closed = NULL;
+    d->subscribers = 0;
+    d->done = NULL;
+    d->listen_fd = d->epoll_fd = d->event_fd = d->signal_fd = -1;
+    pthread_mutex_init(&d->done_lock, NULL);
+
+    // Block signals before I/O threads are created, they are read from signal_fd
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    d->signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    d->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    d->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (d->signal_fd < 0 || d->event_fd < 0 || d->epoll_fd < 0) {
+        goto error;
+    }
+
+    d->listen_fd = listen_socket(d->socket_path);
+    if (d->listen_fd < 0) {
+        printf("Can't listen on %s\n", d->socket_path);
+        goto error;
+    }
+
+    if (epoll_add(d, d->listen_fd, EV_LISTEN) < 0 ||
+        epoll_add(d, d->event_fd, EV_DONE) < 0 ||
+        epoll_add(d, d->signal_fd, EV_SIGNAL) < 0) {
+        goto error;
+    }
+
+    for (started = 0; started < d->nr_sensors; started++) {
+        daemon_sensor_t *s = &d->sensors[started];
+        s->index = started;
+        s->identify = NULL;
+        s->bg_running = false;
+        pthread_mutex_init(&s->lock, NULL);
+        if (d->telemetry_period) {
+            bmlite_telemetry_config_t cfg = {
+                .period = d->telemetry_period,
+                .storage_log = true,
+            };
+            bmlite_telemetry_start(&s->telemetry, &s->svc, &cfg);
+        }
+        if (bmlite_service_start(&s->svc, &s->chain) != FPC_BEP_RESULT_OK) {
+            goto error;
+        }
+        if (d->rt) {
+            hal_rt_config_t rt = *d->rt;
+            // Every sensor gets its own CPU
+            if (rt.cpu >= 0) {
+                rt.cpu += started;
+            }
+            if (bmlite_service_call(&s->svc, rt_job, &rt, BMLITE_PRIO_HIGH) != FPC_BEP_RESULT_OK) {
+                bmlite_service_stop(&s->svc);
+                goto error;
+            }
+        }
+    }
+
+    return FPC_BEP_RESULT_OK;
+
+error:
+    while (started--) {
+        bmlite_service_stop(&d->sensors[started].svc);
+    }
+    if (d->listen_fd >= 0) {
+        close(d->listen_fd);
+        unlink(d->socket_path);
+    }
+    if (d->epoll_fd >= 0)
+        close(d->epoll_fd);
+    if (d->event_fd >= 0)
+        close(d->event_fd);
+    if (d->signal_fd >= 0)
+        close(d->signal_fd);
+    return FPC_BEP_RESULT_NO_RESOURCE;
+}
+
+void daemon_run(daemon_t *d)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int n;
+
+    while (1) {
+        n = epoll_wait(d->epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+
+            if (ptr == EV_SIGNAL) {
+                return;
+            } else if (ptr == EV_LISTEN) {
+                client_accept(d);
+            } else if (ptr == EV_DONE) {
+                process_done(d);
+            } else {
+                client_read(d, (daemon_client_t *)ptr, events[i].events);
+            }
+        }
+        clients_reap(d);
+    }
+}
+
+void daemon_stop(daemon_t *d)
+{
+    for (int i = 0; i < d->nr_sensors; i++) {
+        daemon_sensor_t *s = &d->sensors[i];
+        // Abort waiting for finger, queued requests are cancelled by the service
+        bmlite_service_close(&s->svc);
+        bmlite_cancel(&s->chain);
+        bmlite_service_stop(&s->svc);
+        if (d->telemetry_period) {
+            bmlite_telemetry_destroy(&s->telemetry);
+        }
+    }
+    process_done(d);
+
+    while (d->clients) {
+        client_close(d, d->clients);
+    }
+    clients_reap(d);
+
+    close(d->listen_fd);
+    unlink(d->socket_path);
+    close(d->epoll_fd);
+    close(d->event_fd);
+    close(d->signal_fd);
+}
@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    main.c
+ * @brief   BM-Lite daemon. Options parsing and sensors setup.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "hcp_tiny.h"
+#include "platform.h"
+#include "platform_linux.h"
+#include "console_params.h"
+#include "platform_defs.h"
+#include "bmlite_daemon.h"
+
+#define DATA_BUFFER_SIZE 102400
+
+static daemon_t daemon_ctx;
+
+static void help(void)
+{
+    fprintf(stderr, "BM-Lite daemon\n");
+    fprintf(stderr, "Syntax: bmlite_daemon [-d spidev[:reset_pin:ready_pin]]... [-b baudrate]\n"
+                    "                      [-t timeout] [-S socket] [-w] [-R] [-T period]\n"
+                    "                      [-P cpu[:priority]]\n");
+    fprintf(stderr, "  -d  BM-Lite device, can be repeated (default %s)\n", BMLITE_SPI_DEV);
+    fprintf(stderr, "  -b  SPI speed, Hz (default 1000000)\n");
+    fprintf(stderr, "  -t  capture timeout, s (default 5)\n");
+    fprintf(stderr, "  -S  socket path (default %s)\n", BMLITED_SOCKET_PATH);
+    fprintf(stderr, "  -w  identify continuously while there are subscribers\n");
+    fprintf(stderr, "  -R  reset sensors on start (default: only sensors not responding)\n");
+    fprintf(stderr, "  -T  sample BM-Lite stack, heap and storage log every period s (default off)\n");
+    fprintf(stderr, "  -P  real-time I/O: pin I/O thread of sensor N to CPU cpu+N, SCHED_FIFO\n"
+                    "      priority (default 50), lock memory\n");
+}
+
+static fpc_bep_result_t sensor_open(daemon_sensor_t *s, char *spec, uint32_t baudrate,
+        uint32_t timeout, bool warm_start)
+{
+    console_initparams_t params;
+    fpc_bep_result_t res;
+    char *pin;
+
+    memset(&params, 0, sizeof(params));
+    params.iface = SPI_INTERFACE;
+    params.baudrate = baudrate;
+    params.timeout = timeout;
+    params.hcp_comm = &s->chain;
+    params.warm_start = warm_start;
+
+    params.port = strtok(spec, ":");
+    if ((pin = strtok(NULL, ":")) != NULL) {
+        params.reset_pin = atoi(pin);
+    }
+    if ((pin = strtok(NULL, ":")) != NULL) {
+        params.ready_pin = atoi(pin);
+    }
+
+    memset(&s->chain, 0, sizeof(s->chain));
+    s->chain.txrx_buffer = s->txrx_buffer;
+    s->chain.pkt_buffer = malloc(DATA_BUFFER_SIZE);
+    s->chain.pkt_size_max = DATA_BUFFER_SIZE;
+    if (s->chain.pkt_buffer == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+
+    res = platform_linux_dev_open(&params);
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+    // Commands ask BM-Lite again if the probe fails
+    bep_caps_probe(&s->chain, &s->caps);
+
+    return FPC_BEP_RESULT_OK;
+}
+
+static void sensor_close(daemon_sensor_t *s)
+{
+    platform_linux_dev_close(&s->chain);
+    free(s->chain.pkt_buffer);
+}
+
+int main(int argc, char **argv)
+{
+    daemon_t *d = &daemon_ctx;
+    char *devices[DAEMON_MAX_SENSORS];
+    char default_dev[] = BMLITE_SPI_DEV;
+    int nr_devices = 0;
+    uint32_t baudrate = 1000000;
+    uint32_t timeout = 5;
+    bool warm_start = true;
+    hal_rt_config_t rt = {
+        .cpu = -1,
+        .priority = 50,
+        .lock_memory = true,
+    };
+    int ret = 1;
+    int c;
+
+    d->socket_path = BMLITED_SOCKET_PATH;
+    d->watch = false;
+    d->telemetry_period = 0;
+    d->rt = NULL;
+
+    while ((c = getopt(argc, argv, "d:b:t:S:wRT:P:h")) != -1) {
+        switch (c) {
+            case 'd':
+                if (nr_devices == DAEMON_MAX_SENSORS) {
+                    fprintf(stderr, "Too many devices\n");
+                    exit(1);
+                }
+                devices[nr_devices++] = optarg;
+                break;
+            case 'b':
+                baudrate = atoi(optarg);
+                break;
+            case 't':
+                timeout = atoi(optarg);
+                break;
+            case 'S':
+                d->socket_path = optarg;
+                break;
+            case 'w':
+                d->watch = true;
+                break;
+            case 'R':
+                warm_start = false;
+                break;
+            case 'T':
+                d->telemetry_period = atoi(optarg) * 1000;
+                break;
+            case 'P': {
+                char *prio = strchr(optarg, ':');
+                rt.cpu = atoi(optarg);
+                if (prio) {
+                    rt.priority = atoi(prio + 1);
+                }
+                d->rt = &rt;
+                break;
+            }
+            default:
+                help();
+                exit(1);
+        }
+    }
+
+    if (nr_devices == 0) {
+        devices[nr_devices++] = default_dev;
+    }
+    d->timeout = HCP_MIN(timeout * 1000, 0xffff);
+
+    for (d->nr_sensors = 0; d->nr_sensors < nr_devices; d->nr_sensors++) {
+        daemon_sensor_t *s = &d->sensors[d->nr_sensors];
+        if (sensor_open(s, devices[d->nr_sensors], baudrate, timeout, warm_start) != FPC_BEP_RESULT_OK) {
+            printf("Can't open BM-Lite device %s\n", devices[d->nr_sensors]);
+            free(s->chain.pkt_buffer);
+            goto exit;
+        }
+    }
+
+    if (daemon_start(d) != FPC_BEP_RESULT_OK) {
+        goto exit;
+    }
+    printf("Serving %d sensor(s) on %s\n", d->nr_sensors, d->socket_path);
+    daemon_run(d);
+    daemon_stop(d);
+    ret = 0;
+
+exit:
+    while (d->nr_sensors--) {
+        sensor_close(&d->sensors[d->nr_sensors]);
+    }
+    return ret;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CONSOLE_APP_H
+#define CONSOLE_APP_H
+
+/**
+ * @file    console_app.h
+ * @brief   Console application internal interface
+ */
+
+#include <stdio.h>
+
+#include "hcp_tiny.h"
+
+/**
+ * @brief Execute single batch command
+ *
+ *   Command is given as argument vector, e.g. {"identify", "--count", "1000"}.
+ *   Timing of every operation is printed, summary is printed by batch_summary().
+ *
+ * @param[in] chain - HCP com chain
+ * @param[in] argc  - number of arguments
+ * @param[in] argv  - command name and arguments
+ *
+ * @return 0 if all operations succeeded, -1 on cancellation, 1 otherwise
+ */
+int batch_command(HCP_comm_t *chain, int argc, char **argv);
+
+/**
+ * @brief Execute batch commands from script, one command per line
+ *
+ *   Empty lines and lines starting with '#' are ignored.
+ *
+ * @param[in] chain - HCP com chain
+ * @param[in] f     - script file
+ *
+ * @return 0 if all operations succeeded, 1 otherwise
+ */
+int batch_script(HCP_comm_t *chain, FILE *f);
+
+/**
+ * @brief Set additional sensors used by identify-any
+ *
+ *   Chain given to batch_command() is sensor 0, additional sensors are
+ *   numbered from 1.
+ *
+ * @param[in] chains - HCP com chains of additional sensors
+ * @param[in] count  - number of additional sensors
+ */
+void batch_set_sensors(HCP_comm_t **chains, uint32_t count);
+
+/**
+ * @brief Set real-time I/O mode the application runs in
+ *
+ *   rt-bench compares this mode with normal scheduling and restores it
+ *   afterwards. Without the call rt-bench uses SCHED_FIFO priority 50 and
+ *   locked memory on any CPU.
+ *
+ * @param[in] cfg - real-time settings, NULL - normal scheduling
+ */
+void batch_set_rt(const hal_rt_config_t *cfg);
+
+/**
+ * @brief Print summary of all executed batch commands
+ */
+void batch_summary(void);
+
+/**
+ * @brief Print list of batch commands
+ */
+void batch_help(void);
+
+#endif /* CONSOLE_APP_H */
@@ -0,0 +1,1255 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    batch.c
+ * @brief   Non-interactive batch mode of console application
+ */
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bmlite_if.h"
+#include "hcp_tiny.h"
+#include "bmlite_archive.h"
+#include "bmlite_eval.h"
+#include "bmlite_gallery.h"
+#include "bmlite_harvest.h"
+#include "bmlite_image.h"
+#include "bmlite_link.h"
+#include "bmlite_multi.h"
+#include "bmlite_quality.h"
+#include "bmlite_sync.h"
+#include "bmlite_tdb.h"
+#include "bmlite_telemetry.h"
+#include "console_app.h"
+
+#define DATA_BUFFER_SIZE 102400
+#define MAX_SCRIPT_ARGS 16
+#define INFO_LEN 128
+#define QUALITY_ATTEMPTS 3
+#define QUALITY_BENCH_RUNS 100
+#define MAX_SENSORS 4
+#define RT_BENCH_PROBES 1000
+#define RT_BENCH_TIMEOUT 1000
+/** Gaps recorded per round trip at most */
+#define RT_BENCH_GAPS 8
+
+typedef struct {
+    uint32_t count;
+    uint32_t timeout;
+    int id;
+    uint32_t slots;
+    uint32_t threads;
+    /** Images per finger offered to enrollment */
+    uint32_t enroll;
+    /** Positional argument (file or directory) */
+    const char *path;
+    /** Second positional argument (output directory) */
+    const char *out;
+    /** Operation details printed after timing */
+    char info[INFO_LEN];
+} batch_args_t;
+
+typedef fpc_bep_result_t (*batch_fn_t)(HCP_comm_t *chain, batch_args_t *args);
+
+typedef struct {
+    const char *name;
+    const char *usage;
+    batch_fn_t fn;
+    /** Command handles --count itself */
+    bool once;
+} batch_cmd_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t failed;
+    double min_ms;
+    double max_ms;
+    double total_ms;
+} batch_stat_t;
+
+static uint8_t data_buffer[DATA_BUFFER_SIZE];
+
+/** Additional sensors of identify-any */
+static HCP_comm_t *sensors[MAX_SENSORS - 1];
+static uint32_t nr_sensors;
+
+/** Real-time I/O mode given with -r, used by rt-bench when off */
+static hal_rt_config_t rt_cfg = {
+    .cpu = -1,
+    .priority = 50,
+    .lock_memory = true,
+};
+static bool rt_enabled;
+
+/*
+ * Transfer hooks of rt-bench. HCP_comm_t callbacks have no context,
+ * so the original callbacks and measurements are kept here.
+ */
+static struct {
+    fpc_bep_result_t (*write)(uint16_t, const uint8_t *, uint32_t);
+    fpc_bep_result_t (*read)(uint16_t, uint8_t *, uint32_t);
+    bool (*ready)(void);
+    /** End of the previous transfer, 0 - no transfer yet */
+    double last_end;
+    /** BM-Lite was not ready since the previous transfer */
+    bool waited;
+    double *gaps;
+    uint32_t nr_gaps;
+    uint32_t max_gaps;
+} rt_bench;
+
+static double time_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/*
+ * Commands
+ */
+
+static fpc_bep_result_t cmd_identify(HCP_comm_t *chain, batch_args_t *args)
+{
+    fpc_bep_result_t res;
+    uint16_t template_id = 0;
+    bool match = false;
+
+    res = bep_identify_finger(chain, args->timeout, &template_id, &match);
+    if (res == FPC_BEP_RESULT_OK) {
+        if (match) {
+            snprintf(args->info, INFO_LEN, "match id %d", template_id);
+        } else {
+            snprintf(args->info, INFO_LEN, "no match");
+        }
+    }
+    return res;
+}
+
+static fpc_bep_result_t cmd_identify_any(HCP_comm_t *chain, batch_args_t *args)
+{
+    HCP_comm_t *chains[MAX_SENSORS];
+    bmlite_multi_result_t result;
+    fpc_bep_result_t res;
+
+    chains[0] = chain;
+    for (uint32_t i = 0; i < nr_sensors; i++) {
+        chains[i + 1] = sensors[i];
+    }
+
+    res = bmlite_multi_identify(chains, nr_sensors + 1, args->timeout, &result);
+    if (res == FPC_BEP_RESULT_OK) {
+        if (result.match) {
+            snprintf(args->info, INFO_LEN, "sensor %d match id %d, captured in %u ms",
+                     result.sensor, result.template_id, result.capture_ms);
+        } else {
+            snprintf(args->info, INFO_LEN, "sensor %d no match, captured in %u ms",
+                     result.sensor, result.capture_ms);
+        }
+    }
+    // Result of the identifying sensor is returned, chain may keep its cancelled capture
+    chain->bep_result = FPC_BEP_RESULT_OK;
+    return res;
+}
+
+static fpc_bep_result_t cmd_enroll(HCP_comm_t *chain, batch_args_t *args)
+{
+    bmlite_enroll_session_t session;
+    fpc_bep_result_t res;
+    int len;
+
+    // --timeout limits the whole enrollment
+    bep_enroll_session_init(&session, NULL);
+    session.cfg.timeout = args->timeout;
+    res = bep_enroll_session_run(chain, &session);
+    len = snprintf(args->info, INFO_LEN, "%d captures, capture %d ms, add %d ms, finger up %d ms",
+                   session.nr_steps, session.capture_ms, session.add_ms, session.finger_up_ms);
+
+    if (res == FPC_BEP_RESULT_OK && args->id >= 0) {
+        res = bep_template_save(chain, args->id);
+        snprintf(args->info + len, INFO_LEN - len, ", saved as %d", args->id);
+    }
+    return res;
+}
+
+static fpc_bep_result_t cmd_capture(HCP_comm_t *chain, batch_args_t *args)
+{
+    return bep_capture(chain, args->timeout);
+}
+
+static fpc_bep_result_t cmd_version(HCP_comm_t *chain, batch_args_t *args)
+{
+    struct bmlite_caps *caps = chain->caps;
+    fpc_bep_result_t res;
+
+    // Bypass the cache, version --count measures a command round trip
+    chain->caps = NULL;
+    res = bep_version(chain, args->info, INFO_LEN - 1);
+    chain->caps = caps;
+    return res;
+}
+
+static fpc_bep_result_t cmd_telemetry(HCP_comm_t *chain, batch_args_t *args)
+{
+    bmlite_telemetry_sample_t s;
+    fpc_bep_result_t res;
+
+    res = bmlite_telemetry_sample(chain, true, &s);
+    if (res == FPC_BEP_RESULT_OK) {
+        snprintf(args->info, INFO_LEN, "stack %u/%u, heap %u/%u, log %u, frames %u, errors %u",
+                 s.diag.stack_used, s.diag.stack_size, s.diag.heap_used, s.diag.heap_size,
+                 s.log_size, s.link.frames, s.link.errors);
+    }
+    return res;
+}
+
+static fpc_bep_result_t cmd_list(HCP_comm_t *chain, batch_args_t *args)
+{
+    fpc_bep_result_t res;
+    int len = 0;
+
+    res = bep_template_get_ids(chain);
+    if (res == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_OK) {
+        for (uint32_t i = 0; i < chain->arg.size / 2 && len < INFO_LEN; i++) {
+            len += snprintf(args->info + len, INFO_LEN - len, "%d ",
+                    *(uint16_t *)(chain->arg.data + i * 2));
+        }
+    }
+    return res;
+}
+
+static fpc_bep_result_t cmd_save(HCP_comm_t *chain, batch_args_t *args)
+{
+    return bep_template_save(chain, args->id);
+}
+
+static fpc_bep_result_t cmd_remove(HCP_comm_t *chain, batch_args_t *args)
+{
+    return bep_template_remove(chain, args->id);
+}
+
+static fpc_bep_result_t cmd_remove_all(HCP_comm_t *chain, batch_args_t *args)
+{
+    return bep_template_remove_all(chain);
+}
+
+static fpc_bep_result_t cmd_reset(HCP_comm_t *chain, batch_args_t *args)
+{
+    return bep_sw_reset(chain);
+}
+
+static fpc_bep_result_t write_file(const char *path, uint8_t *data, uint32_t size)
+{
+    FILE *f = fopen(path, "wb");
+
+    if (f == NULL) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    if (fwrite(data, 1, size, f) != size) {
+        fclose(f);
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    fclose(f);
+    return FPC_BEP_RESULT_OK;
+}
+
+static fpc_bep_result_t cmd_image_get(HCP_comm_t *chain, batch_args_t *args)
+{
+    bmlite_image_geometry_t geometry;
+    fpc_bep_result_t res;
+
+    res = bep_image_get_geometry(chain, &geometry);
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+    if (geometry.size > DATA_BUFFER_SIZE) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    res = bep_image_get(chain, data_buffer, geometry.size);
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+
+    snprintf(args->info, INFO_LEN, "%dx%d, %d dpi", geometry.width, geometry.height, geometry.dpi);
+    res = bmlite_image_save(args->path, data_buffer, &geometry);
+    if (res == FPC_BEP_RESULT_INVALID_ARGUMENT) {
+        // Neither .pgm nor .png, save raw data
+        res = write_file(args->path, data_buffer, geometry.size);
+    }
+    return res;
+}
+
+static fpc_bep_result_t harvest_store(void *ctx, uint32_t frame, const uint8_t *image,
+        const bmlite_image_geometry_t *geometry)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%06u.pgm", (const char *)ctx, frame);
+    return bmlite_image_save(path, image, geometry);
+}
+
+static fpc_bep_result_t cmd_harvest(HCP_comm_t *chain, batch_args_t *args)
+{
+    bmlite_harvest_config_t cfg = {
+        .frames = args->count,
+        .timeout = args->timeout,
+        .ring_size = args->slots,
+        .store = harvest_store,
+        .ctx = (void *)args->path,
+    };
+    bmlite_harvest_stats_t st;
+    fpc_bep_result_t res;
+    double total_s;
+
+    res = bmlite_harvest(chain, &cfg, &st);
+    total_s = st.total_us / 1000000.0;
+    snprintf(args->info, INFO_LEN, "%d frames, %.1f fps, %d stored, %d dropped, %d failed, %d timeouts",
+             st.frames, total_s > 0 ? st.frames / total_s : 0, st.stored, st.dropped, st.failed,
+             st.timeouts);
+
+    if (res == FPC_BEP_RESULT_OK && st.failed) {
+        res = FPC_BEP_RESULT_IO_ERROR;
+    }
+    return res;
+}
+
+static fpc_bep_result_t cmd_image_export(HCP_comm_t *chain, batch_args_t *args)
+{
+    bmlite_image_export_stats_t st;
+    fpc_bep_result_t res;
+
+    res = bmlite_image_export_dir(args->path, args->out, BMLITE_IMAGE_PNG,
+                                  BMLITE_IMAGE_DEFAULT_DPI, args->threads, &st);
+    snprintf(args->info, INFO_LEN, "%d files, %d failed, %.1f files/s", st.files, st.failed,
+             st.total_us ? st.files * 1000000.0 / st.total_us : 0);
+
+    return res;
+}
+
+static fpc_bep_result_t cmd_identify_checked(HCP_comm_t *chain, batch_args_t *args)
+{
+    const bmlite_quality_thresholds_t *t = &bmlite_quality_default_thresholds;
+    fpc_bep_result_t res;
+    bmlite_quality_t q;
+    uint32_t rejected = 0;
+    bool match = false;
+
+    res = bmlite_quality_capture(chain, args->timeout, QUALITY_ATTEMPTS, t, data_buffer,
+                                 DATA_BUFFER_SIZE, &q, &rejected);
+    if (res == FPC_BEP_RESULT_OK) {
+        res = bep_image_extract(chain);
+    }
+    if (res == FPC_BEP_RESULT_OK) {
+        res = bep_identify(chain);
+    }
+    if (res == FPC_BEP_RESULT_OK) {
+        res = bmlite_get_arg(chain, ARG_MATCH);
+    }
+    if (res == FPC_BEP_RESULT_OK) {
+        match = *(bool *)chain->arg.data;
+        if (match) {
+            res = bmlite_get_arg(chain, ARG_ID);
+        }
+    }
+
+    if (res == FPC_BEP_RESULT_OK) {
+        if (match) {
+            snprintf(args->info, INFO_LEN, "match id %d, %d rejected",
+                     *(uint16_t *)chain->arg.data, rejected);
+        } else {
+            snprintf(args->info, INFO_LEN, "no match, %d rejected", rejected);
+        }
+    } else if (rejected) {
+        snprintf(args->info, INFO_LEN, "%d rejected, last coverage %.2f contrast %.1f",
+                 rejected, q.coverage, q.contrast);
+    }
+    return res;
+}
+
+static fpc_bep_result_t cmd_quality_bench(HCP_comm_t *chain, batch_args_t *args)
+{
+    const bmlite_quality_thresholds_t *t = &bmlite_quality_default_thresholds;
+    double upload_ms = 0, generic_ms = 0, simd_ms = 0, device_ms = 0;
+    bmlite_image_geometry_t geometry;
+    fpc_bep_result_t res = FPC_BEP_RESULT_OK;
+    uint32_t done = 0, rejected = 0;
+
+    for (; done < args->count; done++) {
+        bmlite_quality_t q, q_ref;
+        double start;
+
+        res = bep_capture(chain, args->timeout);
+        if (res != FPC_BEP_RESULT_OK || chain->bep_result != FPC_BEP_RESULT_OK) {
+            break;
+        }
+        if (done == 0) {
+            res = bep_image_get_geometry(chain, &geometry);
+            if (res != FPC_BEP_RESULT_OK) {
+                break;
+            }
+            if (geometry.size > DATA_BUFFER_SIZE) {
+                res = FPC_BEP_RESULT_NO_MEMORY;
+                break;
+            }
+        }
+
+        start = time_ms();
+        res = bep_image_get(chain, data_buffer, geometry.size);
+        upload_ms += time_ms() - start;
+        if (res != FPC_BEP_RESULT_OK) {
+            break;
+        }
+
+        // Kernels are too fast for a single run to be measured
+        start = time_ms();
+        for (int i = 0; i < QUALITY_BENCH_RUNS; i++) {
+            bmlite_quality_compute_generic(data_buffer, &geometry, t, &q_ref);
+        }
+        generic_ms += (time_ms() - start) / QUALITY_BENCH_RUNS;
+        start = time_ms();
+        for (int i = 0; i < QUALITY_BENCH_RUNS; i++) {
+            bmlite_quality_compute(data_buffer, &geometry, t, &q);
+        }
+        simd_ms += (time_ms() - start) / QUALITY_BENCH_RUNS;
+        if (memcmp(&q, &q_ref, sizeof(q)) != 0) {
+            snprintf(args->info, INFO_LEN, "%s kernel mismatch", bmlite_quality_kernel());
+            return FPC_BEP_RESULT_INTERNAL_ERROR;
+        }
+        if (!bmlite_quality_ok(&q, t)) {
+            rejected++;
+        }
+
+        // Round trips the gate saves on a rejected capture
+        start = time_ms();
+        res = bep_image_extract(chain);
+        if (res == FPC_BEP_RESULT_OK) {
+            res = bep_identify(chain);
+        }
+        device_ms += time_ms() - start;
+        if (res != FPC_BEP_RESULT_OK) {
+            break;
+        }
+        sensor_wait_finger_not_present(chain, 0);
+    }
+
+    if (done) {
+        double gate_ms = (upload_ms + simd_ms) / done;
+
+        printf("\n%-24s %10s\n", "Stage", "Avg, ms");
+        printf("%-24s %10.3f\n", "image upload", upload_ms / done);
+        printf("%-24s %10.4f\n", "quality generic", generic_ms / done);
+        printf("quality %-16s %10.4f\n", bmlite_quality_kernel(), simd_ms / done);
+        printf("%-24s %10.3f\n", "extract + identify", device_ms / done);
+        printf("Rejected %d of %d, gate costs %.3f ms per capture, "
+               "pays off above %.1f%% rejects\n", rejected, done, gate_ms,
+               device_ms ? 100.0 * gate_ms * done / device_ms : 0);
+    }
+
+    snprintf(args->info, INFO_LEN, "%d captures, %d rejected", done, rejected);
+    return res;
+}
+
+static fpc_bep_result_t cmd_template_get(HCP_comm_t *chain, batch_args_t *args)
+{
+    fpc_bep_result_t res;
+
+    res = bep_template_get(chain, data_buffer, DATA_BUFFER_SIZE);
+    if (res == FPC_BEP_RESULT_OK) {
+        snprintf(args->info, INFO_LEN, "%d bytes", chain->arg.size);
+        res = write_file(args->path, data_buffer, chain->arg.size);
+    }
+    return res;
+}
+
+static fpc_bep_result_t cmd_template_put(HCP_comm_t *chain, batch_args_t *args)
+{
+    FILE *f = fopen(args->path, "rb");
+    size_t size;
+
+    if (f == NULL) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    size = fread(data_buffer, 1, DATA_BUFFER_SIZE, f);
+    fclose(f);
+    if (size == 0 || size > 0xffff) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+
+    snprintf(args->info, INFO_LEN, "%d bytes", (int)size);
+    return bep_template_put(chain, data_buffer, size);
+}
+
+static fpc_bep_result_t cmd_template_backup(HCP_comm_t *chain, batch_args_t *args)
+{
+    fpc_bep_result_t res;
+    uint16_t ids[DATA_BUFFER_SIZE / 2 / sizeof(uint16_t)];
+    uint32_t nr_ids;
+    char path[PATH_MAX];
+
+    res = bep_template_get_ids(chain);
+    if (res != FPC_BEP_RESULT_OK || chain->bep_result != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+    nr_ids = HCP_MIN(chain->arg.size / 2, sizeof(ids) / sizeof(ids[0]));
+    memcpy(ids, chain->arg.data, nr_ids * 2);
+
+    for (uint32_t i = 0; i < nr_ids; i++) {
+        res = bep_template_load_storage(chain, ids[i]);
+        if (res == FPC_BEP_RESULT_OK) {
+            res = bep_template_get(chain, data_buffer, DATA_BUFFER_SIZE);
+        }
+        if (res != FPC_BEP_RESULT_OK) {
+            snprintf(args->info, INFO_LEN, "template %d failed", ids[i]);
+            return res;
+        }
+        snprintf(path, sizeof(path), "%s/%d.tmpl", args->path, ids[i]);
+        res = write_file(path, data_buffer, chain->arg.size);
+        if (res != FPC_BEP_RESULT_OK) {
+            snprintf(args->info, INFO_LEN, "can't write %d.tmpl", ids[i]);
+            return res;
+        }
+    }
+    bep_template_remove_ram(chain);
+
+    snprintf(args->info, INFO_LEN, "%d templates", nr_ids);
+    return FPC_BEP_RESULT_OK;
+}
+
+static fpc_bep_result_t cmd_template_restore(HCP_comm_t *chain, batch_args_t *args)
+{
+    fpc_bep_result_t res = FPC_BEP_RESULT_OK;
+    struct dirent *e;
+    char path[PATH_MAX];
+    int restored = 0;
+    DIR *dir;
+
+    dir = opendir(args->path);
+    if (dir == NULL) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+
+    while ((e = readdir(dir)) != NULL) {
+        char *end;
+        long id = strtol(e->d_name, &end, 10);
+        batch_args_t put;
+
+        if (end == e->d_name || strcmp(end, ".tmpl") != 0 || id < 0 || id > 0xffff) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", args->path, e->d_name);
+        put.path = path;
+        res = cmd_template_put(chain, &put);
+        if (res == FPC_BEP_RESULT_OK) {
+            res = bep_template_save(chain, id);
+        }
+        if (res != FPC_BEP_RESULT_OK) {
+            snprintf(args->info, INFO_LEN, "template %ld failed", id);
+            break;
+        }
+        restored++;
+    }
+    closedir(dir);
+    bep_template_remove_ram(chain);
+
+    if (res == FPC_BEP_RESULT_OK) {
+        snprintf(args->info, INFO_LEN, "%d templates", restored);
+    }
+    return res;
+}
+
+static void archive_report(batch_args_t *args, bmlite_archive_stats_t *st)
+{
+    double total_s = st->total_us / 1000000.0;
+
+    snprintf(args->info, INFO_LEN, "%d templates, %d KB, %.1f tmpl/s, %.1f KB/s, link %d%%, stall %d%%",
+             st->nr_templates, (int)(st->bytes / 1024),
+             total_s > 0 ? st->nr_templates / total_s : 0,
+             total_s > 0 ? st->bytes / 1024.0 / total_s : 0,
+             st->total_us ? (int)(st->link_us * 100 / st->total_us) : 0,
+             st->total_us ? (int)(st->stall_us * 100 / st->total_us) : 0);
+}
+
+static fpc_bep_result_t cmd_archive_backup(HCP_comm_t *chain, batch_args_t *args)
+{
+    bmlite_archive_stats_t st;
+    fpc_bep_result_t res;
+
+    res = bmlite_archive_backup(chain, args->path, &st);
+    archive_report(args, &st);
+    return res;
+}
+
+static fpc_bep_result_t cmd_archive_restore(HCP_comm_t *chain, batch_args_t *args)
+{
+    bmlite_archive_stats_t st;
+    fpc_bep_result_t res;
+
+    res = bmlite_archive_restore(chain, args->path, &st);
+    archive_report(args, &st);
+    return res;
+}
+
+static fpc_bep_result_t cmd_tdb_store(HCP_comm_t *chain, batch_args_t *args)
+{
+    fpc_bep_result_t res;
+    bmlite_tdb_t db;
+
+    res = bmlite_tdb_open(&db, args->path, true);
+    if (res == FPC_BEP_RESULT_OK) {
+        // Templates can be used only by the module they were created on
+        res = bmlite_tdb_bind(chain, &db);
+    }
+    if (res != FPC_BEP_RESULT_OK) {
+        bmlite_tdb_close(&db);
+        return res;
+    }
+    // Put received template to the database without copying to a buffer
+    res = bmlite_send_cmd(chain, CMD_TEMPLATE, ARG_UPLOAD);
+    if (res == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_OK) {
+        res = bmlite_get_arg(chain, ARG_DATA);
+    }
+    if (res == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_OK) {
+        res = bmlite_tdb_put(&db, args->id, chain->arg.data, chain->arg.size);
+        snprintf(args->info, INFO_LEN, "%d bytes", chain->arg.size);
+    }
+    if (res == FPC_BEP_RESULT_OK) {
+        res = bmlite_tdb_commit(&db);
+    }
+    bmlite_tdb_close(&db);
+
+    return res;
+}
+
+static fpc_bep_result_t cmd_tdb_load(HCP_comm_t *chain, batch_args_t *args)
+{
+    const bmlite_tdb_record_t *rec;
+    fpc_bep_result_t res;
+    bmlite_tdb_t db;
+
+    res = bmlite_tdb_open(&db, args->path, false);
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+    rec = bmlite_tdb_find(&db, args->id);
+    if (rec) {
+        snprintf(args->info, INFO_LEN, "%d bytes", rec->size);
+        res = bep_template_put(chain, (uint8_t *)rec->data, rec->size);
+    } else {
+        res = FPC_BEP_RESULT_ID_NOT_FOUND;
+    }
+    bmlite_tdb_close(&db);
+
+    return res;
+}
+
+static fpc_bep_result_t cmd_tdb_list(HCP_comm_t *chain, batch_args_t *args)
+{
+    const bmlite_tdb_record_t *rec;
+    fpc_bep_result_t res;
+    bmlite_tdb_t db;
+    uint32_t pos = 0;
+    int len;
+
+    res = bmlite_tdb_open(&db, args->path, false);
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+    len = snprintf(args->info, INFO_LEN, "%d templates, %d KB unused: ", db.nr_records,
+                   (int)(db.dead_bytes / 1024));
+    while ((rec = bmlite_tdb_next(&db, &pos)) != NULL && len < INFO_LEN) {
+        len += snprintf(args->info + len, INFO_LEN - len, "%d ", rec->id);
+    }
+    bmlite_tdb_close(&db);
+
+    return FPC_BEP_RESULT_OK;
+}
+
+static fpc_bep_result_t cmd_tdb_compact(HCP_comm_t *chain, batch_args_t *args)
+{
+    fpc_bep_result_t res;
+    bmlite_tdb_t db;
+    uint64_t dead;
+
+    res = bmlite_tdb_open(&db, args->path, false);
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+    dead = db.dead_bytes;
+    res = bmlite_tdb_compact(&db);
+    bmlite_tdb_close(&db);
+    snprintf(args->info, INFO_LEN, "%d KB freed", (int)(dead / 1024));
+
+    return res;
+}
+
+static fpc_bep_result_t cmd_sync(HCP_comm_t *chain, batch_args_t *args)
+{
+    bmlite_sync_stats_t st;
+    fpc_bep_result_t res;
+    bmlite_tdb_t db;
+
+    res = bmlite_tdb_open(&db, args->path, false);
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+    res = bmlite_sync(chain, &db, NULL, 0, &st);
+    bmlite_tdb_close(&db);
+    snprintf(args->info, INFO_LEN, "%d unchanged, %d added, %d updated, %d removed",
+             st.unchanged, st.added, st.updated, st.removed);
+
+    return res;
+}
+
+static fpc_bep_result_t gallery_load(bmlite_gallery_t *g, const char *dir_path, uint32_t limit)
+{
+    fpc_bep_result_t res = FPC_BEP_RESULT_OK;
+    struct dirent *e;
+    char path[PATH_MAX];
+    DIR *dir;
+
+    dir = opendir(dir_path);
+    if (dir == NULL) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+
+    while (res == FPC_BEP_RESULT_OK && g->nr_entries < limit && (e = readdir(dir)) != NULL) {
+        char *end;
+        long id = strtol(e->d_name, &end, 10);
+        size_t size;
+        FILE *f;
+
+        if (end == e->d_name || strcmp(end, ".tmpl") != 0 || id < 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir_path, e->d_name);
+        f = fopen(path, "rb");
+        if (f == NULL) {
+            continue;
+        }
+        size = fread(data_buffer, 1, DATA_BUFFER_SIZE, f);
+        fclose(f);
+        if (size > 0 && size <= 0xffff) {
+            res = bmlite_gallery_add(g, id, data_buffer, size);
+        }
+    }
+    closedir(dir);
+
+    return res;
+}
+
+/* Identification latency for galleries of 1, 2, 4 ... N templates */
+static fpc_bep_result_t cmd_gallery_bench(HCP_comm_t *chain, batch_args_t *args)
+{
+    fpc_bep_result_t res;
+    bmlite_gallery_t g;
+    uint32_t total, size;
+
+    res = bmlite_gallery_init(&g, 0, 0);
+    if (res == FPC_BEP_RESULT_OK) {
+        res = gallery_load(&g, args->path, UINT32_MAX);
+    }
+    total = g.nr_entries;
+    bmlite_gallery_free(&g);
+    if (res != FPC_BEP_RESULT_OK || total == 0) {
+        snprintf(args->info, INFO_LEN, "can't load templates");
+        return res ? res : FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+
+    printf("\n%8s %8s %12s %12s %10s %10s\n", "Gallery", "Count", "Avg, ms", "Max, ms",
+           "Resident", "Streamed");
+    for (size = 1; ; size = size * 2 < total ? size * 2 : total) {
+        double sum_ms = 0, max_ms = 0;
+        uint32_t done = 0;
+
+        res = bmlite_gallery_init(&g, 0, args->slots);
+        if (res == FPC_BEP_RESULT_OK) {
+            res = gallery_load(&g, args->path, size);
+        }
+        if (res == FPC_BEP_RESULT_OK) {
+            res = bmlite_gallery_sync(chain, &g);
+        }
+
+        for (; res == FPC_BEP_RESULT_OK && done < args->count; done++) {
+            uint32_t id;
+            bool match;
+            double start, elapsed;
+
+            // Latency of identification only, finger capture time is excluded
+            res = bep_capture(chain, args->timeout);
+            if (res == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_OK) {
+                res = bep_image_extract(chain);
+            }
+            if (res != FPC_BEP_RESULT_OK || chain->bep_result != FPC_BEP_RESULT_OK) {
+                break;
+            }
+            start = time_ms();
+            res = bmlite_gallery_match(chain, &g, &id, &match, NULL);
+            elapsed = time_ms() - start;
+            sum_ms += elapsed;
+            if (elapsed > max_ms)
+                max_ms = elapsed;
+            sensor_wait_finger_not_present(chain, 0);
+        }
+
+        if (done) {
+            printf("%8d %8d %12.3f %12.3f %9.1f%% %10.1f\n", g.nr_entries, done, sum_ms / done,
+                   max_ms, 100.0 * g.resident_matches / done,
+                   (double)g.streamed_templates / done);
+            fflush(stdout);
+        }
+        bmlite_gallery_free(&g);
+
+        if (res != FPC_BEP_RESULT_OK || size == total) {
+            break;
+        }
+    }
+    bep_template_remove_all(chain);
+
+    snprintf(args->info, INFO_LEN, "%d templates", total);
+    return res;
+}
+
+static fpc_bep_result_t cmd_eval(HCP_comm_t *chain, batch_args_t *args)
+{
+    bmlite_eval_config_t cfg = {
+        .dir = args->path,
+        .checkpoint = args->out,
+        .enroll_samples = args->enroll,
+        .prefetch = args->slots,
+        .first_id = args->id >= 0 ? args->id : 1,
+    };
+    bmlite_eval_stats_t st;
+    fpc_bep_result_t res;
+
+    res = bmlite_eval_run(chain, &cfg, &st);
+
+    printf("\nFingers %d, enrolled %d, failed to enroll %d\n", st.fingers, st.enrolled,
+           st.enroll_failed);
+    printf("Probes %d, failed %d, %d results taken from checkpoint\n", st.probes, st.failed,
+           st.resumed);
+    printf("Genuine %d, matched %d, FRR %.2f%%\n", st.genuine, st.genuine_match,
+           st.genuine ? 100.0 * st.false_reject / st.genuine : 0);
+    printf("False matches %d, FMR %.3f%%\n", st.false_match,
+           st.probes > st.failed ? 100.0 * st.false_match / (st.probes - st.failed) : 0);
+    printf("Link %.1f%%, waited for disk %.1f%%\n",
+           st.total_us ? 100.0 * st.link_us / st.total_us : 0,
+           st.total_us ? 100.0 * st.stall_us / st.total_us : 0);
+
+    snprintf(args->info, INFO_LEN, "%d images, %.1f images/s", st.images,
+             st.total_us ? st.images * 1000000.0 / st.total_us : 0);
+    return res;
+}
+
+static fpc_bep_result_t cmd_link_tune(HCP_comm_t *chain, batch_args_t *args)
+{
+    bmlite_link_config_t cfg = bmlite_link_default_config;
+    bmlite_link_t link;
+    fpc_bep_result_t res;
+    unsigned long known;
+    FILE *f;
+
+    // Clock found by a previous run is checked first
+    f = fopen(args->path, "r");
+    if (f != NULL) {
+        if (fscanf(f, "%lu", &known) == 1) {
+            cfg.known_hz = known;
+        }
+        fclose(f);
+    }
+
+    res = bmlite_link_tune(chain, &link, &cfg);
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+
+    f = fopen(args->path, "w");
+    if (f == NULL || fprintf(f, "%u\n", link.clock_hz) < 0) {
+        res = FPC_BEP_RESULT_IO_ERROR;
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+    snprintf(args->info, INFO_LEN, "SPI clock %u Hz, BM-Lite maximum %u Hz",
+             link.clock_hz, link.module_max_hz);
+    return res;
+}
+
+/*
+ * Host gap: time from the end of one SPI transfer to the start of the next
+ * while BM-Lite is ready, i.e. BM-Lite waits for the host.
+ */
+static void rt_bench_transfer_start(void)
+{
+    double now = time_ms();
+
+    if (rt_bench.last_end && !rt_bench.waited && rt_bench.nr_gaps < rt_bench.max_gaps) {
+        rt_bench.gaps[rt_bench.nr_gaps++] = (now - rt_bench.last_end) * 1000;
+    }
+    rt_bench.waited = false;
+}
+
+static fpc_bep_result_t rt_bench_write(uint16_t size, const uint8_t *data, uint32_t timeout)
+{
+    fpc_bep_result_t res;
+
+    rt_bench_transfer_start();
+    res = rt_bench.write(size, data, timeout);
+    rt_bench.last_end = time_ms();
+    return res;
+}
+
+static fpc_bep_result_t rt_bench_read(uint16_t size, uint8_t *data, uint32_t timeout)
+{
+    fpc_bep_result_t res;
+
+    rt_bench_transfer_start();
+    res = rt_bench.read(size, data, timeout);
+    rt_bench.last_end = time_ms();
+    return res;
+}
+
+static bool rt_bench_ready(void)
+{
+    bool ready = rt_bench.ready();
+
+    if (!ready) {
+        rt_bench.waited = true;
+    }
+    return ready;
+}
+
+static int gap_compare(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double gap_percentile(double permille)
+{
+    return rt_bench.gaps[(uint32_t)((rt_bench.nr_gaps - 1) * permille / 1000)];
+}
+
+/* Round trips in the current mode, prints distribution of host gaps */
+static fpc_bep_result_t rt_bench_run(HCP_comm_t *chain, const char *mode, uint32_t probes,
+        double *p99)
+{
+    uint32_t errors = chain->link_stats.errors;
+    fpc_bep_result_t res = FPC_BEP_RESULT_OK;
+
+    rt_bench.nr_gaps = 0;
+    rt_bench.last_end = 0;
+    for (uint32_t i = 0; i < probes && res == FPC_BEP_RESULT_OK; i++) {
+        res = bep_link_probe(chain, RT_BENCH_TIMEOUT);
+    }
+    if (rt_bench.nr_gaps == 0) {
+        return res != FPC_BEP_RESULT_OK ? res : FPC_BEP_RESULT_IO_ERROR;
+    }
+
+    qsort(rt_bench.gaps, rt_bench.nr_gaps, sizeof(double), gap_compare);
+    *p99 = gap_percentile(990);
+    printf("%-8s %8u %10.1f %10.1f %10.1f %10.1f %10.1f %8u\n", mode, rt_bench.nr_gaps,
+           rt_bench.gaps[0], gap_percentile(500), *p99, gap_percentile(999),
+           rt_bench.gaps[rt_bench.nr_gaps - 1], chain->link_stats.errors - errors);
+    return res;
+}
+
+static fpc_bep_result_t cmd_rt_bench(HCP_comm_t *chain, batch_args_t *args)
+{
+    uint32_t probes = args->count > 1 ? args->count : RT_BENCH_PROBES;
+    double p99_off = 0, p99_on = 0;
+    fpc_bep_result_t res;
+
+    rt_bench.max_gaps = probes * RT_BENCH_GAPS;
+    rt_bench.gaps = malloc(rt_bench.max_gaps * sizeof(double));
+    if (rt_bench.gaps == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    rt_bench.write = chain->write;
+    rt_bench.read = chain->read;
+    rt_bench.ready = chain->ready;
+    chain->write = rt_bench_write;
+    chain->read = rt_bench_read;
+    if (chain->ready) {
+        chain->ready = rt_bench_ready;
+    }
+
+    printf("\nHost gaps between transfers, us\n");
+    printf("%-8s %8s %10s %10s %10s %10s %10s %8s\n", "Mode", "Gaps", "Min", "p50", "p99",
+           "p99.9", "Max", "Errors");
+    res = hal_rt_set(NULL, chain);
+    if (res == FPC_BEP_RESULT_OK) {
+        res = rt_bench_run(chain, "normal", probes, &p99_off);
+    }
+    if (res == FPC_BEP_RESULT_OK) {
+        res = hal_rt_set(&rt_cfg, chain);
+    }
+    if (res == FPC_BEP_RESULT_OK) {
+        res = rt_bench_run(chain, "rt", probes, &p99_on);
+    }
+    hal_rt_set(rt_enabled ? &rt_cfg : NULL, chain);
+
+    chain->write = rt_bench.write;
+    chain->read = rt_bench.read;
+    chain->ready = rt_bench.ready;
+    free(rt_bench.gaps);
+
+    snprintf(args->info, INFO_LEN, "%u round trips per mode, p99 %.1f us normal, %.1f us rt",
+             probes, p99_off, p99_on);
+    return res;
+}
+
+static fpc_bep_result_t cmd_sleep(HCP_comm_t *chain, batch_args_t *args)
+{
+    usleep(args->timeout * 1000);
+    return FPC_BEP_RESULT_OK;
+}
+
+static const batch_cmd_t commands[] = {
+    { "identify",         "[--count N] [--timeout ms]", cmd_identify, false },
+    { "identify-any",     "[--count N] [--timeout ms]", cmd_identify_any, false },
+    { "enroll",           "[--count N] [--id ID] [--timeout ms]", cmd_enroll, false },
+    { "capture",          "[--count N] [--timeout ms]", cmd_capture, false },
+    { "version",          "[--count N]",                cmd_version, false },
+    { "telemetry",        "[--count N]",                cmd_telemetry, false },
+    { "list",             "",                           cmd_list, false },
+    { "save",             "--id ID",                    cmd_save, false },
+    { "remove",           "--id ID",                    cmd_remove, false },
+    { "remove-all",       "",                           cmd_remove_all, false },
+    { "reset",            "",                           cmd_reset, false },
+    { "image-get",        "FILE[.pgm|.png]",            cmd_image_get, false },
+    { "image-export",     "DIR OUT [--threads N]",      cmd_image_export, true },
+    { "identify-checked", "[--count N] [--timeout ms]", cmd_identify_checked, false },
+    { "quality-bench",    "[--count N] [--timeout ms]", cmd_quality_bench, true },
+    { "harvest",          "DIR [--count N] [--slots S] [--timeout ms]", cmd_harvest, true },
+    { "template-get",     "FILE",                       cmd_template_get, false },
+    { "template-put",     "FILE",                       cmd_template_put, false },
+    { "template-backup",  "DIR",                        cmd_template_backup, false },
+    { "template-restore", "DIR",                        cmd_template_restore, false },
+    { "archive-backup",   "FILE",                       cmd_archive_backup, false },
+    { "archive-restore",  "FILE",                       cmd_archive_restore, false },
+    { "tdb-store",        "DB --id ID",                 cmd_tdb_store, false },
+    { "tdb-load",         "DB --id ID",                 cmd_tdb_load, false },
+    { "tdb-list",         "DB",                         cmd_tdb_list, false },
+    { "tdb-compact",      "DB",                         cmd_tdb_compact, false },
+    { "sync",             "DB",                         cmd_sync, false },
+    { "eval",             "DIR OUT [--enroll N] [--slots S] [--id ID]", cmd_eval, true },
+    { "gallery-bench",    "DIR [--count N] [--slots S] [--timeout ms]", cmd_gallery_bench, true },
+    { "link-tune",        "FILE",                       cmd_link_tune, true },
+    { "rt-bench",         "[--count N]",                cmd_rt_bench, true },
+    { "sleep",            "--timeout ms",               cmd_sleep, false },
+};
+
+#define NR_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+static batch_stat_t stats[NR_COMMANDS];
+
+/*
+ * Batch execution
+ */
+
+void batch_set_sensors(HCP_comm_t **chains, uint32_t count)
+{
+    nr_sensors = HCP_MIN(count, MAX_SENSORS - 1);
+    memcpy(sensors, chains, nr_sensors * sizeof(HCP_comm_t *));
+}
+
+void batch_set_rt(const hal_rt_config_t *cfg)
+{
+    rt_enabled = cfg != NULL;
+    if (cfg) {
+        rt_cfg = *cfg;
+    }
+}
+
+void batch_help(void)
+{
+    fprintf(stderr, "Batch commands:\n");
+    for (uint32_t i = 0; i < NR_COMMANDS; i++) {
+        fprintf(stderr, "  %-17s %s\n", commands[i].name, commands[i].usage);
+    }
+}
+
+static bool needs_path(const batch_cmd_t *cmd)
+{
+    return strstr(cmd->usage, "FILE") || strstr(cmd->usage, "DIR") || strstr(cmd->usage, "DB");
+}
+
+static int parse_args(const batch_cmd_t *cmd, batch_args_t *args, int argc, char **argv)
+{
+    args->count = 1;
+    args->timeout = 0;
+    args->id = -1;
+    args->slots = 5;
+    args->threads = 4;
+    args->enroll = 3;
+    args->path = NULL;
+    args->out = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && (!strcmp(argv[i], "--count") || !strcmp(argv[i], "-n"))) {
+            args->count = atoi(argv[++i]);
+        } else if (i + 1 < argc && !strcmp(argv[i], "--timeout")) {
+            args->timeout = atoi(argv[++i]);
+        } else if (i + 1 < argc && !strcmp(argv[i], "--id")) {
+            args->id = atoi(argv[++i]);
+        } else if (i + 1 < argc && !strcmp(argv[i], "--slots")) {
+            args->slots = atoi(argv[++i]);
+        } else if (i + 1 < argc && !strcmp(argv[i], "--threads")) {
+            args->threads = atoi(argv[++i]);
+        } else if (i + 1 < argc && !strcmp(argv[i], "--enroll")) {
+            args->enroll = atoi(argv[++i]);
+        } else if (argv[i][0] != '-' && args->path == NULL) {
+            args->path = argv[i];
+        } else if (argv[i][0] != '-' && args->out == NULL && strstr(cmd->usage, "OUT")) {
+            args->out = argv[i];
+        } else {
+            fprintf(stderr, "%s: unknown argument %s\n", cmd->name, argv[i]);
+            return -1;
+        }
+    }
+
+    if ((needs_path(cmd) && args->path == NULL) || (strstr(cmd->usage, "OUT") && args->out == NULL)) {
+        fprintf(stderr, "Usage: %s %s\n", cmd->name, cmd->usage);
+        return -1;
+    }
+    if (strstr(cmd->usage, "--id ID") && !strstr(cmd->usage, "[--id ID]") && args->id < 0) {
+        fprintf(stderr, "Usage: %s %s\n", cmd->name, cmd->usage);
+        return -1;
+    }
+    return 0;
+}
+
+int batch_command(HCP_comm_t *chain, int argc, char **argv)
+{
+    const batch_cmd_t *cmd = NULL;
+    batch_stat_t *stat;
+    batch_args_t args;
+    uint32_t repeat;
+    int failed = 0;
+
+    for (uint32_t i = 0; i < NR_COMMANDS; i++) {
+        if (!strcmp(argv[0], commands[i].name)) {
+            cmd = &commands[i];
+            break;
+        }
+    }
+    if (cmd == NULL) {
+        fprintf(stderr, "Unknown command %s\n", argv[0]);
+        return 1;
+    }
+    if (parse_args(cmd, &args, argc, argv) < 0) {
+        return 1;
+    }
+    repeat = args.count;
+    stat = &stats[cmd - commands];
+    if (cmd->once) {
+        repeat = 1;
+    }
+
+    for (uint32_t n = 1; n <= repeat; n++) {
+        fpc_bep_result_t res;
+        double start, elapsed;
+
+        args.info[0] = 0;
+        chain->bep_result = FPC_BEP_RESULT_OK;
+        start = time_ms();
+        res = cmd->fn(chain, &args);
+        elapsed = time_ms() - start;
+
+        if (stat->count == 0 || elapsed < stat->min_ms)
+            stat->min_ms = elapsed;
+        if (elapsed > stat->max_ms)
+            stat->max_ms = elapsed;
+        stat->total_ms += elapsed;
+        stat->count++;
+
+        if (res == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_OK) {
+            printf("%-16s %6d OK %12.3f ms  %s\n", cmd->name, n, elapsed, args.info);
+        } else {
+            printf("%-16s %6d FAILED (%d/%d) %12.3f ms  %s\n", cmd->name, n,
+                   res, chain->bep_result, elapsed, args.info);
+            stat->failed++;
+            failed = 1;
+        }
+        fflush(stdout);
+
+        // Ctrl-C not seen by the command, e.g. it has no cancellable waits
+        if (res == FPC_BEP_RESULT_CANCELLED || chain->cancel) {
+            chain->cancel = 0;
+            return -1;
+        }
+    }
+
+    return failed;
+}
+
+int batch_script(HCP_comm_t *chain, FILE *f)
+{
+    char line[256];
+    char *argv[MAX_SCRIPT_ARGS];
+    int failed = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        int argc = 0;
+        char *tok = strtok(line, " \t\r\n");
+
+        if (tok == NULL || tok[0] == '#') {
+            continue;
+        }
+        while (tok && argc < MAX_SCRIPT_ARGS) {
+            argv[argc++] = tok;
+            tok = strtok(NULL, " \t\r\n");
+        }
+
+        int res = batch_command(chain, argc, argv);
+        if (res < 0) {
+            return 1;
+        }
+        failed |= res;
+    }
+
+    return failed;
+}
+
+void batch_summary(void)
+{
+    uint32_t count = 0, failed = 0;
+    double total_ms = 0;
+
+    printf("\n%-16s %8s %8s %12s %12s %12s\n", "Command", "Count", "Failed",
+           "Min, ms", "Avg, ms", "Max, ms");
+    for (uint32_t i = 0; i < NR_COMMANDS; i++) {
+        batch_stat_t *s = &stats[i];
+        if (s->count == 0) {
+            continue;
+        }
+        printf("%-16s %8d %8d %12.3f %12.3f %12.3f\n", commands[i].name, s->count, s->failed,
+               s->min_ms, s->total_ms / s->count, s->max_ms);
+        count += s->count;
+        failed += s->failed;
+        total_ms += s->total_ms;
+    }
+    printf("Total: %d operations, %d failed, %.3f s\n", count, failed, total_ms / 1000);
+}
@@ -31,6 +31,7 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <string.h>
+#include <signal.h>
 
 #include "bmlite_if.h"
 #include "hcp_tiny.h"
@@ -38,12 +39,18 @@
 #include "bmlite_hal.h"
 #include "platform_linux.h"
 #include "console_params.h"
+#include "console_app.h"
+#include "bmlite_image.h"
 
 
 #define DATA_BUFFER_SIZE 102400
+#define MAX_EXTRA_SENSORS 3
 static uint8_t hcp_txrx_buffer[MTU];
 static uint8_t hcp_data_buffer[DATA_BUFFER_SIZE];
 
+static bmlite_id_cache_t id_cache;
+static bmlite_caps_t caps;
+
 static HCP_comm_t hcp_chain = {
     .write = platform_bmlite_spi_send,
     .read = platform_bmlite_spi_receive,
@@ -52,12 +59,71 @@ static HCP_comm_t hcp_chain = {
     .pkt_size_max = sizeof(hcp_data_buffer),
     .pkt_size = 0,
     .txrx_buffer = hcp_txrx_buffer,
+    .id_cache = &id_cache,
 };
 
+/** Additional sensors given with -d, used by identify-any */
+static HCP_comm_t extra_chain[MAX_EXTRA_SENSORS];
+static uint8_t extra_txrx_buffer[MAX_EXTRA_SENSORS][MTU];
+static uint8_t extra_data_buffer[MAX_EXTRA_SENSORS][DATA_BUFFER_SIZE];
+static int nr_extra = 0;
+
+/** Set while BM-Lite command is executed */
+static volatile sig_atomic_t cmd_busy = 0;
+/** Current command is already cancelled, next Ctrl-C terminates the program */
+static volatile sig_atomic_t cmd_cancelled = 0;
+
+static void sigint_handler(int sig)
+{
+    if (cmd_busy && !cmd_cancelled) {
+        // Abort current command, BM-Lite is informed with CMD_CANCEL
+        cmd_cancelled = 1;
+        bmlite_cancel(&hcp_chain);
+        for (int i = 0; i < nr_extra; i++) {
+            bmlite_cancel(&extra_chain[i]);
+        }
+    } else {
+        signal(sig, SIG_DFL);
+        raise(sig);
+    }
+}
+
+/* Ctrl-C given before the command must not cancel it */
+static void cmd_begin(void)
+{
+    cmd_busy = 0;
+    hcp_chain.cancel = 0;
+    for (int i = 0; i < nr_extra; i++) {
+        extra_chain[i].cancel = 0;
+    }
+    cmd_cancelled = 0;
+    cmd_busy = 1;
+}
+
+/* Ctrl-C at a prompt terminates the program */
+static char *read_input(char *buf, int size)
+{
+    char *res;
+
+    cmd_busy = 0;
+    res = fgets(buf, size, stdin);
+    cmd_begin();
+    if (res) {
+        buf[strcspn(buf, "\r\n")] = 0;
+    }
+    return res;
+}
+
+/** Batch mode, don't print prompts from callbacks */
+static bool batch_mode = false;
+
 static void help(void)
 {
     fprintf(stderr, "BEP Host Communication Application\n");
-    fprintf(stderr, "Syntax: bep_host_com [-s] [-p port] [-b baudrate] [-t timeout]\n");
+    fprintf(stderr, "Syntax: bep_host_com [-s] [-p port] [-b baudrate] [-t timeout] [-w]\n"
+                    "                    [-d spidev[:reset_pin:ready_pin]]... [-r cpu[:priority]]\n"
+                    "                    [-f script | command [args]]\n");
+    batch_help();
 }
 
 void bmlite_on_error(bmlite_error_t error, int32_t value) 
@@ -67,64 +133,113 @@ void bmlite_on_error(bmlite_error_t error, int32_t value)
 
 void bmlite_on_start_capture() 
 {
-    printf("Put finger on the sensor\n");
+    if (!batch_mode)
+        printf("Put finger on the sensor\n");
 }
 void bmlite_on_finish_capture() 
 {
-    printf("Remove finger from the sensor\n");
+    if (!batch_mode)
+        printf("Remove finger from the sensor\n");
 }
 
 void bmlite_on_start_enroll() 
 {
-    printf("Start enrolling\n");
+    if (!batch_mode)
+        printf("Start enrolling\n");
 }
 
 void bmlite_on_finish_enroll() 
 {
-    printf("Finish enrolling\n");
+    if (!batch_mode)
+        printf("Finish enrolling\n");
 }
 
 void bmlite_on_start_enrollcapture() {}
 void bmlite_on_finish_enrollcapture() {}
 
+static void enroll_progress(void *ctx, uint32_t step, const bmlite_enroll_step_t *info)
+{
+    if (!info->accepted) {
+        printf("Sample rejected, put finger again\n");
+    } else if (info->samples_remaining) {
+        printf("Samples remaining: %d\n", info->samples_remaining);
+    }
+}
+
 void bmlite_on_identify_start() 
 {
-    printf("Start Identifying\n");
+    if (!batch_mode)
+        printf("Start Identifying\n");
 }
 void bmlite_on_identify_finish() 
 {
-    printf("Finish Identifying\n");
+    if (!batch_mode)
+        printf("Finish Identifying\n");
 }
 
-void save_to_pgm(FILE *f, uint8_t *image, int res_x, int res_y)
+/*
+ * Open additional SPI sensor given as spidev[:reset_pin:ready_pin]
+ */
+static fpc_bep_result_t extra_open(console_initparams_t *app_params, char *spec)
 {
-        /* Print 8-bpp PGM ASCII header */
-        fprintf(f, "P2\n%d %d\n255\n", res_x, res_y);
-        for (int y = 0; y < res_y; y++) {
-                for (int x = 0; x < res_x; x++, image++)
-                        fprintf(f,"%d ", *image);
-                fprintf(f,"\n");
-        }
+    HCP_comm_t *chain = &extra_chain[nr_extra];
+    console_initparams_t params = *app_params;
+    fpc_bep_result_t res;
+    char *pin;
 
-        fprintf(f,"\x04"); /* End Of Transmission */
-}
+    params.iface = SPI_INTERFACE;
+    params.hcp_comm = chain;
+    params.reset_pin = 0;
+    params.ready_pin = 0;
+    params.port = strtok(spec, ":");
+    if ((pin = strtok(NULL, ":")) != NULL) {
+        params.reset_pin = atoi(pin);
+    }
+    if ((pin = strtok(NULL, ":")) != NULL) {
+        params.ready_pin = atoi(pin);
+    }
+
+    chain->txrx_buffer = extra_txrx_buffer[nr_extra];
+    chain->pkt_buffer = extra_data_buffer[nr_extra];
+    chain->pkt_size_max = DATA_BUFFER_SIZE;
+
+    res = platform_linux_dev_open(&params);
+    if (res != FPC_BEP_RESULT_OK) {
+        printf("Can't open %s\n", params.port);
+        return res;
+    }
+    nr_extra++;
 
+    return FPC_BEP_RESULT_OK;
+}
 
 int main (int argc, char **argv)
 {
-    int index;
+    char *extra_devices[MAX_EXTRA_SENSORS];
+    int nr_extra_devices = 0;
     int c;
+    char *script = NULL;
     console_initparams_t app_params;
+    hal_rt_config_t rt = {
+        .cpu = -1,
+        .priority = 50,
+        .lock_memory = true,
+    };
+    bool rt_mode = false;
     
     app_params.iface = SPI_INTERFACE;
     app_params.hcp_comm = &hcp_chain;
     app_params.baudrate = 921600;
     app_params.timeout = 5;
     app_params.port = NULL;
+    app_params.reset_pin = 0;
+    app_params.ready_pin = 0;
+    app_params.warm_start = false;
 
     opterr = 0;
 
-    while ((c = getopt (argc, argv, "sb:p:t:")) != -1) {
+    // Stop at first non-option, the rest is batch command with its own options
+    while ((c = getopt (argc, argv, "+sb:p:t:f:wd:r:")) != -1) {
         switch (c) {
             case 's':
                 app_params.iface = SPI_INTERFACE;
@@ -141,8 +256,30 @@ int main (int argc, char **argv)
             case 't':
                 app_params.timeout = atoi(optarg);
                 break;
+            case 'f':
+                script = optarg;
+                break;
+            case 'w':
+                app_params.warm_start = true;
+                break;
+            case 'd':
+                if (nr_extra_devices == MAX_EXTRA_SENSORS) {
+                    fprintf(stderr, "Too many devices\n");
+                    exit(1);
+                }
+                extra_devices[nr_extra_devices++] = optarg;
+                break;
+            case 'r': {
+                char *prio = strchr(optarg, ':');
+                rt.cpu = atoi(optarg);
+                if (prio) {
+                    rt.priority = atoi(prio + 1);
+                }
+                rt_mode = true;
+                break;
+            }
             case '?':
-                if (optopt == 'b')
+                if (optopt == 'b' || optopt == 'd' || optopt == 'r')
                     fprintf(stderr, "Option -%c requires an argument.\n", optopt);
                 else if (isprint (optopt))
                     fprintf(stderr, "Unknown option `-%c'.\n", optopt);
@@ -163,14 +300,58 @@ int main (int argc, char **argv)
         exit(1);
     }
 
-    for (index = optind; index < argc; index++) {
-        printf ("Non-option argument %s\n", argv[index]);
-    }
+    batch_mode = script != NULL || optind < argc;
 
-    if(platform_init(&app_params) != FPC_BEP_RESULT_OK) {
+    if((app_params.warm_start ? platform_init_warm(&app_params, &hcp_chain) :
+            platform_init(&app_params)) != FPC_BEP_RESULT_OK) {
         help();
         exit(1);
     }
+    // Commands ask BM-Lite again if the probe fails
+    bep_caps_probe(&hcp_chain, &caps);
+
+    for (int i = 0; i < nr_extra_devices; i++) {
+        if (extra_open(&app_params, extra_devices[i]) != FPC_BEP_RESULT_OK) {
+            exit(1);
+        }
+    }
+    if (nr_extra > 0) {
+        HCP_comm_t *chains[MAX_EXTRA_SENSORS];
+
+        for (int i = 0; i < nr_extra; i++) {
+            chains[i] = &extra_chain[i];
+        }
+        batch_set_sensors(chains, nr_extra);
+    }
+
+    // All transfers are done on this thread, buffers of all sensors are allocated
+    if (rt_mode) {
+        if (hal_rt_set(&rt, &hcp_chain) != FPC_BEP_RESULT_OK) {
+            exit(1);
+        }
+        batch_set_rt(&rt);
+    }
+
+    signal(SIGINT, sigint_handler);
+
+    if (batch_mode) {
+        int res;
+        cmd_begin();
+        if (script) {
+            FILE *f = strcmp(script, "-") ? fopen(script, "r") : stdin;
+            if (f == NULL) {
+                printf("Can't open %s\n", script);
+                exit(1);
+            }
+            res = batch_script(&hcp_chain, f);
+            if (f != stdin)
+                fclose(f);
+        } else {
+            res = batch_command(&hcp_chain, argc - optind, argv + optind) != 0;
+        }
+        batch_summary();
+        return res;
+    }
 
     while(1) {
         char cmd[100];
@@ -202,10 +383,18 @@ int main (int argc, char **argv)
         printf("q: Exit program\n");
         printf("\nOption>> ");
         fgets(cmd, sizeof(cmd), stdin);
+        cmd_begin();
         switch (cmd[0]) {
-            case 'a':
-                res = bep_enroll_finger(&hcp_chain);
+            case 'a': {
+                bmlite_enroll_session_t session;
+
+                // Defaults of bep_enroll_finger(), 3 s per capture
+                bep_enroll_session_init(&session, NULL);
+                session.cfg.progress = enroll_progress;
+                res = bep_enroll_session_run(&hcp_chain, &session);
+                printf("%d captures, %d ms total\n", session.nr_steps, session.total_ms);
                 break;
+            }
             case 'b':
                 res = bep_identify_finger(&hcp_chain, 0, &template_id, &match);
                 if (res == FPC_BEP_RESULT_OK) {
@@ -219,16 +408,25 @@ int main (int argc, char **argv)
             case 'c':
                 res = bep_template_remove_all(&hcp_chain);
                 break;
-            case 'd':
-                printf("Template id: ");
-                fgets(cmd, sizeof(cmd), stdin);
-                template_id = atoi(cmd);
+            case 'd': {
+                // Lowest free ID is the default
+                bool has_free = bep_template_id_alloc(&hcp_chain, &template_id) == FPC_BEP_RESULT_OK;
+                if (has_free) {
+                    printf("Template id [%d]: ", template_id);
+                } else {
+                    printf("Template id: ");
+                }
+                read_input(cmd, sizeof(cmd));
+                if (!has_free || cmd[0] != 0) {
+                    template_id = atoi(cmd);
+                }
                 res = bep_template_save(&hcp_chain, template_id);
                 // res = bep_template_remove_ram(&hcp_chain);
                 break;
+            }
             case 'e':
                 printf("Template id: ");
-                fgets(cmd, sizeof(cmd), stdin);
+                read_input(cmd, sizeof(cmd));
                 template_id = atoi(cmd);
                 res = bep_template_remove(&hcp_chain, template_id);
                 break;
@@ -244,7 +442,7 @@ int main (int argc, char **argv)
                 break;
             case 'f': {
                 printf("Timeout (ms): ");
-                fgets(cmd, sizeof(cmd), stdin);
+                read_input(cmd, sizeof(cmd));
                 uint32_t prev_timeout = hcp_chain.phy_rx_timeout;
                 hcp_chain.phy_rx_timeout = atoi(cmd);
                 res = bep_capture(&hcp_chain, atoi(cmd));
@@ -252,9 +450,10 @@ int main (int argc, char **argv)
                 break;
             }
             case 'g': {
-                uint32_t size;
-                res = bep_image_get_size(&hcp_chain, &size);
+                bmlite_image_geometry_t geometry;
+                res = bep_image_get_geometry(&hcp_chain, &geometry);
                 if (res == FPC_BEP_RESULT_OK) {
+                    uint32_t size = geometry.size;
                     uint8_t *buf = (uint8_t *)malloc(size);
                     if (buf) {
                       res = bep_image_get(&hcp_chain, buf, size);
@@ -268,11 +467,8 @@ int main (int argc, char **argv)
                             fclose(f);
                             printf("Image saved as image.raw\n");
                         }
-                        f = fopen("image.pgm", "wb");
-                        if(f) {
-                            save_to_pgm(f, buf, 160, 160);
-                            fclose(f);
-                            printf("Image saved as image.pgm\n");
+                        if (bmlite_image_save("image.pgm", buf, &geometry) == FPC_BEP_RESULT_OK) {
+                            printf("Image saved as image.pgm (%dx%d)\n", geometry.width, geometry.height);
                         }
                         free(buf);
                       }
@@ -283,7 +479,7 @@ int main (int argc, char **argv)
             case 'T': {
                 uint32_t size;
                 printf("Read template from file: ");
-                fscanf(stdin, "%s", cmd);
+                read_input(cmd, sizeof(cmd));
                 uint8_t *buf = (uint8_t *)malloc(102400);
                 FILE *f = fopen(cmd, "rb");
                 if (f) {
@@ -306,7 +502,7 @@ int main (int argc, char **argv)
             case 't': {
                     uint8_t *buf = (uint8_t *)malloc(102400);
                     printf("Save template to file: ");
-                    fscanf(stdin, "%s", cmd);
+                    read_input(cmd, sizeof(cmd));
                     if (buf) {
                       res = bep_template_get(&hcp_chain, buf, 102400);
                       if (res == FPC_BEP_RESULT_OK) {
@@ -342,6 +538,7 @@ int main (int argc, char **argv)
             default:
                 printf("\nUnknown command\n");
         }
+        cmd_busy = 0;
         if (hcp_chain.bep_result == FPC_BEP_RESULT_OK) {
             printf("\nCommand succeded\n");
         } else {
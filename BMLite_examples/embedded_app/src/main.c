@@ -27,6 +27,8 @@
 #include <string.h>
 
 #include "bmlite_if.h"
+#include "bmlite_link.h"
+#include "bmlite_wake.h"
 #include "hcp_tiny.h"
 #include "platform.h"
 #include "bmlite_hal.h"
@@ -34,6 +36,13 @@
 #define DATA_BUFFER_SIZE (1024*5)
 static uint8_t hcp_txrx_buffer[MTU];
 static uint8_t hcp_data_buffer[DATA_BUFFER_SIZE];
+static bmlite_id_cache_t id_cache;
+static bmlite_caps_t caps;
+/** Wake-ups and wake-to-match latency, e.g. for a debugger */
+static bmlite_wake_stats_t wake_stats;
+#ifdef BMLITE_ON_SPI
+static bmlite_link_t spi_link;
+#endif
 
 static HCP_comm_t hcp_chain = {
 #ifdef BMLITE_ON_UART
@@ -42,12 +51,15 @@ static HCP_comm_t hcp_chain = {
 #else
     .read = platform_bmlite_spi_receive,
     .write = platform_bmlite_spi_send,
+    // Waits for BM-Lite go through hal_bmlite_wait_status()
+    .ready = platform_bmlite_spi_ready,
 #endif
     .pkt_buffer = hcp_data_buffer,
     .txrx_buffer = hcp_txrx_buffer,
     .pkt_size = 0,
     .pkt_size_max = sizeof(hcp_data_buffer),
     .phy_rx_timeout = 2000,
+    .id_cache = &id_cache,
 };
 
 #ifdef BMLITE_USE_CALLBACK
@@ -98,14 +110,16 @@ int main (int argc, char **argv)
     platform_init(NULL);
 
     {
-        char version[100];
         uint16_t template_id;
-        uint32_t current_id = 0;
-        bool match;
+        bmlite_wake_result_t wake;
+
+        // Version, unique ID and sensor properties, asked once
+        fpc_bep_result_t res = bep_caps_probe(&hcp_chain, &caps);
 
-        // These two lines for debug purpose only 
-        memset(version, 0, 100);
-        fpc_bep_result_t res = bep_version(&hcp_chain, version, 99);
+#ifdef BMLITE_ON_SPI
+        // Run at the fastest clock both the board and BM-Lite handle
+        bmlite_link_tune(&hcp_chain, &spi_link, NULL);
+#endif
 
         while (1)
         {
@@ -116,21 +130,31 @@ int main (int argc, char **argv)
             } else if (btn_time < 5000) {
                 // Enroll
                 res = bep_enroll_finger(&hcp_chain);
-                res = bep_template_save(&hcp_chain, current_id++);
+                // Free ID is known after reboot too, existing templates are kept
+                if (res == FPC_BEP_RESULT_OK &&
+                    bep_template_id_alloc(&hcp_chain, &template_id) == FPC_BEP_RESULT_OK) {
+                    res = bep_template_save(&hcp_chain, template_id);
+                }
             } else {
                 // Erase All templates
                 hal_set_leds(BMLITE_LED_STATUS_DELETE_TEMPLATES, true);
                 res = bep_template_remove_all(&hcp_chain);
-                current_id = 0;
             }
-            res = bep_identify_finger(&hcp_chain, 0, &template_id, &match);
+            // Both BM-Lite and the host sleep until a finger touches the sensor
+            res = bmlite_wake_identify(&hcp_chain, NULL, &wake_stats, &wake);
+#ifdef BMLITE_ON_SPI
+            bmlite_link_check(&hcp_chain, &spi_link);
+#endif
             if (res == FPC_BEP_RESULT_TIMEOUT || res == FPC_BEP_RESULT_IO_ERROR) {
-                platform_bmlite_reset();
+                // Reset only if the link can't be brought back in step
+                if (bmlite_resync(&hcp_chain, 0) != FPC_BEP_RESULT_OK) {
+                    platform_bmlite_reset();
+                }
                 continue;
             } else if (res != FPC_BEP_RESULT_OK) {
                 continue;
             }
-            hal_set_leds(BMLITE_LED_STATUS_MATCH, match);
+            hal_set_leds(BMLITE_LED_STATUS_MATCH, wake.match);
             res = sensor_wait_finger_not_present(&hcp_chain, 0);
 
         }
@@ -10,4 +10,12 @@ C_INC += -I$(BMLITE_SDK)/inc
 VPATH += $(BMLITE_SDK)/src/
 
 # C Sources
-C_SRCS += $(notdir $(wildcard $(BMLITE_SDK)/src/*.c))
\ No newline at end of file
+C_SRCS += $(notdir $(wildcard $(BMLITE_SDK)/src/*.c))
+
+# Host-side extensions (Linux only)
+ifneq ($(filter $(PLATFORM), RaspberryPi Linux),)
+C_INC += -I$(BMLITE_SDK)/host/inc
+VPATH += $(BMLITE_SDK)/host/src/
+C_SRCS += $(notdir $(wildcard $(BMLITE_SDK)/host/src/*.c))
+LDFLAGS += -pthread
+endif
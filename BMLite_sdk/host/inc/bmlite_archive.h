@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BMLITE_ARCHIVE_H
+#define BMLITE_ARCHIVE_H
+
+/**
+ * @file    bmlite_archive.h
+ * @brief   Bulk backup and restore of BM-Lite template storage.
+ *
+ *   All templates of a module are kept in a single archive, which is a
+ *   template database (see bmlite_tdb.h). Transfers over the link are done
+ *   by the calling thread while a separate thread writes or reads the
+ *   archive. The two threads exchange templates through a pair of buffers,
+ *   so disk I/O of one template overlaps with the link transfer of the next.
+ */
+
+#include <stdint.h>
+
+#include "hcp_tiny.h"
+
+typedef struct {
+    uint32_t nr_templates;
+    /** Template data transferred, bytes */
+    uint64_t bytes;
+    /** Whole operation time, us */
+    uint64_t total_us;
+    /** Time spent in BM-Lite commands, us */
+    uint64_t link_us;
+    /** Time spent in archive I/O, us */
+    uint64_t disk_us;
+    /** Time the link waited for a free or filled buffer, us */
+    uint64_t stall_us;
+} bmlite_archive_stats_t;
+
+/**
+ * @brief Back up all templates from BM-Lite storage
+ *
+ *   The archive is written to a temporary file and renamed over path when
+ *   complete, so an existing archive is kept if backup fails. The archive
+ *   is tagged with unique ID of the module.
+ *
+ * @param[in] chain  - HCP com chain
+ * @param[in] path   - archive file
+ * @param[out] stats - transfer statistics. Can be NULL
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_archive_backup(HCP_comm_t *chain, const char *path,
+        bmlite_archive_stats_t *stats);
+
+/**
+ * @brief Replace BM-Lite storage with templates from archive
+ *
+ *   The whole archive is validated first, then all templates are removed
+ *   from BM-Lite storage. The archive can be restored to another module,
+ *   e.g. when a reader is replaced.
+ *
+ * @param[in] chain  - HCP com chain
+ * @param[in] path   - archive file
+ * @param[out] stats - transfer statistics. Can be NULL
+ *
+ * @return ::fpc_bep_result_t, FPC_BEP_RESULT_INVALID_FORMAT if the archive
+ *         is damaged. BM-Lite storage is not changed then
+ */
+fpc_bep_result_t bmlite_archive_restore(HCP_comm_t *chain, const char *path,
+        bmlite_archive_stats_t *stats);
+
+#endif /* BMLITE_ARCHIVE_H */
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BMLITE_EVAL_H
+#define BMLITE_EVAL_H
+
+/**
+ * @file    bmlite_eval.h
+ * @brief   Offline matcher evaluation on recorded images.
+ *
+ *   Dataset is a directory with a subdirectory of binary PGM images per
+ *   finger. Images are downloaded to BM-Lite with bep_image_put() instead
+ *   of being captured. First images of every finger are used to enroll it
+ *   with template ID first_id + finger index (in name order), the rest are
+ *   identified against all enrolled fingers.
+ *
+ *   A reader thread loads images ahead of the link. Every result is
+ *   appended to the checkpoint file as a CSV line:
+ *
+ *       enroll,<finger>,<id>,<1 - enrolled | 0 - failed>,<ms>
+ *       probe,<finger>/<file>,<id>,<matched id | -1 no match | -2 failed>,<ms>
+ *
+ *   An interrupted run is resumed from the checkpoint, fingers enrolled
+ *   before must still be present in BM-Lite storage. BM-Lite reports no
+ *   match scores, so results are match decisions only.
+ */
+
+#include <stdint.h>
+
+#include "bmlite_if.h"
+
+typedef struct {
+    /** Dataset directory, DIR/<finger>/<sample>.pgm */
+    const char *dir;
+    /** Results and checkpoint file. NULL - no checkpoint */
+    const char *checkpoint;
+    /** Images per finger offered to enrollment */
+    uint32_t enroll_samples;
+    /** Images loaded ahead of the link */
+    uint32_t prefetch;
+    /** Template ID of the first finger */
+    uint16_t first_id;
+} bmlite_eval_config_t;
+
+typedef struct {
+    uint32_t fingers;
+    uint32_t enrolled;
+    /** Fingers failed to enroll */
+    uint32_t enroll_failed;
+    /** Identified images, including taken from checkpoint */
+    uint32_t probes;
+    /** Probes of enrolled fingers */
+    uint32_t genuine;
+    /** Genuine probes matched to own template */
+    uint32_t genuine_match;
+    /** Genuine probes not matched */
+    uint32_t false_reject;
+    /** Probes matched to template of another finger */
+    uint32_t false_match;
+    /** Probes failed to load or extract */
+    uint32_t failed;
+    /** Images downloaded in this run */
+    uint32_t images;
+    /** Results taken from checkpoint */
+    uint32_t resumed;
+    /** Whole run time, us */
+    uint64_t total_us;
+    /** Time spent in BM-Lite commands, us */
+    uint64_t link_us;
+    /** Time the link waited for the reader, us */
+    uint64_t stall_us;
+} bmlite_eval_stats_t;
+
+/**
+ * @brief Run evaluation of the dataset
+ *
+ * @param[in] chain  - HCP com chain
+ * @param[in] cfg    - evaluation configuration
+ * @param[out] stats - evaluation statistics. Can be NULL
+ *
+ * @return ::fpc_bep_result_t, FPC_BEP_RESULT_CANCELLED if stopped by
+ *         bmlite_cancel(). The run can be resumed from the checkpoint.
+ */
+fpc_bep_result_t bmlite_eval_run(HCP_comm_t *chain, const bmlite_eval_config_t *cfg,
+        bmlite_eval_stats_t *stats);
+
+#endif /* BMLITE_EVAL_H */
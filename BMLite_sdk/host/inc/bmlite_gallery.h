@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BMLITE_GALLERY_H
+#define BMLITE_GALLERY_H
+
+/**
+ * @file    bmlite_gallery.h
+ * @brief   Host-side template gallery for 1:N identification.
+ *
+ *   The gallery keeps any number of templates on the host. The most
+ *   frequently matched templates are kept resident in BM-Lite storage
+ *   slots, so most identifications are done by fast on-module
+ *   bep_identify(). If on-module identification fails, the rest of the
+ *   gallery is streamed into BM-Lite RAM and matched one by one. Matched
+ *   template is promoted to storage, replacing the least frequently
+ *   (then least recently) used one.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hcp_tiny.h"
+
+typedef struct {
+    /** User ID of the template */
+    uint32_t id;
+    uint8_t *data;
+    uint16_t size;
+    /** Number of matches, halved periodically */
+    uint32_t hits;
+    /** Gallery clock value of the last match */
+    uint32_t last_used;
+    /** BM-Lite storage slot or -1 if not resident */
+    int32_t slot;
+} bmlite_gallery_entry_t;
+
+typedef struct {
+    bmlite_gallery_entry_t *entries;
+    uint32_t nr_entries;
+    uint32_t max_entries;
+    /** BM-Lite storage IDs slot_base .. slot_base+nr_slots-1 are owned by gallery */
+    uint16_t slot_base;
+    uint16_t nr_slots;
+    /** Slot -> entry index or -1 */
+    int32_t *slots;
+    /** Incremented on every identification */
+    uint32_t clock;
+    /** Streaming order buffer */
+    uint32_t *order;
+
+    /* Statistics */
+    uint32_t identifies;
+    /** Identified by on-module storage */
+    uint32_t resident_matches;
+    /** Identified by streaming */
+    uint32_t streamed_matches;
+    /** Templates streamed in total */
+    uint32_t streamed_templates;
+} bmlite_gallery_t;
+
+/**
+ * @brief Initialize empty gallery
+ *
+ * @param[in] g         - gallery
+ * @param[in] slot_base - first BM-Lite storage ID used by gallery
+ * @param[in] nr_slots  - number of BM-Lite storage slots used by gallery
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_gallery_init(bmlite_gallery_t *g, uint16_t slot_base, uint16_t nr_slots);
+
+/**
+ * @brief Release gallery memory
+ *
+ * @param[in] g - gallery
+ */
+void bmlite_gallery_free(bmlite_gallery_t *g);
+
+/**
+ * @brief Add template to gallery. Template data is copied
+ *
+ * @param[in] g    - gallery
+ * @param[in] id   - user ID
+ * @param[in] data - template
+ * @param[in] size - template size
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_gallery_add(bmlite_gallery_t *g, uint32_t id, const uint8_t *data,
+        uint16_t size);
+
+/**
+ * @brief Fill gallery storage slots of BM-Lite with the most used templates
+ *
+ *   Must be called after templates are added and every time BM-Lite storage
+ *   could be changed by somebody else.
+ *
+ * @param[in] chain - HCP com chain
+ * @param[in] g     - gallery
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_gallery_sync(HCP_comm_t *chain, bmlite_gallery_t *g);
+
+/**
+ * @brief Identify already extracted image (see bep_image_extract()) against gallery
+ *
+ * @param[in] chain     - HCP com chain
+ * @param[in] g         - gallery
+ * @param[out] id       - user ID of matched template
+ * @param[out] match    - match result
+ * @param[out] streamed - number of templates streamed to BM-Lite. Can be NULL
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_gallery_match(HCP_comm_t *chain, bmlite_gallery_t *g,
+        uint32_t *id, bool *match, uint32_t *streamed);
+
+/**
+ * @brief Capture finger and identify it against gallery
+ *
+ * @param[in] chain     - HCP com chain
+ * @param[in] g         - gallery
+ * @param[in] timeout   - capture timeout, ms
+ * @param[out] id       - user ID of matched template
+ * @param[out] match    - match result
+ * @param[out] streamed - number of templates streamed to BM-Lite. Can be NULL
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_gallery_identify(HCP_comm_t *chain, bmlite_gallery_t *g,
+        uint16_t timeout, uint32_t *id, bool *match, uint32_t *streamed);
+
+#endif /* BMLITE_GALLERY_H */
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BMLITE_HARVEST_H
+#define BMLITE_HARVEST_H
+
+/**
+ * @file    bmlite_harvest.h
+ * @brief   Continuous image capture for sensor QA.
+ *
+ *   The calling thread captures and uploads images into a ring of
+ *   preallocated buffers, a writer thread passes them to the store callback.
+ *   Upload of the next frame overlaps with storing of the previous ones.
+ *   If the ring is full, the captured frame is dropped, unless
+ *   bmlite_harvest_config_t.wait_free is set.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "bmlite_if.h"
+
+/**
+ * @brief Store harvested frame. Called from the writer thread
+ *
+ * @param[in] ctx   - bmlite_harvest_config_t.ctx
+ * @param[in] frame - frame number, counting from 0, including dropped frames
+ * @param[in] image - image data. Valid only during the call
+ * @param[in] geometry - image geometry
+ *
+ * @return ::fpc_bep_result_t
+ */
+typedef fpc_bep_result_t (*bmlite_harvest_store_t)(void *ctx, uint32_t frame,
+        const uint8_t *image, const bmlite_image_geometry_t *geometry);
+
+typedef struct {
+    /** Frames to capture. 0 - until cancelled by bmlite_cancel() */
+    uint32_t frames;
+    /** Capture timeout, ms */
+    uint16_t timeout;
+    /** Number of image buffers in the ring */
+    uint32_t ring_size;
+    /** Wait for free buffer instead of dropping the frame */
+    bool wait_free;
+    bmlite_harvest_store_t store;
+    void *ctx;
+} bmlite_harvest_config_t;
+
+typedef struct {
+    /** Frames captured, including dropped */
+    uint32_t frames;
+    /** Frames passed to store callback successfully */
+    uint32_t stored;
+    /** Frames dropped because the ring was full */
+    uint32_t dropped;
+    /** Frames store callback failed on */
+    uint32_t failed;
+    /** Captures timed out without finger */
+    uint32_t timeouts;
+    /** Whole harvest time, us */
+    uint64_t total_us;
+    /** Time spent in capture and upload, us */
+    uint64_t link_us;
+    /** Time spent in store callback, us */
+    uint64_t store_us;
+} bmlite_harvest_stats_t;
+
+/**
+ * @brief Capture images until the configured number of frames is harvested
+ *
+ * @param[in] chain  - HCP com chain
+ * @param[in] cfg    - harvest configuration
+ * @param[out] stats - harvest statistics. Can be NULL
+ *
+ * @return ::fpc_bep_result_t, FPC_BEP_RESULT_CANCELLED if stopped by bmlite_cancel()
+ */
+fpc_bep_result_t bmlite_harvest(HCP_comm_t *chain, const bmlite_harvest_config_t *cfg,
+        bmlite_harvest_stats_t *stats);
+
+#endif /* BMLITE_HARVEST_H */
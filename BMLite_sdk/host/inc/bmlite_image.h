@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BMLITE_IMAGE_H
+#define BMLITE_IMAGE_H
+
+/**
+ * @file    bmlite_image.h
+ * @brief   Export of BM-Lite images to PGM and PNG files.
+ *
+ *   PGM files are binary (P5). PNG files are 8-bit grayscale, every row is
+ *   filtered with the cheaper of Sub and Up filters and compressed by a
+ *   single pass deflate with fixed Huffman codes. Resolution is stored in
+ *   pHYs chunk.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "bmlite_if.h"
+
+typedef enum {
+    BMLITE_IMAGE_PGM = 0,
+    BMLITE_IMAGE_PNG,
+} bmlite_image_format_t;
+
+typedef struct {
+    uint32_t files;
+    uint32_t failed;
+    /** Whole export time, us */
+    uint64_t total_us;
+} bmlite_image_export_stats_t;
+
+/**
+ * @brief Write binary PGM image
+ *
+ * @param[in] f     - output file
+ * @param[in] image - 8-bit image, geometry->size bytes
+ * @param[in] geometry - image geometry
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_image_write_pgm(FILE *f, const uint8_t *image,
+        const bmlite_image_geometry_t *geometry);
+
+/**
+ * @brief Write PNG image
+ *
+ * @param[in] f     - output file
+ * @param[in] image - 8-bit image, geometry->size bytes
+ * @param[in] geometry - image geometry
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_image_write_png(FILE *f, const uint8_t *image,
+        const bmlite_image_geometry_t *geometry);
+
+/**
+ * @brief Save image to file, format is selected by ".png" or ".pgm" extension
+ *
+ * @param[in] path  - output file
+ * @param[in] image - 8-bit image, geometry->size bytes
+ * @param[in] geometry - image geometry
+ *
+ * @return ::fpc_bep_result_t, FPC_BEP_RESULT_INVALID_ARGUMENT for unknown extension
+ */
+fpc_bep_result_t bmlite_image_save(const char *path, const uint8_t *image,
+        const bmlite_image_geometry_t *geometry);
+
+/**
+ * @brief Read binary PGM image
+ *
+ * @param[in] path      - input file
+ * @param[out] image    - image buffer
+ * @param[in] size      - image buffer size
+ * @param[out] geometry - image geometry, dpi is left unchanged
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_image_load_pgm(const char *path, uint8_t *image, uint32_t size,
+        bmlite_image_geometry_t *geometry);
+
+/**
+ * @brief Convert all PGM images in directory, e.g. made by harvest
+ *
+ * @param[in] src_dir  - directory with *.pgm files
+ * @param[in] dst_dir  - output directory
+ * @param[in] format   - output format
+ * @param[in] dpi      - resolution to store in output files
+ * @param[in] threads  - number of worker threads
+ * @param[out] stats   - export statistics. Can be NULL
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_image_export_dir(const char *src_dir, const char *dst_dir,
+        bmlite_image_format_t format, uint16_t dpi, uint32_t threads,
+        bmlite_image_export_stats_t *stats);
+
+#endif /* BMLITE_IMAGE_H */
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BMLITE_MULTI_H
+#define BMLITE_MULTI_H
+
+/**
+ * @file    bmlite_multi.h
+ * @brief   First-match identification across several sensors.
+ *
+ *   Capture is started on all sensors at once with bmlite_submit(), the
+ *   calling thread serves all of them with bmlite_process() and sleeps in
+ *   poll() on bmlite_get_fd() in between. The first sensor reporting a
+ *   captured finger goes on with extraction and identification, captures
+ *   of the other sensors are cancelled with CMD_CANCEL.
+ *
+ *   Every sensor needs its own HCP_comm_t with HCP_comm_t.phy_dev and
+ *   HCP_comm_t.ready set. Sensors without IRQ edge file descriptor are
+ *   polled every BMLITE_MULTI_POLL_INTERVAL ms.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "bmlite_if.h"
+
+#ifndef BMLITE_MULTI_POLL_INTERVAL
+/** Poll interval of sensors without IRQ file descriptor, ms */
+#define BMLITE_MULTI_POLL_INTERVAL 10
+#endif
+
+typedef struct {
+    /** Index of the sensor the finger was identified on, -1 if none */
+    int sensor;
+    bool match;
+    uint16_t template_id;
+    /** Time from start to finger captured on the sensor, ms */
+    uint32_t capture_ms;
+    /** Time from start to identification result, ms */
+    uint32_t total_ms;
+} bmlite_multi_result_t;
+
+/**
+ * @brief Identify finger put on any of the sensors
+ *
+ *   Can be cancelled by bmlite_cancel() of every chain.
+ *
+ * @param[in] chains  - HCP com chains of the sensors
+ * @param[in] count   - number of sensors
+ * @param[in] timeout - capture timeout (msec), 0 - wait indefinitely
+ * @param[out] result - identification result
+ *
+ * @return ::fpc_bep_result_t of the identifying sensor,
+ *         FPC_BEP_RESULT_TIMEOUT if no finger was captured,
+ *         FPC_BEP_RESULT_CANCELLED if cancelled
+ */
+fpc_bep_result_t bmlite_multi_identify(HCP_comm_t **chains, uint32_t count, uint16_t timeout,
+        bmlite_multi_result_t *result);
+
+#endif /* BMLITE_MULTI_H */
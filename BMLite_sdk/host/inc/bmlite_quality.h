@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BMLITE_QUALITY_H
+#define BMLITE_QUALITY_H
+
+/**
+ * @file    bmlite_quality.h
+ * @brief   Host-side image quality gate.
+ *
+ *   Captured image is uploaded and checked on the host before it is
+ *   extracted on BM-Lite, so bad captures are retried without spending
+ *   bep_image_extract() and bep_identify() round trips on them.
+ *
+ *   All statistics are computed in one pass over the image. SSE2 or NEON
+ *   kernels are used when the compiler targets them, a portable version is
+ *   used otherwise. Both give identical results.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "bmlite_if.h"
+
+#ifndef BMLITE_QUALITY_BLOCK
+/** Coverage is counted on blocks of BMLITE_QUALITY_BLOCK x BMLITE_QUALITY_BLOCK pixels,
+    a multiple of 16 */
+#define BMLITE_QUALITY_BLOCK 16
+#endif
+
+typedef struct {
+    float mean;
+    float variance;
+    /** Mean absolute difference of horizontally adjacent pixels */
+    float contrast;
+    /** Share of blocks with contrast above block_contrast threshold, 0..1 */
+    float coverage;
+    /** Share of pixels equal to 0 or 255, 0..1 */
+    float saturation;
+} bmlite_quality_t;
+
+typedef struct {
+    float min_variance;
+    float min_contrast;
+    float min_coverage;
+    float max_saturation;
+    /** Block is covered by finger if its contrast is above this */
+    float block_contrast;
+} bmlite_quality_thresholds_t;
+
+/** Thresholds rejecting empty and badly saturated captures */
+extern const bmlite_quality_thresholds_t bmlite_quality_default_thresholds;
+
+/**
+ * @brief Compute image quality statistics
+ *
+ * @param[in] image      - 8-bit image
+ * @param[in] geometry   - image geometry
+ * @param[in] thresholds - thresholds, only block_contrast is used
+ * @param[out] q         - quality statistics
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_quality_compute(const uint8_t *image,
+        const bmlite_image_geometry_t *geometry,
+        const bmlite_quality_thresholds_t *thresholds, bmlite_quality_t *q);
+
+/**
+ * @brief Portable version of bmlite_quality_compute(), for reference and benchmarking
+ */
+fpc_bep_result_t bmlite_quality_compute_generic(const uint8_t *image,
+        const bmlite_image_geometry_t *geometry,
+        const bmlite_quality_thresholds_t *thresholds, bmlite_quality_t *q);
+
+/**
+ * @brief Name of kernels used by bmlite_quality_compute(): "sse2", "neon" or "generic"
+ */
+const char *bmlite_quality_kernel(void);
+
+/**
+ * @brief Check quality statistics against thresholds
+ *
+ * @param[in] q          - quality statistics
+ * @param[in] thresholds - thresholds
+ *
+ * @return true if image is good enough for extraction
+ */
+bool bmlite_quality_ok(const bmlite_quality_t *q, const bmlite_quality_thresholds_t *thresholds);
+
+/**
+ * @brief Capture finger until image passes quality gate
+ *
+ *   Every capture is uploaded and checked. Rejected captures are followed
+ *   by the next capture immediately. Image that passed stays on BM-Lite and
+ *   can be extracted with bep_image_extract().
+ *
+ * @param[in] chain        - HCP com chain
+ * @param[in] timeout      - capture timeout, ms
+ * @param[in] max_attempts - maximum number of captures
+ * @param[in] thresholds   - quality thresholds
+ * @param[out] image       - image buffer, at least geometry size
+ * @param[in] size         - image buffer size
+ * @param[out] q           - quality of the last capture. Can be NULL
+ * @param[out] rejected    - number of rejected captures. Can be NULL
+ *
+ * @return ::fpc_bep_result_t, FPC_BEP_RESULT_IMAGE_CAPTURE_ERROR if all
+ *         attempts are rejected
+ */
+fpc_bep_result_t bmlite_quality_capture(HCP_comm_t *chain, uint16_t timeout,
+        uint32_t max_attempts, const bmlite_quality_thresholds_t *thresholds,
+        uint8_t *image, uint32_t size, bmlite_quality_t *q, uint32_t *rejected);
+
+#endif /* BMLITE_QUALITY_H */
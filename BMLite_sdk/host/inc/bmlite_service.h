@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BMLITE_SERVICE_H
+#define BMLITE_SERVICE_H
+
+/**
+ * @file    bmlite_service.h
+ * @brief   BM-Lite sensor service.
+ *
+ *   The service owns HCP link in a dedicated I/O thread. Requests can be
+ *   submitted from any thread through lock-free MPSC queues and executed
+ *   one by one on the I/O thread. An optional idle job runs periodically
+ *   in gaps between requests.
+ */
+
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "hcp_tiny.h"
+
+typedef struct bmlite_request bmlite_request_t;
+
+/**
+ * @brief Job executed on I/O thread
+ *
+ * @param[in] chain - HCP com chain owned by the service
+ * @param[in] ctx   - request context
+ *
+ *   The job can call any blocking bep_* function. Data from chain->pkt_buffer
+ *   must be copied out before the job returns.
+ *
+ * @return ::fpc_bep_result_t
+ */
+typedef fpc_bep_result_t (*bmlite_job_t)(HCP_comm_t *chain, void *ctx);
+
+/**
+ * @brief Request completion callback. Called on I/O thread
+ *
+ * @param[in] req - completed request. The callback owns the request
+ */
+typedef void (*bmlite_request_cb_t)(bmlite_request_t *req);
+
+typedef enum {
+    BMLITE_PRIO_NORMAL = 0,
+    /** Executed before all queued normal priority requests */
+    BMLITE_PRIO_HIGH,
+    BMLITE_PRIO_NR,
+} bmlite_prio_t;
+
+struct bmlite_request {
+    /** Intrusive queue link */
+    bmlite_request_t *next;
+    bmlite_job_t job;
+    void *ctx;
+    /** Completion callback. If NULL, use bmlite_request_wait() */
+    bmlite_request_cb_t done;
+    /** Result returned by the job */
+    fpc_bep_result_t result;
+    /** Result of last BM-Lite command executed by the job */
+    fpc_bep_result_t bep_result;
+    sem_t completed;
+};
+
+typedef struct {
+    bmlite_request_t *head;
+    bmlite_request_t *tail;
+    bmlite_request_t stub;
+} bmlite_queue_t;
+
+typedef struct {
+    HCP_comm_t *chain;
+    pthread_t thread;
+    /** eventfd used to wake up I/O thread */
+    int event_fd;
+    bmlite_queue_t queue[BMLITE_PRIO_NR];
+    /** Set by bmlite_service_close(), accessed atomically */
+    bool stop;
+    /** Number of bmlite_service_submit() calls in progress, accessed atomically */
+    uint32_t submitters;
+    /** Idle job, see bmlite_service_set_idle() */
+    bmlite_job_t idle;
+    void *idle_ctx;
+    uint32_t idle_period;
+    /** Time of the last idle job run, ms */
+    uint64_t idle_last;
+} bmlite_service_t;
+
+/**
+ * @brief Set job executed on I/O thread when no request is queued
+ *
+ *   The job runs at most once per period and only between requests, so it
+ *   never interleaves with commands of a request. A request queued while
+ *   the job runs waits for it to finish. Must be called before
+ *   bmlite_service_start().
+ *
+ * @param[in] svc    - service object
+ * @param[in] job    - idle job. NULL to disable
+ * @param[in] ctx    - job context
+ * @param[in] period - minimal interval between runs, ms
+ */
+void bmlite_service_set_idle(bmlite_service_t *svc, bmlite_job_t job, void *ctx,
+        uint32_t period);
+
+/**
+ * @brief Start I/O thread owning HCP chain
+ *
+ * @param[in] svc   - service object
+ * @param[in] chain - HCP com chain. Must not be used directly while service is running
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_service_start(bmlite_service_t *svc, HCP_comm_t *chain);
+
+/**
+ * @brief Stop accepting requests
+ *
+ *   New requests are rejected with FPC_BEP_RESULT_WRONG_STATE and I/O thread
+ *   doesn't start queued requests any more. Call bmlite_service_stop() to
+ *   wait for the thread.
+ *
+ * @param[in] svc - service object
+ */
+void bmlite_service_close(bmlite_service_t *svc);
+
+/**
+ * @brief Check if service is closed by bmlite_service_close()
+ *
+ * @param[in] svc - service object
+ *
+ * @return true if new requests are rejected
+ */
+bool bmlite_service_closed(bmlite_service_t *svc);
+
+/**
+ * @brief Stop I/O thread
+ *
+ *   Closes the service and waits for the current request. Queued requests
+ *   are completed with FPC_BEP_RESULT_CANCELLED.
+ *
+ * @param[in] svc - service object
+ */
+void bmlite_service_stop(bmlite_service_t *svc);
+
+/**
+ * @brief Initialize request
+ *
+ * @param[in] req  - request
+ * @param[in] job  - job to execute on I/O thread
+ * @param[in] ctx  - job context
+ * @param[in] done - completion callback. Set to NULL for waiting by bmlite_request_wait()
+ */
+void bmlite_request_init(bmlite_request_t *req, bmlite_job_t job, void *ctx,
+        bmlite_request_cb_t done);
+
+/**
+ * @brief Release request resources
+ *
+ * @param[in] req - request
+ */
+void bmlite_request_destroy(bmlite_request_t *req);
+
+/**
+ * @brief Queue request for execution. Can be called from any thread
+ *
+ * @param[in] svc  - service object
+ * @param[in] req  - initialized request. Must stay valid until completed
+ * @param[in] prio - request priority
+ *
+ * @return ::fpc_bep_result_t, FPC_BEP_RESULT_WRONG_STATE if the service is
+ *         closed. On success the request is always completed by the service
+ */
+fpc_bep_result_t bmlite_service_submit(bmlite_service_t *svc, bmlite_request_t *req,
+        bmlite_prio_t prio);
+
+/**
+ * @brief Wait for request without completion callback to finish
+ *
+ * @param[in] req - request
+ *
+ * @return result returned by the job
+ */
+fpc_bep_result_t bmlite_request_wait(bmlite_request_t *req);
+
+/**
+ * @brief Execute job on I/O thread and wait for result
+ *
+ * @param[in] svc  - service object
+ * @param[in] job  - job to execute
+ * @param[in] ctx  - job context
+ * @param[in] prio - request priority
+ *
+ * @return result returned by the job
+ */
+fpc_bep_result_t bmlite_service_call(bmlite_service_t *svc, bmlite_job_t job, void *ctx,
+        bmlite_prio_t prio);
+
+#endif /* BMLITE_SERVICE_H */
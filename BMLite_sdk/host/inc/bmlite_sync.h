@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BMLITE_SYNC_H
+#define BMLITE_SYNC_H
+
+/**
+ * @file    bmlite_sync.h
+ * @brief   Incremental sync of BM-Lite storage with host template database.
+ *
+ *   Module storage can't be read back cheaply, so the host keeps a manifest
+ *   per module: a small template database with CRC32 of every template
+ *   pushed to the module. The manifest is stored next to the master
+ *   database as <master>.<unique ID in hex>.
+ *
+ *   On sync the module ID list is compared with the wanted subset of the
+ *   master database. Only templates which are missing on the module or whose
+ *   manifest CRC differs from the master record are transferred, templates
+ *   not in the subset are removed from the module.
+ */
+
+#include <stdint.h>
+
+#include "hcp_tiny.h"
+#include "bmlite_tdb.h"
+
+typedef struct {
+    /** Templates already up to date */
+    uint32_t unchanged;
+    /** Templates missing on the module */
+    uint32_t added;
+    /** Templates with different or unknown content on the module */
+    uint32_t updated;
+    /** Templates removed from the module */
+    uint32_t removed;
+} bmlite_sync_stats_t;
+
+/**
+ * @brief Make BM-Lite storage match a subset of master database
+ *
+ *   Master record ID is used as BM-Lite storage ID, records with ID above
+ *   0xffff are ignored.
+ *
+ * @param[in] chain  - HCP com chain
+ * @param[in] master - master template database
+ * @param[in] ids    - IDs to keep on the module. NULL to sync all master templates
+ * @param[in] nr_ids - number of IDs
+ * @param[out] stats - sync statistics. Can be NULL
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_sync(HCP_comm_t *chain, bmlite_tdb_t *master,
+        const uint16_t *ids, uint32_t nr_ids, bmlite_sync_stats_t *stats);
+
+#endif /* BMLITE_SYNC_H */
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BMLITE_TDB_H
+#define BMLITE_TDB_H
+
+/**
+ * @file    bmlite_tdb.h
+ * @brief   Memory-mapped host template database.
+ *
+ *   Templates are kept in a single file: fixed header followed by an
+ *   append-only log of records. Every record has CRC32 of its data and of
+ *   its header. Removing a template appends a tombstone record.
+ *
+ *   Appended records become durable by bmlite_tdb_commit(): data is synced
+ *   first, then the header with new end of log. Records after the end of log
+ *   are ignored on open, so a crash never leaves a partially written record.
+ *   bmlite_tdb_compact() writes live records to a new file and atomically
+ *   renames it over the database.
+ *
+ *   Lookups use in-memory hash index and return pointers into the mapping.
+ *   The pointers stay valid until the next modification of the database.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "hcp_tiny.h"
+
+#define BMLITE_TDB_UNIQUE_ID_LEN 12
+
+/** Record is a tombstone of removed template */
+#define BMLITE_TDB_REC_DELETED 0x01
+
+typedef struct {
+    uint32_t magic;
+    uint32_t id;
+    uint32_t size;
+    uint32_t flags;
+    /** CRC32 of data */
+    uint32_t crc;
+    /** CRC32 of the fields above */
+    uint32_t hdr_crc;
+    uint8_t data[];
+} bmlite_tdb_record_t;
+
+typedef struct {
+    uint32_t id;
+    uint32_t used;
+    uint64_t offset;
+} bmlite_tdb_slot_t;
+
+typedef struct {
+    int fd;
+    char *path;
+    uint8_t *map;
+    size_t map_size;
+    /** End of appended records, may be beyond committed end */
+    uint64_t tail;
+    /** Bytes occupied by overwritten, removed and tombstone records */
+    uint64_t dead_bytes;
+    /** Records with bad CRC and damaged log tails dropped on open */
+    uint32_t nr_damaged;
+
+    /* id -> offset index. Open addressing, linear probing */
+    bmlite_tdb_slot_t *index;
+    uint32_t index_size;
+    uint32_t nr_records;
+} bmlite_tdb_t;
+
+/**
+ * @brief Open template database
+ *
+ * @param[in] db     - database object
+ * @param[in] path   - database file
+ * @param[in] create - create file if it doesn't exist
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_tdb_open(bmlite_tdb_t *db, const char *path, bool create);
+
+/**
+ * @brief Commit and close database
+ *
+ * @param[in] db - database object
+ */
+void bmlite_tdb_close(bmlite_tdb_t *db);
+
+/**
+ * @brief Add or replace template
+ *
+ * @param[in] db   - database object
+ * @param[in] id   - template ID
+ * @param[in] data - template
+ * @param[in] size - template size
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_tdb_put(bmlite_tdb_t *db, uint32_t id, const uint8_t *data, uint32_t size);
+
+/**
+ * @brief Remove template
+ *
+ * @param[in] db - database object
+ * @param[in] id - template ID
+ *
+ * @return ::fpc_bep_result_t, FPC_BEP_RESULT_ID_NOT_FOUND if there is no such template
+ */
+fpc_bep_result_t bmlite_tdb_remove(bmlite_tdb_t *db, uint32_t id);
+
+/**
+ * @brief Find template
+ *
+ * @param[in] db - database object
+ * @param[in] id - template ID
+ *
+ * @return record in the mapping or NULL
+ */
+const bmlite_tdb_record_t *bmlite_tdb_find(bmlite_tdb_t *db, uint32_t id);
+
+/**
+ * @brief Iterate over all templates
+ *
+ *   Order is unspecified. The database must not be modified while iterating.
+ *
+ * @param[in] db      - database object
+ * @param[in,out] pos - iterator, must be 0 on first call
+ *
+ * @return next record or NULL at the end
+ */
+const bmlite_tdb_record_t *bmlite_tdb_next(bmlite_tdb_t *db, uint32_t *pos);
+
+/**
+ * @brief Make all changes durable
+ *
+ * @param[in] db - database object
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_tdb_commit(bmlite_tdb_t *db);
+
+/**
+ * @brief Rewrite database with live records only
+ *
+ *   Records found by bmlite_tdb_find() before compaction become invalid.
+ *
+ * @param[in] db - database object
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_tdb_compact(bmlite_tdb_t *db);
+
+/**
+ * @brief Get BM-Lite unique ID the database is bound to
+ *
+ * @param[in] db         - database object
+ * @param[out] unique_id - BMLITE_TDB_UNIQUE_ID_LEN bytes
+ *
+ * @return true if the database is bound to a module
+ */
+bool bmlite_tdb_get_unique_id(bmlite_tdb_t *db, uint8_t *unique_id);
+
+/**
+ * @brief Bind database to BM-Lite module
+ *
+ *   Unbound database is tagged with unique ID of the module. Bound database
+ *   is checked against the module.
+ *
+ * @param[in] chain - HCP com chain
+ * @param[in] db    - database object
+ *
+ * @return ::fpc_bep_result_t, FPC_BEP_RESULT_WRONG_STATE if the database
+ *         belongs to another module
+ */
+fpc_bep_result_t bmlite_tdb_bind(HCP_comm_t *chain, bmlite_tdb_t *db);
+
+#endif /* BMLITE_TDB_H */
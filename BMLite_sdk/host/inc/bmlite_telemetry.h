@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BMLITE_TELEMETRY_H
+#define BMLITE_TELEMETRY_H
+
+/**
+ * @file    bmlite_telemetry.h
+ * @brief   Periodic resource telemetry of BM-Lite.
+ *
+ *   Stack and heap high-water marks are read with bep_diag_get(), size of
+ *   the storage log with CMD_STORAGE_LOG. Samples are taken by the idle job
+ *   of a bmlite_service_t, i.e. only when no request is queued, so they
+ *   don't interleave with biometric commands. Every sample also records
+ *   link layer counters of the chain, so module and transport health are
+ *   read together.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "bmlite_if.h"
+#include "bmlite_service.h"
+
+/**
+ * @brief Storage log changed. Called on I/O thread
+ *
+ * @param[in] ctx  - bmlite_telemetry_config_t.ctx
+ * @param[in] data - whole storage log. Valid only during the call
+ * @param[in] size - log size, bytes
+ */
+typedef void (*bmlite_telemetry_log_t)(void *ctx, const uint8_t *data, uint32_t size);
+
+typedef struct {
+    /** Sampling period, ms */
+    uint32_t period;
+    /** Read storage log in every sample */
+    bool storage_log;
+    /** Called when storage log size changes. Can be NULL */
+    bmlite_telemetry_log_t log;
+    void *ctx;
+} bmlite_telemetry_config_t;
+
+typedef struct {
+    /** Time of the sample, ms of CLOCK_MONOTONIC */
+    uint64_t time_ms;
+    bmlite_diag_t diag;
+    /** Storage log size, bytes. 0 if not read */
+    uint32_t log_size;
+    /** Link counters of the chain at the time of the sample */
+    HCP_link_stats_t link;
+} bmlite_telemetry_sample_t;
+
+typedef struct {
+    /** Samples taken */
+    uint32_t samples;
+    /** Samples BM-Lite failed to answer */
+    uint32_t failed;
+    /** Last successful sample */
+    bmlite_telemetry_sample_t last;
+    /** Highest values seen since start */
+    bmlite_diag_t peak;
+} bmlite_telemetry_metrics_t;
+
+typedef struct {
+    bmlite_telemetry_config_t cfg;
+    pthread_mutex_t lock;
+    bmlite_telemetry_metrics_t metrics;
+} bmlite_telemetry_t;
+
+/**
+ * @brief Take one sample
+ *
+ * @param[in] chain       - HCP com chain
+ * @param[in] storage_log - also read storage log size
+ * @param[out] sample     - sample
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_telemetry_sample(HCP_comm_t *chain, bool storage_log,
+        bmlite_telemetry_sample_t *sample);
+
+/**
+ * @brief Sample BM-Lite served by the service periodically
+ *
+ *   Sets the idle job of the service, so must be called before
+ *   bmlite_service_start().
+ *
+ * @param[in] t   - telemetry object
+ * @param[in] svc - service of the sensor
+ * @param[in] cfg - configuration
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_telemetry_start(bmlite_telemetry_t *t, bmlite_service_t *svc,
+        const bmlite_telemetry_config_t *cfg);
+
+/**
+ * @brief Get collected metrics. Can be called from any thread
+ *
+ * @param[in] t        - telemetry object
+ * @param[out] metrics - metrics
+ */
+void bmlite_telemetry_get(bmlite_telemetry_t *t, bmlite_telemetry_metrics_t *metrics);
+
+/**
+ * @brief Release telemetry resources. The service must be stopped
+ *
+ * @param[in] t - telemetry object
+ */
+void bmlite_telemetry_destroy(bmlite_telemetry_t *t);
+
+#endif /* BMLITE_TELEMETRY_H */
@@ -0,0 +1,418 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    bmlite_archive.c
+ * @brief   Bulk backup and restore of BM-Lite template storage.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bmlite_if.h"
+#include "bmlite_tdb.h"
+#include "bmlite_archive.h"
+
+/** Template size is 16 bit in CMD_TEMPLATE download */
+#define ARCHIVE_MAX_TEMPLATE 0xffff
+
+typedef struct {
+    uint16_t id;
+    uint32_t size;
+    uint8_t data[ARCHIVE_MAX_TEMPLATE];
+} archive_buf_t;
+
+/*
+ * Producer fills buffers in order 0, 1, 0, 1 ..., consumer takes them in the
+ * same order. A buffer with size 0 marks the end of the stream, so empty
+ * templates are never put into a buffer.
+ */
+typedef struct {
+    archive_buf_t buf[2];
+    sem_t free;
+    sem_t full;
+    bmlite_tdb_t db;
+    /** Set by either side to stop the other one */
+    volatile fpc_bep_result_t error;
+    uint64_t disk_us;
+} archive_pipe_t;
+
+static uint64_t time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sem_wait_intr(sem_t *sem)
+{
+    while (sem_wait(sem) < 0 && errno == EINTR);
+}
+
+static archive_pipe_t *pipe_create(void)
+{
+    archive_pipe_t *p = malloc(sizeof(archive_pipe_t));
+
+    if (p == NULL) {
+        return NULL;
+    }
+    sem_init(&p->free, 0, 2);
+    sem_init(&p->full, 0, 0);
+    p->error = FPC_BEP_RESULT_OK;
+    p->disk_us = 0;
+    p->db.fd = -1;
+
+    return p;
+}
+
+static void pipe_destroy(archive_pipe_t *p)
+{
+    sem_destroy(&p->free);
+    sem_destroy(&p->full);
+    free(p);
+}
+
+/*
+ * Backup: the link thread fills buffers, the disk thread appends them to the archive
+ */
+
+static void *backup_writer(void *arg)
+{
+    archive_pipe_t *p = arg;
+    uint32_t n = 0;
+
+    for (;;) {
+        archive_buf_t *b = &p->buf[n++ & 1];
+        uint64_t start;
+
+        sem_wait_intr(&p->full);
+        if (b->size == 0) {
+            break;
+        }
+        start = time_us();
+        if (p->error == FPC_BEP_RESULT_OK) {
+            fpc_bep_result_t res = bmlite_tdb_put(&p->db, b->id, b->data, b->size);
+            if (res != FPC_BEP_RESULT_OK) {
+                p->error = res;
+            }
+        }
+        p->disk_us += time_us() - start;
+        sem_post(&p->free);
+    }
+
+    return NULL;
+}
+
+static fpc_bep_result_t backup_read(HCP_comm_t *chain, archive_buf_t *b, uint16_t id)
+{
+    fpc_bep_result_t res;
+
+    res = bep_template_load_storage(chain, id);
+    if (res != FPC_BEP_RESULT_OK || chain->bep_result != FPC_BEP_RESULT_OK) {
+        return res ? res : chain->bep_result;
+    }
+    res = bmlite_send_cmd(chain, CMD_TEMPLATE, ARG_UPLOAD);
+    if (res != FPC_BEP_RESULT_OK || chain->bep_result != FPC_BEP_RESULT_OK) {
+        return res ? res : chain->bep_result;
+    }
+    res = bmlite_get_arg(chain, ARG_DATA);
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+    if (chain->arg.size == 0 || chain->arg.size > ARCHIVE_MAX_TEMPLATE) {
+        return FPC_BEP_RESULT_INVALID_FORMAT;
+    }
+    b->id = id;
+    b->size = chain->arg.size;
+    memcpy(b->data, chain->arg.data, b->size);
+
+    return FPC_BEP_RESULT_OK;
+}
+
+fpc_bep_result_t bmlite_archive_backup(HCP_comm_t *chain, const char *path,
+        bmlite_archive_stats_t *stats)
+{
+    bmlite_archive_stats_t st;
+    fpc_bep_result_t res;
+    archive_pipe_t *p;
+    pthread_t writer;
+    uint16_t *ids;
+    uint32_t nr_ids;
+    char *tmp_path;
+    size_t len;
+    uint64_t start;
+
+    memset(&st, 0, sizeof(st));
+    if (stats) {
+        *stats = st;
+    }
+    start = time_us();
+
+    res = bep_template_get_ids(chain);
+    if (res != FPC_BEP_RESULT_OK || chain->bep_result != FPC_BEP_RESULT_OK) {
+        return res ? res : chain->bep_result;
+    }
+    nr_ids = chain->arg.size / sizeof(uint16_t);
+    // Argument data is overwritten by the next command
+    ids = malloc(nr_ids * sizeof(uint16_t) + 1);
+    if (ids == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    memcpy(ids, chain->arg.data, nr_ids * sizeof(uint16_t));
+
+    len = strlen(path) + sizeof(".tmp");
+    tmp_path = malloc(len);
+    p = pipe_create();
+    if (tmp_path == NULL || p == NULL) {
+        res = FPC_BEP_RESULT_NO_MEMORY;
+        goto exit;
+    }
+    snprintf(tmp_path, len, "%s.tmp", path);
+    unlink(tmp_path);
+
+    res = bmlite_tdb_open(&p->db, tmp_path, true);
+    if (res == FPC_BEP_RESULT_OK) {
+        res = bmlite_tdb_bind(chain, &p->db);
+    }
+    if (res != FPC_BEP_RESULT_OK) {
+        goto exit;
+    }
+    if (pthread_create(&writer, NULL, backup_writer, p) != 0) {
+        res = FPC_BEP_RESULT_NO_RESOURCE;
+        goto exit;
+    }
+
+    for (uint32_t i = 0; i <= nr_ids; i++) {
+        archive_buf_t *b = &p->buf[i & 1];
+        uint64_t t = time_us();
+
+        sem_wait_intr(&p->free);
+        st.stall_us += time_us() - t;
+
+        if (i == nr_ids || res != FPC_BEP_RESULT_OK || p->error != FPC_BEP_RESULT_OK) {
+            // Stop the writer
+            b->size = 0;
+            sem_post(&p->full);
+            break;
+        }
+
+        t = time_us();
+        res = backup_read(chain, b, ids[i]);
+        st.link_us += time_us() - t;
+        if (res != FPC_BEP_RESULT_OK) {
+            b->size = 0;
+            sem_post(&p->full);
+            break;
+        }
+        st.nr_templates++;
+        st.bytes += b->size;
+        sem_post(&p->full);
+    }
+    pthread_join(writer, NULL);
+    bep_template_remove_ram(chain);
+
+    if (res == FPC_BEP_RESULT_OK) {
+        res = p->error;
+    }
+    if (res == FPC_BEP_RESULT_OK) {
+        res = bmlite_tdb_commit(&p->db);
+    }
+    st.disk_us = p->disk_us;
+
+exit:
+    if (p) {
+        if (p->db.fd >= 0) {
+            bmlite_tdb_close(&p->db);
+        }
+        pipe_destroy(p);
+    }
+    if (tmp_path) {
+        if (res == FPC_BEP_RESULT_OK && rename(tmp_path, path) < 0) {
+            res = FPC_BEP_RESULT_IO_ERROR;
+        }
+        if (res != FPC_BEP_RESULT_OK) {
+            unlink(tmp_path);
+        }
+        free(tmp_path);
+    }
+    free(ids);
+
+    st.total_us = time_us() - start;
+    if (stats) {
+        *stats = st;
+    }
+    return res;
+}
+
+/*
+ * Restore: the disk thread reads the archive into buffers, the link thread sends them
+ */
+
+static void *restore_reader(void *arg)
+{
+    archive_pipe_t *p = arg;
+    const bmlite_tdb_record_t *rec;
+    uint32_t pos = 0;
+    uint32_t n = 0;
+
+    for (;;) {
+        archive_buf_t *b = &p->buf[n++ & 1];
+        uint64_t start;
+
+        sem_wait_intr(&p->free);
+        start = time_us();
+        // Records are validated by restore_check()
+        rec = p->error == FPC_BEP_RESULT_OK ? bmlite_tdb_next(&p->db, &pos) : NULL;
+        if (rec == NULL) {
+            b->size = 0;
+            sem_post(&p->full);
+            break;
+        }
+        // Copying pulls archive pages in while the link is busy with the previous template
+        b->id = rec->id;
+        b->size = rec->size;
+        memcpy(b->data, rec->data, rec->size);
+        p->disk_us += time_us() - start;
+        sem_post(&p->full);
+    }
+
+    return NULL;
+}
+
+/* The whole archive is checked before BM-Lite storage is erased */
+static fpc_bep_result_t restore_check(bmlite_tdb_t *db)
+{
+    const bmlite_tdb_record_t *rec;
+    uint32_t pos = 0;
+
+    // Damaged records and a truncated log are dropped silently by bmlite_tdb_open()
+    if (db->nr_damaged) {
+        return FPC_BEP_RESULT_INVALID_FORMAT;
+    }
+    while ((rec = bmlite_tdb_next(db, &pos)) != NULL) {
+        if (rec->size == 0 || rec->size > ARCHIVE_MAX_TEMPLATE || rec->id > 0xffff) {
+            return FPC_BEP_RESULT_INVALID_FORMAT;
+        }
+    }
+
+    return FPC_BEP_RESULT_OK;
+}
+
+static fpc_bep_result_t restore_write(HCP_comm_t *chain, archive_buf_t *b)
+{
+    fpc_bep_result_t res;
+
+    res = bep_template_put(chain, b->data, b->size);
+    if (res != FPC_BEP_RESULT_OK || chain->bep_result != FPC_BEP_RESULT_OK) {
+        return res ? res : chain->bep_result;
+    }
+    res = bep_template_save(chain, b->id);
+    if (res != FPC_BEP_RESULT_OK || chain->bep_result != FPC_BEP_RESULT_OK) {
+        return res ? res : chain->bep_result;
+    }
+
+    return FPC_BEP_RESULT_OK;
+}
+
+fpc_bep_result_t bmlite_archive_restore(HCP_comm_t *chain, const char *path,
+        bmlite_archive_stats_t *stats)
+{
+    bmlite_archive_stats_t st;
+    fpc_bep_result_t res;
+    archive_pipe_t *p;
+    pthread_t reader;
+    uint64_t start;
+
+    memset(&st, 0, sizeof(st));
+    if (stats) {
+        *stats = st;
+    }
+    start = time_us();
+
+    p = pipe_create();
+    if (p == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    res = bmlite_tdb_open(&p->db, path, false);
+    if (res != FPC_BEP_RESULT_OK) {
+        pipe_destroy(p);
+        return res;
+    }
+    res = restore_check(&p->db);
+    if (res != FPC_BEP_RESULT_OK) {
+        goto exit;
+    }
+
+    res = bep_template_remove_all(chain);
+    if (res != FPC_BEP_RESULT_OK || chain->bep_result != FPC_BEP_RESULT_OK) {
+        res = res ? res : chain->bep_result;
+        goto exit;
+    }
+    if (pthread_create(&reader, NULL, restore_reader, p) != 0) {
+        res = FPC_BEP_RESULT_NO_RESOURCE;
+        goto exit;
+    }
+
+    for (uint32_t i = 0; ; i++) {
+        archive_buf_t *b = &p->buf[i & 1];
+        uint64_t t = time_us();
+
+        sem_wait_intr(&p->full);
+        st.stall_us += time_us() - t;
+        if (b->size == 0) {
+            break;
+        }
+
+        if (res == FPC_BEP_RESULT_OK) {
+            t = time_us();
+            res = restore_write(chain, b);
+            st.link_us += time_us() - t;
+            if (res != FPC_BEP_RESULT_OK) {
+                // Let the reader finish on its next buffer
+                p->error = res;
+            } else {
+                st.nr_templates++;
+                st.bytes += b->size;
+            }
+        }
+        sem_post(&p->free);
+    }
+    pthread_join(reader, NULL);
+    bep_template_remove_ram(chain);
+
+    if (res == FPC_BEP_RESULT_OK) {
+        res = p->error;
+    }
+    st.disk_us = p->disk_us;
+
+exit:
+    bmlite_tdb_close(&p->db);
+    pipe_destroy(p);
+
+    st.total_us = time_us() - start;
+    if (stats) {
+        *stats = st;
+    }
+    return res;
+}
@@ -0,0 +1,720 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    bmlite_eval.c
+ * @brief   Offline matcher evaluation on recorded images.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "bmlite_if.h"
+#include "bmlite_image.h"
+#include "bmlite_eval.h"
+
+/** Image size is 16 bit in CMD_IMAGE download */
+#define EVAL_MAX_IMAGE 0xffff
+
+#define EVAL_NO_MATCH (-1)
+#define EVAL_FAILED   (-2)
+
+/** Reader slot job marking the end of the dataset */
+#define EVAL_END UINT32_MAX
+
+typedef struct {
+    char name[NAME_MAX + 1];
+    uint16_t id;
+    /** Enrollment result is known */
+    bool done;
+    bool enrolled;
+    uint32_t remaining;
+    uint64_t enroll_us;
+} eval_finger_t;
+
+typedef struct {
+    char *path;
+    /** File name within finger directory, points into path */
+    const char *file;
+    uint32_t finger;
+    bool enroll;
+    /** First and last enrollment image of the finger */
+    bool first;
+    bool last;
+    /** Result is known */
+    bool done;
+    int32_t matched;
+} eval_job_t;
+
+typedef struct {
+    uint32_t job;
+    fpc_bep_result_t res;
+    bmlite_image_geometry_t geometry;
+    uint8_t data[EVAL_MAX_IMAGE];
+} eval_slot_t;
+
+/*
+ * Enrollment jobs of all fingers go first, probes follow. Probes are in
+ * finger and file name order, so checkpoint entries are found by bsearch.
+ * The reader fills slots in job order skipping finished jobs, the link
+ * thread takes them in the same order.
+ */
+typedef struct {
+    eval_finger_t *fingers;
+    uint32_t nr_fingers;
+    eval_job_t *jobs;
+    uint32_t nr_jobs;
+    uint32_t nr_enroll_jobs;
+    eval_slot_t *slots;
+    uint32_t nr_slots;
+    sem_t free;
+    sem_t full;
+    /** Set by the link thread to stop the reader */
+    volatile bool stop;
+    bool enrolling;
+    FILE *checkpoint;
+    uint32_t images;
+    uint32_t resumed;
+} eval_t;
+
+static uint64_t time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sem_wait_intr(sem_t *sem)
+{
+    while (sem_wait(sem) < 0 && errno == EINTR);
+}
+
+static bool has_suffix(const char *s, const char *suffix)
+{
+    size_t len = strlen(s), slen = strlen(suffix);
+
+    return len > slen && strcmp(s + len - slen, suffix) == 0;
+}
+
+static int cmp_name(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void free_names(char **names, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    free(names);
+}
+
+/* Sorted subdirectories or *.pgm files of the directory */
+static fpc_bep_result_t list_dir(const char *path, bool dirs, char ***names, uint32_t *count)
+{
+    fpc_bep_result_t res = FPC_BEP_RESULT_OK;
+    uint32_t max_names = 0;
+    struct dirent *e;
+    DIR *dir;
+
+    *names = NULL;
+    *count = 0;
+    dir = opendir(path);
+    if (dir == NULL) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    while ((e = readdir(dir)) != NULL) {
+        char full[PATH_MAX];
+        struct stat st;
+
+        if (e->d_name[0] == '.') {
+            continue;
+        }
+        if (dirs) {
+            snprintf(full, sizeof(full), "%s/%s", path, e->d_name);
+            if (stat(full, &st) < 0 || !S_ISDIR(st.st_mode)) {
+                continue;
+            }
+        } else if (!has_suffix(e->d_name, ".pgm")) {
+            continue;
+        }
+        if (*count == max_names) {
+            char **n;
+            max_names = max_names ? max_names * 2 : 64;
+            n = realloc(*names, max_names * sizeof(char *));
+            if (n == NULL) {
+                res = FPC_BEP_RESULT_NO_MEMORY;
+                break;
+            }
+            *names = n;
+        }
+        (*names)[*count] = strdup(e->d_name);
+        if ((*names)[*count] == NULL) {
+            res = FPC_BEP_RESULT_NO_MEMORY;
+            break;
+        }
+        (*count)++;
+    }
+    closedir(dir);
+
+    if (res == FPC_BEP_RESULT_OK) {
+        qsort(*names, *count, sizeof(char *), cmp_name);
+    }
+    return res;
+}
+
+static fpc_bep_result_t add_job(eval_t *e, uint32_t *max_jobs, const char *dir,
+        uint32_t finger, const char *file)
+{
+    eval_job_t *job;
+    size_t len;
+
+    if (e->nr_jobs == *max_jobs) {
+        eval_job_t *jobs;
+        *max_jobs = *max_jobs ? *max_jobs * 2 : 1024;
+        jobs = realloc(e->jobs, *max_jobs * sizeof(eval_job_t));
+        if (jobs == NULL) {
+            return FPC_BEP_RESULT_NO_MEMORY;
+        }
+        e->jobs = jobs;
+    }
+    job = &e->jobs[e->nr_jobs];
+    memset(job, 0, sizeof(eval_job_t));
+    len = strlen(dir) + strlen(e->fingers[finger].name) + strlen(file) + 3;
+    job->path = malloc(len);
+    if (job->path == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    snprintf(job->path, len, "%s/%s/%s", dir, e->fingers[finger].name, file);
+    job->file = job->path + len - 1 - strlen(file);
+    job->finger = finger;
+    e->nr_jobs++;
+
+    return FPC_BEP_RESULT_OK;
+}
+
+static fpc_bep_result_t eval_scan(eval_t *e, const bmlite_eval_config_t *cfg)
+{
+    fpc_bep_result_t res;
+    char ***files = NULL;
+    uint32_t *nr_files = NULL;
+    char **dirs;
+    uint32_t max_jobs = 0;
+
+    res = list_dir(cfg->dir, true, &dirs, &e->nr_fingers);
+    if (res != FPC_BEP_RESULT_OK) {
+        free_names(dirs, e->nr_fingers);
+        return res;
+    }
+    e->fingers = calloc(e->nr_fingers + 1, sizeof(eval_finger_t));
+    files = calloc(e->nr_fingers + 1, sizeof(char **));
+    nr_files = calloc(e->nr_fingers + 1, sizeof(uint32_t));
+    if (e->fingers == NULL || files == NULL || nr_files == NULL) {
+        res = FPC_BEP_RESULT_NO_MEMORY;
+        goto exit;
+    }
+
+    for (uint32_t f = 0; f < e->nr_fingers && res == FPC_BEP_RESULT_OK; f++) {
+        char path[PATH_MAX];
+
+        snprintf(e->fingers[f].name, sizeof(e->fingers[f].name), "%s", dirs[f]);
+        e->fingers[f].id = cfg->first_id + f;
+        snprintf(path, sizeof(path), "%s/%s", cfg->dir, dirs[f]);
+        res = list_dir(path, false, &files[f], &nr_files[f]);
+    }
+
+    // Enrollment first, then probes of all fingers
+    for (uint32_t f = 0; f < e->nr_fingers && res == FPC_BEP_RESULT_OK; f++) {
+        uint32_t n = nr_files[f] < cfg->enroll_samples ? nr_files[f] : cfg->enroll_samples;
+
+        for (uint32_t i = 0; i < n && res == FPC_BEP_RESULT_OK; i++) {
+            res = add_job(e, &max_jobs, cfg->dir, f, files[f][i]);
+            if (res == FPC_BEP_RESULT_OK) {
+                e->jobs[e->nr_jobs - 1].enroll = true;
+                e->jobs[e->nr_jobs - 1].first = i == 0;
+                e->jobs[e->nr_jobs - 1].last = i == n - 1;
+            }
+        }
+    }
+    e->nr_enroll_jobs = e->nr_jobs;
+    for (uint32_t f = 0; f < e->nr_fingers && res == FPC_BEP_RESULT_OK; f++) {
+        for (uint32_t i = cfg->enroll_samples; i < nr_files[f] && res == FPC_BEP_RESULT_OK; i++) {
+            res = add_job(e, &max_jobs, cfg->dir, f, files[f][i]);
+        }
+    }
+
+exit:
+    for (uint32_t f = 0; files && f < e->nr_fingers; f++) {
+        free_names(files[f], nr_files[f]);
+    }
+    free(files);
+    free(nr_files);
+    free_names(dirs, e->nr_fingers);
+
+    return res;
+}
+
+/*
+ * Checkpoint
+ */
+
+static int cmp_finger(const void *key, const void *f)
+{
+    return strcmp(key, ((const eval_finger_t *)f)->name);
+}
+
+typedef struct {
+    uint32_t finger;
+    const char *file;
+} probe_key_t;
+
+static int cmp_probe(const void *key, const void *job)
+{
+    const probe_key_t *k = key;
+    const eval_job_t *j = job;
+
+    if (k->finger != j->finger) {
+        return k->finger < j->finger ? -1 : 1;
+    }
+    return strcmp(k->file, j->file);
+}
+
+static eval_finger_t *find_finger(eval_t *e, const char *name)
+{
+    return bsearch(name, e->fingers, e->nr_fingers, sizeof(eval_finger_t), cmp_finger);
+}
+
+/* Split CSV line into exactly n fields */
+static bool split_line(char *line, char **fields, int n)
+{
+    line[strcspn(line, "\r\n")] = '\0';
+    for (int i = 0; i < n; i++) {
+        fields[i] = line;
+        line = strchr(line, ',');
+        if ((line == NULL) != (i == n - 1)) {
+            return false;
+        }
+        if (line) {
+            *line++ = '\0';
+        }
+    }
+    return true;
+}
+
+/* Returns true if the last line is not terminated */
+static bool checkpoint_load(eval_t *e, const char *path)
+{
+    char line[2 * NAME_MAX + 64];
+    FILE *f = fopen(path, "r");
+    bool torn = false;
+
+    if (f == NULL) {
+        return false;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *field[5];
+        eval_finger_t *finger;
+
+        torn = strchr(line, '\n') == NULL;
+        if (!split_line(line, field, 5)) {
+            // Torn line at the end of an interrupted run
+            continue;
+        }
+        if (strcmp(field[0], "enroll") == 0) {
+            finger = find_finger(e, field[1]);
+            if (finger && finger->id == atoi(field[2])) {
+                finger->done = true;
+                finger->enrolled = atoi(field[3]) != 0;
+                e->resumed++;
+            }
+        } else if (strcmp(field[0], "probe") == 0) {
+            char *file = strchr(field[1], '/');
+            probe_key_t key;
+            eval_job_t *job;
+
+            if (file == NULL) {
+                continue;
+            }
+            *file++ = '\0';
+            finger = find_finger(e, field[1]);
+            if (finger == NULL || finger->id != atoi(field[2])) {
+                continue;
+            }
+            key.finger = finger - e->fingers;
+            key.file = file;
+            job = bsearch(&key, e->jobs + e->nr_enroll_jobs, e->nr_jobs - e->nr_enroll_jobs,
+                          sizeof(eval_job_t), cmp_probe);
+            if (job && !job->done) {
+                job->done = true;
+                job->matched = atoi(field[3]);
+                e->resumed++;
+            }
+        }
+    }
+    fclose(f);
+
+    return torn;
+}
+
+/* Enrolled fingers must still be stored in BM-Lite, others are enrolled again */
+static fpc_bep_result_t checkpoint_verify(HCP_comm_t *chain, eval_t *e)
+{
+    for (uint32_t f = 0; f < e->nr_fingers; f++) {
+        eval_finger_t *finger = &e->fingers[f];
+        bool used;
+
+        if (finger->done && finger->enrolled) {
+            fpc_bep_result_t res = bep_template_id_is_used(chain, finger->id, &used);
+            if (res != FPC_BEP_RESULT_OK) {
+                return res;
+            }
+            if (!used) {
+                finger->done = false;
+                finger->enrolled = false;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < e->nr_enroll_jobs; i++) {
+        e->jobs[i].done = e->fingers[e->jobs[i].finger].done;
+    }
+    return FPC_BEP_RESULT_OK;
+}
+
+static void checkpoint_write(eval_t *e, const char *kind, const char *finger,
+        const char *file, uint16_t id, int32_t result, uint64_t us)
+{
+    if (e->checkpoint == NULL) {
+        return;
+    }
+    fprintf(e->checkpoint, "%s,%s%s%s,%d,%d,%.3f\n", kind, finger, file ? "/" : "",
+            file ? file : "", id, result, us / 1000.0);
+    fflush(e->checkpoint);
+}
+
+/*
+ * Reader and link threads
+ */
+
+static void *eval_reader(void *arg)
+{
+    eval_t *e = arg;
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; ; i++) {
+        eval_slot_t *s = &e->slots[n++ % e->nr_slots];
+
+        while (i < e->nr_jobs && e->jobs[i].done) {
+            i++;
+        }
+        sem_wait_intr(&e->free);
+        if (e->stop) {
+            break;
+        }
+        if (i == e->nr_jobs) {
+            s->job = EVAL_END;
+            sem_post(&e->full);
+            break;
+        }
+        s->job = i;
+        s->res = bmlite_image_load_pgm(e->jobs[i].path, s->data, EVAL_MAX_IMAGE, &s->geometry);
+        sem_post(&e->full);
+    }
+
+    return NULL;
+}
+
+static fpc_bep_result_t eval_enroll(HCP_comm_t *chain, eval_t *e, eval_job_t *job,
+        eval_slot_t *s)
+{
+    eval_finger_t *f = &e->fingers[job->finger];
+    uint64_t start = time_us();
+    fpc_bep_result_t res;
+
+    if (job->first) {
+        bool used;
+
+        f->remaining = UINT32_MAX;
+        f->enroll_us = 0;
+        // Template left by an interrupted run
+        res = bep_template_id_is_used(chain, f->id, &used);
+        if (res == FPC_BEP_RESULT_OK && used) {
+            res = bep_template_remove(chain, f->id);
+        }
+        if (res == FPC_BEP_RESULT_OK) {
+            res = bmlite_send_cmd(chain, CMD_ENROLL, ARG_START);
+        }
+        if (res != FPC_BEP_RESULT_OK) {
+            return res;
+        }
+        e->enrolling = true;
+    }
+
+    // Images after the enrollment is complete are not needed
+    if (f->remaining != 0 && s->res == FPC_BEP_RESULT_OK) {
+        res = bep_image_put(chain, s->data, s->geometry.size);
+        if (res == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_OK) {
+            res = bmlite_send_cmd(chain, CMD_ENROLL, ARG_ADD);
+        }
+        if (res != FPC_BEP_RESULT_OK) {
+            return res;
+        }
+        if (chain->bep_result == FPC_BEP_RESULT_OK &&
+            bmlite_get_arg(chain, ARG_COUNT) == FPC_BEP_RESULT_OK) {
+            memcpy(&f->remaining, chain->arg.data, sizeof(uint32_t));
+        }
+        e->images++;
+    }
+
+    if (job->last) {
+        e->enrolling = false;
+        res = bmlite_send_cmd(chain, CMD_ENROLL, ARG_FINISH);
+        if (res == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_OK &&
+            f->remaining == 0) {
+            res = bep_template_save(chain, f->id);
+            f->enrolled = res == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_OK;
+        }
+        if (res != FPC_BEP_RESULT_OK) {
+            return res;
+        }
+        f->done = true;
+        f->enroll_us += time_us() - start;
+        checkpoint_write(e, "enroll", f->name, NULL, f->id, f->enrolled, f->enroll_us);
+    } else {
+        f->enroll_us += time_us() - start;
+    }
+
+    return FPC_BEP_RESULT_OK;
+}
+
+static fpc_bep_result_t eval_probe(HCP_comm_t *chain, eval_t *e, eval_job_t *job,
+        eval_slot_t *s)
+{
+    eval_finger_t *f = &e->fingers[job->finger];
+    uint64_t start = time_us();
+    int32_t matched = EVAL_FAILED;
+    fpc_bep_result_t res;
+
+    if (s->res == FPC_BEP_RESULT_OK) {
+        res = bep_image_put(chain, s->data, s->geometry.size);
+        if (res == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_OK) {
+            res = bep_image_extract(chain);
+        }
+        if (res == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_OK) {
+            res = bep_identify(chain);
+        }
+        if (res != FPC_BEP_RESULT_OK) {
+            return res;
+        }
+        if (chain->bep_result == FPC_BEP_RESULT_OK &&
+            bmlite_get_arg(chain, ARG_MATCH) == FPC_BEP_RESULT_OK) {
+            matched = EVAL_NO_MATCH;
+            if (*(bool *)chain->arg.data &&
+                bmlite_get_arg(chain, ARG_ID) == FPC_BEP_RESULT_OK) {
+                matched = *(uint16_t *)chain->arg.data;
+            }
+        }
+        e->images++;
+    }
+
+    job->matched = matched;
+    job->done = true;
+    checkpoint_write(e, "probe", f->name, job->file, f->id, matched, time_us() - start);
+
+    return FPC_BEP_RESULT_OK;
+}
+
+static void eval_summary(eval_t *e, bmlite_eval_stats_t *st)
+{
+    if (e->fingers == NULL) {
+        return;
+    }
+    for (uint32_t f = 0; f < e->nr_fingers; f++) {
+        if (e->fingers[f].done) {
+            if (e->fingers[f].enrolled) {
+                st->enrolled++;
+            } else {
+                st->enroll_failed++;
+            }
+        }
+    }
+    st->fingers = e->nr_fingers;
+
+    for (uint32_t i = e->nr_enroll_jobs; i < e->nr_jobs; i++) {
+        eval_job_t *job = &e->jobs[i];
+        eval_finger_t *f = &e->fingers[job->finger];
+
+        if (!job->done) {
+            continue;
+        }
+        st->probes++;
+        if (job->matched == EVAL_FAILED) {
+            st->failed++;
+            continue;
+        }
+        if (f->enrolled) {
+            st->genuine++;
+            if (job->matched == f->id) {
+                st->genuine_match++;
+            } else {
+                st->false_reject++;
+            }
+        }
+        if (job->matched >= 0 && job->matched != f->id) {
+            st->false_match++;
+        }
+    }
+    st->images = e->images;
+    st->resumed = e->resumed;
+}
+
+fpc_bep_result_t bmlite_eval_run(HCP_comm_t *chain, const bmlite_eval_config_t *cfg,
+        bmlite_eval_stats_t *stats)
+{
+    bmlite_eval_stats_t st;
+    fpc_bep_result_t res;
+    bmlite_id_cache_t id_cache;
+    bool own_cache = false;
+    bool reader_started = false;
+    pthread_t reader;
+    uint64_t start;
+    eval_t e;
+
+    if (cfg->dir == NULL || cfg->prefetch == 0) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+
+    memset(&st, 0, sizeof(st));
+    memset(&e, 0, sizeof(e));
+    sem_init(&e.free, 0, cfg->prefetch);
+    sem_init(&e.full, 0, 0);
+    start = time_us();
+
+    // Stored fingers are checked by ID, attach a cache for the run if there is none
+    if (chain->id_cache == NULL) {
+        memset(&id_cache, 0, sizeof(id_cache));
+        chain->id_cache = &id_cache;
+        own_cache = true;
+    }
+
+    res = eval_scan(&e, cfg);
+    if (res != FPC_BEP_RESULT_OK) {
+        goto exit;
+    }
+    if (cfg->checkpoint) {
+        bool torn = checkpoint_load(&e, cfg->checkpoint);
+
+        res = checkpoint_verify(chain, &e);
+        if (res != FPC_BEP_RESULT_OK) {
+            goto exit;
+        }
+        e.checkpoint = fopen(cfg->checkpoint, "a");
+        if (e.checkpoint == NULL) {
+            res = FPC_BEP_RESULT_IO_ERROR;
+            goto exit;
+        }
+        if (torn) {
+            // Don't glue the first new result to a line torn by interruption
+            fputc('\n', e.checkpoint);
+        }
+    }
+
+    e.nr_slots = cfg->prefetch;
+    e.slots = malloc(e.nr_slots * sizeof(eval_slot_t));
+    if (e.slots == NULL) {
+        res = FPC_BEP_RESULT_NO_MEMORY;
+        goto exit;
+    }
+    res = image_create(chain);
+    if (res != FPC_BEP_RESULT_OK) {
+        goto exit;
+    }
+    if (pthread_create(&reader, NULL, eval_reader, &e) != 0) {
+        res = FPC_BEP_RESULT_NO_RESOURCE;
+        goto exit_image;
+    }
+    reader_started = true;
+
+    for (uint32_t n = 0; ; n++) {
+        eval_slot_t *s = &e.slots[n % e.nr_slots];
+        eval_job_t *job;
+        uint64_t t = time_us();
+
+        sem_wait_intr(&e.full);
+        st.stall_us += time_us() - t;
+        if (s->job == EVAL_END) {
+            break;
+        }
+        job = &e.jobs[s->job];
+
+        t = time_us();
+        if (job->enroll) {
+            res = eval_enroll(chain, &e, job, s);
+        } else {
+            res = eval_probe(chain, &e, job, s);
+        }
+        st.link_us += time_us() - t;
+        sem_post(&e.free);
+        if (res != FPC_BEP_RESULT_OK) {
+            break;
+        }
+    }
+
+    if (e.enrolling) {
+        // Close enrollment interrupted by an error, nothing is saved
+        bmlite_send_cmd(chain, CMD_ENROLL, ARG_FINISH);
+    }
+
+exit_image:
+    image_delete(chain);
+
+exit:
+    if (reader_started) {
+        e.stop = true;
+        sem_post(&e.free);
+        pthread_join(reader, NULL);
+    }
+    if (e.checkpoint) {
+        fclose(e.checkpoint);
+    }
+    eval_summary(&e, &st);
+    for (uint32_t i = 0; i < e.nr_jobs; i++) {
+        free(e.jobs[i].path);
+    }
+    free(e.jobs);
+    free(e.fingers);
+    free(e.slots);
+    sem_destroy(&e.free);
+    sem_destroy(&e.full);
+    if (own_cache) {
+        chain->id_cache = NULL;
+    }
+
+    st.total_us = time_us() - start;
+    if (stats) {
+        *stats = st;
+    }
+    return res;
+}
@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    bmlite_gallery.c
+ * @brief   Host-side template gallery for 1:N identification.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bmlite_if.h"
+#include "bmlite_gallery.h"
+
+/** Hits of all entries are halved every DECAY_PERIOD identifications per slot */
+#define DECAY_PERIOD 16
+
+/*
+ * g->order keeps all entries sorted by hits, most used first. Only one entry
+ * gets a hit per identification and decay keeps the order, so the order is
+ * maintained by moving the matched entry towards the head.
+ */
+
+static void order_promote(bmlite_gallery_t *g, uint32_t idx)
+{
+    uint32_t pos = 0;
+
+    while (g->order[pos] != idx) {
+        pos++;
+    }
+    while (pos > 0 && g->entries[g->order[pos - 1]].hits < g->entries[idx].hits) {
+        g->order[pos] = g->order[pos - 1];
+        pos--;
+    }
+    g->order[pos] = idx;
+}
+
+static void gallery_hit(bmlite_gallery_t *g, uint32_t idx)
+{
+    bmlite_gallery_entry_t *e = &g->entries[idx];
+
+    e->hits++;
+    e->last_used = g->clock;
+    order_promote(g, idx);
+}
+
+static void gallery_decay(bmlite_gallery_t *g)
+{
+    uint32_t period = (g->nr_slots > 4 ? g->nr_slots : 4) * DECAY_PERIOD;
+
+    if (g->clock % period == 0) {
+        for (uint32_t i = 0; i < g->nr_entries; i++) {
+            g->entries[i].hits /= 2;
+        }
+    }
+}
+
+static fpc_bep_result_t slot_store(HCP_comm_t *chain, bmlite_gallery_t *g, uint16_t slot,
+        uint32_t idx)
+{
+    fpc_bep_result_t bep_result;
+    int32_t prev = g->slots[slot];
+
+    if (prev >= 0) {
+        g->entries[prev].slot = -1;
+        g->slots[slot] = -1;
+        bep_template_remove(chain, g->slot_base + slot);
+    }
+
+    // Template to store must be in BM-Lite RAM already
+    bep_result = bep_template_save(chain, g->slot_base + slot);
+    if (bep_result != FPC_BEP_RESULT_OK || chain->bep_result != FPC_BEP_RESULT_OK) {
+        return bep_result ? bep_result : chain->bep_result;
+    }
+    g->slots[slot] = idx;
+    g->entries[idx].slot = slot;
+
+    return FPC_BEP_RESULT_OK;
+}
+
+/* Free slot or slot of least frequently, then least recently used entry */
+static int32_t slot_victim(bmlite_gallery_t *g)
+{
+    int32_t victim = -1;
+
+    for (uint16_t i = 0; i < g->nr_slots; i++) {
+        bmlite_gallery_entry_t *e, *v;
+
+        if (g->slots[i] < 0) {
+            return i;
+        }
+        if (victim < 0) {
+            victim = i;
+            continue;
+        }
+        e = &g->entries[g->slots[i]];
+        v = &g->entries[g->slots[victim]];
+        if (e->hits < v->hits || (e->hits == v->hits && e->last_used < v->last_used)) {
+            victim = i;
+        }
+    }
+    return victim;
+}
+
+fpc_bep_result_t bmlite_gallery_init(bmlite_gallery_t *g, uint16_t slot_base, uint16_t nr_slots)
+{
+    memset(g, 0, sizeof(bmlite_gallery_t));
+    g->slot_base = slot_base;
+    g->nr_slots = nr_slots;
+
+    if (nr_slots) {
+        g->slots = malloc(nr_slots * sizeof(int32_t));
+        if (g->slots == NULL) {
+            return FPC_BEP_RESULT_NO_MEMORY;
+        }
+        for (uint16_t i = 0; i < nr_slots; i++) {
+            g->slots[i] = -1;
+        }
+    }
+
+    return FPC_BEP_RESULT_OK;
+}
+
+void bmlite_gallery_free(bmlite_gallery_t *g)
+{
+    for (uint32_t i = 0; i < g->nr_entries; i++) {
+        free(g->entries[i].data);
+    }
+    free(g->entries);
+    free(g->order);
+    free(g->slots);
+    memset(g, 0, sizeof(bmlite_gallery_t));
+}
+
+fpc_bep_result_t bmlite_gallery_add(bmlite_gallery_t *g, uint32_t id, const uint8_t *data,
+        uint16_t size)
+{
+    bmlite_gallery_entry_t *e;
+
+    if (g->nr_entries == g->max_entries) {
+        uint32_t max = g->max_entries ? g->max_entries * 2 : 64;
+        bmlite_gallery_entry_t *entries = realloc(g->entries, max * sizeof(bmlite_gallery_entry_t));
+        if (entries == NULL) {
+            return FPC_BEP_RESULT_NO_MEMORY;
+        }
+        g->entries = entries;
+        uint32_t *order = realloc(g->order, max * sizeof(uint32_t));
+        if (order == NULL) {
+            return FPC_BEP_RESULT_NO_MEMORY;
+        }
+        g->order = order;
+        g->max_entries = max;
+    }
+
+    e = &g->entries[g->nr_entries];
+    e->data = malloc(size);
+    if (e->data == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    memcpy(e->data, data, size);
+    e->id = id;
+    e->size = size;
+    e->hits = 0;
+    e->last_used = 0;
+    e->slot = -1;
+
+    // New entry has no hits, so it goes to the tail
+    g->order[g->nr_entries] = g->nr_entries;
+    g->nr_entries++;
+
+    return FPC_BEP_RESULT_OK;
+}
+
+fpc_bep_result_t bmlite_gallery_sync(HCP_comm_t *chain, bmlite_gallery_t *g)
+{
+    fpc_bep_result_t bep_result;
+
+    for (uint16_t i = 0; i < g->nr_slots; i++) {
+        if (g->slots[i] >= 0) {
+            g->entries[g->slots[i]].slot = -1;
+            g->slots[i] = -1;
+        }
+        bep_template_remove(chain, g->slot_base + i);
+    }
+
+    for (uint16_t i = 0; i < g->nr_slots && i < g->nr_entries; i++) {
+        bmlite_gallery_entry_t *e = &g->entries[g->order[i]];
+
+        bep_result = bep_template_put(chain, e->data, e->size);
+        if (bep_result == FPC_BEP_RESULT_OK) {
+            bep_result = slot_store(chain, g, i, g->order[i]);
+        }
+        if (bep_result != FPC_BEP_RESULT_OK) {
+            return bep_result;
+        }
+    }
+    bep_template_remove_ram(chain);
+
+    return FPC_BEP_RESULT_OK;
+}
+
+fpc_bep_result_t bmlite_gallery_match(HCP_comm_t *chain, bmlite_gallery_t *g,
+        uint32_t *id, bool *match, uint32_t *streamed)
+{
+    fpc_bep_result_t bep_result;
+    uint32_t nr_streamed = 0;
+    int32_t found = -1;
+
+    *match = false;
+    g->clock++;
+    g->identifies++;
+
+    // Fast path: resident templates
+    if (g->nr_slots) {
+        bep_result = bep_identify(chain);
+        if (bep_result != FPC_BEP_RESULT_OK) {
+            return bep_result;
+        }
+        if (chain->bep_result == FPC_BEP_RESULT_OK &&
+            bmlite_get_arg(chain, ARG_MATCH) == FPC_BEP_RESULT_OK && *(bool *)chain->arg.data &&
+            bmlite_get_arg(chain, ARG_ID) == FPC_BEP_RESULT_OK) {
+            uint16_t storage_id = *(uint16_t *)chain->arg.data;
+            // Templates not owned by gallery are ignored
+            if (storage_id >= g->slot_base && storage_id < g->slot_base + g->nr_slots) {
+                found = g->slots[storage_id - g->slot_base];
+            }
+        }
+        if (found >= 0) {
+            g->resident_matches++;
+        }
+    }
+
+    // Slow path: stream the rest, most used first
+    for (uint32_t i = 0; i < g->nr_entries && found < 0; i++) {
+        uint32_t idx = g->order[i];
+        bmlite_gallery_entry_t *e = &g->entries[idx];
+        bool m;
+
+        if (e->slot >= 0) {
+            continue;
+        }
+
+        bep_result = bep_template_put(chain, e->data, e->size);
+        if (bep_result == FPC_BEP_RESULT_OK) {
+            bep_result = bep_match(chain, &m);
+        }
+        if (bep_result != FPC_BEP_RESULT_OK) {
+            return bep_result;
+        }
+        nr_streamed++;
+
+        if (chain->bep_result == FPC_BEP_RESULT_OK && m) {
+            found = idx;
+            g->streamed_matches++;
+        }
+    }
+    g->streamed_templates += nr_streamed;
+    if (streamed) {
+        *streamed = nr_streamed;
+    }
+
+    if (found >= 0) {
+        bmlite_gallery_entry_t *e = &g->entries[found];
+
+        gallery_hit(g, found);
+        *match = true;
+        *id = e->id;
+
+        // Matched template is in RAM, promote it if it's used more than the victim
+        if (e->slot < 0 && g->nr_slots) {
+            int32_t victim = slot_victim(g);
+            if (g->slots[victim] < 0 || g->entries[g->slots[victim]].hits <= e->hits) {
+                slot_store(chain, g, victim, found);
+            }
+        }
+    }
+    if (nr_streamed) {
+        bep_template_remove_ram(chain);
+    }
+    gallery_decay(g);
+
+    return FPC_BEP_RESULT_OK;
+}
+
+fpc_bep_result_t bmlite_gallery_identify(HCP_comm_t *chain, bmlite_gallery_t *g,
+        uint16_t timeout, uint32_t *id, bool *match, uint32_t *streamed)
+{
+    fpc_bep_result_t bep_result;
+
+    *match = false;
+    if (streamed) {
+        *streamed = 0;
+    }
+
+    bep_result = bep_capture(chain, timeout);
+    if (bep_result != FPC_BEP_RESULT_OK || chain->bep_result != FPC_BEP_RESULT_OK) {
+        return bep_result;
+    }
+    bep_result = bep_image_extract(chain);
+    if (bep_result != FPC_BEP_RESULT_OK || chain->bep_result != FPC_BEP_RESULT_OK) {
+        return bep_result;
+    }
+
+    return bmlite_gallery_match(chain, g, id, match, streamed);
+}
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    bmlite_harvest.c
+ * @brief   Continuous image capture for sensor QA.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bmlite_if.h"
+#include "bmlite_harvest.h"
+
+typedef struct {
+    uint32_t frame;
+    uint8_t *data;
+} harvest_slot_t;
+
+/*
+ * Single producer, single consumer ring. head is advanced by the capturing
+ * thread, tail by the writer. Every queued frame and the end of harvest
+ * are signalled by one post of queued.
+ */
+typedef struct {
+    const bmlite_harvest_config_t *cfg;
+    harvest_slot_t *slots;
+    uint8_t *images;
+    bmlite_image_geometry_t geometry;
+    uint32_t head;
+    uint32_t tail;
+    sem_t queued;
+    sem_t freed;
+
+    /* Updated by the writer */
+    uint32_t stored;
+    uint32_t failed;
+    uint64_t store_us;
+} harvest_t;
+
+static uint64_t time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sem_wait_intr(sem_t *sem)
+{
+    while (sem_wait(sem) < 0 && errno == EINTR);
+}
+
+static void *harvest_writer(void *arg)
+{
+    harvest_t *h = arg;
+
+    for (;;) {
+        uint32_t tail = h->tail;
+        harvest_slot_t *slot;
+        uint64_t start;
+
+        sem_wait_intr(&h->queued);
+        if (tail == __atomic_load_n(&h->head, __ATOMIC_ACQUIRE)) {
+            // Nothing queued after the end was signalled
+            break;
+        }
+        slot = &h->slots[tail % h->cfg->ring_size];
+
+        start = time_us();
+        if (h->cfg->store(h->cfg->ctx, slot->frame, slot->data, &h->geometry) ==
+                FPC_BEP_RESULT_OK) {
+            h->stored++;
+        } else {
+            h->failed++;
+        }
+        h->store_us += time_us() - start;
+
+        __atomic_store_n(&h->tail, tail + 1, __ATOMIC_RELEASE);
+        sem_post(&h->freed);
+    }
+
+    return NULL;
+}
+
+static fpc_bep_result_t harvest_alloc(harvest_t *h)
+{
+    uint32_t image_size = h->geometry.size;
+    uint32_t n = h->cfg->ring_size;
+
+    h->slots = calloc(n, sizeof(harvest_slot_t));
+    h->images = malloc((size_t)n * image_size);
+    if (h->slots == NULL || h->images == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        h->slots[i].data = h->images + (size_t)i * image_size;
+    }
+
+    return FPC_BEP_RESULT_OK;
+}
+
+/* Returns false if the ring is full and the frame must be dropped */
+static bool harvest_wait_free(harvest_t *h)
+{
+    while (h->head - __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE) == h->cfg->ring_size) {
+        if (!h->cfg->wait_free) {
+            return false;
+        }
+        sem_wait_intr(&h->freed);
+    }
+    return true;
+}
+
+fpc_bep_result_t bmlite_harvest(HCP_comm_t *chain, const bmlite_harvest_config_t *cfg,
+        bmlite_harvest_stats_t *stats)
+{
+    bmlite_harvest_stats_t st;
+    fpc_bep_result_t res = FPC_BEP_RESULT_OK;
+    bool writer_started = false;
+    pthread_t writer;
+    uint64_t start;
+    harvest_t h;
+
+    if (cfg->ring_size == 0 || cfg->store == NULL) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+
+    memset(&st, 0, sizeof(st));
+    memset(&h, 0, sizeof(h));
+    h.cfg = cfg;
+    sem_init(&h.queued, 0, 0);
+    sem_init(&h.freed, 0, 0);
+    start = time_us();
+
+    // Keep one image allocated on BM-Lite for all frames
+    res = image_create(chain);
+    if (res != FPC_BEP_RESULT_OK) {
+        goto exit;
+    }
+
+    while (cfg->frames == 0 || st.frames < cfg->frames) {
+        uint64_t t = time_us();
+        harvest_slot_t *slot;
+
+        res = bep_capture(chain, cfg->timeout);
+        if (res == FPC_BEP_RESULT_OK && chain->bep_result != FPC_BEP_RESULT_OK) {
+            // No finger
+            st.link_us += time_us() - t;
+            st.timeouts++;
+            continue;
+        }
+        if (res == FPC_BEP_RESULT_TIMEOUT) {
+            st.link_us += time_us() - t;
+            st.timeouts++;
+            res = FPC_BEP_RESULT_OK;
+            continue;
+        }
+        if (res != FPC_BEP_RESULT_OK) {
+            break;
+        }
+
+        if (h.slots == NULL) {
+            // Geometry is the same for all frames
+            res = bep_image_get_geometry(chain, &h.geometry);
+            if (res == FPC_BEP_RESULT_OK) {
+                res = harvest_alloc(&h);
+            }
+            if (res == FPC_BEP_RESULT_OK &&
+                pthread_create(&writer, NULL, harvest_writer, &h) != 0) {
+                res = FPC_BEP_RESULT_NO_RESOURCE;
+            }
+            if (res != FPC_BEP_RESULT_OK) {
+                break;
+            }
+            writer_started = true;
+        }
+
+        st.frames++;
+        if (!harvest_wait_free(&h)) {
+            st.link_us += time_us() - t;
+            st.dropped++;
+            continue;
+        }
+
+        slot = &h.slots[h.head % cfg->ring_size];
+        slot->frame = st.frames - 1;
+        res = bep_image_get(chain, slot->data, h.geometry.size);
+        st.link_us += time_us() - t;
+        if (res != FPC_BEP_RESULT_OK) {
+            break;
+        }
+        __atomic_store_n(&h.head, h.head + 1, __ATOMIC_RELEASE);
+        sem_post(&h.queued);
+    }
+
+    image_delete(chain);
+
+exit:
+    if (writer_started) {
+        // Let the writer drain the ring and stop
+        sem_post(&h.queued);
+        pthread_join(writer, NULL);
+    }
+    sem_destroy(&h.queued);
+    sem_destroy(&h.freed);
+    free(h.slots);
+    free(h.images);
+
+    st.stored = h.stored;
+    st.failed = h.failed;
+    st.store_us = h.store_us;
+    st.total_us = time_us() - start;
+    if (stats) {
+        *stats = st;
+    }
+    return res;
+}
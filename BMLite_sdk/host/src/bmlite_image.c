@@ -0,0 +1,561 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    bmlite_image.c
+ * @brief   Export of BM-Lite images to PGM and PNG files.
+ */
+
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "bmlite_image.h"
+#include "fpc_crc.h"
+
+/*
+ * Deflate with fixed Huffman codes (RFC 1951, 3.2.6)
+ */
+
+#define HASH_BITS 14
+#define WINDOW_SIZE 32768
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+
+static const uint16_t len_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+typedef struct {
+    uint8_t *out;
+    size_t len;
+    uint64_t bits;
+    uint32_t nr_bits;
+} bit_writer_t;
+
+static void put_bits(bit_writer_t *w, uint32_t value, uint32_t nr_bits)
+{
+    w->bits |= (uint64_t)value << w->nr_bits;
+    w->nr_bits += nr_bits;
+    while (w->nr_bits >= 8) {
+        w->out[w->len++] = (uint8_t)w->bits;
+        w->bits >>= 8;
+        w->nr_bits -= 8;
+    }
+}
+
+/* Huffman codes are packed starting from the most significant bit */
+static void put_code(bit_writer_t *w, uint32_t code, uint32_t nr_bits)
+{
+    uint32_t rev = 0;
+
+    for (uint32_t i = 0; i < nr_bits; i++) {
+        rev = (rev << 1) | ((code >> i) & 1);
+    }
+    put_bits(w, rev, nr_bits);
+}
+
+static void put_symbol(bit_writer_t *w, uint32_t sym)
+{
+    if (sym < 144) {
+        put_code(w, 0x30 + sym, 8);
+    } else if (sym < 256) {
+        put_code(w, 0x190 + sym - 144, 9);
+    } else if (sym < 280) {
+        put_code(w, sym - 256, 7);
+    } else {
+        put_code(w, 0xc0 + sym - 280, 8);
+    }
+}
+
+static void put_match(bit_writer_t *w, uint32_t len, uint32_t dist)
+{
+    uint32_t i = 0;
+
+    while (i < 28 && len_base[i + 1] <= len) {
+        i++;
+    }
+    put_symbol(w, 257 + i);
+    put_bits(w, len - len_base[i], len_extra[i]);
+
+    i = 0;
+    while (i < 29 && dist_base[i + 1] <= dist) {
+        i++;
+    }
+    put_code(w, i, 5);
+    put_bits(w, dist - dist_base[i], dist_extra[i]);
+}
+
+static uint32_t hash3(const uint8_t *p)
+{
+    uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* Output buffer must have at least deflate_bound(size) bytes */
+static size_t deflate_bound(size_t size)
+{
+    // Literals take at most 9 bits
+    return size + size / 8 + 16;
+}
+
+static size_t deflate_fixed(const uint8_t *in, size_t size, uint8_t *out)
+{
+    int32_t head[1 << HASH_BITS];
+    bit_writer_t w = { .out = out };
+    size_t i = 0;
+
+    memset(head, 0xff, sizeof(head));
+
+    // Single final block with fixed codes
+    put_bits(&w, 1, 1);
+    put_bits(&w, 1, 2);
+
+    while (i < size) {
+        uint32_t best = 0;
+        uint32_t dist = 0;
+
+        if (i + MIN_MATCH <= size) {
+            uint32_t h = hash3(in + i);
+            int32_t cand = head[h];
+
+            head[h] = i;
+            if (cand >= 0 && i - cand <= WINDOW_SIZE) {
+                uint32_t max = size - i < MAX_MATCH ? size - i : MAX_MATCH;
+                uint32_t len = 0;
+
+                while (len < max && in[cand + len] == in[i + len]) {
+                    len++;
+                }
+                if (len >= MIN_MATCH) {
+                    best = len;
+                    dist = i - cand;
+                }
+            }
+        }
+
+        if (best) {
+            put_match(&w, best, dist);
+            for (uint32_t k = 1; k < best && i + k + MIN_MATCH <= size; k++) {
+                head[hash3(in + i + k)] = i + k;
+            }
+            i += best;
+        } else {
+            put_symbol(&w, in[i]);
+            i++;
+        }
+    }
+    put_symbol(&w, 256);
+    if (w.nr_bits) {
+        put_bits(&w, 0, 8 - w.nr_bits);
+    }
+
+    return w.len;
+}
+
+static uint32_t adler32(const uint8_t *p, size_t size)
+{
+    uint32_t s1 = 1, s2 = 0;
+
+    while (size) {
+        // Largest block without overflow of s2
+        size_t n = size < 5552 ? size : 5552;
+
+        size -= n;
+        while (n--) {
+            s1 += *p++;
+            s2 += s1;
+        }
+        s1 %= 65521;
+        s2 %= 65521;
+    }
+    return (s2 << 16) | s1;
+}
+
+/*
+ * PNG
+ */
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static bool png_chunk(FILE *f, const char *type, const uint8_t *data, uint32_t size)
+{
+    uint8_t buf[8];
+    uint32_t crc;
+
+    put_be32(buf, size);
+    memcpy(buf + 4, type, 4);
+    crc = fpc_crc(0, type, 4);
+    crc = fpc_crc(crc, data, size);
+    if (fwrite(buf, 8, 1, f) != 1 || (size && fwrite(data, size, 1, f) != 1)) {
+        return false;
+    }
+    put_be32(buf, crc);
+    return fwrite(buf, 4, 1, f) == 1;
+}
+
+static uint32_t filter_cost(const uint8_t *row, uint32_t width)
+{
+    uint32_t cost = 0;
+
+    // Filtered bytes are signed deltas
+    for (uint32_t x = 0; x < width; x++) {
+        int8_t d = row[x];
+        cost += d < 0 ? -d : d;
+    }
+    return cost;
+}
+
+/*
+ * Rows are filtered with Sub or Up, whichever gives smaller deltas. Both are
+ * plain loops over the row which the compiler vectorizes.
+ */
+static void png_filter(const uint8_t *image, uint32_t width, uint32_t height, uint8_t *out,
+        uint8_t *tmp)
+{
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *row = image + (size_t)y * width;
+        const uint8_t *prev;
+        uint8_t *dst = out + (size_t)y * (width + 1);
+
+        // Sub
+        dst[0] = 1;
+        dst[1] = row[0];
+        for (uint32_t x = 1; x < width; x++) {
+            dst[x + 1] = row[x] - row[x - 1];
+        }
+        if (y == 0) {
+            continue;
+        }
+
+        // Up
+        prev = row - width;
+        for (uint32_t x = 0; x < width; x++) {
+            tmp[x] = row[x] - prev[x];
+        }
+        if (filter_cost(tmp, width) < filter_cost(dst + 1, width)) {
+            dst[0] = 2;
+            memcpy(dst + 1, tmp, width);
+        }
+    }
+}
+
+fpc_bep_result_t bmlite_image_write_png(FILE *f, const uint8_t *image,
+        const bmlite_image_geometry_t *geometry)
+{
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    uint32_t width = geometry->width;
+    uint32_t height = geometry->height;
+    size_t raw_size = (size_t)(width + 1) * height;
+    uint8_t ihdr[13], phys[9];
+    uint8_t *raw, *zdata;
+    size_t zsize;
+    uint32_t ppm;
+    bool ok;
+
+    raw = malloc(raw_size + width);
+    zdata = malloc(deflate_bound(raw_size) + 6);
+    if (raw == NULL || zdata == NULL) {
+        free(raw);
+        free(zdata);
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+
+    png_filter(image, width, height, raw, raw + raw_size);
+
+    // zlib stream: deflate, no preset dictionary, fastest compression
+    zdata[0] = 0x78;
+    zdata[1] = 0x01;
+    zsize = 2 + deflate_fixed(raw, raw_size, zdata + 2);
+    put_be32(zdata + zsize, adler32(raw, raw_size));
+    zsize += 4;
+
+    put_be32(ihdr, width);
+    put_be32(ihdr + 4, height);
+    ihdr[8] = 8;    // Bit depth
+    ihdr[9] = 0;    // Grayscale
+    ihdr[10] = 0;   // Deflate
+    ihdr[11] = 0;   // Adaptive filtering
+    ihdr[12] = 0;   // No interlace
+
+    // Pixels per meter
+    ppm = (geometry->dpi * 10000 + 127) / 254;
+    put_be32(phys, ppm);
+    put_be32(phys + 4, ppm);
+    phys[8] = 1;
+
+    ok = fwrite(signature, sizeof(signature), 1, f) == 1 &&
+         png_chunk(f, "IHDR", ihdr, sizeof(ihdr)) &&
+         png_chunk(f, "pHYs", phys, sizeof(phys)) &&
+         png_chunk(f, "IDAT", zdata, zsize) &&
+         png_chunk(f, "IEND", NULL, 0);
+
+    free(raw);
+    free(zdata);
+
+    return ok ? FPC_BEP_RESULT_OK : FPC_BEP_RESULT_IO_ERROR;
+}
+
+/*
+ * PGM
+ */
+
+fpc_bep_result_t bmlite_image_write_pgm(FILE *f, const uint8_t *image,
+        const bmlite_image_geometry_t *geometry)
+{
+    size_t size = (size_t)geometry->width * geometry->height;
+
+    if (fprintf(f, "P5\n%d %d\n255\n", geometry->width, geometry->height) < 0 ||
+        fwrite(image, size, 1, f) != 1) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    return FPC_BEP_RESULT_OK;
+}
+
+fpc_bep_result_t bmlite_image_load_pgm(const char *path, uint8_t *image, uint32_t size,
+        bmlite_image_geometry_t *geometry)
+{
+    fpc_bep_result_t res = FPC_BEP_RESULT_INVALID_FORMAT;
+    unsigned width, height, maxval;
+    FILE *f;
+
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    // Single whitespace separates header from data
+    if (fscanf(f, "P5 %u %u %u", &width, &height, &maxval) == 3 && maxval == 255 &&
+        width <= UINT16_MAX && height <= UINT16_MAX && fgetc(f) != EOF) {
+        if ((uint64_t)width * height > size) {
+            res = FPC_BEP_RESULT_NO_MEMORY;
+        } else if (fread(image, (size_t)width * height, 1, f) == 1) {
+            geometry->width = width;
+            geometry->height = height;
+            geometry->size = width * height;
+            res = FPC_BEP_RESULT_OK;
+        }
+    }
+    fclose(f);
+
+    return res;
+}
+
+static bool has_suffix(const char *s, const char *suffix)
+{
+    size_t len = strlen(s), slen = strlen(suffix);
+
+    return len > slen && strcmp(s + len - slen, suffix) == 0;
+}
+
+fpc_bep_result_t bmlite_image_save(const char *path, const uint8_t *image,
+        const bmlite_image_geometry_t *geometry)
+{
+    fpc_bep_result_t res;
+    bool png;
+    FILE *f;
+
+    if (has_suffix(path, ".png")) {
+        png = true;
+    } else if (has_suffix(path, ".pgm")) {
+        png = false;
+    } else {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+
+    f = fopen(path, "wb");
+    if (f == NULL) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    res = png ? bmlite_image_write_png(f, image, geometry) :
+                bmlite_image_write_pgm(f, image, geometry);
+    if (fclose(f) != 0 && res == FPC_BEP_RESULT_OK) {
+        res = FPC_BEP_RESULT_IO_ERROR;
+    }
+
+    return res;
+}
+
+/*
+ * Directory export
+ */
+
+typedef struct {
+    const char *src_dir;
+    const char *dst_dir;
+    bmlite_image_format_t format;
+    uint16_t dpi;
+    char **names;
+    uint32_t nr_names;
+    /** Next file to convert, shared by workers */
+    uint32_t next;
+    uint32_t files;
+    uint32_t failed;
+} export_job_t;
+
+static fpc_bep_result_t export_file(export_job_t *job, const char *name)
+{
+    bmlite_image_geometry_t geometry = { .dpi = job->dpi };
+    char src[PATH_MAX], dst[PATH_MAX];
+    fpc_bep_result_t res;
+    struct stat st;
+    uint8_t *image;
+
+    snprintf(src, sizeof(src), "%s/%s", job->src_dir, name);
+    snprintf(dst, sizeof(dst), "%s/%.*s%s", job->dst_dir, (int)(strlen(name) - 4), name,
+             job->format == BMLITE_IMAGE_PNG ? ".png" : ".pgm");
+
+    if (stat(src, &st) < 0) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    // Data is never larger than the file
+    image = malloc(st.st_size);
+    if (image == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    res = bmlite_image_load_pgm(src, image, st.st_size, &geometry);
+    if (res == FPC_BEP_RESULT_OK) {
+        res = bmlite_image_save(dst, image, &geometry);
+    }
+    free(image);
+
+    return res;
+}
+
+static void *export_worker(void *arg)
+{
+    export_job_t *job = arg;
+    uint32_t i;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nr_names) {
+        if (export_file(job, job->names[i]) == FPC_BEP_RESULT_OK) {
+            __atomic_fetch_add(&job->files, 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+fpc_bep_result_t bmlite_image_export_dir(const char *src_dir, const char *dst_dir,
+        bmlite_image_format_t format, uint16_t dpi, uint32_t threads,
+        bmlite_image_export_stats_t *stats)
+{
+    export_job_t job = {
+        .src_dir = src_dir,
+        .dst_dir = dst_dir,
+        .format = format,
+        .dpi = dpi,
+    };
+    fpc_bep_result_t res = FPC_BEP_RESULT_OK;
+    uint32_t max_names = 0;
+    pthread_t *workers;
+    uint32_t started = 0;
+    struct timespec t0, t1;
+    struct dirent *e;
+    DIR *dir;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    dir = opendir(src_dir);
+    if (dir == NULL) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    while ((e = readdir(dir)) != NULL) {
+        if (!has_suffix(e->d_name, ".pgm")) {
+            continue;
+        }
+        if (job.nr_names == max_names) {
+            char **names;
+            max_names = max_names ? max_names * 2 : 256;
+            names = realloc(job.names, max_names * sizeof(char *));
+            if (names == NULL) {
+                res = FPC_BEP_RESULT_NO_MEMORY;
+                break;
+            }
+            job.names = names;
+        }
+        job.names[job.nr_names] = strdup(e->d_name);
+        if (job.names[job.nr_names] == NULL) {
+            res = FPC_BEP_RESULT_NO_MEMORY;
+            break;
+        }
+        job.nr_names++;
+    }
+    closedir(dir);
+
+    if (threads == 0) {
+        threads = 1;
+    }
+    workers = malloc(threads * sizeof(pthread_t));
+    if (workers == NULL) {
+        res = FPC_BEP_RESULT_NO_MEMORY;
+    }
+    if (res == FPC_BEP_RESULT_OK) {
+        for (started = 0; started < threads; started++) {
+            if (pthread_create(&workers[started], NULL, export_worker, &job) != 0) {
+                break;
+            }
+        }
+        if (started == 0) {
+            res = FPC_BEP_RESULT_NO_RESOURCE;
+        }
+    }
+    for (uint32_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    for (uint32_t i = 0; i < job.nr_names; i++) {
+        free(job.names[i]);
+    }
+    free(job.names);
+
+    if (res == FPC_BEP_RESULT_OK && job.failed) {
+        res = FPC_BEP_RESULT_IO_ERROR;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (stats) {
+        stats->files = job.files;
+        stats->failed = job.failed;
+        stats->total_us = (t1.tv_sec - t0.tv_sec) * 1000000ull + (t1.tv_nsec - t0.tv_nsec) / 1000;
+    }
+    return res;
+}
@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    bmlite_multi.c
+ * @brief   First-match identification across several sensors.
+ */
+
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bmlite_hal.h"
+#include "bmlite_if.h"
+#include "bmlite_multi.h"
+
+#define CAPTURE_ATTEMPTS 3
+
+typedef enum {
+    SENSOR_CAPTURE,
+    SENSOR_EXTRACT,
+    SENSOR_IDENTIFY,
+    SENSOR_DONE,
+} sensor_state_t;
+
+typedef struct multi multi_t;
+
+typedef struct {
+    multi_t *m;
+    HCP_comm_t *chain;
+    int index;
+    sensor_state_t state;
+    uint32_t attempts;
+    /** Capture cancelled because another sensor got the finger */
+    bool lost;
+    fpc_bep_result_t result;
+    uint32_t prev_timeout;
+    hal_tick_t prev_deadline;
+} multi_sensor_t;
+
+struct multi {
+    multi_sensor_t *sensors;
+    uint32_t count;
+    uint16_t timeout;
+    /** Sensor which captured the finger first, -1 - none yet */
+    int winner;
+    hal_tick_t start;
+    bmlite_multi_result_t *result;
+};
+
+static void sensor_done(HCP_comm_t *chain, fpc_bep_result_t result, void *ctx);
+
+static void sensor_finish(multi_sensor_t *s, fpc_bep_result_t result)
+{
+    s->state = SENSOR_DONE;
+    s->result = result;
+}
+
+static void sensor_submit(multi_sensor_t *s, sensor_state_t state)
+{
+    fpc_bep_result_t res;
+
+    s->state = state;
+    res = bmlite_submit(s->chain, sensor_done, s);
+    if (res != FPC_BEP_RESULT_OK) {
+        sensor_finish(s, res);
+    }
+}
+
+static void capture_start(multi_sensor_t *s)
+{
+    HCP_comm_t *chain = s->chain;
+    // Retries share the time limit
+    uint16_t timeout = HCP_MIN(bmlite_deadline_budget(chain, s->m->timeout), UINT16_MAX);
+    fpc_bep_result_t res;
+
+    s->attempts++;
+    chain->phy_rx_timeout = timeout;
+    res = bmlite_init_cmd(chain, CMD_CAPTURE, ARG_NONE);
+    if (res == FPC_BEP_RESULT_OK) {
+        res = bmlite_add_arg(chain, ARG_TIMEOUT, &timeout, sizeof(timeout));
+    }
+    if (res != FPC_BEP_RESULT_OK) {
+        sensor_finish(s, res);
+        return;
+    }
+    sensor_submit(s, SENSOR_CAPTURE);
+}
+
+static void capture_won(multi_sensor_t *s)
+{
+    multi_t *m = s->m;
+
+    m->winner = s->index;
+    m->result->sensor = s->index;
+    m->result->capture_ms = hal_timebase_get_tick() - m->start;
+
+    // Captures of the other sensors are not needed any more
+    for (uint32_t i = 0; i < m->count; i++) {
+        if (m->sensors[i].state == SENSOR_CAPTURE && (int)i != s->index) {
+            m->sensors[i].lost = true;
+            bmlite_cancel(m->sensors[i].chain);
+        }
+    }
+
+    s->chain->phy_rx_timeout = s->prev_timeout;
+    if (bmlite_init_cmd(s->chain, CMD_IMAGE, ARG_EXTRACT) == FPC_BEP_RESULT_OK) {
+        sensor_submit(s, SENSOR_EXTRACT);
+    } else {
+        sensor_finish(s, FPC_BEP_RESULT_NO_MEMORY);
+    }
+}
+
+static void identify_parse(multi_sensor_t *s)
+{
+    const bmlite_timing_t *timing = s->chain->timing ? s->chain->timing : &bmlite_timing_default;
+    bmlite_multi_result_t *result = s->m->result;
+    HCP_comm_t *chain = s->chain;
+
+    if (bmlite_get_arg(chain, ARG_MATCH) != FPC_BEP_RESULT_OK) {
+        sensor_finish(s, FPC_BEP_RESULT_INVALID_ARGUMENT);
+        return;
+    }
+    result->match = *(bool *)chain->arg.data;
+    if (result->match) {
+        if (bmlite_get_arg(chain, ARG_ID) == FPC_BEP_RESULT_OK) {
+            result->template_id = *(uint16_t *)chain->arg.data;
+        }
+        // BM-Lite may be updating the matched template, as after bep_identify()
+        bmlite_hold_off(chain, timing->template_update_ms);
+    }
+    result->total_ms = hal_timebase_get_tick() - s->m->start;
+    sensor_finish(s, FPC_BEP_RESULT_OK);
+}
+
+/* Completion callback, called from bmlite_process() */
+static void sensor_done(HCP_comm_t *chain, fpc_bep_result_t result, void *ctx)
+{
+    multi_sensor_t *s = (multi_sensor_t *)ctx;
+    fpc_bep_result_t bep_result = chain->bep_result;
+
+    if (result != FPC_BEP_RESULT_OK) {
+        sensor_finish(s, result);
+        return;
+    }
+
+    switch (s->state) {
+        case SENSOR_CAPTURE:
+            if (bep_result == FPC_BEP_RESULT_OK) {
+                if (s->m->winner < 0) {
+                    capture_won(s);
+                } else {
+                    // Finger captured here too late, the other sensor is used
+                    sensor_finish(s, FPC_BEP_RESULT_CANCELLED);
+                }
+            } else if (bep_result != FPC_BEP_RESULT_TIMEOUT &&
+                       bep_result != FPC_BEP_RESULT_CANCELLED &&
+                       s->m->winner < 0 && s->attempts < CAPTURE_ATTEMPTS &&
+                       bmlite_deadline_budget(chain, s->m->timeout) > 1) {
+                // Bad capture, finger may still be there
+                capture_start(s);
+            } else {
+                sensor_finish(s, bep_result);
+            }
+            break;
+        case SENSOR_EXTRACT:
+            if (bep_result == FPC_BEP_RESULT_OK &&
+                bmlite_init_cmd(chain, CMD_IDENTIFY, ARG_NONE) == FPC_BEP_RESULT_OK) {
+                sensor_submit(s, SENSOR_IDENTIFY);
+            } else {
+                sensor_finish(s, bep_result);
+            }
+            break;
+        case SENSOR_IDENTIFY:
+            if (bep_result == FPC_BEP_RESULT_OK) {
+                identify_parse(s);
+            } else {
+                sensor_finish(s, bep_result);
+            }
+            break;
+        default:
+            sensor_finish(s, FPC_BEP_RESULT_WRONG_STATE);
+            break;
+    }
+}
+
+/*
+ * Serve all sensors once and wait until some of them may have data.
+ * Returns false when all sensors are done.
+ */
+static bool multi_step(multi_t *m, struct pollfd *pfd)
+{
+    hal_tick_t now;
+    hal_tick_t deadline = 0;
+    uint32_t nfds = 0;
+    int timeout = -1;
+    bool active = false;
+
+    for (uint32_t i = 0; i < m->count; i++) {
+        multi_sensor_t *s = &m->sensors[i];
+        hal_tick_t d;
+        int fd;
+
+        if (s->state == SENSOR_DONE || !bmlite_process(s->chain)) {
+            continue;
+        }
+        active = true;
+        if (s->chain->cancel) {
+            // Cancellation is handled by the next bmlite_process() at once
+            timeout = 0;
+        }
+        d = bmlite_get_deadline(s->chain);
+        if (d && (deadline == 0 || d < deadline)) {
+            deadline = d;
+        }
+        fd = bmlite_get_fd(s->chain);
+        if (fd < 0) {
+            if (timeout < 0 || timeout > BMLITE_MULTI_POLL_INTERVAL) {
+                timeout = BMLITE_MULTI_POLL_INTERVAL;
+            }
+        } else {
+            pfd[nfds].fd = fd;
+            pfd[nfds].events = POLLPRI | POLLERR;
+            nfds++;
+        }
+    }
+    if (!active) {
+        return false;
+    }
+
+    if (deadline) {
+        now = hal_timebase_get_tick();
+        if (deadline <= now) {
+            timeout = 0;
+        } else if (timeout < 0 || deadline - now < (hal_tick_t)timeout) {
+            timeout = deadline - now;
+        }
+    }
+    if (timeout != 0) {
+        poll(pfd, nfds, timeout);
+    }
+
+    return true;
+}
+
+fpc_bep_result_t bmlite_multi_identify(HCP_comm_t **chains, uint32_t count, uint16_t timeout,
+        bmlite_multi_result_t *result)
+{
+    multi_t m;
+    struct pollfd *pfd;
+    fpc_bep_result_t res = FPC_BEP_RESULT_TIMEOUT;
+    bool cancelled = false;
+
+    memset(result, 0, sizeof(bmlite_multi_result_t));
+    result->sensor = -1;
+    if (count == 0) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+
+    m.sensors = calloc(count, sizeof(multi_sensor_t));
+    pfd = calloc(count, sizeof(struct pollfd));
+    if (m.sensors == NULL || pfd == NULL) {
+        free(m.sensors);
+        free(pfd);
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    m.count = count;
+    m.timeout = timeout;
+    m.winner = -1;
+    m.result = result;
+    m.start = hal_timebase_get_tick();
+
+    for (uint32_t i = 0; i < count; i++) {
+        multi_sensor_t *s = &m.sensors[i];
+
+        s->m = &m;
+        s->chain = chains[i];
+        s->index = i;
+        s->prev_timeout = chains[i]->phy_rx_timeout;
+        s->prev_deadline = bmlite_deadline_begin(chains[i], timeout);
+        capture_start(s);
+    }
+
+    while (multi_step(&m, pfd));
+
+    for (uint32_t i = 0; i < count; i++) {
+        multi_sensor_t *s = &m.sensors[i];
+
+        s->chain->phy_rx_timeout = s->prev_timeout;
+        bmlite_deadline_end(s->chain, s->prev_deadline);
+        if (s->lost) {
+            // The answer may have come before the cancel was sent
+            s->chain->cancel = 0;
+        }
+        if (s->result == FPC_BEP_RESULT_CANCELLED) {
+            cancelled = true;
+        } else if (s->result != FPC_BEP_RESULT_TIMEOUT && res == FPC_BEP_RESULT_TIMEOUT) {
+            // No sensor saw a finger, report the first failure
+            res = s->result;
+        }
+    }
+    if (m.winner >= 0) {
+        res = m.sensors[m.winner].result;
+    } else if (cancelled) {
+        res = FPC_BEP_RESULT_CANCELLED;
+    }
+
+    free(m.sensors);
+    free(pfd);
+
+    return res;
+}
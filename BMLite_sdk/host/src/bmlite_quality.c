@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    bmlite_quality.c
+ * @brief   Host-side image quality gate.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "bmlite_if.h"
+#include "bmlite_quality.h"
+
+/** Pixels per 128-bit vector of the SIMD kernels */
+#define QUALITY_LANES 16
+
+// A vector must not cross a block border, row_simd() adds it to one block
+#if BMLITE_QUALITY_BLOCK % QUALITY_LANES != 0
+#error BMLITE_QUALITY_BLOCK must be a multiple of QUALITY_LANES
+#endif
+
+const bmlite_quality_thresholds_t bmlite_quality_default_thresholds = {
+    .min_variance = 100.0f,
+    .min_contrast = 4.0f,
+    .min_coverage = 0.6f,
+    .max_saturation = 0.1f,
+    .block_contrast = 6.0f,
+};
+
+typedef struct {
+    uint64_t sum;
+    uint64_t sum_sq;
+    uint64_t grad;
+    uint32_t saturated;
+} row_acc_t;
+
+/*
+ * Accumulate pixels [x, width) of a row and horizontal differences of
+ * pixels from x on. Differences are also summed per block column.
+ */
+static void row_tail(const uint8_t *row, uint32_t x, uint32_t width,
+        row_acc_t *acc, uint32_t *block_grad)
+{
+    for (; x < width; x++) {
+        uint32_t p = row[x];
+
+        acc->sum += p;
+        acc->sum_sq += p * p;
+        acc->saturated += (p == 0 || p == 255);
+        if (x + 1 < width) {
+            uint32_t d = p > row[x + 1] ? p - row[x + 1] : row[x + 1] - p;
+            acc->grad += d;
+            block_grad[x / BMLITE_QUALITY_BLOCK] += d;
+        }
+    }
+}
+
+#if defined(__SSE2__)
+
+/* QUALITY_LANES pixels at a time, while the next pixel exists for the difference */
+static uint32_t row_simd(const uint8_t *row, uint32_t width, row_acc_t *acc,
+        uint32_t *block_grad)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi8((char)0xff);
+    __m128i sum = zero;
+    __m128i sum_sq = zero;
+    uint32_t x;
+
+    for (x = 0; x + QUALITY_LANES < width; x += QUALITY_LANES) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(row + x));
+        __m128i next = _mm_loadu_si128((const __m128i *)(row + x + 1));
+        __m128i lo = _mm_unpacklo_epi8(p, zero);
+        __m128i hi = _mm_unpackhi_epi8(p, zero);
+        __m128i sat = _mm_or_si128(_mm_cmpeq_epi8(p, zero), _mm_cmpeq_epi8(p, ones));
+        __m128i d;
+        uint32_t grad;
+
+        // |p - next| summed by halves
+        d = _mm_sad_epu8(p, next);
+        grad = _mm_cvtsi128_si32(d) + _mm_cvtsi128_si32(_mm_srli_si128(d, 8));
+        acc->grad += grad;
+        block_grad[x / BMLITE_QUALITY_BLOCK] += grad;
+
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(p, zero));
+        // Squares fit 32-bit lanes for rows up to 64K pixels
+        sum_sq = _mm_add_epi32(sum_sq, _mm_madd_epi16(lo, lo));
+        sum_sq = _mm_add_epi32(sum_sq, _mm_madd_epi16(hi, hi));
+        acc->saturated += __builtin_popcount(_mm_movemask_epi8(sat));
+    }
+
+    acc->sum += (uint64_t)_mm_cvtsi128_si32(sum) +
+            (uint64_t)_mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+    {
+        uint32_t lanes[4];
+
+        _mm_storeu_si128((__m128i *)lanes, sum_sq);
+        acc->sum_sq += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    return x;
+}
+
+#define QUALITY_KERNEL "sse2"
+#define QUALITY_HAVE_SIMD
+
+#elif defined(__ARM_NEON)
+
+static uint32_t row_simd(const uint8_t *row, uint32_t width, row_acc_t *acc,
+        uint32_t *block_grad)
+{
+    uint64x2_t sum = vdupq_n_u64(0);
+    uint64x2_t sum_sq = vdupq_n_u64(0);
+    uint64x2_t sat_count = vdupq_n_u64(0);
+    uint32_t x;
+
+    for (x = 0; x + QUALITY_LANES < width; x += QUALITY_LANES) {
+        uint8x16_t p = vld1q_u8(row + x);
+        uint8x16_t next = vld1q_u8(row + x + 1);
+        uint8x16_t sat = vorrq_u8(vceqq_u8(p, vdupq_n_u8(0)), vceqq_u8(p, vdupq_n_u8(255)));
+        uint16x8_t sq_lo = vmull_u8(vget_low_u8(p), vget_low_u8(p));
+        uint16x8_t sq_hi = vmull_u8(vget_high_u8(p), vget_high_u8(p));
+        uint64x2_t d = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(vabdq_u8(p, next))));
+        uint32_t grad = vgetq_lane_u64(d, 0) + vgetq_lane_u64(d, 1);
+
+        acc->grad += grad;
+        block_grad[x / BMLITE_QUALITY_BLOCK] += grad;
+
+        sum = vaddq_u64(sum, vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(p))));
+        sum_sq = vaddq_u64(sum_sq, vpaddlq_u32(vaddq_u32(vpaddlq_u16(sq_lo), vpaddlq_u16(sq_hi))));
+        sat_count = vaddq_u64(sat_count, vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(
+                vshrq_n_u8(sat, 7)))));
+    }
+
+    acc->sum += vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1);
+    acc->sum_sq += vgetq_lane_u64(sum_sq, 0) + vgetq_lane_u64(sum_sq, 1);
+    acc->saturated += vgetq_lane_u64(sat_count, 0) + vgetq_lane_u64(sat_count, 1);
+    return x;
+}
+
+#define QUALITY_KERNEL "neon"
+#define QUALITY_HAVE_SIMD
+
+#else
+
+#define QUALITY_KERNEL "generic"
+
+#endif
+
+static fpc_bep_result_t quality_compute(const uint8_t *image,
+        const bmlite_image_geometry_t *geometry,
+        const bmlite_quality_thresholds_t *thresholds, bmlite_quality_t *q, bool simd)
+{
+    uint32_t width = geometry->width;
+    uint32_t height = geometry->height;
+    uint32_t block_cols = (width + BMLITE_QUALITY_BLOCK - 1) / BMLITE_QUALITY_BLOCK;
+    uint32_t block_rows = (height + BMLITE_QUALITY_BLOCK - 1) / BMLITE_QUALITY_BLOCK;
+    uint32_t *block_grad;
+    uint32_t covered = 0;
+    row_acc_t acc;
+    double n;
+    double mean;
+
+    if (width < 2 || height == 0) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+
+    block_grad = calloc((size_t)block_cols * block_rows, sizeof(uint32_t));
+    if (block_grad == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+
+    memset(&acc, 0, sizeof(acc));
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *row = image + (size_t)y * width;
+        uint32_t *grad = block_grad + (size_t)(y / BMLITE_QUALITY_BLOCK) * block_cols;
+        uint32_t x = 0;
+
+#ifdef QUALITY_HAVE_SIMD
+        if (simd) {
+            x = row_simd(row, width, &acc, grad);
+        }
+#endif
+        row_tail(row, x, width, &acc, grad);
+    }
+    (void)simd;
+
+    for (uint32_t by = 0; by < block_rows; by++) {
+        uint32_t rows = height - by * BMLITE_QUALITY_BLOCK;
+
+        if (rows > BMLITE_QUALITY_BLOCK) {
+            rows = BMLITE_QUALITY_BLOCK;
+        }
+        for (uint32_t bx = 0; bx < block_cols; bx++) {
+            // Differences in the block, the last column has none
+            uint32_t cols = width - 1 - bx * BMLITE_QUALITY_BLOCK;
+
+            if (cols > BMLITE_QUALITY_BLOCK) {
+                cols = BMLITE_QUALITY_BLOCK;
+            }
+            if (cols && block_grad[by * block_cols + bx] >
+                    thresholds->block_contrast * rows * cols) {
+                covered++;
+            }
+        }
+    }
+    free(block_grad);
+
+    n = (double)width * height;
+    mean = acc.sum / n;
+    q->mean = mean;
+    q->variance = acc.sum_sq / n - mean * mean;
+    q->contrast = acc.grad / ((double)(width - 1) * height);
+    q->coverage = (float)covered / (block_cols * block_rows);
+    q->saturation = acc.saturated / n;
+
+    return FPC_BEP_RESULT_OK;
+}
+
+fpc_bep_result_t bmlite_quality_compute(const uint8_t *image,
+        const bmlite_image_geometry_t *geometry,
+        const bmlite_quality_thresholds_t *thresholds, bmlite_quality_t *q)
+{
+    return quality_compute(image, geometry, thresholds, q, true);
+}
+
+fpc_bep_result_t bmlite_quality_compute_generic(const uint8_t *image,
+        const bmlite_image_geometry_t *geometry,
+        const bmlite_quality_thresholds_t *thresholds, bmlite_quality_t *q)
+{
+    return quality_compute(image, geometry, thresholds, q, false);
+}
+
+const char *bmlite_quality_kernel(void)
+{
+    return QUALITY_KERNEL;
+}
+
+bool bmlite_quality_ok(const bmlite_quality_t *q, const bmlite_quality_thresholds_t *thresholds)
+{
+    return q->variance >= thresholds->min_variance &&
+           q->contrast >= thresholds->min_contrast &&
+           q->coverage >= thresholds->min_coverage &&
+           q->saturation <= thresholds->max_saturation;
+}
+
+fpc_bep_result_t bmlite_quality_capture(HCP_comm_t *chain, uint16_t timeout,
+        uint32_t max_attempts, const bmlite_quality_thresholds_t *thresholds,
+        uint8_t *image, uint32_t size, bmlite_quality_t *q, uint32_t *rejected)
+{
+    bmlite_image_geometry_t geometry;
+    bmlite_quality_t quality;
+    fpc_bep_result_t res;
+    uint32_t nr_rejected = 0;
+    bool have_geometry = false;
+
+    res = FPC_BEP_RESULT_IMAGE_CAPTURE_ERROR;
+    for (uint32_t i = 0; i < max_attempts; i++) {
+        res = bep_capture(chain, timeout);
+        if (res != FPC_BEP_RESULT_OK) {
+            break;
+        }
+        if (chain->bep_result != FPC_BEP_RESULT_OK) {
+            // No finger, not counted as rejected
+            res = chain->bep_result;
+            continue;
+        }
+
+        if (!have_geometry) {
+            res = bep_image_get_geometry(chain, &geometry);
+            if (res != FPC_BEP_RESULT_OK) {
+                break;
+            }
+            if (geometry.size > size) {
+                res = FPC_BEP_RESULT_NO_MEMORY;
+                break;
+            }
+            have_geometry = true;
+        }
+
+        res = bep_image_get(chain, image, geometry.size);
+        if (res == FPC_BEP_RESULT_OK) {
+            res = bmlite_quality_compute(image, &geometry, thresholds, &quality);
+        }
+        if (res != FPC_BEP_RESULT_OK) {
+            break;
+        }
+        if (q) {
+            *q = quality;
+        }
+        if (bmlite_quality_ok(&quality, thresholds)) {
+            break;
+        }
+        nr_rejected++;
+        res = FPC_BEP_RESULT_IMAGE_CAPTURE_ERROR;
+    }
+
+    if (rejected) {
+        *rejected = nr_rejected;
+    }
+    return res;
+}
@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    bmlite_service.c
+ * @brief   BM-Lite sensor service with dedicated I/O thread.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "bmlite_service.h"
+
+/*
+ * Intrusive multi-producer single-consumer queue (D. Vyukov).
+ * Producers never block each other: a push is one atomic exchange.
+ */
+
+static void queue_init(bmlite_queue_t *q)
+{
+    q->stub.next = NULL;
+    q->head = &q->stub;
+    q->tail = &q->stub;
+}
+
+static void queue_push(bmlite_queue_t *q, bmlite_request_t *req)
+{
+    bmlite_request_t *prev;
+
+    __atomic_store_n(&req->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&q->head, req, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, req, __ATOMIC_RELEASE);
+}
+
+/* Called by the consumer only. May return NULL while a push is in progress,
+   the producer wakes the consumer again when the push is finished */
+static bmlite_request_t *queue_pop(bmlite_queue_t *q)
+{
+    bmlite_request_t *tail = q->tail;
+    bmlite_request_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &q->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+
+    if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    queue_push(q, &q->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static void request_complete(bmlite_request_t *req, fpc_bep_result_t result)
+{
+    req->result = result;
+    if (req->done) {
+        // Callback owns the request from now
+        req->done(req);
+    } else {
+        sem_post(&req->completed);
+    }
+}
+
+static bmlite_request_t *service_next(bmlite_service_t *svc)
+{
+    bmlite_request_t *req = NULL;
+
+    for (int prio = BMLITE_PRIO_NR - 1; prio >= 0 && req == NULL; prio--) {
+        req = queue_pop(&svc->queue[prio]);
+    }
+    return req;
+}
+
+static uint64_t time_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Wait for a request or for the idle job to become due */
+static int service_wait(bmlite_service_t *svc)
+{
+    struct pollfd pfd = { .fd = svc->event_fd, .events = POLLIN };
+    int timeout = -1;
+    uint64_t events;
+
+    if (svc->idle) {
+        uint64_t now = time_ms();
+        uint64_t due = svc->idle_last + svc->idle_period;
+
+        if (now >= due) {
+            svc->idle_last = now;
+            svc->chain->bep_result = FPC_BEP_RESULT_OK;
+            svc->idle(svc->chain, svc->idle_ctx);
+            return 0;
+        }
+        timeout = due - now;
+    }
+
+    if (poll(&pfd, 1, timeout) < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    if (pfd.revents && read(svc->event_fd, &events, sizeof(events)) < 0 && errno != EINTR) {
+        return -1;
+    }
+    return 0;
+}
+
+static void *service_thread(void *arg)
+{
+    bmlite_service_t *svc = (bmlite_service_t *)arg;
+    bmlite_request_t *req;
+
+    while (!bmlite_service_closed(svc)) {
+        req = service_next(svc);
+        if (req == NULL) {
+            if (service_wait(svc) < 0) {
+                break;
+            }
+            continue;
+        }
+        req->bep_result = FPC_BEP_RESULT_OK;
+        svc->chain->bep_result = FPC_BEP_RESULT_OK;
+        fpc_bep_result_t result = req->job(svc->chain, req->ctx);
+        req->bep_result = svc->chain->bep_result;
+        request_complete(req, result);
+    }
+
+    // Submitters that passed the check of stop finish their push soon
+    while (__atomic_load_n(&svc->submitters, __ATOMIC_SEQ_CST)) {
+        sched_yield();
+    }
+    while ((req = service_next(svc)) != NULL) {
+        request_complete(req, FPC_BEP_RESULT_CANCELLED);
+    }
+
+    return NULL;
+}
+
+void bmlite_service_set_idle(bmlite_service_t *svc, bmlite_job_t job, void *ctx,
+        uint32_t period)
+{
+    svc->idle = job;
+    svc->idle_ctx = ctx;
+    svc->idle_period = period;
+}
+
+fpc_bep_result_t bmlite_service_start(bmlite_service_t *svc, HCP_comm_t *chain)
+{
+    svc->chain = chain;
+    svc->stop = false;
+    svc->submitters = 0;
+    // First idle run after one period, not right on start
+    svc->idle_last = time_ms();
+    for (int prio = 0; prio < BMLITE_PRIO_NR; prio++) {
+        queue_init(&svc->queue[prio]);
+    }
+
+    svc->event_fd = eventfd(0, EFD_CLOEXEC);
+    if (svc->event_fd < 0) {
+        return FPC_BEP_RESULT_NO_RESOURCE;
+    }
+
+    if (pthread_create(&svc->thread, NULL, service_thread, svc) != 0) {
+        close(svc->event_fd);
+        return FPC_BEP_RESULT_NO_RESOURCE;
+    }
+
+    return FPC_BEP_RESULT_OK;
+}
+
+static void service_wake(bmlite_service_t *svc)
+{
+    uint64_t event = 1;
+
+    // Counter can't overflow, so the write fails only if interrupted
+    while (write(svc->event_fd, &event, sizeof(event)) < 0 && errno == EINTR);
+}
+
+void bmlite_service_close(bmlite_service_t *svc)
+{
+    __atomic_store_n(&svc->stop, true, __ATOMIC_SEQ_CST);
+}
+
+bool bmlite_service_closed(bmlite_service_t *svc)
+{
+    return __atomic_load_n(&svc->stop, __ATOMIC_SEQ_CST);
+}
+
+void bmlite_service_stop(bmlite_service_t *svc)
+{
+    bmlite_service_close(svc);
+    service_wake(svc);
+    pthread_join(svc->thread, NULL);
+    close(svc->event_fd);
+}
+
+void bmlite_request_init(bmlite_request_t *req, bmlite_job_t job, void *ctx,
+        bmlite_request_cb_t done)
+{
+    req->next = NULL;
+    req->job = job;
+    req->ctx = ctx;
+    req->done = done;
+    req->result = FPC_BEP_RESULT_OK;
+    req->bep_result = FPC_BEP_RESULT_OK;
+    sem_init(&req->completed, 0, 0);
+}
+
+void bmlite_request_destroy(bmlite_request_t *req)
+{
+    sem_destroy(&req->completed);
+}
+
+fpc_bep_result_t bmlite_service_submit(bmlite_service_t *svc, bmlite_request_t *req,
+        bmlite_prio_t prio)
+{
+    if (prio >= BMLITE_PRIO_NR) {
+        return FPC_BEP_RESULT_WRONG_STATE;
+    }
+
+    /*
+     * I/O thread drains the queues when it sees stop and no submitters.
+     * Counting before the check of stop guarantees that the thread either
+     * waits for this push or the check sees stop.
+     */
+    __atomic_add_fetch(&svc->submitters, 1, __ATOMIC_SEQ_CST);
+    if (bmlite_service_closed(svc)) {
+        __atomic_sub_fetch(&svc->submitters, 1, __ATOMIC_SEQ_CST);
+        return FPC_BEP_RESULT_WRONG_STATE;
+    }
+    queue_push(&svc->queue[prio], req);
+    // The request belongs to the service from now, so it is reported as queued
+    service_wake(svc);
+    __atomic_sub_fetch(&svc->submitters, 1, __ATOMIC_SEQ_CST);
+
+    return FPC_BEP_RESULT_OK;
+}
+
+fpc_bep_result_t bmlite_request_wait(bmlite_request_t *req)
+{
+    while (sem_wait(&req->completed) < 0 && errno == EINTR);
+    return req->result;
+}
+
+fpc_bep_result_t bmlite_service_call(bmlite_service_t *svc, bmlite_job_t job, void *ctx,
+        bmlite_prio_t prio)
+{
+    bmlite_request_t req;
+    fpc_bep_result_t result;
+
+    bmlite_request_init(&req, job, ctx, NULL);
+    result = bmlite_service_submit(svc, &req, prio);
+    if (result == FPC_BEP_RESULT_OK) {
+        result = bmlite_request_wait(&req);
+    }
+    bmlite_request_destroy(&req);
+
+    return result;
+}
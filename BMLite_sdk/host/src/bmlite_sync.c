@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    bmlite_sync.c
+ * @brief   Incremental sync of BM-Lite storage with host template database.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bmlite_if.h"
+#include "bmlite_sync.h"
+
+/* One bit per BM-Lite storage ID */
+#define ID_MAP_SIZE (0x10000 / 8)
+
+static bool id_test(const uint8_t *map, uint16_t id)
+{
+    return map[id / 8] & (1 << (id % 8));
+}
+
+static void id_set(uint8_t *map, uint16_t id)
+{
+    map[id / 8] |= 1 << (id % 8);
+}
+
+static fpc_bep_result_t manifest_open(HCP_comm_t *chain, bmlite_tdb_t *master,
+        bmlite_tdb_t *manifest)
+{
+    uint8_t unique_id[BMLITE_TDB_UNIQUE_ID_LEN];
+    fpc_bep_result_t res;
+    size_t len = strlen(master->path) + 2 * BMLITE_TDB_UNIQUE_ID_LEN + 2;
+    char *path;
+
+    res = bep_unique_id_get(chain, unique_id);
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+
+    path = malloc(len);
+    if (path == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    len = sprintf(path, "%s.", master->path);
+    for (int i = 0; i < BMLITE_TDB_UNIQUE_ID_LEN; i++) {
+        len += sprintf(path + len, "%02x", unique_id[i]);
+    }
+
+    res = bmlite_tdb_open(manifest, path, true);
+    if (res == FPC_BEP_RESULT_OK) {
+        res = bmlite_tdb_bind(chain, manifest);
+        if (res == FPC_BEP_RESULT_WRONG_STATE) {
+            // Manifest of another module, start over with unknown content
+            bmlite_tdb_close(manifest);
+            unlink(path);
+            res = bmlite_tdb_open(manifest, path, true);
+            if (res == FPC_BEP_RESULT_OK) {
+                res = bmlite_tdb_bind(chain, manifest);
+            }
+        }
+        if (res != FPC_BEP_RESULT_OK) {
+            bmlite_tdb_close(manifest);
+        }
+    }
+    free(path);
+
+    return res;
+}
+
+static fpc_bep_result_t sync_remove(HCP_comm_t *chain, bmlite_tdb_t *manifest, uint16_t id)
+{
+    fpc_bep_result_t res;
+
+    // Forget the content first, so an interrupted sync never trusts it
+    bmlite_tdb_remove(manifest, id);
+    res = bmlite_tdb_commit(manifest);
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+    res = bep_template_remove(chain, id);
+    if (res != FPC_BEP_RESULT_OK || chain->bep_result != FPC_BEP_RESULT_OK) {
+        return res ? res : chain->bep_result;
+    }
+
+    return FPC_BEP_RESULT_OK;
+}
+
+static fpc_bep_result_t sync_push(HCP_comm_t *chain, bmlite_tdb_t *manifest,
+        const bmlite_tdb_record_t *rec)
+{
+    fpc_bep_result_t res;
+    uint32_t crc = rec->crc;
+
+    res = bep_template_put(chain, (uint8_t *)rec->data, rec->size);
+    if (res != FPC_BEP_RESULT_OK || chain->bep_result != FPC_BEP_RESULT_OK) {
+        return res ? res : chain->bep_result;
+    }
+    res = bep_template_save(chain, rec->id);
+    if (res != FPC_BEP_RESULT_OK || chain->bep_result != FPC_BEP_RESULT_OK) {
+        return res ? res : chain->bep_result;
+    }
+
+    // Committed with the next change or at the end of sync
+    return bmlite_tdb_put(manifest, rec->id, (uint8_t *)&crc, sizeof(crc));
+}
+
+fpc_bep_result_t bmlite_sync(HCP_comm_t *chain, bmlite_tdb_t *master,
+        const uint16_t *ids, uint32_t nr_ids, bmlite_sync_stats_t *stats)
+{
+    const bmlite_tdb_record_t *rec;
+    bmlite_sync_stats_t st;
+    bmlite_tdb_t manifest;
+    fpc_bep_result_t res;
+    uint8_t *on_module;
+    uint8_t *wanted;
+    uint16_t *module_ids;
+    uint32_t nr_module_ids;
+    uint32_t pos = 0;
+
+    memset(&st, 0, sizeof(st));
+
+    on_module = calloc(2, ID_MAP_SIZE);
+    if (on_module == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    wanted = on_module + ID_MAP_SIZE;
+
+    if (ids) {
+        for (uint32_t i = 0; i < nr_ids; i++) {
+            if (bmlite_tdb_find(master, ids[i])) {
+                id_set(wanted, ids[i]);
+            }
+        }
+    } else {
+        while ((rec = bmlite_tdb_next(master, &pos)) != NULL) {
+            if (rec->id <= 0xffff) {
+                id_set(wanted, rec->id);
+            }
+        }
+    }
+
+    res = manifest_open(chain, master, &manifest);
+    if (res != FPC_BEP_RESULT_OK) {
+        free(on_module);
+        return res;
+    }
+
+    res = bep_template_get_ids(chain);
+    if (res != FPC_BEP_RESULT_OK || chain->bep_result != FPC_BEP_RESULT_OK) {
+        res = res ? res : chain->bep_result;
+        goto exit;
+    }
+    nr_module_ids = chain->arg.size / sizeof(uint16_t);
+    module_ids = (uint16_t *)chain->arg.data;
+    for (uint32_t i = 0; i < nr_module_ids; i++) {
+        id_set(on_module, module_ids[i]);
+    }
+    // chain->arg is not valid after the next command
+
+    // Stale templates
+    for (uint32_t id = 0; id <= 0xffff; id++) {
+        if (id_test(on_module, id) && !id_test(wanted, id)) {
+            res = sync_remove(chain, &manifest, id);
+            if (res != FPC_BEP_RESULT_OK) {
+                goto exit;
+            }
+            st.removed++;
+        }
+    }
+
+    // Missing and changed templates
+    for (uint32_t id = 0; id <= 0xffff; id++) {
+        const bmlite_tdb_record_t *known;
+
+        if (!id_test(wanted, id)) {
+            continue;
+        }
+        rec = bmlite_tdb_find(master, id);
+        known = bmlite_tdb_find(&manifest, id);
+
+        if (id_test(on_module, id)) {
+            if (known && known->size == sizeof(uint32_t) &&
+                memcmp(known->data, &rec->crc, sizeof(uint32_t)) == 0) {
+                st.unchanged++;
+                continue;
+            }
+            res = sync_remove(chain, &manifest, id);
+            if (res == FPC_BEP_RESULT_OK) {
+                res = sync_push(chain, &manifest, rec);
+            }
+            st.updated += res == FPC_BEP_RESULT_OK;
+        } else {
+            res = sync_push(chain, &manifest, rec);
+            st.added += res == FPC_BEP_RESULT_OK;
+        }
+        if (res != FPC_BEP_RESULT_OK) {
+            goto exit;
+        }
+    }
+
+exit:
+    if (st.added || st.updated) {
+        bep_template_remove_ram(chain);
+    }
+    bmlite_tdb_close(&manifest);
+    free(on_module);
+
+    if (stats) {
+        *stats = st;
+    }
+    return res;
+}
@@ -0,0 +1,512 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    bmlite_tdb.c
+ * @brief   Memory-mapped host template database.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bmlite_if.h"
+#include "bmlite_tdb.h"
+#include "fpc_crc.h"
+
+#define TDB_MAGIC "BMLTDB01"
+#define TDB_VERSION 1
+#define TDB_REC_MAGIC 0x43455254 /* "TREC" */
+
+#define TDB_F_UNIQUE_ID 0x01
+
+#define TDB_DATA_START 64
+#define TDB_MIN_SIZE (64 * 1024)
+#define TDB_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint8_t unique_id[BMLITE_TDB_UNIQUE_ID_LEN];
+    uint32_t reserved;
+    /** Committed end of records */
+    uint64_t data_end;
+    /** CRC32 of the fields above */
+    uint32_t crc;
+} tdb_header_t;
+
+#define HDR(db) ((tdb_header_t *)(db)->map)
+#define REC(db, off) ((bmlite_tdb_record_t *)((db)->map + (off)))
+#define REC_SIZE(size) TDB_ALIGN(sizeof(bmlite_tdb_record_t) + (size))
+
+static uint32_t header_crc(tdb_header_t *hdr)
+{
+    return fpc_crc(0, hdr, offsetof(tdb_header_t, crc));
+}
+
+static uint32_t record_hdr_crc(const bmlite_tdb_record_t *rec)
+{
+    return fpc_crc(0, rec, offsetof(bmlite_tdb_record_t, hdr_crc));
+}
+
+/*
+ * Index
+ */
+
+static uint32_t index_hash(uint32_t id)
+{
+    // Template ids are often sequential, spread them over the table
+    return id * 2654435761u;
+}
+
+static bmlite_tdb_slot_t *index_lookup(bmlite_tdb_t *db, uint32_t id)
+{
+    uint32_t mask = db->index_size - 1;
+
+    for (uint32_t i = index_hash(id) & mask; ; i = (i + 1) & mask) {
+        bmlite_tdb_slot_t *s = &db->index[i];
+        if (!s->used || s->id == id) {
+            return s;
+        }
+    }
+}
+
+static fpc_bep_result_t index_resize(bmlite_tdb_t *db, uint32_t size)
+{
+    bmlite_tdb_slot_t *old = db->index;
+    uint32_t old_size = db->index_size;
+
+    db->index = calloc(size, sizeof(bmlite_tdb_slot_t));
+    if (db->index == NULL) {
+        db->index = old;
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    db->index_size = size;
+
+    for (uint32_t i = 0; i < old_size; i++) {
+        if (old[i].used) {
+            *index_lookup(db, old[i].id) = old[i];
+        }
+    }
+    free(old);
+
+    return FPC_BEP_RESULT_OK;
+}
+
+/* Removal is done by backward shift, so lookups never need tombstones */
+static void index_remove(bmlite_tdb_t *db, bmlite_tdb_slot_t *s)
+{
+    uint32_t mask = db->index_size - 1;
+    uint32_t hole = s - db->index;
+
+    for (uint32_t i = (hole + 1) & mask; db->index[i].used; i = (i + 1) & mask) {
+        uint32_t home = index_hash(db->index[i].id) & mask;
+        // Move the entry if the hole is between its home and its position
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            db->index[hole] = db->index[i];
+            hole = i;
+        }
+    }
+    db->index[hole].used = 0;
+}
+
+static fpc_bep_result_t index_set(bmlite_tdb_t *db, uint32_t id, uint64_t offset)
+{
+    bmlite_tdb_slot_t *s;
+
+    if ((db->nr_records + 1) * 2 > db->index_size) {
+        fpc_bep_result_t res = index_resize(db, db->index_size ? db->index_size * 2 : 256);
+        if (res != FPC_BEP_RESULT_OK) {
+            return res;
+        }
+    }
+
+    s = index_lookup(db, id);
+    if (s->used) {
+        db->dead_bytes += REC_SIZE(REC(db, s->offset)->size);
+    } else {
+        s->used = 1;
+        s->id = id;
+        db->nr_records++;
+    }
+    s->offset = offset;
+
+    return FPC_BEP_RESULT_OK;
+}
+
+/*
+ * Mapping
+ */
+
+static fpc_bep_result_t tdb_grow(bmlite_tdb_t *db, uint64_t need)
+{
+    size_t size = db->map_size;
+    uint8_t *map;
+
+    if (db->tail + need <= db->map_size) {
+        return FPC_BEP_RESULT_OK;
+    }
+    while (size < db->tail + need) {
+        size *= 2;
+    }
+
+    if (ftruncate(db->fd, size) < 0) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    map = mremap(db->map, db->map_size, size, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    db->map = map;
+    db->map_size = size;
+
+    return FPC_BEP_RESULT_OK;
+}
+
+static int tdb_msync(bmlite_tdb_t *db, uint64_t from, uint64_t to)
+{
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t start = from & ~(page - 1);
+
+    return msync(db->map + start, to - start, MS_SYNC);
+}
+
+/* Rebuild index from the log. Stops at first damaged record */
+static fpc_bep_result_t tdb_scan(bmlite_tdb_t *db)
+{
+    uint64_t end = HDR(db)->data_end;
+    uint64_t off = TDB_DATA_START;
+    fpc_bep_result_t res;
+
+    while (off + sizeof(bmlite_tdb_record_t) <= end) {
+        bmlite_tdb_record_t *rec = REC(db, off);
+
+        if (rec->magic != TDB_REC_MAGIC || rec->hdr_crc != record_hdr_crc(rec) ||
+            off + REC_SIZE(rec->size) > end) {
+            break;
+        }
+
+        if (rec->crc != fpc_crc(0, rec->data, rec->size)) {
+            // Record boundaries are known, skip only the damaged template
+            db->dead_bytes += REC_SIZE(rec->size);
+            db->nr_damaged++;
+        } else if (rec->flags & BMLITE_TDB_REC_DELETED) {
+            bmlite_tdb_slot_t *s = db->index_size ? index_lookup(db, rec->id) : NULL;
+            if (s && s->used) {
+                db->dead_bytes += REC_SIZE(REC(db, s->offset)->size);
+                index_remove(db, s);
+                db->nr_records--;
+            }
+            db->dead_bytes += REC_SIZE(0);
+        } else {
+            res = index_set(db, rec->id, off);
+            if (res != FPC_BEP_RESULT_OK) {
+                return res;
+            }
+        }
+        off += REC_SIZE(rec->size);
+    }
+
+    db->tail = off;
+    if (off != end) {
+        // Drop damaged tail of the log
+        HDR(db)->data_end = off;
+        db->nr_damaged++;
+        HDR(db)->crc = header_crc(HDR(db));
+    }
+
+    return FPC_BEP_RESULT_OK;
+}
+
+fpc_bep_result_t bmlite_tdb_open(bmlite_tdb_t *db, const char *path, bool create)
+{
+    fpc_bep_result_t res = FPC_BEP_RESULT_IO_ERROR;
+    struct stat st;
+    tdb_header_t *hdr;
+
+    memset(db, 0, sizeof(bmlite_tdb_t));
+    db->fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+    if (db->fd < 0 || fstat(db->fd, &st) < 0) {
+        goto error;
+    }
+    db->path = strdup(path);
+
+    db->map_size = st.st_size;
+    if (st.st_size < TDB_MIN_SIZE) {
+        if (st.st_size != 0 || !create || ftruncate(db->fd, TDB_MIN_SIZE) < 0) {
+            res = FPC_BEP_RESULT_INVALID_FORMAT;
+            goto error;
+        }
+        db->map_size = TDB_MIN_SIZE;
+    }
+
+    db->map = mmap(NULL, db->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, db->fd, 0);
+    if (db->map == MAP_FAILED) {
+        db->map = NULL;
+        goto error;
+    }
+    hdr = HDR(db);
+
+    if (st.st_size == 0) {
+        memcpy(hdr->magic, TDB_MAGIC, sizeof(hdr->magic));
+        hdr->version = TDB_VERSION;
+        hdr->data_end = TDB_DATA_START;
+        hdr->crc = header_crc(hdr);
+        if (tdb_msync(db, 0, TDB_DATA_START) < 0) {
+            goto error;
+        }
+    }
+
+    if (memcmp(hdr->magic, TDB_MAGIC, sizeof(hdr->magic)) || hdr->version != TDB_VERSION ||
+        hdr->crc != header_crc(hdr) || hdr->data_end > db->map_size) {
+        res = FPC_BEP_RESULT_INVALID_FORMAT;
+        goto error;
+    }
+
+    res = tdb_scan(db);
+    if (res != FPC_BEP_RESULT_OK) {
+        goto error;
+    }
+
+    return FPC_BEP_RESULT_OK;
+
+error:
+    bmlite_tdb_close(db);
+    return res;
+}
+
+void bmlite_tdb_close(bmlite_tdb_t *db)
+{
+    if (db->map) {
+        // tail is set only if the database is opened successfully
+        if (db->tail) {
+            bmlite_tdb_commit(db);
+        }
+        munmap(db->map, db->map_size);
+    }
+    if (db->fd >= 0) {
+        close(db->fd);
+    }
+    free(db->index);
+    free(db->path);
+    memset(db, 0, sizeof(bmlite_tdb_t));
+    db->fd = -1;
+}
+
+static fpc_bep_result_t tdb_append(bmlite_tdb_t *db, uint32_t id, uint32_t flags,
+        const uint8_t *data, uint32_t size, uint64_t *offset)
+{
+    bmlite_tdb_record_t *rec;
+    fpc_bep_result_t res;
+
+    res = tdb_grow(db, REC_SIZE(size));
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+
+    rec = REC(db, db->tail);
+    rec->magic = TDB_REC_MAGIC;
+    rec->id = id;
+    rec->size = size;
+    rec->flags = flags;
+    if (size) {
+        memcpy(rec->data, data, size);
+    }
+    rec->crc = fpc_crc(0, rec->data, size);
+    rec->hdr_crc = record_hdr_crc(rec);
+
+    *offset = db->tail;
+    db->tail += REC_SIZE(size);
+
+    return FPC_BEP_RESULT_OK;
+}
+
+fpc_bep_result_t bmlite_tdb_put(bmlite_tdb_t *db, uint32_t id, const uint8_t *data, uint32_t size)
+{
+    fpc_bep_result_t res;
+    uint64_t offset;
+
+    res = tdb_append(db, id, 0, data, size, &offset);
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+
+    return index_set(db, id, offset);
+}
+
+fpc_bep_result_t bmlite_tdb_remove(bmlite_tdb_t *db, uint32_t id)
+{
+    bmlite_tdb_slot_t *s;
+    fpc_bep_result_t res;
+    uint64_t offset;
+
+    if (db->index_size == 0 || !(s = index_lookup(db, id))->used) {
+        return FPC_BEP_RESULT_ID_NOT_FOUND;
+    }
+
+    res = tdb_append(db, id, BMLITE_TDB_REC_DELETED, NULL, 0, &offset);
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+    db->dead_bytes += REC_SIZE(REC(db, s->offset)->size) + REC_SIZE(0);
+    index_remove(db, s);
+    db->nr_records--;
+
+    return FPC_BEP_RESULT_OK;
+}
+
+const bmlite_tdb_record_t *bmlite_tdb_find(bmlite_tdb_t *db, uint32_t id)
+{
+    bmlite_tdb_slot_t *s;
+
+    if (db->index_size == 0) {
+        return NULL;
+    }
+    s = index_lookup(db, id);
+    return s->used ? REC(db, s->offset) : NULL;
+}
+
+const bmlite_tdb_record_t *bmlite_tdb_next(bmlite_tdb_t *db, uint32_t *pos)
+{
+    while (*pos < db->index_size) {
+        bmlite_tdb_slot_t *s = &db->index[(*pos)++];
+        if (s->used) {
+            return REC(db, s->offset);
+        }
+    }
+    return NULL;
+}
+
+fpc_bep_result_t bmlite_tdb_commit(bmlite_tdb_t *db)
+{
+    tdb_header_t *hdr = HDR(db);
+
+    if (hdr->data_end == db->tail) {
+        return FPC_BEP_RESULT_OK;
+    }
+
+    // Records must reach the disk before the header pointing to them
+    if (tdb_msync(db, hdr->data_end, db->tail) < 0) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    hdr->data_end = db->tail;
+    hdr->crc = header_crc(hdr);
+    if (tdb_msync(db, 0, TDB_DATA_START) < 0) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+
+    return FPC_BEP_RESULT_OK;
+}
+
+fpc_bep_result_t bmlite_tdb_compact(bmlite_tdb_t *db)
+{
+    fpc_bep_result_t res;
+    const bmlite_tdb_record_t *rec;
+    bmlite_tdb_t tmp;
+    char *path;
+    uint32_t pos = 0;
+    size_t len = strlen(db->path) + sizeof(".compact");
+
+    path = malloc(len);
+    if (path == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    snprintf(path, len, "%s.compact", db->path);
+    unlink(path);
+
+    res = bmlite_tdb_open(&tmp, path, true);
+    if (res != FPC_BEP_RESULT_OK) {
+        free(path);
+        return res;
+    }
+
+    memcpy(HDR(&tmp)->unique_id, HDR(db)->unique_id, BMLITE_TDB_UNIQUE_ID_LEN);
+    HDR(&tmp)->flags = HDR(db)->flags;
+    HDR(&tmp)->crc = header_crc(HDR(&tmp));
+
+    while (res == FPC_BEP_RESULT_OK && (rec = bmlite_tdb_next(db, &pos)) != NULL) {
+        res = bmlite_tdb_put(&tmp, rec->id, rec->data, rec->size);
+    }
+    if (res == FPC_BEP_RESULT_OK) {
+        res = bmlite_tdb_commit(&tmp);
+    }
+    if (res == FPC_BEP_RESULT_OK && tdb_msync(&tmp, 0, TDB_DATA_START) < 0) {
+        res = FPC_BEP_RESULT_IO_ERROR;
+    }
+    if (res == FPC_BEP_RESULT_OK && (fsync(tmp.fd) < 0 || rename(path, db->path) < 0)) {
+        res = FPC_BEP_RESULT_IO_ERROR;
+    }
+    if (res != FPC_BEP_RESULT_OK) {
+        bmlite_tdb_close(&tmp);
+        unlink(path);
+        free(path);
+        return res;
+    }
+    free(path);
+
+    // Take over the new file
+    free(tmp.path);
+    tmp.path = db->path;
+    db->path = NULL;
+    bmlite_tdb_close(db);
+    *db = tmp;
+
+    return FPC_BEP_RESULT_OK;
+}
+
+bool bmlite_tdb_get_unique_id(bmlite_tdb_t *db, uint8_t *unique_id)
+{
+    tdb_header_t *hdr = HDR(db);
+
+    if (!(hdr->flags & TDB_F_UNIQUE_ID)) {
+        return false;
+    }
+    memcpy(unique_id, hdr->unique_id, BMLITE_TDB_UNIQUE_ID_LEN);
+    return true;
+}
+
+fpc_bep_result_t bmlite_tdb_bind(HCP_comm_t *chain, bmlite_tdb_t *db)
+{
+    tdb_header_t *hdr = HDR(db);
+    uint8_t unique_id[BMLITE_TDB_UNIQUE_ID_LEN];
+    fpc_bep_result_t res;
+
+    res = bep_unique_id_get(chain, unique_id);
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+
+    if (hdr->flags & TDB_F_UNIQUE_ID) {
+        return memcmp(hdr->unique_id, unique_id, BMLITE_TDB_UNIQUE_ID_LEN) ?
+               FPC_BEP_RESULT_WRONG_STATE : FPC_BEP_RESULT_OK;
+    }
+
+    memcpy(hdr->unique_id, unique_id, BMLITE_TDB_UNIQUE_ID_LEN);
+    hdr->flags |= TDB_F_UNIQUE_ID;
+    hdr->crc = header_crc(hdr);
+    if (tdb_msync(db, 0, TDB_DATA_START) < 0) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+
+    return FPC_BEP_RESULT_OK;
+}
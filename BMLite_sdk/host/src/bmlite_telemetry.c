@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    bmlite_telemetry.c
+ * @brief   Periodic resource telemetry of BM-Lite.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "bmlite_if.h"
+#include "bmlite_telemetry.h"
+
+static uint64_t time_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Storage log is left in chain->pkt_buffer, *log points to it until the
+ * next command
+ */
+static fpc_bep_result_t telemetry_sample(HCP_comm_t *chain, bool storage_log,
+        bmlite_telemetry_sample_t *sample, const uint8_t **log)
+{
+    fpc_bep_result_t res;
+
+    memset(sample, 0, sizeof(bmlite_telemetry_sample_t));
+    *log = NULL;
+
+    res = bep_diag_get(chain, &sample->diag);
+    if (res == FPC_BEP_RESULT_OK && storage_log) {
+        res = bmlite_send_cmd(chain, CMD_STORAGE_LOG, ARG_UPLOAD);
+        // Empty or unsupported log is not an error of the sample
+        if (res == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_OK &&
+            bmlite_get_arg_opt(chain, ARG_DATA) == FPC_BEP_RESULT_OK) {
+            sample->log_size = chain->arg.size;
+            *log = chain->arg.data;
+        }
+        chain->bep_result = FPC_BEP_RESULT_OK;
+    }
+    sample->time_ms = time_ms();
+    sample->link = chain->link_stats;
+
+    return res;
+}
+
+fpc_bep_result_t bmlite_telemetry_sample(HCP_comm_t *chain, bool storage_log,
+        bmlite_telemetry_sample_t *sample)
+{
+    const uint8_t *log;
+
+    return telemetry_sample(chain, storage_log, sample, &log);
+}
+
+static void peak_update(bmlite_diag_t *peak, const bmlite_diag_t *diag)
+{
+    if (diag->stack_used > peak->stack_used)
+        peak->stack_used = diag->stack_used;
+    if (diag->heap_used > peak->heap_used)
+        peak->heap_used = diag->heap_used;
+    if (diag->stack_size > peak->stack_size)
+        peak->stack_size = diag->stack_size;
+    if (diag->heap_size > peak->heap_size)
+        peak->heap_size = diag->heap_size;
+}
+
+/* Idle job of the service */
+static fpc_bep_result_t telemetry_job(HCP_comm_t *chain, void *ctx)
+{
+    bmlite_telemetry_t *t = (bmlite_telemetry_t *)ctx;
+    bmlite_telemetry_sample_t sample;
+    const uint8_t *log;
+    fpc_bep_result_t res;
+    uint32_t prev_log_size;
+
+    res = telemetry_sample(chain, t->cfg.storage_log, &sample, &log);
+
+    pthread_mutex_lock(&t->lock);
+    prev_log_size = t->metrics.last.log_size;
+    t->metrics.samples++;
+    if (res == FPC_BEP_RESULT_OK) {
+        t->metrics.last = sample;
+        peak_update(&t->metrics.peak, &sample.diag);
+    } else {
+        t->metrics.failed++;
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    if (res == FPC_BEP_RESULT_OK && log && t->cfg.log && sample.log_size != prev_log_size) {
+        t->cfg.log(t->cfg.ctx, log, sample.log_size);
+    }
+
+    return res;
+}
+
+fpc_bep_result_t bmlite_telemetry_start(bmlite_telemetry_t *t, bmlite_service_t *svc,
+        const bmlite_telemetry_config_t *cfg)
+{
+    if (cfg->period == 0) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+
+    t->cfg = *cfg;
+    memset(&t->metrics, 0, sizeof(t->metrics));
+    pthread_mutex_init(&t->lock, NULL);
+    bmlite_service_set_idle(svc, telemetry_job, t, cfg->period);
+
+    return FPC_BEP_RESULT_OK;
+}
+
+void bmlite_telemetry_get(bmlite_telemetry_t *t, bmlite_telemetry_metrics_t *metrics)
+{
+    pthread_mutex_lock(&t->lock);
+    *metrics = t->metrics;
+    pthread_mutex_unlock(&t->lock);
+}
+
+void bmlite_telemetry_destroy(bmlite_telemetry_t *t)
+{
+    pthread_mutex_destroy(&t->lock);
+}
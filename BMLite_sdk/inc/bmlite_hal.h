@@ -144,5 +144,66 @@ uint32_t hal_check_button_pressed(void);
  */
 void hal_set_leds(platform_led_status_t status, uint16_t mode);
 
+/**
+ *  Optional functions for event-driven and multi-device operation
+ */
+
+/**
+ * @brief Select BM-Lite device used by following HAL calls
+ *
+ * @param[in] dev  Device handle from HCP_comm_t.phy_dev. NULL - default device
+ */
+void hal_bmlite_select(void *dev);
+
+/**
+ * @brief Wait for BM-Lite IRQ pin to be set without busy looping
+ *
+ * May return earlier on another interrupt, so the caller can check what it set.
+ *
+ * @param[in] ms  Maximum time to wait [ms]. UINT32_MAX - no time limit
+ * @return ::bool Status of BM-Lite IRQ pin
+ */
+bool hal_bmlite_wait_status(uint32_t ms);
+
+/**
+ * @brief Get file descriptor signalling BM-Lite IRQ pin rising edge
+ *
+ * @return File descriptor to poll for POLLPRI. -1 if not supported
+ */
+int hal_bmlite_get_status_fd(void);
+
+/**
+ * @brief Set SPI clock (optional)
+ *
+ * @param[in] hz  Requested clock [Hz]
+ * @return ::uint32_t Clock actually set, the closest supported one not
+ *         above the requested. 0 if clock can't be changed
+ */
+uint32_t hal_bmlite_spi_set_clock(uint32_t hz);
+
+struct HCP_comm;
+
+typedef struct {
+    /** CPU the I/O thread is pinned to, -1 - any CPU */
+    int cpu;
+    /** Real-time priority, 0 - keep default scheduling */
+    int priority;
+    /** Lock memory of the process */
+    bool lock_memory;
+} hal_rt_config_t;
+
+/**
+ * @brief Switch calling thread to real-time I/O mode or back (optional)
+ *
+ *   Must be called on the thread doing HCP transfers of the chain.
+ *
+ * @param[in] cfg    Real-time settings, NULL - normal scheduling
+ * @param[in] chain  HCP com chain served by the thread, its buffers are
+ *                   pre-faulted. Can be NULL
+ * @return ::fpc_bep_result_t FPC_BEP_RESULT_NOT_SUPPORTED if the platform
+ *         has no real-time mode or a setting is not permitted
+ */
+fpc_bep_result_t hal_rt_set(const hal_rt_config_t *cfg, struct HCP_comm *chain);
+
 
 #endif /* BMLITE_H */
@@ -20,6 +20,33 @@
 #include "hcp_tiny.h"
 #include "bmlite_if_callbacks.h"
 
+#ifndef BMLITE_IMAGE_DEFAULT_DPI
+/** Resolution of BM-Lite sensor */
+#define BMLITE_IMAGE_DEFAULT_DPI 508
+#endif
+
+#ifndef BMLITE_ID_CACHE_MAX
+/** Template IDs 0 .. BMLITE_ID_CACHE_MAX-1 are tracked by ID cache */
+#define BMLITE_ID_CACHE_MAX 1024
+#endif
+
+/**
+ * @brief Host copy of used template IDs
+ *
+ *   Set HCP_comm_t.id_cache to enable it. The cache is filled from
+ *   bep_template_get_ids() on first use and then kept up to date by
+ *   bep_template_save(), bep_template_remove() and bep_template_remove_all().
+ *   It is invalidated by bep_sw_reset() and by link errors.
+ */
+typedef struct bmlite_id_cache {
+    uint32_t map[(BMLITE_ID_CACHE_MAX + 31) / 32];
+    /** Number of used IDs, including IDs beyond BMLITE_ID_CACHE_MAX */
+    uint16_t count;
+    /** All IDs below are used */
+    uint16_t free_hint;
+    bool valid;
+} bmlite_id_cache_t;
+
 /**
  * @brief Enroll finger. Created template must be saved to FLASH storage
  *
@@ -29,9 +56,100 @@
  */
 fpc_bep_result_t bep_enroll_finger(HCP_comm_t *chain);
 
+/**
+ * @brief One capture of enrollment session
+ */
+typedef struct {
+    /** Result of capture and enroll add */
+    fpc_bep_result_t result;
+    /** Sample was added to the template */
+    bool accepted;
+    /** Samples remaining after this step */
+    uint32_t samples_remaining;
+    /** Time spent waiting for finger and capturing, ms */
+    uint32_t capture_ms;
+    /** Time spent adding sample, ms */
+    uint32_t add_ms;
+    /** Time spent waiting for finger up, ms. 0 if skipped */
+    uint32_t finger_up_ms;
+} bmlite_enroll_step_t;
+
+/**
+ * @brief Enrollment progress callback, called after every step
+ *
+ * @param[in] ctx  - bmlite_enroll_config_t.ctx
+ * @param[in] step - step number, counting from 0
+ * @param[in] info - step results
+ */
+typedef void (*bmlite_enroll_progress_t)(void *ctx, uint32_t step,
+        const bmlite_enroll_step_t *info);
+
+typedef struct {
+    /** Capture timeout of one step, ms. 0 - wait indefinitely */
+    uint16_t step_timeout;
+    /** Finger up timeout, ms. 0 - wait indefinitely */
+    uint16_t finger_up_timeout;
+    /** Wait for finger up between samples */
+    bool wait_finger_up;
+    /** Whole enrollment timeout, ms. 0 - no limit */
+    uint32_t timeout;
+    /** Maximum number of captures. 0 - 15 */
+    uint32_t max_steps;
+    /** Progress callback. Can be NULL */
+    bmlite_enroll_progress_t progress;
+    void *ctx;
+} bmlite_enroll_config_t;
+
+/* Steps are not stored, so the session is small enough for embedded stacks */
+typedef struct {
+    bmlite_enroll_config_t cfg;
+    uint32_t nr_steps;
+    /** Current step, see bmlite_enroll_config_t.progress for all steps */
+    bmlite_enroll_step_t step;
+    uint32_t samples_remaining;
+    /** Total capture, enroll add and finger up times of all steps, ms */
+    uint32_t capture_ms;
+    uint32_t add_ms;
+    uint32_t finger_up_ms;
+    /** Time of ENROLL FINISH, ms */
+    uint32_t finish_ms;
+    /** Whole enrollment time, ms */
+    uint32_t total_ms;
+} bmlite_enroll_session_t;
+
+/**
+ * @brief Initialize enrollment session
+ *
+ *   Default configuration is the one of bep_enroll_finger(): 15 captures
+ *   with 3 s timeout, waiting for finger up indefinitely, no overall timeout.
+ *
+ * @param[out] session - enrollment session
+ * @param[in] cfg      - configuration. NULL for defaults
+ */
+void bep_enroll_session_init(bmlite_enroll_session_t *session, const bmlite_enroll_config_t *cfg);
+
+/**
+ * @brief Run enrollment session. Created template must be saved to FLASH storage
+ *
+ *   Finger up is not waited for after the last sample and after a sample
+ *   BM-Lite rejected, the finger is captured again right away. Step and
+ *   finger up timeouts are shortened to meet the overall timeout.
+ *
+ * @param[in] chain       - HCP com chain
+ * @param[in,out] session - initialized session, filled with step results
+ *
+ * @return ::fpc_bep_result_t, FPC_BEP_RESULT_TIMEOUT if the overall timeout
+ *         expired, FPC_BEP_RESULT_GENERAL_ERROR if not enough samples were
+ *         collected in max_steps captures
+ */
+fpc_bep_result_t bep_enroll_session_run(HCP_comm_t *chain, bmlite_enroll_session_t *session);
+
 /**
  * @brief Capture and identify finger against existing templates in Flash storage
  *
+ *   The timeout limits the whole call, not only the capture,
+ *   see bmlite_deadline_begin().
+ *
  * @param[in] chain   - HCP com chain
  * @param[in] timeout - timeout (msec). Maximum timeout 65535 msec
  *                      set to 0 for waiting indefinitely
@@ -66,9 +184,26 @@ fpc_bep_result_t sensor_wait_finger_present(HCP_comm_t *chain, uint16_t timeout)
  */
 fpc_bep_result_t sensor_wait_finger_not_present(HCP_comm_t *chain, uint16_t timeout);
 
+/**
+ * @brief Put BM-Lite into finger detect sleep until finger touches the sensor
+ *
+ *   BM-Lite answers CMD_MCU when it wakes up on finger touch. With
+ *   HCP_comm_t.ready set the host waits for the answer in
+ *   hal_bmlite_wait_status(), so the host MCU can sleep too.
+ *
+ * @param[in] chain   - HCP com chain
+ * @param[in] deep    - deep sleep: lowest power, longer wake-up
+ * @param[in] timeout - timeout (msec), set to 0 for waiting indefinitely
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bep_sleep(HCP_comm_t *chain, bool deep, uint32_t timeout);
+
 /**
  * @brief Wait for finger present on sensor and capture image"
  *
+ *   Capture is retried up to 3 times within the timeout.
+ *
  * @param[in] chain   - HCP com chain
  * @param[in] timeout - timeout (msec). Maximum timeout 65535 msec
  *                      set to 0 for waiting indefinitely
@@ -88,6 +223,74 @@ fpc_bep_result_t bep_capture(HCP_comm_t *chain, uint16_t timeout);
  */
 fpc_bep_result_t bep_image_get_size(HCP_comm_t *chain, uint32_t *size);
 
+typedef struct {
+    uint16_t width;
+    uint16_t height;
+    /** Resolution, dots per inch */
+    uint16_t dpi;
+    /** Image size in bytes */
+    uint32_t size;
+} bmlite_image_geometry_t;
+
+/**
+ * @brief Get geometry of captured image
+ *
+ *   Width, height and resolution are taken from ARG_WIDTH, ARG_HEIGHT and
+ *   ARG_DPI if BM-Lite reports them with the image size. Otherwise the image
+ *   is assumed to be square with BMLITE_IMAGE_DEFAULT_DPI resolution.
+ *   Geometry doesn't change, so it is enough to query it once. Taken from
+ *   HCP_comm_t.caps if it is known there.
+ *
+ * @param[in] chain     - HCP com chain
+ * @param[out] geometry - image geometry
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bep_image_get_geometry(HCP_comm_t *chain, bmlite_image_geometry_t *geometry);
+
+/** Size of BM-Lite unique ID */
+#define BMLITE_UNIQUE_ID_LEN 12
+
+#ifndef BMLITE_CAPS_VERSION_LEN
+/** Space for firmware version string, including terminating zero */
+#define BMLITE_CAPS_VERSION_LEN 64
+#endif
+
+/**
+ * @brief Host copy of BM-Lite properties that don't change at runtime
+ *
+ *   Filled by bep_caps_probe(), which also sets HCP_comm_t.caps. While the
+ *   cache is valid bep_version(), bep_unique_id_get(), bep_spi_max_clock_get()
+ *   and bep_image_get_geometry() are answered from it without a command.
+ *   The cache survives bep_sw_reset(), probe again after firmware update.
+ */
+typedef struct bmlite_caps {
+    char version[BMLITE_CAPS_VERSION_LEN];
+    uint8_t unique_id[BMLITE_UNIQUE_ID_LEN];
+    /** ARG_SENSOR_TYPE, 0 if not reported */
+    uint16_t sensor_type;
+    /** Image geometry, size is 0 if BM-Lite doesn't report it */
+    bmlite_image_geometry_t geometry;
+    /** Maximum SPI clock, Hz. 0 if not reported */
+    uint32_t max_spi_clock;
+    bool valid;
+} bmlite_caps_t;
+
+/**
+ * @brief Query BM-Lite properties once and cache them on the chain
+ *
+ *   Version and unique ID are required. Sensor type, image geometry and
+ *   maximum SPI clock are requested with one CMD_SENSOR command, properties
+ *   BM-Lite doesn't report are left 0 and the functions returning them
+ *   keep asking BM-Lite.
+ *
+ * @param[in] chain - HCP com chain
+ * @param[out] caps - capability cache, stays attached to the chain
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bep_caps_probe(HCP_comm_t *chain, bmlite_caps_t *caps);
+
 /**
  * @brief Allocates image buffer on FPC BM-LIte
  *
@@ -145,12 +348,27 @@ fpc_bep_result_t bep_image_extract(HCP_comm_t *chain);
 /**
  * @brief Identify prepared image against existing templates in Flash storage
  *
+ *   After a match BM-Lite may update the template, the next command is held
+ *   off for bmlite_timing_t.template_update_ms, see bmlite_hold_off().
+ *
  * @param[in] chain  - HCP com chain
  * 
  * @return ::fpc_bep_result_t
  */
 fpc_bep_result_t bep_identify(HCP_comm_t *chain);
 
+/**
+ * @brief Match prepared image against template in RAM
+ *
+ *   Template can be loaded by bep_template_put() or bep_template_load_storage()
+ *
+ * @param[in] chain  - HCP com chain
+ * @param[out] match - match result
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bep_match(HCP_comm_t *chain, bool *match);
+
 /**
  * @brief Save template after enroll is finished to FLASH storage
  *
@@ -248,6 +466,48 @@ fpc_bep_result_t bep_template_get_count(HCP_comm_t *chain, uint16_t *count);
  */
 fpc_bep_result_t bep_template_get_ids(HCP_comm_t *chain);
 
+/**
+ * @brief Fill template ID cache from BM-Lite
+ *
+ *   Called implicitly by functions using the cache if it is not valid.
+ *
+ * @param[in] chain - HCP com chain with id_cache set
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bep_template_id_load(HCP_comm_t *chain);
+
+/**
+ * @brief Drop template ID cache, e.g. after storage is changed by somebody else
+ *
+ * @param[in] chain - HCP com chain
+ */
+void bep_template_id_invalidate(HCP_comm_t *chain);
+
+/**
+ * @brief Check if template ID is used
+ *
+ * @param[in] chain   - HCP com chain with id_cache set
+ * @param[in] id      - template ID, less than BMLITE_ID_CACHE_MAX
+ * @param[out] used   - true if there is template with this ID
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bep_template_id_is_used(HCP_comm_t *chain, uint16_t id, bool *used);
+
+/**
+ * @brief Get the lowest free template ID
+ *
+ *   The ID becomes used when the template is saved with bep_template_save().
+ *
+ * @param[in] chain - HCP com chain with id_cache set
+ * @param[out] id   - free template ID
+ *
+ * @return ::fpc_bep_result_t, FPC_BEP_RESULT_NO_RESOURCE if all IDs below
+ *         BMLITE_ID_CACHE_MAX are used
+ */
+fpc_bep_result_t bep_template_id_alloc(HCP_comm_t *chain, uint16_t *id);
+
 /**
  * @brief Software reset of FCP BM-Lite
  *
@@ -277,6 +537,49 @@ fpc_bep_result_t bep_sensor_calibrate(HCP_comm_t *chain);
  */
 fpc_bep_result_t bep_sensor_calibrate_remove(HCP_comm_t *chain);
 
+/**
+ * @brief Resource usage of FPC BM-Lite firmware
+ *
+ *   Values BM-Lite doesn't report are 0.
+ */
+typedef struct {
+    /** Stack high-water mark, bytes */
+    uint32_t stack_used;
+    /** Stack size, bytes */
+    uint32_t stack_size;
+    /** Heap high-water mark, bytes */
+    uint32_t heap_used;
+    /** Heap size, bytes */
+    uint32_t heap_size;
+} bmlite_diag_t;
+
+/**
+ * @brief Get stack and heap usage of FPC BM-Lite firmware
+ *
+ *   Sends CMD_DIAG with ARG_STACK and ARG_HEAP. Each reply argument holds
+ *   the high-water mark, optionally followed by the total size.
+ *
+ * @param[in] chain - HCP com chain
+ * @param[out] diag - resource usage
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bep_diag_get(HCP_comm_t *chain, bmlite_diag_t *diag);
+
+/**
+ * @brief Pull storage log from FPC BM-Lite
+ *
+ * @param[in] chain  - HCP com chain
+ * @param[in] data   - pointer to log buffer
+ * @param[in] size   - size of the log buffer
+ *                     if buffer size is not enough the log
+ *                     will be truncated
+ *                     chain->arg.size will contain real size of the log
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bep_storage_log_get(HCP_comm_t *chain, uint8_t *data, uint32_t size);
+
 /**
  * @brief Get version of FPC BM-LIte firmware
  *
@@ -292,10 +595,69 @@ fpc_bep_result_t bep_sensor_calibrate_remove(HCP_comm_t *chain);
 fpc_bep_result_t bep_version(HCP_comm_t *chain, char *version, int len);
 
 /**
- * @brief Get version of FPC BM-LIte firmware
+ * @brief Get maximum SPI clock supported by BM-Lite
+ *
+ * @param[in] chain - HCP com chain
+ * @param[out] hz   - maximum SPI clock, Hz
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bep_spi_max_clock_get(HCP_comm_t *chain, uint32_t *hz);
+
+#ifndef BMLITE_WARM_START_TIMEOUT
+/** Timeout of the link probe of bep_warm_start(), ms */
+#define BMLITE_WARM_START_TIMEOUT 50
+#endif
+
+/**
+ * @brief Check that BM-Lite is up and responding
+ *
+ *   Firmware version is requested with a short timeout. The timeout also
+ *   bounds waiting for ACK of the command, see bmlite_deadline_begin().
+ *   An answer without the version, e.g. a pending answer to a command of a
+ *   previous host process, fails the probe.
+ *
+ * @param[in] chain   - HCP com chain
+ * @param[in] timeout - response timeout, ms
+ *
+ * @return ::fpc_bep_result_t, FPC_BEP_RESULT_IO_ERROR if the answer is not
+ *         the one to the probe
+ */
+fpc_bep_result_t bep_link_probe(HCP_comm_t *chain, uint32_t timeout);
+
+/**
+ * @brief Bring up BM-Lite without reset if it is already running
+ *
+ *   BM-Lite is probed with bep_link_probe() and is reset by
+ *   platform_bmlite_reset_chain() only if the probe fails, e.g. the module is
+ *   powered up but not booted yet, or is still busy with a command of a
+ *   previous host process.
+ *
+ * @param[in] chain   - HCP com chain
+ * @param[in] timeout - probe timeout, ms
+ *
+ * @return ::fpc_bep_result_t of the probe, BM-Lite is reset if it isn't
+ *         FPC_BEP_RESULT_OK
+ */
+fpc_bep_result_t bep_warm_start(HCP_comm_t *chain, uint32_t timeout);
+
+/**
+ * @brief Wait for BM-Lite reset by platform_bmlite_reset_chain() to boot
+ *
+ *   BM-Lite is polled with bep_link_probe() until it answers or
+ *   bmlite_timing_t.boot_ms after reset is over, so a module booting faster
+ *   is used right away. Called by bmlite_send_cmd() and bmlite_send_cmd_arg(),
+ *   commands submitted with bmlite_submit() wait for the whole boot time.
+ *
+ * @param[in] chain - HCP com chain
+ */
+void bep_boot_wait(HCP_comm_t *chain);
+
+/**
+ * @brief Get unique ID of FPC BM-LIte
  *
  * @param[in] chain     - HCP com chain
- * @param[in] unique_id - pointer to data buffer
+ * @param[in] unique_id - pointer to data buffer of BMLITE_UNIQUE_ID_LEN bytes
  *                        chain->arg.size will contain real size of the data
  * 
  * @return ::fpc_bep_result_t
@@ -331,6 +693,39 @@ fpc_bep_result_t bep_uart_speed_get(HCP_comm_t *chain, uint32_t *speed);
  */
 fpc_bep_result_t bep_sensor_reset(HCP_comm_t *chain);
 
+/**
+ * @brief Delays of BM-Lite firmware which it doesn't signal completion of
+ */
+typedef struct bmlite_timing {
+    /** Firmware version prefix. NULL matches any version */
+    const char *version;
+    /** BM-Lite may update the matched template after identify, ms */
+    uint16_t template_update_ms;
+    /** Reset pulse, ms */
+    uint16_t reset_pulse_ms;
+    /** Boot time after reset, ms */
+    uint16_t boot_ms;
+} bmlite_timing_t;
+
+/** Timing used if HCP_comm_t.timing is not set */
+extern const bmlite_timing_t bmlite_timing_default;
+
+/**
+ * @brief Select timing by firmware version
+ *
+ *   Sets HCP_comm_t.timing to the first entry of the table matching
+ *   the version reported by BM-Lite, or to bmlite_timing_default.
+ *   Reset timing is used by platform_bmlite_reset_chain().
+ *
+ * @param[in] chain - HCP com chain
+ * @param[in] table - timing table, NULL entries match any version
+ * @param[in] count - number of table entries
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bep_timing_select(HCP_comm_t *chain, const bmlite_timing_t *table,
+        uint32_t count);
+
 /**
  * @brief Build and send command to FPC BM-Lite and receive answer
  *
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BMLITE_LINK_H
+#define BMLITE_LINK_H
+
+/**
+ * @file    bmlite_link.h
+ * @brief   SPI clock tuning.
+ *
+ *   bmlite_link_tune() steps the host SPI clock up through standard rates,
+ *   up to the maximum reported by BM-Lite, and keeps the fastest one that
+ *   passes a series of CRC-checked round trips. bmlite_link_check() watches
+ *   link error counters of HCP_comm_t and steps the clock down when the
+ *   error rate rises. Requires hal_bmlite_spi_set_clock().
+ */
+
+#include <stdint.h>
+
+#include "bmlite_if.h"
+
+typedef struct {
+    /** Starting and lowest clock, Hz */
+    uint32_t min_hz;
+    /** Highest clock allowed by the board, Hz. 0 - BM-Lite maximum */
+    uint32_t max_hz;
+    /** Clock found by a previous tuning, checked first. 0 - none */
+    uint32_t known_hz;
+    /** Round trips without errors needed to accept a clock */
+    uint32_t probes;
+    /** Frames per error rate window of bmlite_link_check() */
+    uint32_t window;
+    /** Error rate in a window which makes the clock go down, per mille */
+    uint32_t max_error_permille;
+} bmlite_link_config_t;
+
+typedef struct {
+    bmlite_link_config_t cfg;
+    /** Maximum clock reported by BM-Lite, Hz. 0 - not reported */
+    uint32_t module_max_hz;
+    /** Current clock, Hz */
+    uint32_t clock_hz;
+    /** Number of times bmlite_link_check() lowered the clock */
+    uint32_t backoffs;
+    /** Link counters at the start of the current window */
+    HCP_link_stats_t window_start;
+} bmlite_link_t;
+
+/** 1 MHz start, 20 probes, step down on more than 1% errors in 200 frames */
+extern const bmlite_link_config_t bmlite_link_default_config;
+
+/**
+ * @brief Find the fastest SPI clock working without errors
+ *
+ *   A clock failing the probes is not tried again, the link is brought
+ *   back with bmlite_resync() at the previous clock.
+ *
+ * @param[in] chain  - HCP com chain
+ * @param[out] link  - tuning state, clock_hz is the result
+ * @param[in] cfg    - configuration. NULL for defaults
+ *
+ * @return ::fpc_bep_result_t, FPC_BEP_RESULT_NOT_SUPPORTED if HAL can't
+ *         change SPI clock, FPC_BEP_RESULT_IO_ERROR if even min_hz fails
+ */
+fpc_bep_result_t bmlite_link_tune(HCP_comm_t *chain, bmlite_link_t *link,
+        const bmlite_link_config_t *cfg);
+
+/**
+ * @brief Lower SPI clock if the link error rate is too high
+ *
+ *   Call regularly, e.g. after every operation. Errors are counted over
+ *   windows of cfg.window frames, the clock goes one step down, not lower
+ *   than cfg.min_hz, when a window has too many of them.
+ *
+ * @param[in] chain    - HCP com chain
+ * @param[in,out] link - state from bmlite_link_tune()
+ *
+ * @return true if the clock was lowered
+ */
+bool bmlite_link_check(HCP_comm_t *chain, bmlite_link_t *link);
+
+#endif /* BMLITE_LINK_H */
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BMLITE_WAKE_H
+#define BMLITE_WAKE_H
+
+/**
+ * @file    bmlite_wake.h
+ * @brief   Low-power identification loop.
+ *
+ *   bmlite_wake_identify() puts BM-Lite into finger detect sleep with
+ *   bep_sleep() and identifies the finger which woke it up. While BM-Lite
+ *   sleeps the host waits for its IRQ in hal_bmlite_wait_status(), which
+ *   lets the host MCU sleep too if the HAL implements it. Time from the
+ *   wake-up to the identification result is measured on every finger.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "bmlite_if.h"
+
+typedef struct {
+    /** Use deep sleep: lowest power, longer wake-up */
+    bool deep_sleep;
+    /** Time to wait for a finger (msec), 0 - indefinitely */
+    uint32_t sleep_timeout;
+    /** Capture timeout after wake-up (msec) */
+    uint16_t capture_timeout;
+} bmlite_wake_config_t;
+
+typedef struct {
+    bool match;
+    uint16_t template_id;
+    /** Time from wake-up to identification result (msec) */
+    uint32_t latency_ms;
+} bmlite_wake_result_t;
+
+typedef struct {
+    /** Wake-ups of BM-Lite */
+    uint32_t wakeups;
+    /** Wake-ups without a finger to capture */
+    uint32_t false_wakeups;
+    /** Identified fingers, matching or not */
+    uint32_t identified;
+    uint32_t matches;
+    /** Wake-up to identification result latency (msec) */
+    uint32_t latency_min_ms;
+    uint32_t latency_max_ms;
+    uint32_t latency_total_ms;
+} bmlite_wake_stats_t;
+
+/** Light sleep, wait indefinitely, 1 s to capture after wake-up */
+extern const bmlite_wake_config_t bmlite_wake_default_config;
+
+/**
+ * @brief Sleep until a finger touches the sensor and identify it
+ *
+ *   Wake-ups without a finger to capture put BM-Lite to sleep again. If
+ *   BM-Lite doesn't support sleep, finger is waited for with
+ *   sensor_wait_finger_present().
+ *
+ * @param[in] chain     - HCP com chain, HCP_comm_t.ready should be set
+ * @param[in] cfg       - configuration. NULL for defaults
+ * @param[in,out] stats - statistics to update. Can be NULL
+ * @param[out] result   - identification result
+ *
+ * @return ::fpc_bep_result_t, FPC_BEP_RESULT_TIMEOUT if no finger within
+ *         cfg.sleep_timeout. Errors of BM-Lite are in chain->bep_result
+ */
+fpc_bep_result_t bmlite_wake_identify(HCP_comm_t *chain, const bmlite_wake_config_t *cfg,
+        bmlite_wake_stats_t *stats, bmlite_wake_result_t *result);
+
+#endif /* BMLITE_WAKE_H */
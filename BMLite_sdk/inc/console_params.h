@@ -32,6 +32,11 @@ typedef struct {
    char *port;
    uint32_t baudrate;
    uint32_t timeout;
+   /** BM-Lite RESET and READY pins. 0 - use platform default */
+   uint32_t reset_pin;
+   uint32_t ready_pin;
+   /** Reset BM-Lite only if it doesn't respond, see bep_warm_start() */
+   bool warm_start;
    HCP_comm_t *hcp_comm;
 } console_initparams_t;
 
@@ -17,8 +17,11 @@
 #ifndef HCP_H
 #define HCP_H
 
+#include <signal.h>
+
 #include "fpc_bep_types.h"
 #include "fpc_hcp_common.h"
+#include "bmlite_hal.h"
 
 /** MTU for HCP physical layer */
 #define MTU 256
@@ -31,7 +34,58 @@ typedef struct {
     uint8_t *data;
 } HCP_arg_t;
 
+/** State of non-blocking command execution */
+typedef enum {
+    HCP_STATE_IDLE = 0,
+    /** Sending next frame of command packet */
+    HCP_STATE_TX,
+    /** Waiting for ACK of sent frame */
+    HCP_STATE_TX_ACK,
+    /** Waiting for next frame of answer */
+    HCP_STATE_RX,
+} HCP_state_t;
+
+typedef struct HCP_comm HCP_comm_t;
+
+/**
+ * @brief Link layer counters, never reset by the SDK
+ */
+typedef struct {
+    /** Frames sent and received */
+    uint32_t frames;
+    /** Received frames with CRC mismatch and sent frames not acknowledged */
+    uint32_t errors;
+} HCP_link_stats_t;
+
+/**
+ * @brief Completion callback of non-blocking command
+ *
+ * @param[in] hcp_comm - pointer to HCP_comm struct. Answer is in pkt_buffer
+ * @param[in] result   - communication result
+ * @param[in] ctx      - user context passed to bmlite_submit()
+ */
+typedef void (*HCP_done_cb_t)(HCP_comm_t *hcp_comm, fpc_bep_result_t result, void *ctx);
+
 typedef struct {
+    HCP_state_t state;
+    uint16_t seq_nr;
+    uint16_t seq_len;
+    /** Bytes of pkt_buffer already sent or received */
+    uint32_t offset;
+    /** Tick when current step times out. 0 - wait indefinitely */
+    hal_tick_t deadline;
+    /** Deferred error of answer receiving */
+    fpc_bep_result_t result;
+    /** CMD_CANCEL is exchanged instead of the command, then the command is
+        finished with this result. FPC_BEP_RESULT_OK - not cancelling */
+    fpc_bep_result_t cancel_result;
+    /** Answers received while cancelling */
+    uint8_t cancel_answers;
+    HCP_done_cb_t done;
+    void *ctx;
+} HCP_async_t;
+
+struct HCP_comm {
     /** Send data to BM-Lite */
     fpc_bep_result_t (*write) (uint16_t, const uint8_t *, uint32_t);  
     /** Receive data from BM-Lite */
@@ -51,7 +105,31 @@ typedef struct {
     HCP_arg_t arg;
     /** Result of execution command on BM-Lite */
     fpc_bep_result_t bep_result;
-} HCP_comm_t;
+    /** Check if BM-Lite has data to send (optional).
+        Required for non-blocking operation. If not set, bmlite_process() blocks in read() */
+    bool (*ready)(void);
+    /** Set by bmlite_cancel(). Cleared when pending command is cancelled */
+    volatile sig_atomic_t cancel;
+    /** HAL device handle selected before every transfer. NULL - default device */
+    void *phy_dev;
+    /** State of non-blocking command execution */
+    HCP_async_t async;
+    /** Cache of used template IDs (optional), see bep_template_id_alloc() */
+    struct bmlite_id_cache *id_cache;
+    /** BM-Lite is busy after previous command until this tick. 0 - not busy */
+    hal_tick_t hold_until;
+    /** hold_until is boot time after platform_bmlite_reset_chain(), see bep_boot_wait() */
+    bool booting;
+    /** Timing of the firmware (optional), see bep_timing_select() */
+    const struct bmlite_timing *timing;
+    /** Tick when the current operation must be finished, see bmlite_deadline_begin().
+        0 - no deadline */
+    hal_tick_t deadline;
+    /** Link layer counters, see bmlite_link_check() */
+    HCP_link_stats_t link_stats;
+    /** Cache of BM-Lite properties (optional), see bep_caps_probe() */
+    struct bmlite_caps *caps;
+};
 
 /**
  * @brief Send prepared command packet to FPC BM-LIte
@@ -85,6 +163,134 @@ fpc_bep_result_t bmlite_receive(HCP_comm_t *hcp_comm);
  */
 fpc_bep_result_t bmlite_tranceive(HCP_comm_t *hcp_comm);
 
+/**
+ * @brief Cancel command waiting for BM-Lite answer
+ *
+ * @param[in] hcp_comm - pointer to HCP_comm struct
+ *
+ *   Safe to call from other thread or signal handler. The thread waiting for
+ *   the answer stops waiting, sends CMD_CANCEL, drains BM-Lite answers and
+ *   returns FPC_BEP_RESULT_CANCELLED. If no command is waiting, the request
+ *   stays pending and cancels the next one.
+ *   Requires hcp_comm->ready, otherwise the request is served only after
+ *   read() returns.
+ */
+void bmlite_cancel(HCP_comm_t *hcp_comm);
+
+/**
+ * @brief Bring the link back in step without BM-Lite reset
+ *
+ *   Used after FPC_BEP_RESULT_IO_ERROR or FPC_BEP_RESULT_TIMEOUT, when the
+ *   host and BM-Lite may disagree on framing. Incoming data is drained and
+ *   scanned for valid link frames, which are acknowledged so BM-Lite
+ *   finishes sending. Then CMD_CANCEL is exchanged, so no command is left
+ *   pending on BM-Lite. Templates and images in BM-Lite RAM are kept.
+ *
+ * @param[in] hcp_comm - pointer to HCP_comm struct
+ * @param[in] timeout  - time limit of the whole procedure (msec), 0 - 1 s
+ *
+ * @return ::fpc_bep_result_t, FPC_BEP_RESULT_WRONG_STATE if a non-blocking
+ *         command is in progress. Reset BM-Lite if resync fails
+ */
+fpc_bep_result_t bmlite_resync(HCP_comm_t *hcp_comm, uint32_t timeout);
+
+/**
+ * @brief Start non-blocking execution of prepared command packet
+ *
+ * @param[in] hcp_comm - pointer to HCP_comm struct
+ * @param[in] done     - callback called by bmlite_process() when the answer
+ *                       is received or communication failed
+ * @param[in] ctx      - user context passed to the callback
+ *
+ *   The command is not sent until bmlite_process() is called.
+ *   pkt_buffer must not be touched until the callback is called.
+ *
+ * @return ::fpc_bep_result_t
+ *   FPC_BEP_RESULT_WRONG_STATE if other command is in progress
+ */
+fpc_bep_result_t bmlite_submit(HCP_comm_t *hcp_comm, HCP_done_cb_t done, void *ctx);
+
+/**
+ * @brief Advance non-blocking command execution
+ *
+ * @param[in] hcp_comm - pointer to HCP_comm struct
+ *
+ *   Sends frames and reads ACKs/answer frames which are already available.
+ *   Never waits for BM-Lite if hcp_comm->ready is set.
+ *   Calls completion callback when the command is finished.
+ *   A command cancelled by bmlite_cancel() or by the deadline is finished
+ *   after CMD_CANCEL is exchanged the same way, frame by frame.
+ *
+ * @return true if command is still in progress
+ */
+bool bmlite_process(HCP_comm_t *hcp_comm);
+
+/**
+ * @brief Don't send next command to BM-Lite for the given time
+ *
+ *   Used when BM-Lite keeps working after answering a command. The next
+ *   bmlite_send() or bmlite_submit() waits for the rest of the time, so
+ *   nothing is spent if the next command comes later anyway.
+ *
+ * @param[in] hcp_comm - pointer to HCP_comm struct
+ * @param[in] ms       - time BM-Lite may be busy (msec)
+ */
+void bmlite_hold_off(HCP_comm_t *hcp_comm, uint32_t ms);
+
+/**
+ * @brief Start operation which must be finished within the given time
+ *
+ *   All waits of following commands (READY, ACK, frame body) are limited
+ *   by the deadline, commands are not started after it. If the deadline
+ *   expires while BM-Lite is executing a command, the command is cancelled
+ *   with CMD_CANCEL. Nested operations can only make the deadline earlier.
+ *
+ * @param[in] hcp_comm - pointer to HCP_comm struct
+ * @param[in] timeout  - time limit (msec). 0 - keep current deadline
+ *
+ * @return previous deadline, to be passed to bmlite_deadline_end()
+ */
+hal_tick_t bmlite_deadline_begin(HCP_comm_t *hcp_comm, uint32_t timeout);
+
+/**
+ * @brief Finish operation started by bmlite_deadline_begin()
+ *
+ * @param[in] hcp_comm - pointer to HCP_comm struct
+ * @param[in] prev     - deadline returned by bmlite_deadline_begin()
+ */
+void bmlite_deadline_end(HCP_comm_t *hcp_comm, hal_tick_t prev);
+
+/**
+ * @brief Get timeout limited by time left to the deadline
+ *
+ * @param[in] hcp_comm - pointer to HCP_comm struct
+ * @param[in] timeout  - timeout (msec). 0 - wait indefinitely
+ *
+ * @return timeout or time left to the deadline, whichever is less.
+ *         At least 1 ms if there is a deadline, even an expired one
+ */
+uint32_t bmlite_deadline_budget(HCP_comm_t *hcp_comm, uint32_t timeout);
+
+/**
+ * @brief Get time when the current step of non-blocking command times out
+ *
+ * @param[in] hcp_comm - pointer to HCP_comm struct
+ *
+ * @return ::hal_tick_t Deadline tick. 0 if there is no deadline
+ */
+hal_tick_t bmlite_get_deadline(HCP_comm_t *hcp_comm);
+
+/**
+ * @brief Get file descriptor to wait for BM-Lite data on
+ *
+ * @param[in] hcp_comm - pointer to HCP_comm struct
+ *
+ *   The descriptor signals POLLPRI on BM-Lite IRQ rising edge.
+ *
+ * @return file descriptor. -1 if not supported by HAL
+ */
+int bmlite_get_fd(HCP_comm_t *hcp_comm);
+
 /**
  * @brief Initialize new command for BM-Lite
  *
@@ -124,6 +330,18 @@ fpc_bep_result_t bmlite_add_arg(HCP_comm_t *hcp_comm, uint16_t arg_type, void *a
  */
 fpc_bep_result_t bmlite_get_arg(HCP_comm_t *hcp_comm, uint16_t arg_type);
 
+/**
+ * @brief  Search for optional argument in received answer.
+ *
+ *  Same as bmlite_get_arg(), but missing argument is not reported as error
+ *
+ * @param[in] hcp_comm     - pointer to HCP_comm struct
+ * @param[in] arg_type     - argument key
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_get_arg_opt(HCP_comm_t *hcp_comm, uint16_t arg_type);
+
 /**
  * @brief  Search for argument in received answer and copy argument's data
  *         to arg_data 
@@ -31,6 +31,7 @@
 #include <stddef.h>
 
 #include "fpc_bep_types.h"
+#include "hcp_tiny.h"
 
 /**
  * @brief Initializes board
@@ -39,12 +40,35 @@
  */
 fpc_bep_result_t platform_init(void *params);
 
+/**
+ * @brief Initializes board, BM-Lite is reset only if it doesn't respond
+ *
+ *   Skips reset and boot time of platform_init() when BM-Lite is already
+ *   running, e.g. on host application restart. See bep_warm_start().
+ *
+ * @param[in] params  - pointer to additional parameters.
+ * @param[in] chain   - HCP com chain
+ */
+fpc_bep_result_t platform_init_warm(void *params, HCP_comm_t *chain);
+
 /**
  * @brief Does BM-Lite HW Reset
  *
+ *   Waits for boot with bmlite_timing_default.
  */
 void platform_bmlite_reset(void);
 
+/**
+ * @brief Does HW Reset of BM-Lite of the chain
+ *
+ *   Reset pulse and boot time are taken from HCP_comm_t.timing. Boot is not
+ *   waited for here: the next command waits for it with bep_boot_wait(), so
+ *   sensors of other chains are not affected.
+ *
+ * @param[in] chain - HCP com chain
+ */
+void platform_bmlite_reset_chain(HCP_comm_t *chain);
+
 /**
  * @brief Sends data over SPI port in blocking mode.
  *
@@ -89,6 +113,13 @@ fpc_bep_result_t platform_bmlite_spi_receive(uint16_t size, uint8_t *data, uint3
  */
 fpc_bep_result_t platform_bmlite_uart_receive(uint16_t size, uint8_t *data, uint32_t timeout);
 
+/**
+ * @brief Checks if BM-Lite has data to send over SPI port. Never blocks.
+ *
+ * @return true if BM-Lite IRQ pin is set
+ */
+bool platform_bmlite_spi_ready(void);
+
 /**
  * @brief Stops execution if a debug interface is attached.
  */
@@ -17,13 +17,17 @@
 #include "hcp_tiny.h"
 #include "bmlite_if.h"
 #include "bmlite_hal.h"
+#include "platform.h"
 #include <stdio.h>
+#include <string.h>
 
 #include "bmlite_if_callbacks.h"
 
 #define MAX_CAPTURE_ATTEMPTS 15
 #define MAX_SINGLE_CAPTURE_ATTEMPTS 3
 #define CAPTURE_TIMEOUT 3000
+/** Timeout of one probe while BM-Lite boots, ms */
+#define BOOT_POLL_TIMEOUT 10
 
 #define exit_if_err(c) { bep_result = c; if(bep_result || chain->bep_result) goto exit; }
 
@@ -50,53 +54,157 @@ __attribute__((weak)) void bmlite_on_identify_finish() {}
 
 fpc_bep_result_t bep_enroll_finger(HCP_comm_t *chain)
 {
-    uint32_t samples_remaining = 0;
+    bmlite_enroll_session_t session;
+
+    bep_enroll_session_init(&session, NULL);
+    return bep_enroll_session_run(chain, &session);
+}
+
+void bep_enroll_session_init(bmlite_enroll_session_t *session, const bmlite_enroll_config_t *cfg)
+{
+    memset(session, 0, sizeof(bmlite_enroll_session_t));
+    if (cfg) {
+        session->cfg = *cfg;
+    } else {
+        session->cfg.step_timeout = CAPTURE_TIMEOUT;
+        session->cfg.wait_finger_up = true;
+    }
+    if (session->cfg.max_steps == 0) {
+        session->cfg.max_steps = MAX_CAPTURE_ATTEMPTS;
+    }
+}
+
+/*
+ * Timeout for the next command, limited by the overall deadline.
+ * Returns false if the deadline has passed.
+ */
+static bool enroll_timeout(bmlite_enroll_session_t *session, hal_tick_t start,
+        uint16_t step_timeout, uint16_t *timeout)
+{
+    uint32_t elapsed, left;
+
+    *timeout = step_timeout;
+    if (session->cfg.timeout == 0) {
+        return true;
+    }
+    elapsed = hal_timebase_get_tick() - start;
+    if (elapsed >= session->cfg.timeout) {
+        return false;
+    }
+    left = session->cfg.timeout - elapsed;
+    if (left > UINT16_MAX) {
+        left = UINT16_MAX;
+    }
+    if (*timeout == 0 || *timeout > left) {
+        *timeout = left;
+    }
+    return true;
+}
+
+fpc_bep_result_t bep_enroll_session_run(HCP_comm_t *chain, bmlite_enroll_session_t *session)
+{
     fpc_bep_result_t bep_result = FPC_BEP_RESULT_OK;
+    hal_tick_t start = hal_timebase_get_tick();
     bool enroll_done = false;
+    bool expired = false;
+    uint16_t timeout;
+    hal_tick_t t;
+
+    session->nr_steps = 0;
+    session->samples_remaining = UINT32_MAX;
+    session->capture_ms = 0;
+    session->add_ms = 0;
+    session->finger_up_ms = 0;
 
     bmlite_on_start_enroll();
     /* Enroll start */
     exit_if_err(bmlite_send_cmd(chain, CMD_ENROLL, ARG_START));
-    
-    for (uint8_t i = 0; i < MAX_CAPTURE_ATTEMPTS; ++i) {
+
+    while (session->nr_steps < session->cfg.max_steps) {
+        bmlite_enroll_step_t *step = &session->step;
+
+        if (!enroll_timeout(session, start, session->cfg.step_timeout, &timeout)) {
+            expired = true;
+            break;
+        }
+        memset(step, 0, sizeof(bmlite_enroll_step_t));
+        step->samples_remaining = session->samples_remaining;
 
         bmlite_on_start_enrollcapture();
-        bep_result = bep_capture(chain, CAPTURE_TIMEOUT);
+        t = hal_timebase_get_tick();
+        bep_result = bep_capture(chain, timeout);
+        step->capture_ms = hal_timebase_get_tick() - t;
         bmlite_on_finish_enrollcapture();
 
-        if (bep_result != FPC_BEP_RESULT_OK) {
-            continue;
+        if (bep_result == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_OK) {
+            /* Enroll add */
+            t = hal_timebase_get_tick();
+            bep_result = bmlite_send_cmd(chain, CMD_ENROLL, ARG_ADD);
+            if (bep_result == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_OK &&
+                bmlite_get_arg(chain, ARG_COUNT) == FPC_BEP_RESULT_OK) {
+                memcpy(&session->samples_remaining, chain->arg.data, sizeof(uint32_t));
+                step->samples_remaining = session->samples_remaining;
+                step->accepted = true;
+            }
+            step->add_ms = hal_timebase_get_tick() - t;
         }
+        step->result = bep_result ? bep_result : chain->bep_result;
+        session->capture_ms += step->capture_ms;
+        session->add_ms += step->add_ms;
+        session->nr_steps++;
 
-        /* Enroll add */
-        bep_result = bmlite_send_cmd(chain, CMD_ENROLL, ARG_ADD);
-        if (bep_result != FPC_BEP_RESULT_OK) {
-            continue;
+        if (bep_result == FPC_BEP_RESULT_CANCELLED || bep_result == FPC_BEP_RESULT_IO_ERROR) {
+            break;
         }
 
-        bmlite_get_arg(chain, ARG_COUNT);
-        samples_remaining = *(uint32_t *)chain->arg.data;
-//      DEBUG("Enroll samples remaining: %d\n", samples_remaining);
-
         /* Break enrolling if we can't collect enough correct images for enroll*/
-        if (samples_remaining == 0U) {
+        if (step->accepted && session->samples_remaining == 0U) {
             enroll_done = true;
-            break;
+        } else if (step->accepted && session->cfg.wait_finger_up) {
+            // Rejected sample is captured again without lifting the finger
+            if (!enroll_timeout(session, start, session->cfg.finger_up_timeout, &timeout)) {
+                expired = true;
+            } else {
+                t = hal_timebase_get_tick();
+                bep_result = sensor_wait_finger_not_present(chain, timeout);
+                step->finger_up_ms = hal_timebase_get_tick() - t;
+                session->finger_up_ms += step->finger_up_ms;
+            }
         }
 
-        sensor_wait_finger_not_present(chain, 0);
+        if (session->cfg.progress) {
+            session->cfg.progress(session->cfg.ctx, session->nr_steps - 1, step);
+        }
+        if (enroll_done || expired || bep_result == FPC_BEP_RESULT_CANCELLED) {
+            break;
+        }
     }
 
-    bep_result = bmlite_send_cmd(chain, CMD_ENROLL, ARG_FINISH);
+    t = hal_timebase_get_tick();
+    if (bep_result == FPC_BEP_RESULT_CANCELLED || expired) {
+        // Close enroll session but report cancellation or timeout
+        bmlite_send_cmd(chain, CMD_ENROLL, ARG_FINISH);
+        if (expired) {
+            bep_result = FPC_BEP_RESULT_TIMEOUT;
+        }
+    } else {
+        bep_result = bmlite_send_cmd(chain, CMD_ENROLL, ARG_FINISH);
+    }
+    session->finish_ms = hal_timebase_get_tick() - t;
 
 exit:
+    session->total_ms = hal_timebase_get_tick() - start;
     bmlite_on_finish_enroll();
+    if (bep_result == FPC_BEP_RESULT_CANCELLED || bep_result == FPC_BEP_RESULT_TIMEOUT) {
+        return bep_result;
+    }
     return (!enroll_done) ? FPC_BEP_RESULT_GENERAL_ERROR : bep_result;
 }
 
 fpc_bep_result_t bep_identify_finger(HCP_comm_t *chain, uint32_t timeout, uint16_t *template_id, bool *match)
 {
     fpc_bep_result_t bep_result;
+    hal_tick_t prev_deadline = bmlite_deadline_begin(chain, timeout);
     *match = false;
 
     bmlite_on_identify_start();
@@ -109,10 +217,9 @@ fpc_bep_result_t bep_identify_finger(HCP_comm_t *chain, uint32_t timeout, uint16
     if(*match) {
         bmlite_get_arg(chain, ARG_ID);
         *template_id = *(uint16_t *)chain->arg.data;
-        // Delay for possible updating template on BM-Lite
-        hal_timebase_busy_wait(50);
     }
 exit:
+    bmlite_deadline_end(chain, prev_deadline);
     bmlite_on_identify_finish();
     return bep_result;    
 }
@@ -123,6 +230,7 @@ fpc_bep_result_t sensor_wait_finger_present(HCP_comm_t *chain, uint16_t timeout)
     uint32_t prev_timeout = chain->phy_rx_timeout;
 
     bmlite_on_start_capture();
+    timeout = HCP_MIN(bmlite_deadline_budget(chain, timeout), UINT16_MAX);
     chain->phy_rx_timeout = timeout;
     bep_result = bmlite_send_cmd_arg(chain, CMD_WAIT, ARG_FINGER_DOWN, ARG_TIMEOUT, &timeout, sizeof(timeout));
     chain->phy_rx_timeout = prev_timeout;
@@ -136,6 +244,7 @@ fpc_bep_result_t sensor_wait_finger_not_present(HCP_comm_t *chain, uint16_t time
     fpc_bep_result_t bep_result;
     uint32_t prev_timeout = chain->phy_rx_timeout;
 
+    timeout = HCP_MIN(bmlite_deadline_budget(chain, timeout), UINT16_MAX);
     chain->phy_rx_timeout = timeout;
     bep_result = bmlite_send_cmd_arg(chain, CMD_WAIT, ARG_FINGER_UP, ARG_TIMEOUT, &timeout, sizeof(timeout));
     chain->phy_rx_timeout = prev_timeout;
@@ -143,23 +252,43 @@ fpc_bep_result_t sensor_wait_finger_not_present(HCP_comm_t *chain, uint16_t time
     return bep_result;
 }
 
+fpc_bep_result_t bep_sleep(HCP_comm_t *chain, bool deep, uint32_t timeout)
+{
+    fpc_bep_result_t bep_result;
+    uint32_t prev_timeout = chain->phy_rx_timeout;
+
+    // The answer comes on wake-up
+    chain->phy_rx_timeout = bmlite_deadline_budget(chain, timeout);
+    bep_result = bmlite_send_cmd(chain, CMD_MCU, deep ? ARG_DEEP_SLEEP : ARG_SLEEP);
+    chain->phy_rx_timeout = prev_timeout;
+
+    return bep_result;
+}
+
 fpc_bep_result_t bep_capture(HCP_comm_t *chain, uint16_t timeout)
 {
     fpc_bep_result_t bep_result;
     uint32_t prev_timeout = chain->phy_rx_timeout;
+    hal_tick_t prev_deadline = bmlite_deadline_begin(chain, timeout);
 
     bmlite_on_start_capture();
-    chain->phy_rx_timeout = timeout;
     for(int i=0; i< MAX_SINGLE_CAPTURE_ATTEMPTS; i++) {
-        bep_result = bmlite_send_cmd_arg(chain, CMD_CAPTURE, ARG_NONE, ARG_TIMEOUT, &timeout, sizeof(timeout));
+        // Retries share the time limit
+        uint16_t step_timeout = HCP_MIN(bmlite_deadline_budget(chain, timeout), UINT16_MAX);
+
+        chain->phy_rx_timeout = step_timeout;
+        bep_result = bmlite_send_cmd_arg(chain, CMD_CAPTURE, ARG_NONE, ARG_TIMEOUT,
+                &step_timeout, sizeof(step_timeout));
         if(bep_result == FPC_BEP_RESULT_IO_ERROR ||
-           bep_result == FPC_BEP_RESULT_TIMEOUT) {
+           bep_result == FPC_BEP_RESULT_TIMEOUT ||
+           bep_result == FPC_BEP_RESULT_CANCELLED) {
             break;
         }
         if( !(bep_result || chain->bep_result))
             break;
     }
     chain->phy_rx_timeout = prev_timeout;
+    bmlite_deadline_end(chain, prev_deadline);
     bmlite_on_finish_capture();
 
     return bep_result;
@@ -175,6 +304,58 @@ fpc_bep_result_t bep_image_get_size(HCP_comm_t *chain, uint32_t *size)
     return FPC_BEP_RESULT_OK;
 }
 
+static uint16_t arg_u16(HCP_comm_t *chain, uint16_t arg_type, uint16_t def)
+{
+    uint16_t value = def;
+
+    // Optional argument, don't report it as an error if missing
+    if (bmlite_get_arg_opt(chain, arg_type) == FPC_BEP_RESULT_OK) {
+        if (chain->arg.size == sizeof(uint16_t)) {
+            memcpy(&value, chain->arg.data, sizeof(uint16_t));
+        } else if (chain->arg.size == sizeof(uint32_t)) {
+            uint32_t v;
+            memcpy(&v, chain->arg.data, sizeof(uint32_t));
+            value = v;
+        }
+    }
+    return value;
+}
+
+static bmlite_caps_t *caps_get(HCP_comm_t *chain)
+{
+    if (chain->caps && chain->caps->valid) {
+        chain->bep_result = FPC_BEP_RESULT_OK;
+        return chain->caps;
+    }
+    return NULL;
+}
+
+fpc_bep_result_t bep_image_get_geometry(HCP_comm_t *chain, bmlite_image_geometry_t *geometry)
+{
+    bmlite_caps_t *caps = caps_get(chain);
+    uint16_t side;
+
+    if (caps && caps->geometry.size) {
+        *geometry = caps->geometry;
+        return FPC_BEP_RESULT_OK;
+    }
+
+    assert(bmlite_send_cmd(chain, CMD_IMAGE, ARG_SIZE));
+    assert(bmlite_get_arg(chain, ARG_SIZE));
+    memcpy(&geometry->size, chain->arg.data, sizeof(uint32_t));
+
+    // Square image by default
+    for (side = 1; (uint32_t)side * side < geometry->size; side++);
+    geometry->width = arg_u16(chain, ARG_WIDTH, side);
+    geometry->height = arg_u16(chain, ARG_HEIGHT, geometry->width ? geometry->size / geometry->width : 0);
+    geometry->dpi = arg_u16(chain, ARG_DPI, BMLITE_IMAGE_DEFAULT_DPI);
+    if ((uint32_t)geometry->width * geometry->height != geometry->size) {
+        return FPC_BEP_RESULT_INVALID_FORMAT;
+    }
+
+    return FPC_BEP_RESULT_OK;
+}
+
 fpc_bep_result_t image_create(HCP_comm_t *chain)
 {
     return bmlite_send_cmd(chain, CMD_IMAGE, ARG_CREATE);
@@ -203,12 +384,179 @@ fpc_bep_result_t bep_image_extract(HCP_comm_t *chain)
 
 fpc_bep_result_t bep_identify(HCP_comm_t *chain)
 {
-   return bmlite_send_cmd(chain, CMD_IDENTIFY, ARG_NONE);
+    const bmlite_timing_t *timing = chain->timing ? chain->timing : &bmlite_timing_default;
+    fpc_bep_result_t bep_result;
+
+    bep_result = bmlite_send_cmd(chain, CMD_IDENTIFY, ARG_NONE);
+    // BM-Lite may be updating the matched template, let the next command wait for it
+    if (bep_result == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_OK &&
+        bmlite_get_arg_opt(chain, ARG_MATCH) == FPC_BEP_RESULT_OK && *(bool *)chain->arg.data) {
+        bmlite_hold_off(chain, timing->template_update_ms);
+    }
+    return bep_result;
+}
+
+fpc_bep_result_t bep_match(HCP_comm_t *chain, bool *match)
+{
+    *match = false;
+    assert(bmlite_send_cmd(chain, CMD_MATCH, ARG_NONE));
+    if (chain->bep_result == FPC_BEP_RESULT_OK) {
+        assert(bmlite_get_arg(chain, ARG_MATCH));
+        *match = *(bool *)chain->arg.data;
+    }
+    return FPC_BEP_RESULT_OK;
+}
+
+/*
+ * Template ID cache
+ */
+
+static void id_cache_set(bmlite_id_cache_t *cache, uint16_t id, bool used)
+{
+    uint32_t mask;
+
+    if (id >= BMLITE_ID_CACHE_MAX) {
+        // IDs beyond the map are unique only when the cache is filled
+        if (used) {
+            cache->count++;
+        } else if (cache->count) {
+            cache->count--;
+        }
+        return;
+    }
+    mask = 1u << (id % 32);
+    if (used && !(cache->map[id / 32] & mask)) {
+        cache->map[id / 32] |= mask;
+        cache->count++;
+    } else if (!used && (cache->map[id / 32] & mask)) {
+        cache->map[id / 32] &= ~mask;
+        cache->count--;
+        if (id < cache->free_hint) {
+            cache->free_hint = id;
+        }
+    }
+}
+
+static void id_cache_clear(bmlite_id_cache_t *cache)
+{
+    memset(cache->map, 0, sizeof(cache->map));
+    cache->count = 0;
+    cache->free_hint = 0;
+}
+
+/* Keep the cache in sync with result of storage command */
+static void id_cache_update(HCP_comm_t *chain, fpc_bep_result_t res, uint16_t id, bool used)
+{
+    bmlite_id_cache_t *cache = chain->id_cache;
+
+    if (cache == NULL || !cache->valid) {
+        return;
+    }
+    if (res != FPC_BEP_RESULT_OK) {
+        // Command may or may not be executed
+        cache->valid = false;
+    } else if (chain->bep_result == FPC_BEP_RESULT_OK) {
+        if (used && id >= BMLITE_ID_CACHE_MAX) {
+            // Saving may replace a template, the count is unknown
+            cache->valid = false;
+        } else {
+            id_cache_set(cache, id, used);
+        }
+    }
+}
+
+static void id_cache_fill(HCP_comm_t *chain)
+{
+    bmlite_id_cache_t *cache = chain->id_cache;
+    uint16_t id;
+
+    id_cache_clear(cache);
+    for (uint32_t i = 0; i < chain->arg.size / 2; i++) {
+        memcpy(&id, chain->arg.data + i * 2, sizeof(id));
+        id_cache_set(cache, id, true);
+    }
+    cache->valid = true;
+}
+
+fpc_bep_result_t bep_template_id_load(HCP_comm_t *chain)
+{
+    // Fills the cache on success
+    return bep_template_get_ids(chain);
+}
+
+void bep_template_id_invalidate(HCP_comm_t *chain)
+{
+    if (chain->id_cache) {
+        chain->id_cache->valid = false;
+    }
+}
+
+static fpc_bep_result_t id_cache_get(HCP_comm_t *chain, bmlite_id_cache_t **cache)
+{
+    fpc_bep_result_t bep_result;
+
+    if (chain->id_cache == NULL) {
+        return FPC_BEP_RESULT_WRONG_STATE;
+    }
+    if (!chain->id_cache->valid) {
+        bep_result = bep_template_id_load(chain);
+        if (!chain->id_cache->valid) {
+            if (bep_result == FPC_BEP_RESULT_OK) {
+                bep_result = chain->bep_result;
+            }
+            return bep_result ? bep_result : FPC_BEP_RESULT_GENERAL_ERROR;
+        }
+    }
+    *cache = chain->id_cache;
+
+    return FPC_BEP_RESULT_OK;
+}
+
+fpc_bep_result_t bep_template_id_is_used(HCP_comm_t *chain, uint16_t id, bool *used)
+{
+    bmlite_id_cache_t *cache;
+
+    if (id >= BMLITE_ID_CACHE_MAX) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+    assert(id_cache_get(chain, &cache));
+    *used = cache->map[id / 32] & (1u << (id % 32));
+
+    return FPC_BEP_RESULT_OK;
+}
+
+fpc_bep_result_t bep_template_id_alloc(HCP_comm_t *chain, uint16_t *id)
+{
+    bmlite_id_cache_t *cache;
+
+    assert(id_cache_get(chain, &cache));
+
+    // Words below free_hint are full, so usually the first word checked has a free bit
+    for (uint32_t w = cache->free_hint / 32; w < sizeof(cache->map) / sizeof(cache->map[0]); w++) {
+        uint32_t free_bits = ~cache->map[w];
+        if (free_bits) {
+            uint32_t free_id = w * 32 + __builtin_ctz(free_bits);
+            if (free_id >= BMLITE_ID_CACHE_MAX) {
+                break;
+            }
+            cache->free_hint = free_id;
+            *id = free_id;
+            return FPC_BEP_RESULT_OK;
+        }
+    }
+    cache->free_hint = BMLITE_ID_CACHE_MAX;
+
+    return FPC_BEP_RESULT_NO_RESOURCE;
 }
 
 fpc_bep_result_t bep_template_save(HCP_comm_t *chain, uint16_t template_id)
 {
-    return bmlite_send_cmd_arg(chain, CMD_TEMPLATE, ARG_SAVE, ARG_ID, &template_id, sizeof(template_id));
+    fpc_bep_result_t bep_result;
+
+    bep_result = bmlite_send_cmd_arg(chain, CMD_TEMPLATE, ARG_SAVE, ARG_ID, &template_id, sizeof(template_id));
+    id_cache_update(chain, bep_result, template_id, true);
+
+    return bep_result;
 }
 
 fpc_bep_result_t bep_template_remove_ram(HCP_comm_t *chain)
@@ -230,14 +578,31 @@ fpc_bep_result_t bep_template_put(HCP_comm_t *chain, uint8_t *data, uint16_t len
 
 fpc_bep_result_t bep_template_remove(HCP_comm_t *chain, uint16_t template_id)
 {
-    return bmlite_send_cmd_arg(chain, CMD_STORAGE_TEMPLATE, ARG_DELETE, 
+    fpc_bep_result_t bep_result;
+
+    bep_result = bmlite_send_cmd_arg(chain, CMD_STORAGE_TEMPLATE, ARG_DELETE, 
             ARG_ID, &template_id, sizeof(template_id));
+    id_cache_update(chain, bep_result, template_id, false);
+
+    return bep_result;
 }
 
 fpc_bep_result_t bep_template_remove_all(HCP_comm_t *chain)
 {
-    return bmlite_send_cmd_arg(chain, CMD_STORAGE_TEMPLATE, ARG_DELETE,
+    fpc_bep_result_t bep_result;
+
+    bep_result = bmlite_send_cmd_arg(chain, CMD_STORAGE_TEMPLATE, ARG_DELETE,
              ARG_ALL, 0, 0);
+    if (chain->id_cache) {
+        if (bep_result == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_OK) {
+            id_cache_clear(chain->id_cache);
+            chain->id_cache->valid = true;
+        } else {
+            chain->id_cache->valid = false;
+        }
+    }
+
+    return bep_result;
 }
 
 fpc_bep_result_t bep_template_load_storage(HCP_comm_t *chain, uint16_t template_id)
@@ -256,12 +621,25 @@ fpc_bep_result_t bep_template_get_count(HCP_comm_t *chain, uint16_t *count)
 
 fpc_bep_result_t bep_template_get_ids(HCP_comm_t *chain)
 {
+    fpc_bep_result_t bep_result;
+
     assert(bmlite_send_cmd(chain, CMD_STORAGE_TEMPLATE, ARG_ID));
-    return bmlite_get_arg(chain, ARG_DATA);
+    bep_result = bmlite_get_arg(chain, ARG_DATA);
+    // The list is here anyway, refresh the cache for free
+    if (chain->id_cache && chain->bep_result == FPC_BEP_RESULT_OK) {
+        if (bep_result != FPC_BEP_RESULT_OK) {
+            // No list means empty storage
+            chain->arg.size = 0;
+        }
+        id_cache_fill(chain);
+    }
+
+    return bep_result;
 }
 
 fpc_bep_result_t bep_sw_reset(HCP_comm_t *chain)
 {
+    bep_template_id_invalidate(chain);
     return bmlite_send_cmd(chain, CMD_RESET, ARG_NONE);
 }
 
@@ -275,20 +653,188 @@ fpc_bep_result_t bep_sensor_calibrate_remove(HCP_comm_t *chain)
     return bmlite_send_cmd(chain, CMD_STORAGE_CALIBRATION, ARG_DELETE);    
 }
 
+static void diag_arg(HCP_comm_t *chain, uint16_t arg_type, uint32_t *used, uint32_t *size)
+{
+    // Optional argument, don't report it as an error if missing
+    if (bmlite_get_arg_opt(chain, arg_type) == FPC_BEP_RESULT_OK) {
+        if (chain->arg.size >= sizeof(uint32_t)) {
+            memcpy(used, chain->arg.data, sizeof(uint32_t));
+        }
+        if (chain->arg.size >= 2 * sizeof(uint32_t)) {
+            memcpy(size, chain->arg.data + sizeof(uint32_t), sizeof(uint32_t));
+        }
+    }
+}
+
+fpc_bep_result_t bep_diag_get(HCP_comm_t *chain, bmlite_diag_t *diag)
+{
+    memset(diag, 0, sizeof(bmlite_diag_t));
+
+    bep_boot_wait(chain);
+    assert(bmlite_init_cmd(chain, CMD_DIAG, ARG_GET));
+    assert(bmlite_add_arg(chain, ARG_STACK, 0, 0));
+    assert(bmlite_add_arg(chain, ARG_HEAP, 0, 0));
+    assert(bmlite_tranceive(chain));
+    if (chain->bep_result != FPC_BEP_RESULT_OK) {
+        return chain->bep_result;
+    }
+    diag_arg(chain, ARG_STACK, &diag->stack_used, &diag->stack_size);
+    diag_arg(chain, ARG_HEAP, &diag->heap_used, &diag->heap_size);
+
+    return FPC_BEP_RESULT_OK;
+}
+
+fpc_bep_result_t bep_storage_log_get(HCP_comm_t *chain, uint8_t *data, uint32_t size)
+{
+    assert(bmlite_send_cmd(chain, CMD_STORAGE_LOG, ARG_UPLOAD));
+    return bmlite_copy_arg(chain, ARG_DATA, data, size);
+}
+
 fpc_bep_result_t bep_version(HCP_comm_t *chain, char *version, int len)
 {
+    bmlite_caps_t *caps = caps_get(chain);
+
+    if (caps) {
+        memcpy(version, caps->version, HCP_MIN(len, BMLITE_CAPS_VERSION_LEN));
+        return FPC_BEP_RESULT_OK;
+    }
     assert(bmlite_send_cmd_arg(chain, CMD_INFO, ARG_GET, ARG_VERSION, 0, 0));
     return bmlite_copy_arg(chain, ARG_VERSION, version, len);
 }
 
+fpc_bep_result_t bep_spi_max_clock_get(HCP_comm_t *chain, uint32_t *hz)
+{
+    bmlite_caps_t *caps = caps_get(chain);
+
+    if (caps && caps->max_spi_clock) {
+        *hz = caps->max_spi_clock;
+        return FPC_BEP_RESULT_OK;
+    }
+    assert(bmlite_send_cmd_arg(chain, CMD_SENSOR, ARG_GET, ARG_MAX_SPI_CLOCK, 0, 0));
+    if (chain->bep_result != FPC_BEP_RESULT_OK) {
+        return chain->bep_result;
+    }
+    return bmlite_copy_arg(chain, ARG_MAX_SPI_CLOCK, hz, sizeof(uint32_t));
+}
+
+fpc_bep_result_t bep_link_probe(HCP_comm_t *chain, uint32_t timeout)
+{
+    fpc_bep_result_t bep_result;
+    uint32_t prev_timeout = chain->phy_rx_timeout;
+    // ACK wait of the command frame is bounded by the deadline only
+    hal_tick_t prev_deadline = bmlite_deadline_begin(chain, timeout);
+
+    chain->phy_rx_timeout = timeout;
+    bep_result = bmlite_send_cmd_arg(chain, CMD_INFO, ARG_GET, ARG_VERSION, 0, 0);
+    chain->phy_rx_timeout = prev_timeout;
+    bmlite_deadline_end(chain, prev_deadline);
+    if (bep_result == FPC_BEP_RESULT_OK) {
+        bep_result = chain->bep_result;
+    }
+    // A pending answer to a command of a previous host process is not ours
+    if (bep_result == FPC_BEP_RESULT_OK &&
+        bmlite_get_arg(chain, ARG_VERSION) != FPC_BEP_RESULT_OK) {
+        bep_result = FPC_BEP_RESULT_IO_ERROR;
+    }
+
+    return bep_result;
+}
+
+fpc_bep_result_t bep_warm_start(HCP_comm_t *chain, uint32_t timeout)
+{
+    fpc_bep_result_t bep_result = bep_link_probe(chain, timeout);
+
+    if (bep_result != FPC_BEP_RESULT_OK) {
+        platform_bmlite_reset_chain(chain);
+    }
+
+    return bep_result;
+}
+
+void bep_boot_wait(HCP_comm_t *chain)
+{
+    const bmlite_timing_t *timing = chain->timing ? chain->timing : &bmlite_timing_default;
+    hal_tick_t until = chain->hold_until;
+    HCP_link_stats_t link_stats = chain->link_stats;
+
+    if (!chain->booting) {
+        return;
+    }
+    chain->booting = false;
+
+    for (;;) {
+        hal_tick_t left = until - hal_timebase_get_tick();
+
+        // Wrap-around safe check that boot time is not over
+        if (!left || left > timing->boot_ms) {
+            break;
+        }
+        chain->hold_until = 0;
+        if (bep_link_probe(chain, HCP_MIN(left, BOOT_POLL_TIMEOUT)) == FPC_BEP_RESULT_OK) {
+            break;
+        }
+    }
+    chain->hold_until = 0;
+    // Probes unanswered while booting are not link errors
+    chain->link_stats = link_stats;
+}
+
 fpc_bep_result_t bep_unique_id_get(HCP_comm_t *chain, uint8_t *unique_id)
 {
+    bmlite_caps_t *caps = caps_get(chain);
+
+    if (caps) {
+        memcpy(unique_id, caps->unique_id, BMLITE_UNIQUE_ID_LEN);
+        return FPC_BEP_RESULT_OK;
+    }
     assert(bmlite_send_cmd_arg(chain, CMD_INFO, ARG_GET, ARG_UNIQUE_ID, 0, 0));
-    return bmlite_copy_arg(chain, ARG_UNIQUE_ID, unique_id, 12);
+    return bmlite_copy_arg(chain, ARG_UNIQUE_ID, unique_id, BMLITE_UNIQUE_ID_LEN);
+}
+
+fpc_bep_result_t bep_caps_probe(HCP_comm_t *chain, bmlite_caps_t *caps)
+{
+    bmlite_image_geometry_t *geometry = &caps->geometry;
+
+    memset(caps, 0, sizeof(bmlite_caps_t));
+    if (chain->caps == caps) {
+        chain->caps = NULL;
+    }
+
+    assert(bmlite_send_cmd_arg(chain, CMD_INFO, ARG_GET, ARG_VERSION, 0, 0));
+    assert(bmlite_copy_arg(chain, ARG_VERSION, caps->version, BMLITE_CAPS_VERSION_LEN - 1));
+    assert(bmlite_send_cmd_arg(chain, CMD_INFO, ARG_GET, ARG_UNIQUE_ID, 0, 0));
+    assert(bmlite_copy_arg(chain, ARG_UNIQUE_ID, caps->unique_id, BMLITE_UNIQUE_ID_LEN));
+
+    // Older firmware may know none of these, they stay unknown then
+    assert(bmlite_init_cmd(chain, CMD_SENSOR, ARG_GET));
+    assert(bmlite_add_arg(chain, ARG_SENSOR_TYPE, 0, 0));
+    assert(bmlite_add_arg(chain, ARG_WIDTH, 0, 0));
+    assert(bmlite_add_arg(chain, ARG_HEIGHT, 0, 0));
+    assert(bmlite_add_arg(chain, ARG_DPI, 0, 0));
+    assert(bmlite_add_arg(chain, ARG_MAX_SPI_CLOCK, 0, 0));
+    assert(bmlite_tranceive(chain));
+    if (chain->bep_result == FPC_BEP_RESULT_OK) {
+        caps->sensor_type = arg_u16(chain, ARG_SENSOR_TYPE, 0);
+        geometry->width = arg_u16(chain, ARG_WIDTH, 0);
+        geometry->height = arg_u16(chain, ARG_HEIGHT, 0);
+        geometry->dpi = arg_u16(chain, ARG_DPI, BMLITE_IMAGE_DEFAULT_DPI);
+        geometry->size = (uint32_t)geometry->width * geometry->height;
+        if (bmlite_get_arg_opt(chain, ARG_MAX_SPI_CLOCK) == FPC_BEP_RESULT_OK &&
+            chain->arg.size == sizeof(uint32_t)) {
+            memcpy(&caps->max_spi_clock, chain->arg.data, sizeof(uint32_t));
+        }
+    }
+    chain->bep_result = FPC_BEP_RESULT_OK;
+
+    caps->valid = true;
+    chain->caps = caps;
+
+    return FPC_BEP_RESULT_OK;
 }
 
 fpc_bep_result_t bep_uart_speed_set(HCP_comm_t *chain, uint32_t speed)
 {
+    bep_boot_wait(chain);
     assert(bmlite_init_cmd(chain, CMD_COMMUNICATION, ARG_SPEED));
     assert(bmlite_add_arg(chain, ARG_SET, 0, 0));
     assert(bmlite_add_arg(chain, ARG_DATA, (uint8_t*)&speed, sizeof(speed)));
@@ -298,6 +844,7 @@ fpc_bep_result_t bep_uart_speed_set(HCP_comm_t *chain, uint32_t speed)
 
 fpc_bep_result_t bep_uart_speed_get(HCP_comm_t *chain, uint32_t *speed)
 {
+    bep_boot_wait(chain);
     assert(bmlite_init_cmd(chain, CMD_COMMUNICATION, ARG_SPEED));
     assert(bmlite_add_arg(chain, ARG_GET, 0, 0));
     assert(bmlite_tranceive(chain));
@@ -307,20 +854,51 @@ fpc_bep_result_t bep_uart_speed_get(HCP_comm_t *chain, uint32_t *speed)
 
 fpc_bep_result_t bep_sensor_reset(HCP_comm_t *chain)
 {
-    // Delay for possible updating template on BM-Lite
-    hal_timebase_busy_wait(50);
+    // Possible template update after identify is waited for by hold-off
+    return bmlite_send_cmd(chain, CMD_SENSOR, ARG_RESET);
+}
+
+/*
+ * Firmware timing
+ */
+
+const bmlite_timing_t bmlite_timing_default = {
+    .version = NULL,
+    .template_update_ms = 50,
+    .reset_pulse_ms = 100,
+    .boot_ms = 100,
+};
+
+fpc_bep_result_t bep_timing_select(HCP_comm_t *chain, const bmlite_timing_t *table,
+        uint32_t count)
+{
+    const bmlite_timing_t *timing = &bmlite_timing_default;
+    char version[100];
+
+    memset(version, 0, sizeof(version));
+    assert(bep_version(chain, version, sizeof(version) - 1));
+    for (uint32_t i = 0; i < count; i++) {
+        if (table[i].version == NULL ||
+            strncmp(version, table[i].version, strlen(table[i].version)) == 0) {
+            timing = &table[i];
+            break;
+        }
+    }
+    chain->timing = timing;
 
-    return bmlite_send_cmd(chain, CMD_SENSOR, ARG_RESET);    
+    return FPC_BEP_RESULT_OK;
 }
 
 fpc_bep_result_t bmlite_send_cmd(HCP_comm_t *chain, uint16_t cmd, uint16_t arg_type)
 {
+    bep_boot_wait(chain);
     assert(bmlite_init_cmd(chain, cmd, arg_type));
     return bmlite_tranceive(chain);
 }
 
 fpc_bep_result_t bmlite_send_cmd_arg(HCP_comm_t *chain, uint16_t cmd, uint16_t arg1_type, uint16_t arg2_type, void *arg2_data, uint16_t arg2_length)
 {
+    bep_boot_wait(chain);
     assert(bmlite_init_cmd(chain, cmd, arg1_type));
     assert(bmlite_add_arg(chain, arg2_type, arg2_data, arg2_length));
 
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    bmlite_link.c
+ * @brief   SPI clock tuning.
+ */
+
+#include "bmlite_hal.h"
+#include "bmlite_link.h"
+
+/** Timeout of one probe round trip (msec) */
+#define LINK_PROBE_TIMEOUT 100
+
+/** Clocks tried by tuning, Hz */
+static const uint32_t link_clocks[] = {
+    500000, 1000000, 2000000, 4000000, 8000000,
+    12000000, 16000000, 20000000, 24000000, 32000000,
+};
+
+#define NR_LINK_CLOCKS (sizeof(link_clocks) / sizeof(link_clocks[0]))
+
+const bmlite_link_config_t bmlite_link_default_config = {
+    .min_hz = 1000000,
+    .max_hz = 0,
+    .known_hz = 0,
+    .probes = 20,
+    .window = 200,
+    .max_error_permille = 10,
+};
+
+static uint32_t link_set_clock(HCP_comm_t *chain, bmlite_link_t *link, uint32_t hz)
+{
+    uint32_t actual;
+
+    hal_bmlite_select(chain->phy_dev);
+    actual = hal_bmlite_spi_set_clock(hz);
+    if (actual) {
+        link->clock_hz = actual;
+    }
+    return actual;
+}
+
+/* Round trips at the current clock, any link error fails the clock */
+static bool link_probe(HCP_comm_t *chain, uint32_t probes)
+{
+    uint32_t errors = chain->link_stats.errors;
+
+    for (uint32_t i = 0; i < probes; i++) {
+        if (bep_link_probe(chain, LINK_PROBE_TIMEOUT) != FPC_BEP_RESULT_OK) {
+            return false;
+        }
+    }
+    return chain->link_stats.errors == errors;
+}
+
+/* Try a faster clock, go back to the current one if it fails */
+static bool link_try(HCP_comm_t *chain, bmlite_link_t *link, uint32_t hz)
+{
+    uint32_t prev = link->clock_hz;
+    uint32_t actual = link_set_clock(chain, link, hz);
+
+    if (actual <= prev) {
+        link_set_clock(chain, link, prev);
+        return false;
+    }
+    if (!link_probe(chain, link->cfg.probes)) {
+        link_set_clock(chain, link, prev);
+        bmlite_resync(chain, 0);
+        return false;
+    }
+    return true;
+}
+
+fpc_bep_result_t bmlite_link_tune(HCP_comm_t *chain, bmlite_link_t *link,
+        const bmlite_link_config_t *cfg)
+{
+    uint32_t limit = UINT32_MAX;
+
+    link->cfg = cfg ? *cfg : bmlite_link_default_config;
+    link->module_max_hz = 0;
+    link->clock_hz = 0;
+    link->backoffs = 0;
+
+    if (!link_set_clock(chain, link, link->cfg.min_hz)) {
+        return FPC_BEP_RESULT_NOT_SUPPORTED;
+    }
+    if (!link_probe(chain, link->cfg.probes)) {
+        bmlite_resync(chain, 0);
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+
+    // Older firmware may not report its maximum, then board limit only
+    if (bep_spi_max_clock_get(chain, &link->module_max_hz) == FPC_BEP_RESULT_OK &&
+            link->module_max_hz) {
+        limit = link->module_max_hz;
+    } else {
+        link->module_max_hz = 0;
+    }
+    if (link->cfg.max_hz && link->cfg.max_hz < limit) {
+        limit = link->cfg.max_hz;
+    }
+
+    if (link->cfg.known_hz && link->cfg.known_hz <= limit &&
+            link_try(chain, link, link->cfg.known_hz)) {
+        goto exit;
+    }
+
+    for (uint32_t i = 0; i < NR_LINK_CLOCKS && link_clocks[i] <= limit; i++) {
+        if (link_clocks[i] > link->clock_hz && !link_try(chain, link, link_clocks[i])) {
+            break;
+        }
+    }
+
+exit:
+    link->window_start = chain->link_stats;
+    return FPC_BEP_RESULT_OK;
+}
+
+bool bmlite_link_check(HCP_comm_t *chain, bmlite_link_t *link)
+{
+    uint32_t frames = chain->link_stats.frames - link->window_start.frames;
+    uint32_t errors = chain->link_stats.errors - link->window_start.errors;
+
+    if (frames < link->cfg.window) {
+        return false;
+    }
+    link->window_start = chain->link_stats;
+    if ((uint64_t)errors * 1000 <= (uint64_t)link->cfg.max_error_permille * frames) {
+        return false;
+    }
+
+    for (uint32_t i = NR_LINK_CLOCKS; i-- > 0;) {
+        if (link_clocks[i] < link->clock_hz && link_clocks[i] >= link->cfg.min_hz) {
+            if (link_set_clock(chain, link, link_clocks[i])) {
+                link->backoffs++;
+                return true;
+            }
+            break;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    bmlite_wake.c
+ * @brief   Low-power identification loop.
+ */
+
+#include <string.h>
+
+#include "bmlite_hal.h"
+#include "bmlite_wake.h"
+
+const bmlite_wake_config_t bmlite_wake_default_config = {
+    .deep_sleep = false,
+    .sleep_timeout = 0,
+    .capture_timeout = 1000,
+};
+
+static fpc_bep_result_t wake_wait(HCP_comm_t *chain, const bmlite_wake_config_t *cfg,
+        bool *sleep_supported)
+{
+    fpc_bep_result_t bep_result;
+
+    if (*sleep_supported) {
+        bep_result = bep_sleep(chain, cfg->deep_sleep, cfg->sleep_timeout);
+        if (bep_result != FPC_BEP_RESULT_OK || chain->bep_result == FPC_BEP_RESULT_OK) {
+            return bep_result;
+        }
+        // Old firmware, don't ask again during this call
+        *sleep_supported = false;
+    }
+    return sensor_wait_finger_present(chain,
+            HCP_MIN(bmlite_deadline_budget(chain, cfg->sleep_timeout), UINT16_MAX));
+}
+
+static void stats_update(bmlite_wake_stats_t *stats, const bmlite_wake_result_t *result)
+{
+    if (stats->identified == 0 || result->latency_ms < stats->latency_min_ms) {
+        stats->latency_min_ms = result->latency_ms;
+    }
+    if (result->latency_ms > stats->latency_max_ms) {
+        stats->latency_max_ms = result->latency_ms;
+    }
+    stats->latency_total_ms += result->latency_ms;
+    stats->identified++;
+    if (result->match) {
+        stats->matches++;
+    }
+}
+
+fpc_bep_result_t bmlite_wake_identify(HCP_comm_t *chain, const bmlite_wake_config_t *cfg,
+        bmlite_wake_stats_t *stats, bmlite_wake_result_t *result)
+{
+    fpc_bep_result_t bep_result;
+    hal_tick_t prev_deadline;
+    bool sleep_supported = true;
+
+    if (cfg == NULL) {
+        cfg = &bmlite_wake_default_config;
+    }
+    memset(result, 0, sizeof(bmlite_wake_result_t));
+    prev_deadline = bmlite_deadline_begin(chain, cfg->sleep_timeout);
+
+    while (1) {
+        hal_tick_t wake;
+
+        bep_result = wake_wait(chain, cfg, &sleep_supported);
+        if (bep_result != FPC_BEP_RESULT_OK || chain->bep_result != FPC_BEP_RESULT_OK) {
+            break;
+        }
+        wake = hal_timebase_get_tick();
+        if (stats) {
+            stats->wakeups++;
+        }
+
+        bep_result = bep_identify_finger(chain, cfg->capture_timeout,
+                &result->template_id, &result->match);
+        if (bep_result == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_TIMEOUT) {
+            // Finger was gone before capture, go back to sleep
+            if (stats) {
+                stats->false_wakeups++;
+            }
+            chain->bep_result = FPC_BEP_RESULT_OK;
+            continue;
+        }
+        if (bep_result == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_OK) {
+            result->latency_ms = hal_timebase_get_tick() - wake;
+            if (stats) {
+                stats_update(stats, result);
+            }
+        }
+        break;
+    }
+
+    bmlite_deadline_end(chain, prev_deadline);
+
+    return bep_result;
+}
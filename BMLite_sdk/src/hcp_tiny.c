@@ -19,6 +19,7 @@
 #include "fpc_crc.h"
 #include "hcp_tiny.h"
 #include "bmlite_if_callbacks.h"
+#include "bmlite_hal.h"
 
 #ifdef DEBUG
 #include <stdio.h>
@@ -28,10 +29,45 @@
 #define LOG_DEBUG(...)
 #endif
 
+/** Application MTU size is PHY MTU - (Transport and Link overhead) */
+#define APP_MTU (MTU - 6 - 8)
+
+/** Timeout for ACK from BM-Lite (msec) */
+#define ACK_TIMEOUT 500
+
+/** Timeout for the rest of a frame after its header (msec) */
+#define RX_BODY_TIMEOUT 100
+
+/** Timeout for answers to CMD_CANCEL (msec) */
+#define CANCEL_TIMEOUT 500
+
+/**
+ * How often cancel request is checked while waiting for BM-Lite (msec).
+ * 0 - wait up to the deadline. For HALs where any interrupt, e.g. the one
+ * calling bmlite_cancel(), ends hal_bmlite_wait_status()
+ */
+#ifndef BMLITE_CANCEL_POLL_INTERVAL
+#define BMLITE_CANCEL_POLL_INTERVAL 10
+#endif
+
+/** Default time limit of link resync (msec) */
+#define RESYNC_TIMEOUT 1000
+
+/** Link is drained when no data comes for this time during resync (msec) */
+#define RESYNC_IDLE_TIMEOUT 20
+
 static uint32_t fpc_com_ack = FPC_BEP_ACK;
 
+static fpc_bep_result_t _receive(HCP_comm_t *hcp_comm, bool cancellable);
+static fpc_bep_result_t _wait_ready(HCP_comm_t *hcp_comm, uint32_t timeout, bool cancellable);
+static fpc_bep_result_t _cancel_sync(HCP_comm_t *hcp_comm);
 static fpc_bep_result_t _rx_link(HCP_comm_t *hcp_comm);
+static fpc_bep_result_t _rx_chunk(HCP_comm_t *hcp_comm, uint32_t *buf_len, 
+        uint16_t *seq_nr, uint16_t *seq_len);
 static fpc_bep_result_t _tx_link(HCP_comm_t *hcp_comm);
+static fpc_bep_result_t _tx_link_write(HCP_comm_t *hcp_comm);
+static fpc_bep_result_t _tx_link_ack(HCP_comm_t *hcp_comm);
+static uint16_t _tx_frame(HCP_comm_t *hcp_comm, uint16_t seq_nr, uint16_t seq_len, uint32_t offset);
 
 typedef struct {
     uint16_t cmd;
@@ -54,6 +90,82 @@ typedef struct {
    _HCP_cmd_t t_pld;
 } _HPC_pkt_t;
 
+static hal_tick_t _deadline(uint32_t timeout)
+{
+    hal_tick_t deadline;
+
+    if (!timeout) {
+        return 0;
+    }
+    deadline = hal_timebase_get_tick() + timeout;
+    // 0 is reserved for "no deadline"
+    return deadline ? deadline : 1;
+}
+
+static bool _deadline_passed(hal_tick_t deadline)
+{
+    // Wrap-around safe comparison
+    return deadline &&
+        (hal_tick_t)(hal_timebase_get_tick() - deadline) < ((hal_tick_t)~0 >> 1);
+}
+
+void bmlite_hold_off(HCP_comm_t *hcp_comm, uint32_t ms)
+{
+    hal_tick_t until = _deadline(ms);
+
+    // Keep the later of two hold-offs
+    if (until && (!hcp_comm->hold_until ||
+        (hal_tick_t)(until - hcp_comm->hold_until) < ((hal_tick_t)~0 >> 1))) {
+        hcp_comm->hold_until = until;
+    }
+}
+
+static hal_tick_t _earlier(hal_tick_t a, hal_tick_t b)
+{
+    if (!a || !b) {
+        return a ? a : b;
+    }
+    return (hal_tick_t)(a - b) < ((hal_tick_t)~0 >> 1) ? b : a;
+}
+
+hal_tick_t bmlite_deadline_begin(HCP_comm_t *hcp_comm, uint32_t timeout)
+{
+    hal_tick_t prev = hcp_comm->deadline;
+
+    hcp_comm->deadline = _earlier(prev, _deadline(timeout));
+    return prev;
+}
+
+void bmlite_deadline_end(HCP_comm_t *hcp_comm, hal_tick_t prev)
+{
+    hcp_comm->deadline = prev;
+}
+
+uint32_t bmlite_deadline_budget(HCP_comm_t *hcp_comm, uint32_t timeout)
+{
+    hal_tick_t left;
+
+    if (!hcp_comm->deadline) {
+        return timeout;
+    }
+    if (_deadline_passed(hcp_comm->deadline)) {
+        return 1;
+    }
+    left = hcp_comm->deadline - hal_timebase_get_tick();
+    if (!left) {
+        left = 1;
+    }
+    return (!timeout || left < timeout) ? (uint32_t)left : timeout;
+}
+
+static void _wait_hold_off(HCP_comm_t *hcp_comm)
+{
+    if (hcp_comm->hold_until && !_deadline_passed(hcp_comm->hold_until)) {
+        hal_timebase_busy_wait(hcp_comm->hold_until - hal_timebase_get_tick());
+    }
+    hcp_comm->hold_until = 0;
+}
+
 fpc_bep_result_t bmlite_init_cmd(HCP_comm_t *hcp_comm, uint16_t cmd, uint16_t arg_key)
 {
     fpc_bep_result_t bep_result;
@@ -92,7 +204,7 @@ fpc_bep_result_t bmlite_add_arg(HCP_comm_t *hcp_comm, uint16_t arg_type, void *a
     return FPC_BEP_RESULT_OK;
 }
 
-fpc_bep_result_t bmlite_get_arg(HCP_comm_t *hcp_comm, uint16_t arg_type)
+fpc_bep_result_t bmlite_get_arg_opt(HCP_comm_t *hcp_comm, uint16_t arg_type)
 {
     uint16_t i = 0;
     uint8_t *buffer = hcp_comm->pkt_buffer;
@@ -110,13 +222,19 @@ fpc_bep_result_t bmlite_get_arg(HCP_comm_t *hcp_comm, uint16_t arg_type)
         }
     }
 
-    // Ignore missing ARG_RESULT because some command return result other way
-    // if (arg_type != ARG_RESULT) {
-        bmlite_on_error(BMLITE_ERROR_GET_ARG, FPC_BEP_RESULT_INVALID_ARGUMENT);
-    // }
     return FPC_BEP_RESULT_INVALID_ARGUMENT;
 }
 
+fpc_bep_result_t bmlite_get_arg(HCP_comm_t *hcp_comm, uint16_t arg_type)
+{
+    fpc_bep_result_t bep_result = bmlite_get_arg_opt(hcp_comm, arg_type);
+
+    if (bep_result != FPC_BEP_RESULT_OK) {
+        bmlite_on_error(BMLITE_ERROR_GET_ARG, FPC_BEP_RESULT_INVALID_ARGUMENT);
+    }
+    return bep_result;
+}
+
 fpc_bep_result_t bmlite_copy_arg(HCP_comm_t *hcp_comm, uint16_t arg_key, void *arg_data, uint16_t arg_data_size)
 {
     fpc_bep_result_t bep_result;
@@ -135,6 +253,15 @@ fpc_bep_result_t bmlite_copy_arg(HCP_comm_t *hcp_comm, uint16_t arg_key, void *a
     return bep_result;
 }
 
+static void _parse_result(HCP_comm_t *hcp_comm)
+{
+    if (bmlite_get_arg(hcp_comm, ARG_RESULT) == FPC_BEP_RESULT_OK) {
+        hcp_comm->bep_result = (fpc_bep_result_t)*(int8_t*)hcp_comm->arg.data;
+    } else {
+        hcp_comm->bep_result = FPC_BEP_RESULT_OK;
+    }
+}
+
 fpc_bep_result_t bmlite_tranceive(HCP_comm_t *hcp_comm)
 {
     fpc_bep_result_t bep_result;
@@ -142,11 +269,10 @@ fpc_bep_result_t bmlite_tranceive(HCP_comm_t *hcp_comm)
     bep_result = bmlite_send(hcp_comm);
     if (bep_result == FPC_BEP_RESULT_OK) {
         bep_result = bmlite_receive(hcp_comm);
-
-        if (bmlite_get_arg(hcp_comm, ARG_RESULT) == FPC_BEP_RESULT_OK) {
-            hcp_comm->bep_result = (fpc_bep_result_t)*(int8_t*)hcp_comm->arg.data;
+        if (bep_result == FPC_BEP_RESULT_CANCELLED) {
+            hcp_comm->bep_result = FPC_BEP_RESULT_CANCELLED;
         } else {
-            hcp_comm->bep_result = FPC_BEP_RESULT_OK;
+            _parse_result(hcp_comm);
         }
     }
 
@@ -154,36 +280,54 @@ fpc_bep_result_t bmlite_tranceive(HCP_comm_t *hcp_comm)
 }
 
 fpc_bep_result_t bmlite_receive(HCP_comm_t *hcp_comm)
+{
+    fpc_bep_result_t bep_result;
+
+    hal_bmlite_select(hcp_comm->phy_dev);
+
+    bep_result = _receive(hcp_comm, true);
+    if (bep_result == FPC_BEP_RESULT_CANCELLED) {
+        _cancel_sync(hcp_comm);
+    } else if (bep_result == FPC_BEP_RESULT_TIMEOUT && _deadline_passed(hcp_comm->deadline)) {
+        // Operation is out of time, don't leave BM-Lite busy with the command
+        _cancel_sync(hcp_comm);
+    }
+
+    return bep_result;
+}
+
+void bmlite_cancel(HCP_comm_t *hcp_comm)
+{
+    hcp_comm->cancel = 1;
+}
+
+static fpc_bep_result_t _receive(HCP_comm_t *hcp_comm, bool cancellable)
 {
     fpc_bep_result_t bep_result = FPC_BEP_RESULT_OK;
     fpc_bep_result_t com_result = FPC_BEP_RESULT_OK;
     uint16_t seq_nr = 0;
     uint16_t seq_len = 1;
-    uint8_t *p = hcp_comm->pkt_buffer;
-    _HPC_pkt_t *pkt = (_HPC_pkt_t *)hcp_comm->txrx_buffer;
-    uint16_t buf_len = 0;
+    uint32_t buf_len = 0;
+
+    if (hcp_comm->ready) {
+        bep_result = _wait_ready(hcp_comm,
+                bmlite_deadline_budget(hcp_comm, hcp_comm->phy_rx_timeout), cancellable);
+        if (bep_result) {
+            if (bep_result != FPC_BEP_RESULT_CANCELLED) {
+                bmlite_on_error(BMLITE_ERROR_SEND_CMD, bep_result);
+            }
+            return bep_result;
+        }
+    }
 
     while(seq_nr < seq_len) {
         bep_result = _rx_link(hcp_comm);
 
         if (!bep_result) {
-            seq_nr = pkt->t_seq_nr;
-            seq_len = pkt->t_seq_len;
-            if(pkt->t_size != pkt->lnk_size - 6) {
-                com_result = FPC_BEP_RESULT_IO_ERROR;
-                continue;
-            }
-            if(buf_len + pkt->t_size < hcp_comm->pkt_size_max) {
-                memcpy(p, &pkt->t_pld, pkt->t_size);
-                p += pkt->t_size;
-                buf_len += pkt->t_size;
-            } else {
-                com_result = FPC_BEP_RESULT_NO_MEMORY;
+            bep_result = _rx_chunk(hcp_comm, &buf_len, &seq_nr, &seq_len);
+            if (bep_result) {
+                com_result = bep_result;
             }
-#ifdef DEBUG            
-            if (seq_len > 1)
-                LOG_DEBUG("Received data chunk %d of %d\n", seq_nr, seq_len);
-#endif
         } else {
             bmlite_on_error(BMLITE_ERROR_SEND_CMD, bep_result);
             return bep_result;
@@ -197,10 +341,172 @@ fpc_bep_result_t bmlite_receive(HCP_comm_t *hcp_comm)
     return com_result;
 }
 
+static uint32_t _wait_time(hal_tick_t deadline)
+{
+    uint32_t ms = deadline ? (uint32_t)(deadline - hal_timebase_get_tick()) : UINT32_MAX;
+
+#if BMLITE_CANCEL_POLL_INTERVAL
+    ms = HCP_MIN(ms, BMLITE_CANCEL_POLL_INTERVAL);
+#endif
+    return ms;
+}
+
+static fpc_bep_result_t _wait_ready(HCP_comm_t *hcp_comm, uint32_t timeout, bool cancellable)
+{
+    hal_tick_t deadline = _deadline(timeout);
+
+    while (!hcp_comm->ready()) {
+        if (cancellable && hcp_comm->cancel) {
+            return FPC_BEP_RESULT_CANCELLED;
+        }
+        if (_deadline_passed(deadline) || hal_check_button_pressed()) {
+            return FPC_BEP_RESULT_TIMEOUT;
+        }
+        hal_bmlite_wait_status(_wait_time(deadline));
+    }
+
+    return FPC_BEP_RESULT_OK;
+}
+
+static fpc_bep_result_t _cancel_sync(HCP_comm_t *hcp_comm)
+{
+    fpc_bep_result_t bep_result;
+    uint32_t prev_timeout = hcp_comm->phy_rx_timeout;
+    hal_tick_t prev_deadline = hcp_comm->deadline;
+
+    LOG_DEBUG("Cancelling command\n");
+    hcp_comm->cancel = 0;
+    // Cancellation must complete even after the deadline
+    hcp_comm->deadline = 0;
+
+    bmlite_init_cmd(hcp_comm, CMD_CANCEL, ARG_NONE);
+    bep_result = bmlite_send(hcp_comm);
+
+    // BM-Lite answers to cancelled command and to CMD_CANCEL.
+    // Drain everything up to CMD_CANCEL answer to keep the link in sync
+    hcp_comm->phy_rx_timeout = CANCEL_TIMEOUT;
+    for (int i = 0; i < 2 && bep_result == FPC_BEP_RESULT_OK; i++) {
+        bep_result = _receive(hcp_comm, false);
+        if (bep_result == FPC_BEP_RESULT_OK &&
+                ((_HCP_cmd_t *)hcp_comm->pkt_buffer)->cmd == CMD_CANCEL) {
+            break;
+        }
+    }
+    hcp_comm->phy_rx_timeout = prev_timeout;
+    hcp_comm->deadline = prev_deadline;
+
+    return bep_result;
+}
+
+/*
+ * Read and drop incoming data until the link is idle. Data is scanned for
+ * link frames byte by byte, every frame with valid CRC is acknowledged,
+ * so BM-Lite goes on with the rest of its answer instead of resending.
+ */
+static fpc_bep_result_t _resync_drain(HCP_comm_t *hcp_comm, hal_tick_t deadline)
+{
+    uint8_t *buf = hcp_comm->txrx_buffer;
+    _HPC_pkt_t *pkt = (_HPC_pkt_t *)buf;
+    uint32_t len = 0;
+
+    while (!_deadline_passed(deadline)) {
+        if (len < 4) {
+            if (hcp_comm->ready &&
+                _wait_ready(hcp_comm, RESYNC_IDLE_TIMEOUT, false) != FPC_BEP_RESULT_OK) {
+                return FPC_BEP_RESULT_OK;
+            }
+            if (hcp_comm->read(1, buf + len, RESYNC_IDLE_TIMEOUT) != FPC_BEP_RESULT_OK) {
+                return FPC_BEP_RESULT_OK;
+            }
+            len++;
+            continue;
+        }
+
+        // Link header: channel 0, transport header fits, frame fits MTU
+        if (pkt->lnk_chn == 0 && pkt->lnk_size >= 6 && MTU >= pkt->lnk_size + 8) {
+            uint16_t size = pkt->lnk_size;
+
+            if (len < size + 8u) {
+                if (hcp_comm->read(size + 8 - len, buf + len, RESYNC_IDLE_TIMEOUT) !=
+                        FPC_BEP_RESULT_OK) {
+                    return FPC_BEP_RESULT_OK;
+                }
+                len = size + 8;
+            }
+            if (fpc_crc(0, buf + 4, size) == *(uint32_t *)(buf + 4 + size)) {
+                LOG_DEBUG("Resync: dropped frame of %d bytes\n", size);
+                hcp_comm->write(4, (uint8_t *)&fpc_com_ack, 0);
+                len = 0;
+                continue;
+            }
+        }
+
+        // Not a frame start, slide by one byte
+        len--;
+        memmove(buf, buf + 1, len);
+    }
+
+    return FPC_BEP_RESULT_TIMEOUT;
+}
+
+fpc_bep_result_t bmlite_resync(HCP_comm_t *hcp_comm, uint32_t timeout)
+{
+    hal_tick_t deadline = _deadline(timeout ? timeout : RESYNC_TIMEOUT);
+    fpc_bep_result_t bep_result = FPC_BEP_RESULT_TIMEOUT;
+
+    if (hcp_comm->async.state != HCP_STATE_IDLE) {
+        return FPC_BEP_RESULT_WRONG_STATE;
+    }
+
+    hal_bmlite_select(hcp_comm->phy_dev);
+    hcp_comm->hold_until = 0;
+
+    // CMD_CANCEL may be lost if BM-Lite still expects frames of a broken command
+    while (!_deadline_passed(deadline)) {
+        bep_result = _resync_drain(hcp_comm, deadline);
+        if (bep_result != FPC_BEP_RESULT_OK) {
+            break;
+        }
+        bep_result = _cancel_sync(hcp_comm);
+        if (bep_result == FPC_BEP_RESULT_OK &&
+                ((_HCP_cmd_t *)hcp_comm->pkt_buffer)->cmd == CMD_CANCEL) {
+            LOG_DEBUG("Resync: link is in sync\n");
+            return FPC_BEP_RESULT_OK;
+        }
+        bep_result = FPC_BEP_RESULT_IO_ERROR;
+    }
+
+    bmlite_on_error(BMLITE_ERROR_SEND_CMD, bep_result);
+    return bep_result;
+}
+
+static fpc_bep_result_t _rx_chunk(HCP_comm_t *hcp_comm, uint32_t *buf_len, 
+        uint16_t *seq_nr, uint16_t *seq_len)
+{
+    _HPC_pkt_t *pkt = (_HPC_pkt_t *)hcp_comm->txrx_buffer;
+
+    *seq_nr = pkt->t_seq_nr;
+    *seq_len = pkt->t_seq_len;
+    if(pkt->t_size != pkt->lnk_size - 6) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    if(*buf_len + pkt->t_size >= hcp_comm->pkt_size_max) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    memcpy(hcp_comm->pkt_buffer + *buf_len, &pkt->t_pld, pkt->t_size);
+    *buf_len += pkt->t_size;
+#ifdef DEBUG
+    if (*seq_len > 1)
+        LOG_DEBUG("Received data chunk %d of %d\n", *seq_nr, *seq_len);
+#endif
+    return FPC_BEP_RESULT_OK;
+}
+
 static fpc_bep_result_t _rx_link(HCP_comm_t *hcp_comm)
 {
     // Get size, msg and CRC
-    fpc_bep_result_t result = hcp_comm->read(4, hcp_comm->txrx_buffer, hcp_comm->phy_rx_timeout);
+    fpc_bep_result_t result = hcp_comm->read(4, hcp_comm->txrx_buffer,
+            bmlite_deadline_budget(hcp_comm, hcp_comm->phy_rx_timeout));
     _HPC_pkt_t *pkt = (_HPC_pkt_t *)hcp_comm->txrx_buffer;
     uint16_t size;
 
@@ -218,12 +524,15 @@ static fpc_bep_result_t _rx_link(HCP_comm_t *hcp_comm)
         return FPC_BEP_RESULT_IO_ERROR;
     }
         
-    hcp_comm->read(size + 4, hcp_comm->txrx_buffer + 4, 100);
+    hcp_comm->read(size + 4, hcp_comm->txrx_buffer + 4,
+            bmlite_deadline_budget(hcp_comm, RX_BODY_TIMEOUT));
 
     uint32_t crc = *(uint32_t *)(hcp_comm->txrx_buffer + 4 + size);
     uint32_t crc_calc = fpc_crc(0, hcp_comm->txrx_buffer+4, size);
 
+    hcp_comm->link_stats.frames++;
     if (crc_calc != crc) {
+        hcp_comm->link_stats.errors++;
         LOG_DEBUG("CRC mismatch. Calculated %04X, received %04X\n", 
                                (unsigned int)crc_calc, (unsigned int)crc);
         bmlite_on_error(BMLITE_ERROR_SEND_CMD, FPC_BEP_RESULT_IO_ERROR);
@@ -240,32 +549,20 @@ fpc_bep_result_t bmlite_send(HCP_comm_t *hcp_comm)
 {
     uint16_t seq_nr = 1;
     fpc_bep_result_t bep_result = FPC_BEP_RESULT_OK;
-    uint16_t data_left = hcp_comm->pkt_size;
-    uint8_t *p = hcp_comm->pkt_buffer;
-
-    _HPC_pkt_t *phy_frm = (_HPC_pkt_t *)hcp_comm->txrx_buffer;
-
-    // Application MTU size is PHY MTU - (Transport and Link overhead)
-    uint16_t app_mtu = MTU - 6 - 8;
+    uint32_t offset = 0;
 
     // Calculate sequence length
-    uint16_t seq_len = (data_left / app_mtu) + 1;
+    uint16_t seq_len = (hcp_comm->pkt_size / APP_MTU) + 1;
 
-    phy_frm->lnk_chn = 0;
-    phy_frm->t_seq_len = seq_len;
+    hal_bmlite_select(hcp_comm->phy_dev);
+    _wait_hold_off(hcp_comm);
+    if (_deadline_passed(hcp_comm->deadline)) {
+        bmlite_on_error(BMLITE_ERROR_SEND_CMD, FPC_BEP_RESULT_TIMEOUT);
+        return FPC_BEP_RESULT_TIMEOUT;
+    }
 
     for (seq_nr = 1; seq_nr <= seq_len && !bep_result; seq_nr++) {
-        phy_frm->t_seq_nr = seq_nr;
-        if (data_left < app_mtu) {
-            phy_frm->t_size = data_left;
-        } else {
-            phy_frm->t_size = app_mtu;
-        }
-        memcpy(&phy_frm->t_pld, p, phy_frm->t_size);
-        phy_frm->lnk_size = phy_frm->t_size + 6;
-        p += phy_frm->t_size;
-        data_left -= phy_frm->t_size;
-
+        offset += _tx_frame(hcp_comm, seq_nr, seq_len, offset);
         bep_result = _tx_link(hcp_comm);
     }
 
@@ -275,31 +572,286 @@ fpc_bep_result_t bmlite_send(HCP_comm_t *hcp_comm)
     return bep_result;
 }
 
+static uint16_t _tx_frame(HCP_comm_t *hcp_comm, uint16_t seq_nr, uint16_t seq_len, uint32_t offset)
+{
+    _HPC_pkt_t *phy_frm = (_HPC_pkt_t *)hcp_comm->txrx_buffer;
+    uint32_t data_left = hcp_comm->pkt_size - offset;
+
+    phy_frm->lnk_chn = 0;
+    phy_frm->t_seq_nr = seq_nr;
+    phy_frm->t_seq_len = seq_len;
+    if (data_left < APP_MTU) {
+        phy_frm->t_size = data_left;
+    } else {
+        phy_frm->t_size = APP_MTU;
+    }
+    memcpy(&phy_frm->t_pld, hcp_comm->pkt_buffer + offset, phy_frm->t_size);
+    phy_frm->lnk_size = phy_frm->t_size + 6;
+
+    return phy_frm->t_size;
+}
+
 static fpc_bep_result_t _tx_link(HCP_comm_t *hcp_comm)
 {
     fpc_bep_result_t bep_result;
 
+    bep_result = _tx_link_write(hcp_comm);
+    if (bep_result) {
+        return bep_result;
+    }
+
+    return _tx_link_ack(hcp_comm);
+}
+
+static fpc_bep_result_t _tx_link_write(HCP_comm_t *hcp_comm)
+{
     _HPC_pkt_t *pkt = (_HPC_pkt_t *)hcp_comm->txrx_buffer;
 
     uint32_t crc_calc = fpc_crc(0, &pkt->t_size, pkt->lnk_size);
     *(uint32_t *)(hcp_comm->txrx_buffer + pkt->lnk_size + 4) = crc_calc;
     uint16_t size = pkt->lnk_size + 8;
 
-    bep_result = hcp_comm->write(size, hcp_comm->txrx_buffer, 0);
+    return hcp_comm->write(size, hcp_comm->txrx_buffer, 0);
+}
+
+static fpc_bep_result_t _tx_link_ack(HCP_comm_t *hcp_comm)
+{
+    fpc_bep_result_t bep_result;
 
     // Wait for ACK
     uint32_t ack;
-    bep_result = hcp_comm->read(4, (uint8_t *)&ack, 500);
+    bep_result = hcp_comm->read(4, (uint8_t *)&ack, bmlite_deadline_budget(hcp_comm, ACK_TIMEOUT));
+    hcp_comm->link_stats.frames++;
     if (bep_result == FPC_BEP_RESULT_TIMEOUT) {
+        hcp_comm->link_stats.errors++;
         LOG_DEBUG("ASK read timeout\n");
         bmlite_on_error(BMLITE_ERROR_SEND_CMD, FPC_BEP_RESULT_TIMEOUT);
         return FPC_BEP_RESULT_IO_ERROR;
     }
 
     if(ack != fpc_com_ack) {
+        hcp_comm->link_stats.errors++;
         return FPC_BEP_RESULT_IO_ERROR;
     }
 
     return FPC_BEP_RESULT_OK;
 }
 
+static bool _link_ready(HCP_comm_t *hcp_comm)
+{
+    // Without ready() the following read() waits for the data itself
+    return hcp_comm->ready == NULL || hcp_comm->ready();
+}
+
+static void _async_finish(HCP_comm_t *hcp_comm, fpc_bep_result_t result)
+{
+    HCP_async_t *as = &hcp_comm->async;
+
+    as->state = HCP_STATE_IDLE;
+    // Failures of the cancel exchange are not reported, as in _cancel_sync()
+    if (as->cancel_result != FPC_BEP_RESULT_OK) {
+        result = as->cancel_result;
+        as->cancel_result = FPC_BEP_RESULT_OK;
+    }
+    if (result == FPC_BEP_RESULT_OK) {
+        hcp_comm->pkt_size = as->offset;
+        _parse_result(hcp_comm);
+    } else if (result == FPC_BEP_RESULT_CANCELLED) {
+        hcp_comm->bep_result = FPC_BEP_RESULT_CANCELLED;
+    } else {
+        bmlite_on_error(BMLITE_ERROR_SEND_CMD, result);
+    }
+
+    if (as->done) {
+        as->done(hcp_comm, result, as->ctx);
+    }
+}
+
+/*
+ * Replace pending command with CMD_CANCEL exchange, without waiting.
+ * The command is finished with the result when BM-Lite answers CMD_CANCEL.
+ */
+static void _async_cancel(HCP_comm_t *hcp_comm, fpc_bep_result_t result)
+{
+    HCP_async_t *as = &hcp_comm->async;
+
+    LOG_DEBUG("Cancelling command\n");
+    hcp_comm->cancel = 0;
+    as->cancel_result = result;
+    as->cancel_answers = 0;
+
+    bmlite_init_cmd(hcp_comm, CMD_CANCEL, ARG_NONE);
+    as->seq_nr = 1;
+    as->seq_len = 1;
+    as->offset = 0;
+    as->state = HCP_STATE_TX;
+}
+
+/* Cancellation must complete even after the deadline */
+static uint32_t _async_budget(HCP_comm_t *hcp_comm, uint32_t timeout)
+{
+    if (hcp_comm->async.cancel_result != FPC_BEP_RESULT_OK) {
+        return timeout;
+    }
+    return bmlite_deadline_budget(hcp_comm, timeout);
+}
+
+static fpc_bep_result_t _async_io(HCP_comm_t *hcp_comm, fpc_bep_result_t (*io)(HCP_comm_t *))
+{
+    hal_tick_t prev_deadline = hcp_comm->deadline;
+    fpc_bep_result_t result;
+
+    if (hcp_comm->async.cancel_result != FPC_BEP_RESULT_OK) {
+        hcp_comm->deadline = 0;
+    }
+    result = io(hcp_comm);
+    hcp_comm->deadline = prev_deadline;
+
+    return result;
+}
+
+fpc_bep_result_t bmlite_submit(HCP_comm_t *hcp_comm, HCP_done_cb_t done, void *ctx)
+{
+    HCP_async_t *as = &hcp_comm->async;
+
+    if (as->state != HCP_STATE_IDLE) {
+        return FPC_BEP_RESULT_WRONG_STATE;
+    }
+
+    as->seq_nr = 1;
+    as->seq_len = (hcp_comm->pkt_size / APP_MTU) + 1;
+    as->offset = 0;
+    as->deadline = 0;
+    as->result = FPC_BEP_RESULT_OK;
+    as->cancel_result = FPC_BEP_RESULT_OK;
+    as->done = done;
+    as->ctx = ctx;
+    as->state = HCP_STATE_TX;
+
+    return FPC_BEP_RESULT_OK;
+}
+
+bool bmlite_process(HCP_comm_t *hcp_comm)
+{
+    HCP_async_t *as = &hcp_comm->async;
+    fpc_bep_result_t result;
+
+    hal_bmlite_select(hcp_comm->phy_dev);
+
+    // Completion callback may submit next command, so loop until idle
+    while (as->state != HCP_STATE_IDLE) {
+        switch (as->state) {
+            case HCP_STATE_TX:
+                if (as->seq_nr == 1 && as->offset == 0 && hcp_comm->hold_until) {
+                    // Poll again at the end of hold-off
+                    if (!_deadline_passed(hcp_comm->hold_until)) {
+                        as->deadline = hcp_comm->hold_until;
+                        return true;
+                    }
+                    hcp_comm->hold_until = 0;
+                }
+                as->offset += _tx_frame(hcp_comm, as->seq_nr, as->seq_len, as->offset);
+                result = _tx_link_write(hcp_comm);
+                if (result) {
+                    _async_finish(hcp_comm, result);
+                    break;
+                }
+                as->deadline = _deadline(_async_budget(hcp_comm, ACK_TIMEOUT));
+                as->state = HCP_STATE_TX_ACK;
+                break;
+
+            case HCP_STATE_TX_ACK:
+                if (!_link_ready(hcp_comm)) {
+                    if (_deadline_passed(as->deadline)) {
+                        _async_finish(hcp_comm, FPC_BEP_RESULT_TIMEOUT);
+                        break;
+                    }
+                    return true;
+                }
+                result = _async_io(hcp_comm, _tx_link_ack);
+                if (result) {
+                    _async_finish(hcp_comm, result);
+                    break;
+                }
+                if (as->seq_nr < as->seq_len) {
+                    as->seq_nr++;
+                    as->state = HCP_STATE_TX;
+                } else {
+                    as->seq_nr = 0;
+                    as->seq_len = 1;
+                    as->offset = 0;
+                    as->deadline = _deadline(as->cancel_result != FPC_BEP_RESULT_OK ?
+                            CANCEL_TIMEOUT :
+                            bmlite_deadline_budget(hcp_comm, hcp_comm->phy_rx_timeout));
+                    as->state = HCP_STATE_RX;
+                }
+                break;
+
+            case HCP_STATE_RX:
+                if (!_link_ready(hcp_comm)) {
+                    if (as->cancel_result != FPC_BEP_RESULT_OK) {
+                        if (_deadline_passed(as->deadline)) {
+                            _async_finish(hcp_comm, as->cancel_result);
+                            break;
+                        }
+                        return true;
+                    }
+                    if (hcp_comm->cancel) {
+                        _async_cancel(hcp_comm, FPC_BEP_RESULT_CANCELLED);
+                        break;
+                    }
+                    if (_deadline_passed(as->deadline)) {
+                        if (_deadline_passed(hcp_comm->deadline)) {
+                            // Don't leave BM-Lite busy with the command
+                            _async_cancel(hcp_comm, FPC_BEP_RESULT_TIMEOUT);
+                        } else {
+                            _async_finish(hcp_comm, FPC_BEP_RESULT_TIMEOUT);
+                        }
+                        break;
+                    }
+                    return true;
+                }
+                result = _async_io(hcp_comm, _rx_link);
+                if (result) {
+                    _async_finish(hcp_comm, result);
+                    break;
+                }
+                result = _rx_chunk(hcp_comm, &as->offset, &as->seq_nr, &as->seq_len);
+                if (result) {
+                    as->result = result;
+                }
+                if (as->seq_nr < as->seq_len) {
+                    break;
+                }
+                // BM-Lite answers to cancelled command and to CMD_CANCEL, drain both
+                if (as->cancel_result != FPC_BEP_RESULT_OK &&
+                        ((_HCP_cmd_t *)hcp_comm->pkt_buffer)->cmd != CMD_CANCEL &&
+                        ++as->cancel_answers < 2) {
+                    as->seq_nr = 0;
+                    as->seq_len = 1;
+                    as->offset = 0;
+                    as->deadline = _deadline(CANCEL_TIMEOUT);
+                    break;
+                }
+                _async_finish(hcp_comm, as->result);
+                break;
+
+            default:
+                _async_finish(hcp_comm, FPC_BEP_RESULT_WRONG_STATE);
+                break;
+        }
+    }
+
+    return false;
+}
+
+hal_tick_t bmlite_get_deadline(HCP_comm_t *hcp_comm)
+{
+    return hcp_comm->async.state == HCP_STATE_IDLE ? 0 : hcp_comm->async.deadline;
+}
+
+int bmlite_get_fd(HCP_comm_t *hcp_comm)
+{
+    hal_bmlite_select(hcp_comm->phy_dev);
+    return hal_bmlite_get_status_fd();
+}
@@ -32,6 +32,7 @@
 #include "fpc_bep_types.h"
 #include "platform.h"
 #include "bmlite_hal.h"
+#include "bmlite_if.h"
 
 fpc_bep_result_t platform_init(void *params)
 {
@@ -44,12 +45,36 @@ fpc_bep_result_t platform_init(void *params)
     return result;
 }
 
+fpc_bep_result_t platform_init_warm(void *params, HCP_comm_t *chain)
+{
+    fpc_bep_result_t result;
+    hal_timebase_init();
+    result = hal_board_init(params);
+    if(result == FPC_BEP_RESULT_OK) {
+        bep_warm_start(chain, BMLITE_WARM_START_TIMEOUT);
+    }
+    return result;
+}
+
 void platform_bmlite_reset(void)
 {
     hal_bmlite_reset(true);
-    hal_timebase_busy_wait(100);
+    hal_timebase_busy_wait(bmlite_timing_default.reset_pulse_ms);
     hal_bmlite_reset(false);
-    hal_timebase_busy_wait(100);
+    hal_timebase_busy_wait(bmlite_timing_default.boot_ms);
+}
+
+void platform_bmlite_reset_chain(HCP_comm_t *chain)
+{
+    const bmlite_timing_t *timing = chain->timing ? chain->timing : &bmlite_timing_default;
+
+    hal_bmlite_select(chain->phy_dev);
+    hal_bmlite_reset(true);
+    hal_timebase_busy_wait(timing->reset_pulse_ms);
+    hal_bmlite_reset(false);
+    // Boot time is waited for by the next command
+    bmlite_hold_off(chain, timing->boot_ms);
+    chain->booting = true;
 }
 
 #ifdef BMLITE_ON_UART
@@ -105,6 +130,7 @@ fpc_bep_result_t platform_bmlite_uart_receive(uint16_t size, uint8_t *data, uint
 fpc_bep_result_t platform_bmlite_spi_send(uint16_t size, const uint8_t *data, uint32_t timeout)
 {
     uint8_t buff[size];
+
 #ifdef DEBUG_COMM
     LOG_DEBUG("-> ");
     for (int i=0; i<size; i++)
@@ -125,6 +151,7 @@ fpc_bep_result_t platform_bmlite_spi_receive(uint16_t size, uint8_t *data, uint3
                 if(hal_check_button_pressed()) {
                     return FPC_BEP_RESULT_TIMEOUT;
                 }
+                hal_bmlite_wait_status(timeout ? timeout - (curr_time - start_time) : UINT32_MAX);
     }
     if(timeout && curr_time - start_time >= timeout) {
         return FPC_BEP_RESULT_TIMEOUT;
@@ -143,6 +170,11 @@ fpc_bep_result_t platform_bmlite_spi_receive(uint16_t size, uint8_t *data, uint3
     return res;
 }
 
+bool platform_bmlite_spi_ready(void)
+{
+    return hal_bmlite_get_status();
+}
+
 #endif
 
 __attribute__((weak)) uint32_t hal_check_button_pressed()
@@ -150,3 +182,28 @@ __attribute__((weak)) uint32_t hal_check_button_pressed()
     return 0;
 }
 
+__attribute__((weak)) void hal_bmlite_select(void *dev)
+{
+}
+
+__attribute__((weak)) bool hal_bmlite_wait_status(uint32_t ms)
+{
+    return hal_bmlite_get_status();
+}
+
+__attribute__((weak)) int hal_bmlite_get_status_fd(void)
+{
+    return -1;
+}
+
+__attribute__((weak)) uint32_t hal_bmlite_spi_set_clock(uint32_t hz)
+{
+    return 0;
+}
+
+__attribute__((weak)) fpc_bep_result_t hal_rt_set(const hal_rt_config_t *cfg,
+        struct HCP_comm *chain)
+{
+    return cfg ? FPC_BEP_RESULT_NOT_SUPPORTED : FPC_BEP_RESULT_OK;
+}
+
@@ -27,7 +27,27 @@
 
 #include "fpc_bep_types.h"
 #include "hcp_tiny.h"
+#include "console_params.h"
 
 void clear_screen(void);
 
+/**
+ * @brief Open additional BM-Lite device and bind it to params->hcp_comm
+ *
+ *   The device is reset after opening. All HCP transfers of params->hcp_comm
+ *   will use this device. Different devices can be used from different threads.
+ *
+ * @param[in] params - device parameters. params->port is spidev device
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t platform_linux_dev_open(console_initparams_t *params);
+
+/**
+ * @brief Close BM-Lite device opened by platform_linux_dev_open()
+ *
+ * @param[in] hcp_comm - HCP_comm struct bound to the device
+ */
+void platform_linux_dev_close(HCP_comm_t *hcp_comm);
+
 #endif /* PLATFORM_RPI_H */
@@ -19,6 +19,9 @@
  * @brief   Linux platform specific functions
  */
 
+// CPU affinity of threads
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -28,6 +31,10 @@
 #include <fcntl.h>
 #include <string.h>
 #include <termios.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/ioctl.h>
 #include <linux/types.h>
@@ -35,26 +42,59 @@
 
 #include "bmlite_hal.h"
 #include "platform.h"
+#include "bmlite_if.h"
 #include "console_params.h"
 #include "platform_defs.h"
+#include "platform_linux.h"
 
 #define MAX_FNAME_LEN 128
-
-static int fd_spi = -1;
-static int fd_reset_value = -1;
-static int fd_ready_value = -1;
-
-static struct spi_ioc_transfer spi_tr = {
-    .tx_buf = (unsigned long)0,
-    .rx_buf = (unsigned long)0,
-    .len = 0,
-    .delay_usecs = 1000,
-    .speed_hz = 500000,
-    .bits_per_word = 8,
+/** Stack touched when entering real-time mode, bytes */
+#define RT_STACK_PREFAULT (64 * 1024)
+
+typedef struct {
+    int fd_spi;
+    int fd_reset_value;
+    int fd_ready_value;
+    uint32_t ready_pin;
+    bool ready_edge;
+    struct spi_ioc_transfer spi_tr;
+} linux_bmlite_dev_t;
+
+static linux_bmlite_dev_t default_dev = {
+    .fd_spi = -1,
+    .fd_reset_value = -1,
+    .fd_ready_value = -1,
+    .ready_pin = BMLITE_READY_PIN,
+    .ready_edge = false,
+    .spi_tr = {
+        .tx_buf = (unsigned long)0,
+        .rx_buf = (unsigned long)0,
+        .len = 0,
+        .delay_usecs = 1000,
+        .speed_hz = 500000,
+        .bits_per_word = 8,
+    },
 };
 
-static fpc_bep_result_t platform_spi_init(char *device, uint32_t baudrate);
-static fpc_bep_result_t platform_gpio_init();
+/** Device used by HAL calls of the current thread */
+static __thread linux_bmlite_dev_t *dev = &default_dev;
+
+/** Thread state before real-time mode, see hal_rt_set() */
+typedef struct {
+    bool saved;
+    cpu_set_t affinity;
+    int policy;
+    struct sched_param param;
+    /** This thread holds the memory lock */
+    bool locked;
+} linux_rt_state_t;
+
+static __thread linux_rt_state_t rt_state;
+/** Threads which need memory locked, memory is unlocked by the last one */
+static int rt_lock_users;
+
+static fpc_bep_result_t platform_spi_init(linux_bmlite_dev_t *d, char *device, uint32_t baudrate);
+static fpc_bep_result_t platform_gpio_init(linux_bmlite_dev_t *d, uint32_t reset_pin, uint32_t ready_pin);
 static int gpio_init(uint32_t pin, gpio_dir_t dir);
 
 
@@ -92,7 +132,7 @@ fpc_bep_result_t hal_board_init(void *params)
             if(p->port == NULL)
                p->port = BMLITE_SPI_DEV;
 
-            if(platform_spi_init(p->port, p->baudrate) != FPC_BEP_RESULT_OK) {
+            if(platform_spi_init(&default_dev, p->port, p->baudrate) != FPC_BEP_RESULT_OK) {
                 printf("SPI initialization failed\n");
                 return FPC_BEP_RESULT_INTERNAL_ERROR;
             }
@@ -104,18 +144,250 @@ fpc_bep_result_t hal_board_init(void *params)
 
     p->hcp_comm->read = platform_bmlite_spi_receive;
     p->hcp_comm->write = platform_bmlite_spi_send;
+    p->hcp_comm->ready = platform_bmlite_spi_ready;
+    p->hcp_comm->phy_rx_timeout = p->timeout*1000;
+    p->hcp_comm->phy_dev = NULL;
+
+    return platform_gpio_init(&default_dev,
+                p->reset_pin ? p->reset_pin : BMLITE_RESET_PIN,
+                p->ready_pin ? p->ready_pin : BMLITE_READY_PIN);
+}
+
+fpc_bep_result_t platform_linux_dev_open(console_initparams_t *p)
+{
+    linux_bmlite_dev_t *d;
+    fpc_bep_result_t res;
+
+    if (p->iface != SPI_INTERFACE || p->port == NULL) {
+        printf("Only SPI devices are supported\n");
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+
+    d = malloc(sizeof(linux_bmlite_dev_t));
+    if (d == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    memcpy(d, &default_dev, sizeof(linux_bmlite_dev_t));
+    d->fd_spi = d->fd_reset_value = d->fd_ready_value = -1;
+    d->ready_edge = false;
+    p->hcp_comm->phy_dev = d;
+
+    res = platform_spi_init(d, p->port, p->baudrate);
+    if (res == FPC_BEP_RESULT_OK) {
+        res = platform_gpio_init(d,
+                p->reset_pin ? p->reset_pin : BMLITE_RESET_PIN,
+                p->ready_pin ? p->ready_pin : BMLITE_READY_PIN);
+    }
+    if (res != FPC_BEP_RESULT_OK) {
+        platform_linux_dev_close(p->hcp_comm);
+        return res;
+    }
+
+    p->hcp_comm->read = platform_bmlite_spi_receive;
+    p->hcp_comm->write = platform_bmlite_spi_send;
+    p->hcp_comm->ready = platform_bmlite_spi_ready;
     p->hcp_comm->phy_rx_timeout = p->timeout*1000;
 
-    return platform_gpio_init();
+    hal_bmlite_select(d);
+    if (p->warm_start) {
+        bep_warm_start(p->hcp_comm, BMLITE_WARM_START_TIMEOUT);
+    } else {
+        platform_bmlite_reset_chain(p->hcp_comm);
+    }
+
+    return FPC_BEP_RESULT_OK;
+}
+
+void platform_linux_dev_close(HCP_comm_t *hcp_comm)
+{
+    linux_bmlite_dev_t *d = (linux_bmlite_dev_t *)hcp_comm->phy_dev;
+
+    if (d == NULL) {
+        return;
+    }
+    if (dev == d) {
+        dev = &default_dev;
+    }
+    if (d->fd_spi >= 0)
+        close(d->fd_spi);
+    if (d->fd_reset_value >= 0)
+        close(d->fd_reset_value);
+    if (d->fd_ready_value >= 0)
+        close(d->fd_ready_value);
+    free(d);
+    hcp_comm->phy_dev = NULL;
+}
+
+void hal_bmlite_select(void *d)
+{
+    dev = d ? (linux_bmlite_dev_t *)d : &default_dev;
+}
+
+int hal_bmlite_get_status_fd(void)
+{
+    char fn[MAX_FNAME_LEN];
+    int fd;
+
+    if (!dev->ready_edge) {
+        // sysfs GPIO value file signals POLLPRI on configured edge
+        snprintf(fn, MAX_FNAME_LEN, "/sys/class/gpio/gpio%d/edge", dev->ready_pin);
+        fd = open(fn, O_SYNC | O_WRONLY);
+        if (fd < 0) {
+            return -1;
+        }
+        if (write(fd, "rising", 6) != 6) {
+            close(fd);
+            return -1;
+        }
+        close(fd);
+        dev->ready_edge = true;
+    }
+
+    return dev->fd_ready_value;
+}
+
+/* Fault in pages of a buffer without changing its contents */
+static void rt_prefault(uint8_t *buf, size_t size)
+{
+    volatile uint8_t *p = buf;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    if (buf == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < size; i += page) {
+        p[i] = p[i];
+    }
+}
+
+static void __attribute__((noinline)) rt_prefault_stack(void)
+{
+    volatile uint8_t stack[RT_STACK_PREFAULT];
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    for (size_t i = 0; i < sizeof(stack); i += page) {
+        stack[i] = 0;
+    }
+}
+
+static void rt_unlock_memory(void)
+{
+    if (rt_state.locked) {
+        rt_state.locked = false;
+        if (__atomic_sub_fetch(&rt_lock_users, 1, __ATOMIC_SEQ_CST) == 0) {
+            munlockall();
+        }
+    }
+}
+
+/*
+ * Real-time mode: pin to cfg->cpu, SCHED_FIFO, mlockall() and touch the HCP
+ * buffers and the stack, so no page fault happens between frames. Affinity
+ * and scheduling the thread had before the first call are restored with
+ * cfg == NULL. Needs CAP_SYS_NICE and CAP_IPC_LOCK (or root).
+ */
+fpc_bep_result_t hal_rt_set(const hal_rt_config_t *cfg, struct HCP_comm *chain)
+{
+    pthread_t self = pthread_self();
+    struct sched_param param;
+    cpu_set_t cpus;
+    int err;
+
+    if (!rt_state.saved) {
+        pthread_getaffinity_np(self, sizeof(cpu_set_t), &rt_state.affinity);
+        pthread_getschedparam(self, &rt_state.policy, &rt_state.param);
+        rt_state.saved = true;
+    }
+
+    if (cfg == NULL) {
+        pthread_setaffinity_np(self, sizeof(cpu_set_t), &rt_state.affinity);
+        pthread_setschedparam(self, rt_state.policy, &rt_state.param);
+        rt_unlock_memory();
+        return FPC_BEP_RESULT_OK;
+    }
+
+    if (cfg->cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(cfg->cpu, &cpus);
+        err = pthread_setaffinity_np(self, sizeof(cpu_set_t), &cpus);
+        if (err) {
+            printf("Can't pin I/O thread to CPU %d: %s\n", cfg->cpu, strerror(err));
+            return FPC_BEP_RESULT_NOT_SUPPORTED;
+        }
+    } else {
+        pthread_setaffinity_np(self, sizeof(cpu_set_t), &rt_state.affinity);
+    }
+
+    if (cfg->priority > 0) {
+        param.sched_priority = cfg->priority;
+        err = pthread_setschedparam(self, SCHED_FIFO, &param);
+        if (err) {
+            printf("Can't set SCHED_FIFO priority %d: %s\n", cfg->priority, strerror(err));
+            return FPC_BEP_RESULT_NOT_SUPPORTED;
+        }
+    } else {
+        pthread_setschedparam(self, rt_state.policy, &rt_state.param);
+    }
+
+    if (cfg->lock_memory && !rt_state.locked) {
+        // Also locks stacks and buffers allocated later
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+            printf("Can't lock memory: %s\n", strerror(errno));
+            return FPC_BEP_RESULT_NOT_SUPPORTED;
+        }
+        rt_state.locked = true;
+        __atomic_add_fetch(&rt_lock_users, 1, __ATOMIC_SEQ_CST);
+    } else if (!cfg->lock_memory) {
+        rt_unlock_memory();
+    }
+
+    // Without memory lock pages can still be reclaimed, but first frames are not delayed
+    if (chain) {
+        rt_prefault(chain->pkt_buffer, chain->pkt_size_max);
+        rt_prefault(chain->txrx_buffer, MTU);
+    }
+    rt_prefault_stack();
+
+    return FPC_BEP_RESULT_OK;
+}
+
+uint32_t hal_bmlite_spi_set_clock(uint32_t hz)
+{
+    // Speed of every transfer is taken from spi_tr
+    if (dev->fd_spi < 0 || ioctl(dev->fd_spi, SPI_IOC_WR_MAX_SPEED_HZ, &hz) < 0) {
+        return 0;
+    }
+    dev->spi_tr.speed_hz = hz;
+    return hz;
+}
+
+bool hal_bmlite_wait_status(uint32_t ms)
+{
+    struct pollfd pfd;
+
+    if (hal_bmlite_get_status()) {
+        return true;
+    }
+
+    pfd.fd = hal_bmlite_get_status_fd();
+    pfd.events = POLLPRI | POLLERR;
+    if (pfd.fd < 0) {
+        // No edge detection on this pin, just don't burn CPU
+        usleep(HCP_MIN(ms, 1) * 1000);
+    } else {
+        poll(&pfd, 1, ms);
+    }
+
+    return hal_bmlite_get_status();
 }
 
 void hal_bmlite_reset(bool state)
 {
     /* The reset pin is controlled by WiringPis digitalWrite function*/
     if (state) {
-        write(fd_reset_value, "0", 2);
+        write(dev->fd_reset_value, "0", 2);
     } else {
-        write(fd_reset_value, "1", 2);
+        write(dev->fd_reset_value, "1", 2);
     }
 }
 
@@ -123,8 +395,8 @@ bool hal_bmlite_get_status(void)
 {
     char res[2];
 
-    lseek (fd_ready_value, 0, SEEK_SET);
-    read (fd_ready_value, res, 2);
+    lseek (dev->fd_ready_value, 0, SEEK_SET);
+    read (dev->fd_ready_value, res, 2);
     return res[0] == '1';
 }
 
@@ -134,11 +406,11 @@ fpc_bep_result_t hal_bmlite_spi_write_read(uint8_t *write, uint8_t *read, size_t
 
     size_t status;
 
-    spi_tr.tx_buf        = (unsigned long)write;
-    spi_tr.rx_buf        = (unsigned long)read;
-    spi_tr.len           = size;
+    dev->spi_tr.tx_buf        = (unsigned long)write;
+    dev->spi_tr.rx_buf        = (unsigned long)read;
+    dev->spi_tr.len           = size;
 
-    status = ioctl(fd_spi, SPI_IOC_MESSAGE(1), &spi_tr);
+    status = ioctl(dev->fd_spi, SPI_IOC_MESSAGE(1), &dev->spi_tr);
 
     /*
      * Status returns the number of bytes sent, if this number is different
@@ -151,32 +423,32 @@ fpc_bep_result_t hal_bmlite_spi_write_read(uint8_t *write, uint8_t *read, size_t
 }
 
 
-static fpc_bep_result_t platform_spi_init(char *device, uint32_t baudrate)
+static fpc_bep_result_t platform_spi_init(linux_bmlite_dev_t *d, char *device, uint32_t baudrate)
 {
     uint8_t mode = 0;
     uint32_t speed = baudrate;
     uint8_t bits = 8;
 
-    spi_tr.bits_per_word = bits;
-    spi_tr.speed_hz = baudrate;
+    d->spi_tr.bits_per_word = bits;
+    d->spi_tr.speed_hz = baudrate;
 
-    fd_spi = open(device, O_RDWR);
-	if (fd_spi < 0) {
+    d->fd_spi = open(device, O_RDWR);
+	if (d->fd_spi < 0) {
 		printf("Can't open device %s\n", device);
         return FPC_BEP_RESULT_INTERNAL_ERROR;
     }
 
-	if(ioctl(fd_spi, SPI_IOC_WR_MODE, &mode) < 0) {
+	if(ioctl(d->fd_spi, SPI_IOC_WR_MODE, &mode) < 0) {
 		printf("Can't set spi mode");
         return FPC_BEP_RESULT_INTERNAL_ERROR;
     }
 
-	if(ioctl(fd_spi, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0) {
+	if(ioctl(d->fd_spi, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0) {
 		printf("Can't set bits per word");
         return FPC_BEP_RESULT_INTERNAL_ERROR;
     }
 
-	if(ioctl(fd_spi, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0) {
+	if(ioctl(d->fd_spi, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0) {
 		printf("Can't set speed hz");
         return FPC_BEP_RESULT_INTERNAL_ERROR;
     }
@@ -185,12 +457,13 @@ static fpc_bep_result_t platform_spi_init(char *device, uint32_t baudrate)
     return FPC_BEP_RESULT_OK;
 }
 
-static fpc_bep_result_t platform_gpio_init()
+static fpc_bep_result_t platform_gpio_init(linux_bmlite_dev_t *d, uint32_t reset_pin, uint32_t ready_pin)
 {
-    fd_reset_value = gpio_init(BMLITE_RESET_PIN, GPIO_DIR_OUT);
-    fd_ready_value = gpio_init(BMLITE_READY_PIN, GPIO_DIR_IN);
+    d->ready_pin = ready_pin;
+    d->fd_reset_value = gpio_init(reset_pin, GPIO_DIR_OUT);
+    d->fd_ready_value = gpio_init(ready_pin, GPIO_DIR_IN);
 
-    if(fd_ready_value < 0 || fd_ready_value < 0) 
+    if(d->fd_reset_value < 0 || d->fd_ready_value < 0)
         return FPC_BEP_RESULT_INTERNAL_ERROR;
     else
         return FPC_BEP_RESULT_OK;
@@ -230,7 +503,7 @@ static int gpio_init(uint32_t pin, gpio_dir_t dir)
 	// Some GPIO doesn't allow to change pin direction
         if(dir == GPIO_DIR_OUT)
             write(fd, "out", 4);
-        else 
+        else
             write(fd, "in", 4);
         close(fd);
     }
@@ -246,4 +519,3 @@ static int gpio_init(uint32_t pin, gpio_dir_t dir)
     }
     return fd;
 }
-
@@ -27,7 +27,27 @@
 
 #include "fpc_bep_types.h"
 #include "hcp_tiny.h"
+#include "console_params.h"
 
 void clear_screen(void);
 
+/**
+ * @brief Open additional BM-Lite device
+ *
+ *   wiringPi drives a single SPI channel with fixed pins, so additional
+ *   devices are not supported on this platform.
+ *
+ * @param[in] params - device parameters
+ *
+ * @return FPC_BEP_RESULT_NOT_SUPPORTED
+ */
+fpc_bep_result_t platform_linux_dev_open(console_initparams_t *params);
+
+/**
+ * @brief Close BM-Lite device opened by platform_linux_dev_open()
+ *
+ * @param[in] hcp_comm - HCP_comm struct bound to the device
+ */
+void platform_linux_dev_close(HCP_comm_t *hcp_comm);
+
 #endif /* PLATFORM_RPI_H */
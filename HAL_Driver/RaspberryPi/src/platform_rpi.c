@@ -36,6 +36,7 @@
 #include "bmlite_hal.h"
 #include "platform_rpi.h"
 #include "platform.h"
+#include "platform_linux.h"
 #include "console_params.h"
 
 hal_tick_t hal_timebase_get_tick(void)
@@ -97,3 +98,13 @@ fpc_bep_result_t hal_board_init(void *params)
 
     return FPC_BEP_RESULT_OK;
 }
+
+fpc_bep_result_t platform_linux_dev_open(console_initparams_t *p)
+{
+    printf("Additional BM-Lite devices are not supported on Raspberry Pi\n");
+    return FPC_BEP_RESULT_NOT_SUPPORTED;
+}
+
+void platform_linux_dev_close(HCP_comm_t *hcp_comm)
+{
+}
@@ -85,6 +85,13 @@ bool hal_bmlite_get_status(void)
 }
 
 
+uint32_t hal_bmlite_spi_set_clock(uint32_t hz)
+{
+    // Speed is set per transfer
+    speed_hz_int = hz;
+    return hz;
+}
+
 bool rpi_spi_init(uint32_t speed_hz)
 {
     raspberryPi_init();
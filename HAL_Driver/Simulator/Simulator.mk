@@ -0,0 +1,29 @@
+# Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#   https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+HAL = $(ROOT)/HAL_Driver/Simulator
+
+CC := gcc
+
+CFLAGS +=\
+	-D_DEFAULT_SOURCE
+
+VPATH += $(HAL)
+C_INC += -I$(HAL)/inc
+
+# Source Folders
+VPATH += $(HAL)/src/
+
+# C Sources
+C_SRCS += $(notdir $(wildcard $(HAL)/src/*.c))
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PLATFORM_SIM_H
+#define PLATFORM_SIM_H
+
+/**
+ * @file    platform_sim.h
+ * @brief   Simulator HAL: configuration and internal interface.
+ *
+ *   BM-Lite is simulated in the same process, a finger touches the sensor
+ *   periodically. Every value can be changed with -D in CFLAGS.
+ */
+
+#include <stdint.h>
+
+#include "bmlite_hal.h"
+
+/** A finger touches the sensor every SIM_TOUCH_PERIOD ms */
+#ifndef SIM_TOUCH_PERIOD
+#define SIM_TOUCH_PERIOD 3000
+#endif
+
+/** Duration of a touch, ms */
+#ifndef SIM_TOUCH_TIME
+#define SIM_TOUCH_TIME 600
+#endif
+
+/** Every SIM_TAP_EVERY-th touch is a short tap, gone before capture. 0 - no taps */
+#ifndef SIM_TAP_EVERY
+#define SIM_TAP_EVERY 5
+#endif
+
+#ifndef SIM_TAP_TIME
+#define SIM_TAP_TIME 3
+#endif
+
+/** Touches cycle through this number of different fingers */
+#ifndef SIM_FINGERS
+#define SIM_FINGERS 2
+#endif
+
+/** Timing of the simulated BM-Lite, ms */
+#define SIM_WAKE_TIME       5
+#define SIM_DEEP_WAKE_TIME  30
+#define SIM_CAPTURE_TIME    60
+#define SIM_EXTRACT_TIME    40
+#define SIM_IDENTIFY_TIME   20
+
+#define SIM_ENROLL_SAMPLES  3
+#define SIM_TEMPLATES       30
+
+/**
+ * @brief Sleep as the host core does in WFI, the time is counted as idle
+ *
+ * @param[in] ms  Time to sleep [ms]
+ */
+void sim_host_sleep(uint32_t ms);
+
+/**
+ * @brief Print message with time stamp
+ */
+void sim_log(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/**
+ * @brief Initialize simulated BM-Lite. Storage is empty
+ */
+void sim_bmlite_init(void);
+
+#endif /* PLATFORM_SIM_H */
@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    hal_board.c
+ * @brief   Simulator HAL: timebase, button and LEDs on the console.
+ */
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bmlite_hal.h"
+#include "platform_sim.h"
+
+/** Button press times given by console keys */
+#define BUTTON_ENROLL_MS 1000
+#define BUTTON_DELETE_MS 6000
+
+static hal_tick_t start_tick;
+static uint64_t idle_ms;
+static uint32_t button_press_time;
+
+static hal_tick_t time_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (hal_tick_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void hal_timebase_init(void)
+{
+    start_tick = time_ms();
+}
+
+hal_tick_t hal_timebase_get_tick(void)
+{
+    return time_ms() - start_tick;
+}
+
+void hal_timebase_busy_wait(uint32_t ms)
+{
+    usleep(ms * 1000);
+}
+
+void sim_host_sleep(uint32_t ms)
+{
+    hal_tick_t start = hal_timebase_get_tick();
+
+    usleep(ms * 1000);
+    idle_ms += hal_timebase_get_tick() - start;
+}
+
+void sim_log(const char *fmt, ...)
+{
+    va_list ap;
+    hal_tick_t now = hal_timebase_get_tick();
+
+    printf("[%5u.%03u] ", (unsigned)(now / 1000), (unsigned)(now % 1000));
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+    fflush(stdout);
+}
+
+fpc_bep_result_t hal_board_init(void *params)
+{
+    (void)params;
+
+    // Keys are read without blocking the application loop
+    fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+    sim_bmlite_init();
+
+    printf("BM-Lite simulator: finger touches the sensor every %d ms\n", SIM_TOUCH_PERIOD);
+    printf("Keys (+Enter): e - enroll, d - delete all templates, q - quit\n");
+
+    return FPC_BEP_RESULT_OK;
+}
+
+static void button_poll(void)
+{
+    char c;
+
+    while (read(STDIN_FILENO, &c, 1) == 1) {
+        switch (c) {
+            case 'e':
+                button_press_time = BUTTON_ENROLL_MS;
+                break;
+            case 'd':
+                button_press_time = BUTTON_DELETE_MS;
+                break;
+            case 'q':
+                exit(0);
+            default:
+                break;
+        }
+    }
+}
+
+uint32_t hal_get_button_press_time(void)
+{
+    uint32_t time;
+
+    button_poll();
+    time = button_press_time;
+    button_press_time = 0;
+
+    return time;
+}
+
+uint32_t hal_check_button_pressed(void)
+{
+    button_poll();
+    return button_press_time;
+}
+
+void hal_set_leds(platform_led_status_t status, uint16_t mode)
+{
+    hal_tick_t now = hal_timebase_get_tick();
+
+    switch (status) {
+        case BMLITE_LED_STATUS_MATCH:
+            sim_log("LED: %s, host slept %u%% of the time", mode ? "MATCH" : "NO MATCH",
+                    now ? (unsigned)(idle_ms * 100 / now) : 0);
+            break;
+        case BMLITE_LED_STATUS_WAITTOUCH:
+            if (mode) {
+                sim_log("LED: put finger");
+            }
+            break;
+        case BMLITE_LED_STATUS_ENROLL:
+            sim_log("LED: enroll %s", mode ? "started" : "finished");
+            break;
+        case BMLITE_LED_STATUS_DELETE_TEMPLATES:
+            sim_log("LED: delete templates");
+            break;
+        case BMLITE_LED_STATUS_ERROR:
+            if (!mode) {
+                sim_log("LED: error");
+            }
+            break;
+        default:
+            break;
+    }
+}
@@ -0,0 +1,605 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    sim_bmlite.c
+ * @brief   Simulated BM-Lite on SPI.
+ *
+ *   Link and transport layers follow HCP: every frame is acknowledged,
+ *   answers longer than one frame are split into a sequence. IRQ is raised
+ *   while there is data for the host. Biometric commands work on finger
+ *   numbers instead of images: identification matches if the template was
+ *   enrolled from the same finger.
+ */
+
+#include <string.h>
+
+#include "bmlite_hal.h"
+#include "fpc_crc.h"
+#include "hcp_tiny.h"
+#include "platform_sim.h"
+
+/** Transport payload of one frame, as in hcp_tiny.c */
+#define SIM_APP_MTU (MTU - 6 - 8)
+/** Largest command or answer handled */
+#define SIM_PKT_SIZE 1024
+
+typedef struct {
+    uint8_t data[SIM_PKT_SIZE];
+    uint32_t size;
+    /** Tick when the answer is ready */
+    hal_tick_t at;
+} sim_pkt_t;
+
+static const uint32_t sim_ack = 0x7f01ff7f;
+
+static struct {
+    /** Command being received */
+    sim_pkt_t cmd;
+    /** Answers waiting to be sent, the second follows the first */
+    sim_pkt_t answer[2];
+    uint32_t nr_answers;
+    /** Bytes for the host: ACK or answer frame */
+    uint8_t out[MTU];
+    uint32_t out_size;
+    uint32_t out_pos;
+    /** Answer frame is sent and waits for ACK */
+    bool wait_ack;
+    uint32_t answer_offset;
+    uint16_t seq_nr;
+    /** Finger of captured image, extracted features and template, -1 - none */
+    int image;
+    int features;
+    int template;
+    int enroll_finger;
+    uint32_t enroll_left;
+    /** Finger of stored templates, -1 - free slot */
+    int storage[SIM_TEMPLATES];
+    /** Tick of the last wake-up, 0 - awake */
+    hal_tick_t wake_at;
+} sim;
+
+/*
+ * Finger: touch k starts at k * SIM_TOUCH_PERIOD, k > 0
+ */
+
+static uint32_t touch_time(uint32_t k)
+{
+    return (SIM_TAP_EVERY && k % SIM_TAP_EVERY == 0) ? SIM_TAP_TIME : SIM_TOUCH_TIME;
+}
+
+/* Finger on the sensor at t, -1 if none */
+static int touch_finger(hal_tick_t t)
+{
+    uint32_t k = t / SIM_TOUCH_PERIOD;
+
+    if (k == 0 || t - (hal_tick_t)k * SIM_TOUCH_PERIOD >= touch_time(k)) {
+        return -1;
+    }
+    return k % SIM_FINGERS;
+}
+
+/* First tick at or after t when finger is on the sensor */
+static hal_tick_t touch_next(hal_tick_t t)
+{
+    if (touch_finger(t) >= 0) {
+        return t;
+    }
+    return (t / SIM_TOUCH_PERIOD + 1) * SIM_TOUCH_PERIOD;
+}
+
+/* First tick at or after t when finger is off the sensor */
+static hal_tick_t touch_end(hal_tick_t t)
+{
+    uint32_t k = t / SIM_TOUCH_PERIOD;
+
+    if (touch_finger(t) < 0) {
+        return t;
+    }
+    return (hal_tick_t)k * SIM_TOUCH_PERIOD + touch_time(k);
+}
+
+/*
+ * Application layer
+ */
+
+static uint8_t *cmd_arg(uint16_t arg, uint16_t *size)
+{
+    uint8_t *p = sim.cmd.data + 4;
+    uint16_t nr_args;
+
+    memcpy(&nr_args, sim.cmd.data + 2, sizeof(nr_args));
+    for (uint16_t i = 0; i < nr_args && p + 4 <= sim.cmd.data + sim.cmd.size; i++) {
+        uint16_t type, len;
+
+        memcpy(&type, p, sizeof(type));
+        memcpy(&len, p + 2, sizeof(len));
+        if (type == arg) {
+            if (size) {
+                *size = len;
+            }
+            return p + 4;
+        }
+        p += 4 + len;
+    }
+    return NULL;
+}
+
+static bool cmd_has(uint16_t arg)
+{
+    return cmd_arg(arg, NULL) != NULL;
+}
+
+static uint16_t cmd_u16(uint16_t arg, uint16_t def)
+{
+    uint16_t size;
+    uint8_t *data = cmd_arg(arg, &size);
+    uint16_t value = def;
+
+    if (data && size >= sizeof(value)) {
+        memcpy(&value, data, sizeof(value));
+    }
+    return value;
+}
+
+static sim_pkt_t *answer_begin(uint16_t cmd, hal_tick_t at)
+{
+    sim_pkt_t *a;
+
+    if (sim.nr_answers == 2) {
+        return NULL;
+    }
+    a = &sim.answer[sim.nr_answers++];
+    memcpy(a->data, &cmd, sizeof(cmd));
+    memset(a->data + 2, 0, 2);
+    a->size = 4;
+    a->at = at;
+    return a;
+}
+
+static void answer_arg(sim_pkt_t *a, uint16_t arg, const void *data, uint16_t size)
+{
+    uint16_t nr_args;
+
+    if (a == NULL || a->size + 4 + size > SIM_PKT_SIZE) {
+        return;
+    }
+    memcpy(a->data + a->size, &arg, sizeof(arg));
+    memcpy(a->data + a->size + 2, &size, sizeof(size));
+    memcpy(a->data + a->size + 4, data, size);
+    a->size += 4 + size;
+    memcpy(&nr_args, a->data + 2, sizeof(nr_args));
+    nr_args++;
+    memcpy(a->data + 2, &nr_args, sizeof(nr_args));
+}
+
+static void answer_result(sim_pkt_t *a, fpc_bep_result_t result)
+{
+    int8_t r = result;
+
+    answer_arg(a, ARG_RESULT, &r, sizeof(r));
+}
+
+/* Answer after waiting for finger event at tick 'event', limited by ARG_TIMEOUT */
+static sim_pkt_t *answer_event(uint16_t cmd, hal_tick_t now, hal_tick_t event)
+{
+    uint16_t timeout = cmd_u16(ARG_TIMEOUT, 0);
+    sim_pkt_t *a;
+
+    if (timeout && event - now > timeout) {
+        a = answer_begin(cmd, now + timeout);
+        answer_result(a, FPC_BEP_RESULT_TIMEOUT);
+        return NULL;
+    }
+    a = answer_begin(cmd, event);
+    return a;
+}
+
+static void cmd_sensor(uint16_t cmd, hal_tick_t now)
+{
+    sim_pkt_t *a = answer_begin(cmd, now);
+    uint16_t u16;
+    uint32_t u32;
+
+    if (cmd_has(ARG_SENSOR_TYPE)) {
+        u16 = 0x1021;
+        answer_arg(a, ARG_SENSOR_TYPE, &u16, sizeof(u16));
+    }
+    if (cmd_has(ARG_WIDTH)) {
+        u16 = 160;
+        answer_arg(a, ARG_WIDTH, &u16, sizeof(u16));
+    }
+    if (cmd_has(ARG_HEIGHT)) {
+        u16 = 160;
+        answer_arg(a, ARG_HEIGHT, &u16, sizeof(u16));
+    }
+    if (cmd_has(ARG_DPI)) {
+        u16 = 508;
+        answer_arg(a, ARG_DPI, &u16, sizeof(u16));
+    }
+    if (cmd_has(ARG_MAX_SPI_CLOCK)) {
+        u32 = 8000000;
+        answer_arg(a, ARG_MAX_SPI_CLOCK, &u32, sizeof(u32));
+    }
+    answer_result(a, FPC_BEP_RESULT_OK);
+}
+
+static void cmd_info(uint16_t cmd, hal_tick_t now)
+{
+    static const char version[] = "BM-Lite simulator";
+    static const uint8_t unique_id[12] = { 'S', 'I', 'M', 0, 0, 0, 0, 0, 0, 0, 0, 1 };
+    sim_pkt_t *a = answer_begin(cmd, now);
+
+    if (cmd_has(ARG_VERSION)) {
+        answer_arg(a, ARG_VERSION, version, sizeof(version));
+    }
+    if (cmd_has(ARG_UNIQUE_ID)) {
+        answer_arg(a, ARG_UNIQUE_ID, unique_id, sizeof(unique_id));
+    }
+    answer_result(a, FPC_BEP_RESULT_OK);
+}
+
+static void cmd_enroll(uint16_t cmd, hal_tick_t now)
+{
+    sim_pkt_t *a = answer_begin(cmd, now + SIM_EXTRACT_TIME);
+    fpc_bep_result_t result = FPC_BEP_RESULT_OK;
+
+    if (cmd_has(ARG_START)) {
+        sim.enroll_left = SIM_ENROLL_SAMPLES;
+        sim.enroll_finger = -1;
+    } else if (cmd_has(ARG_ADD)) {
+        if (sim.image < 0 || sim.enroll_left == 0) {
+            result = FPC_BEP_RESULT_WRONG_STATE;
+        } else {
+            sim.enroll_finger = sim.image;
+            sim.enroll_left--;
+            answer_arg(a, ARG_COUNT, &sim.enroll_left, sizeof(sim.enroll_left));
+        }
+    } else if (cmd_has(ARG_FINISH)) {
+        if (sim.enroll_left == 0 && sim.enroll_finger >= 0) {
+            sim.template = sim.enroll_finger;
+        } else {
+            result = FPC_BEP_RESULT_GENERAL_ERROR;
+        }
+    }
+    answer_result(a, result);
+}
+
+static void cmd_storage(uint16_t cmd, hal_tick_t now)
+{
+    sim_pkt_t *a = answer_begin(cmd, now + 1);
+    uint16_t id = cmd_u16(ARG_ID, UINT16_MAX);
+    fpc_bep_result_t result = FPC_BEP_RESULT_OK;
+
+    if (cmd_has(ARG_DELETE)) {
+        if (cmd_has(ARG_ALL)) {
+            memset(sim.storage, -1, sizeof(sim.storage));
+        } else if (id < SIM_TEMPLATES && sim.storage[id] >= 0) {
+            sim.storage[id] = -1;
+        } else {
+            result = FPC_BEP_RESULT_ID_NOT_FOUND;
+        }
+    } else if (cmd_has(ARG_COUNT)) {
+        uint16_t count = 0;
+
+        for (int i = 0; i < SIM_TEMPLATES; i++) {
+            count += sim.storage[i] >= 0;
+        }
+        answer_arg(a, ARG_COUNT, &count, sizeof(count));
+    } else if (cmd_has(ARG_ID)) {
+        uint16_t ids[SIM_TEMPLATES];
+        uint16_t count = 0;
+
+        for (int i = 0; i < SIM_TEMPLATES; i++) {
+            if (sim.storage[i] >= 0) {
+                ids[count++] = i;
+            }
+        }
+        if (count) {
+            answer_arg(a, ARG_DATA, ids, count * sizeof(uint16_t));
+        }
+    }
+    answer_result(a, result);
+}
+
+static void cmd_cancel(uint16_t cmd, hal_tick_t now)
+{
+    // Pending answer becomes cancelled unless its sending has started
+    if (sim.nr_answers && sim.answer_offset == 0 && !sim.wait_ack) {
+        uint16_t pending;
+        sim_pkt_t *a;
+
+        memcpy(&pending, sim.answer[0].data, sizeof(pending));
+        sim.nr_answers = 0;
+        a = answer_begin(pending, now);
+        answer_result(a, FPC_BEP_RESULT_CANCELLED);
+        sim.wake_at = 0;
+    }
+    answer_result(answer_begin(cmd, now), FPC_BEP_RESULT_OK);
+}
+
+static void cmd_execute(hal_tick_t now)
+{
+    uint16_t cmd;
+    sim_pkt_t *a;
+    int match = -1;
+
+    memcpy(&cmd, sim.cmd.data, sizeof(cmd));
+    if (cmd == CMD_CANCEL) {
+        cmd_cancel(cmd, now);
+        return;
+    }
+    // New command drops the answer not sent yet
+    if (sim.answer_offset == 0 && !sim.wait_ack) {
+        sim.nr_answers = 0;
+    }
+
+    switch (cmd) {
+        case CMD_CAPTURE:
+            a = answer_event(cmd, now, touch_next(now));
+            if (a) {
+                sim.image = touch_finger(a->at);
+                a->at += SIM_CAPTURE_TIME;
+                answer_result(a, FPC_BEP_RESULT_OK);
+            }
+            break;
+        case CMD_WAIT:
+            a = answer_event(cmd, now, cmd_has(ARG_FINGER_UP) ? touch_end(now) : touch_next(now));
+            answer_result(a, FPC_BEP_RESULT_OK);
+            break;
+        case CMD_MCU:
+            if (cmd_has(ARG_SLEEP) || cmd_has(ARG_DEEP_SLEEP)) {
+                // Finger detect sleep, answer on wake-up
+                sim.wake_at = touch_next(now) +
+                    (cmd_has(ARG_DEEP_SLEEP) ? SIM_DEEP_WAKE_TIME : SIM_WAKE_TIME);
+                answer_result(answer_begin(cmd, sim.wake_at), FPC_BEP_RESULT_OK);
+            } else {
+                answer_result(answer_begin(cmd, now), FPC_BEP_RESULT_NOT_IMPLEMENTED);
+            }
+            break;
+        case CMD_IMAGE:
+            a = answer_begin(cmd, now + SIM_EXTRACT_TIME);
+            if (cmd_has(ARG_EXTRACT) && sim.image >= 0) {
+                sim.features = sim.image;
+                answer_result(a, FPC_BEP_RESULT_OK);
+            } else {
+                answer_result(a, cmd_has(ARG_EXTRACT) ? FPC_BEP_RESULT_WRONG_STATE :
+                        FPC_BEP_RESULT_NOT_IMPLEMENTED);
+            }
+            break;
+        case CMD_IDENTIFY:
+            a = answer_begin(cmd, now + SIM_IDENTIFY_TIME);
+            for (int i = 0; i < SIM_TEMPLATES && sim.features >= 0; i++) {
+                if (sim.storage[i] == sim.features) {
+                    match = i;
+                    break;
+                }
+            }
+            answer_arg(a, ARG_MATCH, &(bool){ match >= 0 }, sizeof(bool));
+            if (match >= 0) {
+                answer_arg(a, ARG_ID, &(uint16_t){ match }, sizeof(uint16_t));
+            }
+            answer_result(a, FPC_BEP_RESULT_OK);
+            break;
+        case CMD_ENROLL:
+            cmd_enroll(cmd, now);
+            break;
+        case CMD_TEMPLATE: {
+            uint16_t id = cmd_u16(ARG_ID, UINT16_MAX);
+
+            a = answer_begin(cmd, now + 1);
+            if (cmd_has(ARG_SAVE) && id < SIM_TEMPLATES && sim.template >= 0) {
+                sim.storage[id] = sim.template;
+                answer_result(a, FPC_BEP_RESULT_OK);
+            } else if (cmd_has(ARG_DELETE)) {
+                sim.template = -1;
+                answer_result(a, FPC_BEP_RESULT_OK);
+            } else {
+                answer_result(a, FPC_BEP_RESULT_INVALID_ARGUMENT);
+            }
+            break;
+        }
+        case CMD_STORAGE_TEMPLATE:
+            cmd_storage(cmd, now);
+            break;
+        case CMD_INFO:
+            cmd_info(cmd, now);
+            break;
+        case CMD_SENSOR:
+            cmd_sensor(cmd, now);
+            break;
+        case CMD_RESET:
+            answer_result(answer_begin(cmd, now), FPC_BEP_RESULT_OK);
+            break;
+        default:
+            answer_result(answer_begin(cmd, now), FPC_BEP_RESULT_NOT_IMPLEMENTED);
+            break;
+    }
+}
+
+/*
+ * Link and transport layers
+ */
+
+static void frame_send(void)
+{
+    sim_pkt_t *a = &sim.answer[0];
+    uint16_t chn = 0;
+    uint16_t t_size = HCP_MIN(a->size - sim.answer_offset, SIM_APP_MTU);
+    uint16_t lnk_size = t_size + 6;
+    uint16_t seq_len = a->size / SIM_APP_MTU + 1;
+    uint32_t crc;
+
+    sim.seq_nr++;
+    memcpy(sim.out, &chn, 2);
+    memcpy(sim.out + 2, &lnk_size, 2);
+    memcpy(sim.out + 4, &t_size, 2);
+    memcpy(sim.out + 6, &sim.seq_nr, 2);
+    memcpy(sim.out + 8, &seq_len, 2);
+    memcpy(sim.out + 10, a->data + sim.answer_offset, t_size);
+    crc = fpc_crc(0, sim.out + 4, lnk_size);
+    memcpy(sim.out + 4 + lnk_size, &crc, 4);
+    sim.out_size = lnk_size + 8;
+    sim.out_pos = 0;
+    sim.answer_offset += t_size;
+    sim.wait_ack = true;
+}
+
+static void answer_start(hal_tick_t now)
+{
+    uint16_t cmd;
+
+    memcpy(&cmd, sim.answer[0].data, sizeof(cmd));
+    if (sim.wake_at && cmd == CMD_MCU) {
+        if (touch_finger(sim.wake_at) >= 0) {
+            sim_log("BM-Lite: woke up, finger %d", touch_finger(sim.wake_at));
+        } else {
+            sim_log("BM-Lite: woke up, finger is gone");
+        }
+    } else if (sim.wake_at && cmd == CMD_IDENTIFY) {
+        sim_log("BM-Lite: identified %u ms after wake-up", (unsigned)(now - sim.wake_at));
+        sim.wake_at = 0;
+    }
+    sim.answer_offset = 0;
+    sim.seq_nr = 0;
+    frame_send();
+}
+
+static void ack_received(void)
+{
+    sim.wait_ack = false;
+    if (sim.answer_offset < sim.answer[0].size) {
+        frame_send();
+        return;
+    }
+    // Answer is sent
+    sim.answer_offset = 0;
+    sim.nr_answers--;
+    if (sim.nr_answers) {
+        sim.answer[0] = sim.answer[1];
+    }
+}
+
+static void frame_received(const uint8_t *frame, size_t size)
+{
+    uint16_t lnk_size, t_size, seq_nr, seq_len;
+    uint32_t crc;
+
+    memcpy(&lnk_size, frame + 2, 2);
+    if (size < 14 || lnk_size + 8u > size) {
+        return;
+    }
+    memcpy(&t_size, frame + 4, 2);
+    memcpy(&seq_nr, frame + 6, 2);
+    memcpy(&seq_len, frame + 8, 2);
+    memcpy(&crc, frame + 4 + lnk_size, 4);
+    if (crc != fpc_crc(0, frame + 4, lnk_size)) {
+        // Not acknowledged, the host sends it again or gives up
+        return;
+    }
+
+    if (seq_nr == 1) {
+        sim.cmd.size = 0;
+    }
+    if (sim.cmd.size + t_size <= SIM_PKT_SIZE) {
+        memcpy(sim.cmd.data + sim.cmd.size, frame + 10, t_size);
+        sim.cmd.size += t_size;
+    }
+    memcpy(sim.out, &sim_ack, 4);
+    sim.out_size = 4;
+    sim.out_pos = 0;
+
+    if (seq_nr == seq_len) {
+        cmd_execute(hal_timebase_get_tick());
+    }
+}
+
+/*
+ * HAL
+ */
+
+void sim_bmlite_init(void)
+{
+    memset(&sim, 0, sizeof(sim));
+    memset(sim.storage, -1, sizeof(sim.storage));
+    sim.image = sim.features = sim.template = sim.enroll_finger = -1;
+}
+
+void hal_bmlite_reset(bool state)
+{
+    if (state) {
+        // Storage survives reset
+        sim.nr_answers = 0;
+        sim.out_size = sim.out_pos = 0;
+        sim.wait_ack = false;
+        sim.answer_offset = 0;
+        sim.cmd.size = 0;
+        sim.wake_at = 0;
+        sim.image = sim.features = sim.template = -1;
+    }
+}
+
+bool hal_bmlite_get_status(void)
+{
+    hal_tick_t now = hal_timebase_get_tick();
+
+    if (sim.out_pos < sim.out_size) {
+        return true;
+    }
+    if (sim.nr_answers && !sim.wait_ack && sim.answer_offset == 0 && now >= sim.answer[0].at) {
+        answer_start(now);
+        return true;
+    }
+    return false;
+}
+
+bool hal_bmlite_wait_status(uint32_t ms)
+{
+    hal_tick_t now = hal_timebase_get_tick();
+
+    if (!hal_bmlite_get_status()) {
+        // Host core sleeps until IRQ, as in WFI
+        if (sim.nr_answers && !sim.wait_ack && sim.answer[0].at > now) {
+            ms = HCP_MIN(ms, sim.answer[0].at - now);
+        }
+        sim_host_sleep(ms);
+    }
+    return hal_bmlite_get_status();
+}
+
+fpc_bep_result_t hal_bmlite_spi_write_read(uint8_t *write, uint8_t *read, size_t size,
+        bool leave_cs_asserted)
+{
+    (void)leave_cs_asserted;
+
+    if (sim.out_pos < sim.out_size) {
+        // Host reads
+        size_t n = HCP_MIN(size, sim.out_size - sim.out_pos);
+
+        memcpy(read, sim.out + sim.out_pos, n);
+        memset(read + n, 0, size - n);
+        sim.out_pos += n;
+        return FPC_BEP_RESULT_OK;
+    }
+
+    memset(read, 0, size);
+    if (size == 4 && sim.wait_ack && !memcmp(write, &sim_ack, 4)) {
+        ack_received();
+    } else {
+        frame_received(write, size);
+    }
+    return FPC_BEP_RESULT_OK;
+}
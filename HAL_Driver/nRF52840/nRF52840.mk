@@ -41,6 +41,7 @@ CFLAGS +=\
  	-DBSP_SIMPLE \
  	-Wa,--defsym,_STARTUP_CONFIG=1 \
  	-DUART_CMDS \
+ 	-DBMLITE_CANCEL_POLL_INTERVAL=0 \
 
 CFLAGS +=\
 	-DUSE_HAL_DRIVER \
@@ -33,11 +33,13 @@
 
 #define BMLITE_PIN_RESET   	ARDUINO_2_PIN
 #define BMLITE_PIN_STATUS   ARDUINO_A2_PIN
+#define BMLITE_PIN_BUTTON   BUTTON_4
 
 static volatile bool sensor_interrupt = false;
 
 static void nordic_bmlite_gpio_init(void);
 void nordic_bmlite_spi_init(uint32_t speed_hz);
+void nordic_timebase_sleep(uint32_t ms);
 
 
 fpc_bep_result_t hal_board_init(void *params)
@@ -55,9 +57,10 @@ fpc_bep_result_t hal_board_init(void *params)
 	}
 	NRF_USBD->ENABLE = 1;
 
-    nordic_bmlite_gpio_init();
-    nordic_bmlite_spi_init(4000000);
+    // Before GPIOTE, which adds wake-up sense to the button pin
     bsp_board_init(BSP_INIT_LEDS | BSP_INIT_BUTTONS);
+    nordic_bmlite_gpio_init();
+    nordic_bmlite_spi_init(8000000);
 
     return FPC_BEP_RESULT_OK;
 }
@@ -76,6 +79,31 @@ bool hal_bmlite_get_status(void)
     return nrf_drv_gpiote_in_is_set(BMLITE_PIN_STATUS);
 }
 
+static void bmlite_status_handler(nrf_drv_gpiote_pin_t pin, nrf_gpiote_polarity_t action)
+{
+    sensor_interrupt = true;
+}
+
+bool hal_bmlite_wait_status(uint32_t ms)
+{
+    uint32_t primask = __get_PRIMASK();
+
+    __disable_irq();
+    // Sleep until status pin, another interrupt or timeout
+    if (!sensor_interrupt && !hal_bmlite_get_status()) {
+        nordic_timebase_sleep(ms);
+    }
+    __set_PRIMASK(primask);
+    sensor_interrupt = false;
+
+    return hal_bmlite_get_status();
+}
+
+static void button_handler(nrf_drv_gpiote_pin_t pin, nrf_gpiote_polarity_t action)
+{
+    // Only wakes the core, button is checked with 1 ms tick
+}
+
 static void nordic_bmlite_gpio_init(void)
 {
     ret_code_t err_code;
@@ -86,10 +114,17 @@ static void nordic_bmlite_gpio_init(void)
     APP_ERROR_CHECK(err_code);
 	nrf_drv_gpiote_out_task_enable(BMLITE_PIN_RESET); //Enable task for output pin (toggle)
 
-    nrf_drv_gpiote_in_config_t config = GPIOTE_CONFIG_IN_SENSE_LOTOHI(true);
-    err_code = nrf_drv_gpiote_in_init(BMLITE_PIN_STATUS, &config, NULL);
+    // PORT event keeps working with HFCLK off in nordic_timebase_sleep()
+    nrf_drv_gpiote_in_config_t config = GPIOTE_CONFIG_IN_SENSE_LOTOHI(false);
+    err_code = nrf_drv_gpiote_in_init(BMLITE_PIN_STATUS, &config, bmlite_status_handler);
+    APP_ERROR_CHECK(err_code);
+    nrf_drv_gpiote_in_event_enable(BMLITE_PIN_STATUS, true);
+
+    nrf_drv_gpiote_in_config_t btn_config = GPIOTE_CONFIG_IN_SENSE_TOGGLE(false);
+    btn_config.pull = BUTTON_PULL;
+    err_code = nrf_drv_gpiote_in_init(BMLITE_PIN_BUTTON, &btn_config, button_handler);
     APP_ERROR_CHECK(err_code);
-    nrf_gpiote_event_clear(NRF_GPIOTE_EVENTS_IN_0);
+    nrf_drv_gpiote_in_event_enable(BMLITE_PIN_BUTTON, true);
     return;
 }
 
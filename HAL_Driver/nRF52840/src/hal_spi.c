@@ -99,13 +99,49 @@ fpc_bep_result_t hal_bmlite_spi_write_read(uint8_t *write, uint8_t *read, size_t
 	return FPC_BEP_RESULT_OK;
 }
 
+/* Supported clocks, the fastest one not above the requested is used */
+static const struct {
+    uint32_t hz;
+    nrf_drv_spi_frequency_t freq;
+} spi_clocks[] = {
+    { 8000000, NRF_SPI_FREQ_8M },
+    { 4000000, NRF_SPI_FREQ_4M },
+    { 2000000, NRF_SPI_FREQ_2M },
+    { 1000000, NRF_SPI_FREQ_1M },
+    { 500000, NRF_SPI_FREQ_500K },
+    { 250000, NRF_SPI_FREQ_250K },
+    { 125000, NRF_SPI_FREQ_125K },
+};
+
+static uint32_t spi_set_frequency(uint32_t speed_hz)
+{
+    uint32_t i;
+
+    for (i = 0; i < sizeof(spi_clocks) / sizeof(spi_clocks[0]) - 1; i++) {
+        if (spi_clocks[i].hz <= speed_hz) {
+            break;
+        }
+    }
+    spi_config.frequency = spi_clocks[i].freq;
+    return spi_clocks[i].hz;
+}
+
+uint32_t hal_bmlite_spi_set_clock(uint32_t hz)
+{
+    uint32_t actual = spi_set_frequency(hz);
+
+    nrf_drv_spi_uninit(&spi);
+    nrf_drv_spi_init(&spi, &spi_config, spi_event_handler, NULL);
+    return actual;
+}
+
 void nordic_bmlite_spi_init(uint32_t speed_hz)
 {
     //spi_config.ss_pin   = BMLITE_CS_PIN;
 	spi_config.miso_pin = BMLITE_MISO_PIN;
     spi_config.mosi_pin = BMLITE_MOSI_PIN;
     spi_config.sck_pin  = BMLITE_CLK_PIN;
-    spi_config.frequency  = NRF_SPI_FREQ_8M;// default to 8M for now
+    spi_set_frequency(speed_hz);
     nrf_drv_spi_init(&spi, &spi_config, spi_event_handler, NULL);
 
     nrf_drv_gpiote_out_config_t out_config = GPIOTE_CONFIG_OUT_SIMPLE(true);
@@ -41,6 +41,10 @@ static uint32_t btn_pressed = 0;
 
 #define BMLITE_BUTTON 3
 
+/** RTC2 counts 32768 Hz LFCLK while 1 ms tick is stopped */
+#define SLEEP_RTC_HZ 32768
+#define SLEEP_MAX_MS (RTC_COUNTER_COUNTER_Msk / SLEEP_RTC_HZ * 1000)
+
 static void check_buttons();
 
 /**
@@ -78,6 +82,55 @@ void hal_timebase_init(void)
          &TIMER_LED, NRF_TIMER_CC_CHANNEL0, time_ticks, NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK, true);
 
     nrf_drv_timer_enable(&TIMER_LED);
+
+    NRF_CLOCK->LFCLKSRC = CLOCK_LFCLKSRC_SRC_Xtal << CLOCK_LFCLKSRC_SRC_Pos;
+    NRF_CLOCK->EVENTS_LFCLKSTARTED = 0;
+    NRF_CLOCK->TASKS_LFCLKSTART = 1;
+    while (NRF_CLOCK->EVENTS_LFCLKSTARTED == 0) {
+    }
+    NRF_RTC2->PRESCALER = 0;
+    NRF_RTC2->INTENSET = RTC_INTENSET_COMPARE0_Msk;
+    NVIC_EnableIRQ(RTC2_IRQn);
+}
+
+void RTC2_IRQHandler(void)
+{
+    NRF_RTC2->EVENTS_COMPARE[0] = 0;
+}
+
+void nordic_timebase_sleep(uint32_t ms)
+{
+    uint32_t counter;
+
+    // Interrupts are disabled by the caller, a pending one still wakes the core
+    if (ms > SLEEP_MAX_MS) {
+        ms = SLEEP_MAX_MS;
+    }
+    if (ms < 2) {
+        __WFI();
+        return;
+    }
+
+    // Stop 1 ms tick, so HFCLK is off and only the wake-up interrupt or
+    // RTC compare at the deadline wakes the core
+    nrf_drv_timer_pause(&TIMER_LED);
+    NRF_RTC2->CC[0] = (uint64_t)ms * SLEEP_RTC_HZ / 1000;
+    NRF_RTC2->TASKS_START = 1;
+
+    __DSB();
+    __WFI();
+
+    counter = NRF_RTC2->COUNTER;
+    NRF_RTC2->TASKS_STOP = 1;
+    // Clearing takes a few LFCLK cycles, it is done long before the next sleep
+    NRF_RTC2->TASKS_CLEAR = 1;
+    NRF_RTC2->EVENTS_COMPARE[0] = 0;
+    NVIC_ClearPendingIRQ(RTC2_IRQn);
+
+    systick += (uint32_t)((uint64_t)counter * 1000 / SLEEP_RTC_HZ);
+    // Button edges during sleep are seen before the next tick
+    check_buttons();
+    nrf_drv_timer_resume(&TIMER_LED);
 }
 
 void hal_timebase_busy_wait(uint32_t delay)
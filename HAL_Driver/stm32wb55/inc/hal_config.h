@@ -102,5 +102,7 @@
 
 #define BMLITE_READY_PORT     GPIOA
 #define BMLITE_READY_PIN      GPIO_PIN_1
+#define BMLITE_READY_IRQn     EXTI1_IRQn
+#define BMLITE_READY_IRQ_HANDLER EXTI1_IRQHandler
 
 #endif /* BMLITE_HAL_CONFIG_H */
@@ -37,6 +37,7 @@ static void system_irq_init();
 
 void stm_spi_init(uint32_t speed_hz);
 void stm_uart_init(uint32_t speed_hz);
+void stm_timebase_sleep(uint32_t ms);
 void board_led_init();
 void board_button_init();
 
@@ -66,6 +67,9 @@ fpc_bep_result_t hal_board_init(void *params)
 #else
 #ifdef BMLITE_ON_SPI
     stm_spi_init(4000000);
+    // READY rising edge wakes the core up from hal_bmlite_wait_status()
+    HAL_NVIC_SetPriority(BMLITE_READY_IRQn, 2, 0);
+    HAL_NVIC_EnableIRQ(BMLITE_READY_IRQn);
 #else
    #error "BMLITE_ON_SPI or BMLITE_ON_SPI must be defined"
 #endif
@@ -97,6 +101,29 @@ bool hal_bmlite_get_status(void)
     return HAL_GPIO_ReadPin(BMLITE_READY_PORT, BMLITE_READY_PIN);
 }
 
+void BMLITE_READY_IRQ_HANDLER(void)
+{
+    if(__HAL_GPIO_EXTI_GET_IT(BMLITE_READY_PIN) != 0x00u)  {
+        __HAL_GPIO_EXTI_CLEAR_IT(BMLITE_READY_PIN);
+        sensor_interrupt = true;
+    }
+}
+
+bool hal_bmlite_wait_status(uint32_t ms)
+{
+    uint32_t primask = __get_PRIMASK();
+
+    __disable_irq();
+    // Sleep until READY interrupt, another interrupt or timeout
+    if (!sensor_interrupt && !hal_bmlite_get_status()) {
+        stm_timebase_sleep(ms);
+    }
+    __set_PRIMASK(primask);
+    sensor_interrupt = false;
+
+    return hal_bmlite_get_status();
+}
+
 void dma_init(void)
 {
     /* DMA controller clock enable */
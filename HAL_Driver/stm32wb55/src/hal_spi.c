@@ -101,6 +101,27 @@ static void set_prescaler(uint32_t speed_hz)
     }
 }
 
+uint32_t hal_bmlite_spi_set_clock(uint32_t hz)
+{
+    static const uint32_t prescalers[] = {
+        SPI_BAUDRATEPRESCALER_2, SPI_BAUDRATEPRESCALER_4, SPI_BAUDRATEPRESCALER_8,
+        SPI_BAUDRATEPRESCALER_16, SPI_BAUDRATEPRESCALER_32, SPI_BAUDRATEPRESCALER_64,
+        SPI_BAUDRATEPRESCALER_128, SPI_BAUDRATEPRESCALER_256,
+    };
+    uint32_t div = 2;
+    uint32_t i;
+
+    // Unlike set_prescaler(), never go above the requested clock
+    for (i = 0; i < sizeof(prescalers) / sizeof(prescalers[0]) - 1; i++, div *= 2) {
+        if (SystemCoreClock / div <= hz) {
+            break;
+        }
+    }
+    bmlite_handle.Init.BaudRatePrescaler = prescalers[i];
+    HAL_SPI_Init(&bmlite_handle);
+    return SystemCoreClock / div;
+}
+
 void stm_spi_init(uint32_t speed_hz)
 {
     /* Peripheral clock enable */
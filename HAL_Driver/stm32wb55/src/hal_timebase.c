@@ -45,6 +45,41 @@ uint32_t hal_timebase_get_tick(void)
     return HAL_GetTick();
 }
 
+void stm_timebase_sleep(uint32_t ms)
+{
+    uint32_t ticks_per_ms = SystemCoreClock / 1000;
+    uint32_t load;
+    uint32_t elapsed;
+
+    // Interrupts are disabled by the caller, a pending one still wakes the core
+    if (ms > SysTick_LOAD_RELOAD_Msk / ticks_per_ms) {
+        ms = SysTick_LOAD_RELOAD_Msk / ticks_per_ms;
+    }
+    if (ms < 2 || (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk)) {
+        __WFI();
+        return;
+    }
+
+    // One SysTick period up to the deadline instead of a tick every ms
+    load = ms * ticks_per_ms - 1;
+    SysTick->LOAD = load;
+    SysTick->VAL = 0;
+
+    __DSB();
+    __WFI();
+
+    if (SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk) {
+        elapsed = ms;
+    } else {
+        elapsed = (load - SysTick->VAL) / ticks_per_ms;
+    }
+    SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk;
+    uwTick += elapsed;
+
+    SysTick->LOAD = ticks_per_ms * uwTickFreq - 1;
+    SysTick->VAL = 0;
+}
+
 /**
  * This function handles System tick timer.
  */
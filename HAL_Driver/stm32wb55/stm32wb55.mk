@@ -35,7 +35,8 @@ CFLAGS +=\
 CFLAGS +=\
 	-DUSE_HAL_DRIVER \
 	-DNUCLEO \
-	-DARM_MATH_CM4
+	-DARM_MATH_CM4 \
+	-DBMLITE_CANCEL_POLL_INTERVAL=0
 
 CFLAGS += -DSTM32WB55xx
 